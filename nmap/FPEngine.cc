@@ -784,11 +784,16 @@ static double vectorize_isr(std::map<std::string, FPPacket>& resps) {
   return sum / t;
 }
 
-static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
+/* The number of features in the model; the arrays from FPModel.cc are sized
+   by it. */
+#define FP_NUM_FEATURES NELEMS(FPmean[0])
+
+/* Fills features (FP_NUM_FEATURES of them) from the responses in FPR. A
+   feature that can't be had is -1. */
+static void vectorize(const FingerPrintResultsIPv6 *FPR, double *features) {
   const char * const IPV6_PROBE_NAMES[] = {"S1", "S2", "S3", "S4", "S5", "S6", "IE1", "IE2", "NS", "U1", "TECN", "T2", "T3", "T4", "T5", "T6", "T7"};
   const char * const TCP_PROBE_NAMES[] = {"S1", "S2", "S3", "S4", "S5", "S6", "TECN", "T2", "T3", "T4", "T5", "T6", "T7"};
   unsigned int nr_feature, i, idx;
-  struct feature_node *features;
   std::map<std::string, FPPacket> resps;
 
   for (i = 0; i < NUM_FP_PROBES_IPv6; i++) {
@@ -802,24 +807,20 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
     resps[FPR->fp_responses[i]->probe_id].setTime(&FPR->fp_responses[i]->senttime);
   }
 
-  nr_feature = get_nr_feature(&FPModel);
-  features = new feature_node[nr_feature + 1];
-  for (i = 0; i < nr_feature; i++) {
-    features[i].index = i + 1;
-    features[i].value = -1;
-  }
-  features[i].index = -1;
+  nr_feature = FP_NUM_FEATURES;
+  for (i = 0; i < nr_feature; i++)
+    features[i] = -1;
 
   idx = 0;
   for (i = 0; i < NELEMS(IPV6_PROBE_NAMES); i++) {
     const char *probe_name;
 
     probe_name = IPV6_PROBE_NAMES[i];
-    features[idx++].value = vectorize_plen(resps[probe_name].getPacket());
-    features[idx++].value = vectorize_tc(resps[probe_name].getPacket());
+    features[idx++] = vectorize_plen(resps[probe_name].getPacket());
+    features[idx++] = vectorize_tc(resps[probe_name].getPacket());
   }
   /* TCP features */
-  features[idx++].value = vectorize_isr(resps);
+  features[idx++] = vectorize_isr(resps);
   for (i = 0; i < NELEMS(TCP_PROBE_NAMES); i++) {
     const char *probe_name;
     const TCPHeader *tcp;
@@ -842,17 +843,17 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
       idx += 48;
       continue;
     }
-    features[idx++].value = tcp->getWindow();
+    features[idx++] = tcp->getWindow();
     flags = tcp->getFlags16();
     for (mask = 0x001; mask <= 0x800; mask <<= 1)
-      features[idx++].value = (flags & mask) != 0;
+      features[idx++] = (flags & mask) != 0;
 
     for (j = 0; j < 16; j++) {
       nping_tcp_opt_t opt;
       opt = tcp->getOption(j);
       if (opt.value == NULL)
         break;
-      features[idx++].value = opt.type;
+      features[idx++] = opt.type;
       /* opt.len includes the two (type, len) bytes. */
       if (opt.type == TCPOPT_MSS && opt.len == 4 && mss == -1)
         mss = ntohs(*(u16 *) opt.value);
@@ -869,37 +870,84 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
       opt = tcp->getOption(j);
       if (opt.value == NULL)
         break;
-      features[idx++].value = opt.len;
+      features[idx++] = opt.len;
     }
     for (; j < 16; j++)
       idx++;
 
-    features[idx++].value = mss;
-    features[idx++].value = sackok;
-    features[idx++].value = wscale;
+    features[idx++] = mss;
+    features[idx++] = sackok;
+    features[idx++] = wscale;
   }
   assert(idx == nr_feature);
 
   if (o.debugging > 2) {
     log_write(LOG_PLAIN, "v = {");
     for (i = 0; i < nr_feature; i++)
-      log_write(LOG_PLAIN, "%.16g, ", features[i].value);
+      log_write(LOG_PLAIN, "%.16g, ", features[i]);
     log_write(LOG_PLAIN, "};\n");
   }
-
-  return features;
 }
 
-static void apply_scale(struct feature_node *features, unsigned int num_features,
+static void apply_scale(double *features, unsigned int num_features,
   const double (*scale)[2]) {
   unsigned int i;
 
   for (i = 0; i < num_features; i++) {
-    double val = features[i].value;
+    double val = features[i];
     if (val < 0)
       continue;
     val = (val + scale[i][0]) * scale[i][1];
-    features[i].value = val;
+    features[i] = val;
+  }
+}
+
+/* Classes whose decision values predict_dense computes together. */
+#define PREDICT_BLOCK 8
+
+/* Computes the decision value of each class of model for the dense feature
+   vector features, as liblinear's predict_values does for the same features
+   in feature_node form. The weights are a dense features x classes matrix.
+   The classes are taken PREDICT_BLOCK at a time. Their sums stay in
+   registers while the block's part of every row is added in, which compilers
+   turn into vector operations even at -O2. Each class still adds up its
+   features in order, as liblinear does, so the values come out the same to
+   the bit. A feature of 0 can only add a signed zero to each value, which
+   doesn't change it, so it is skipped. */
+static void predict_dense(const struct model *model, const double *features,
+  unsigned int num_features, double *values) {
+  double sum[PREDICT_BLOCK];
+  const double *w;
+  unsigned int i;
+  int nr_class, j, k, n;
+  double x;
+
+  nr_class = get_nr_class(model);
+  /* A two-class model has one column of weights rather than two, and a
+     bias would be one more feature. */
+  assert(nr_class > 2);
+  assert(model->bias < 0);
+  assert(num_features == (unsigned int) get_nr_feature(model));
+
+  for (j = 0; j < nr_class; j += PREDICT_BLOCK) {
+    n = MIN(PREDICT_BLOCK, nr_class - j);
+    for (k = 0; k < PREDICT_BLOCK; k++)
+      sum[k] = 0;
+    w = model->w + j;
+    for (i = 0; i < num_features; i++, w += nr_class) {
+      x = features[i];
+      if (x == 0)
+        continue;
+      if (n == PREDICT_BLOCK) {
+        for (k = 0; k < PREDICT_BLOCK; k++)
+          sum[k] += w[k] * x;
+      } else {
+        for (k = 0; k < n; k++)
+          sum[k] += w[k] * x;
+      }
+    }
+    for (k = 0; k < n; k++)
+      values[j + k] = sum[k];
   }
 }
 
@@ -946,7 +994,7 @@ int label_prob_cmp(const void *a, const void *b) {
    tend to make small differences count a lot (because we probably want this
    fingerprint in order to expand the class), while still allowing near-perfect
    matches to match. */
-static double novelty_of(const struct feature_node *features, int label) {
+static double novelty_of(const double *features, int label) {
   const double *means, *variances;
   int i, nr_feature;
   double sum;
@@ -962,8 +1010,7 @@ static double novelty_of(const struct feature_node *features, int label) {
   for (i = 0; i < nr_feature; i++) {
     double d, v;
 
-    assert(i + 1 == features[i].index);
-    d = features[i].value - means[i];
+    d = features[i] - means[i];
     v = variances[i];
     if (v == 0.0) {
       /* No variance? It means that samples were identical. Substitute a default
@@ -977,21 +1024,21 @@ static double novelty_of(const struct feature_node *features, int label) {
   return sqrt(sum);
 }
 
-static void classify(FingerPrintResultsIPv6 *FPR) {
+unsigned int classify_fp6_num_features() {
+  return FP_NUM_FEATURES;
+}
+
+void classify_fp6_features(FingerPrintResultsIPv6 *FPR, const double *features) {
   int nr_class, i;
-  struct feature_node *features;
   double *values;
   struct label_prob *labels;
 
   nr_class = get_nr_class(&FPModel);
 
-  features = vectorize(FPR);
   values = new double[nr_class];
   labels = new struct label_prob[nr_class];
 
-  apply_scale(features, get_nr_feature(&FPModel), FPscale);
-
-  predict_values(&FPModel, features, values);
+  predict_dense(&FPModel, features, FP_NUM_FEATURES, values);
   for (i = 0; i < nr_class; i++) {
     labels[i].label = i;
     labels[i].prob = 1.0 / (1.0 + exp(-values[i]));
@@ -1032,11 +1079,18 @@ static void classify(FingerPrintResultsIPv6 *FPR) {
     FPR->num_perfect_matches = 0;
   }
 
-  delete[] features;
   delete[] values;
   delete[] labels;
 }
 
+static void classify(FingerPrintResultsIPv6 *FPR) {
+  double features[FP_NUM_FEATURES];
+
+  vectorize(FPR, features);
+  apply_scale(features, FP_NUM_FEATURES, FPscale);
+  classify_fp6_features(FPR, features);
+}
+
 
 /* This method is the core of the FPEngine class. It takes a list of IPv6
  * targets that need to be fingerprinted. The method handles the whole
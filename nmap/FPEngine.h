@@ -437,5 +437,12 @@ void response_reception_handler_wrapper(nsock_pool nsp, nsock_event nse, void *a
 
 std::vector<FingerMatch> load_fp_matches();
 
+/* The IPv6 classifier on its own, for tools that don't send probes.
+   classify_fp6_features fills in FPR's matches from features, which must
+   hold classify_fp6_num_features() values already scaled the way the model
+   expects. o.os_labels_ipv6 must be loaded. */
+unsigned int classify_fp6_num_features();
+void classify_fp6_features(FingerPrintResultsIPv6 *FPR, const double *features);
+
 
 #endif /* __FPENGINE_H__ */
@@ -168,6 +168,9 @@ const char *FingerPrintResults::OmitSubmissionFP() {
   if (o.timing_level > 4)
     return "Timing level 5 (Insane) used";
 
+  if (o.osscan_adaptive)
+    return "--osscan-adaptive may have left tests out";
+
   if (osscan_opentcpport <= 0)
     return "Missing an open TCP port so results incomplete";
 
@@ -105,6 +105,10 @@ NmapOps o;
 NmapOps::NmapOps() {
   datadir = NULL;
   xsl_stylesheet = NULL;
+  version_cache = NULL;
+  version_stats = NULL;
+  version_profile = NULL;
+  osscan_cache = NULL;
   Initialize();
 }
 
@@ -147,6 +151,22 @@ NmapOps::~NmapOps() {
     free(datadir);
     datadir = NULL;
   }
+  if (version_cache) {
+    free(version_cache);
+    version_cache = NULL;
+  }
+  if (version_stats) {
+    free(version_stats);
+    version_stats = NULL;
+  }
+  if (version_profile) {
+    free(version_profile);
+    version_profile = NULL;
+  }
+  if (osscan_cache) {
+    free(osscan_cache);
+    osscan_cache = NULL;
+  }
 
 #ifndef NOLUA
   if (scriptversion || script)
@@ -286,12 +306,21 @@ void NmapOps::Initialize() {
   resume_ip.s_addr = 0;
   osscan_limit = 0;
   osscan_guess = 0;
+  osscan_adaptive = 0;
+  if (osscan_cache) free(osscan_cache);
+  osscan_cache = NULL;
   numdecoys = 0;
   decoyturn = -1;
   osscan = 0;
   servicescan = 0;
   override_excludeports = 0;
   version_intensity = 7;
+  if (version_cache) free(version_cache);
+  version_cache = NULL;
+  if (version_stats) free(version_stats);
+  version_stats = NULL;
+  if (version_profile) free(version_profile);
+  version_profile = NULL;
   pingtype = PINGTYPE_UNKNOWN;
   listscan = allowall = ackscan = bouncescan = connectscan = 0;
   nullscan = xmasscan = fragscan = synscan = windowscan = 0;
@@ -273,10 +273,15 @@ class NmapOps {
   // Version Detection Options
   int override_excludeports;
   int version_intensity;
+  char *version_cache; /* --version-cache file, or NULL */
+  char *version_stats; /* --version-stats file, or NULL */
+  char *version_profile; /* --version-profile file, or NULL */
 
   struct in_addr decoys[MAX_DECOYS];
   int osscan_limit; /* Skip OS Scan if no open or no closed TCP ports */
   int osscan_guess;   /* Be more aggressive in guessing OS type */
+  int osscan_adaptive; /* Stop a try's probes once they can't change the match */
+  char *osscan_cache; /* --osscan-cache file, or NULL */
   int numdecoys;
   int decoyturn;
   int osscan;
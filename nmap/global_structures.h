@@ -203,14 +203,76 @@ struct FingerPrint {
   void sort();
 };
 
+/* Operations of the terms of a compiled reference expression */
+enum fp_term_op { FP_TERM_EQ, FP_TERM_NONZERO, FP_TERM_LT, FP_TERM_GT, FP_TERM_RANGE };
+
+/* One term of a compiled reference expression such as "3B-47" or "8|A".
+   For FP_TERM_EQ, lo is the ID of the value in FingerPrintDB::value_ids;
+   otherwise lo and hi are the numbers in the term. */
+struct FPExprTerm {
+  u8 op;
+  u32 lo, hi;
+};
+
+/* One attribute of a compiled reference print: the expression made of
+   terms[first] to terms[first + count - 1], joined by "|" if is_or or
+   by "&" otherwise. rest_points is what this attribute and the ones after
+   it in the print are worth, used to bound the accuracy it can reach. */
+struct FPAttrTest {
+  u16 attr;
+  u8 is_or;
+  u16 count;
+  u32 first;
+  u32 rest_points;
+};
+
+/* A string of a compiled fingerprint DB (an offset into its string table)
+   and the ID it stands for. Sorted arrays of these are used to look up
+   the attributes and values of observed fingerprints. */
+struct FPStringID {
+  u32 str;
+  u32 id;
+};
+
 /* This structure contains the important data from the fingerprint
    database (nmap-os-db) */
 struct FingerPrintDB {
   FingerPrint *MatchPoints;
   std::vector<FingerPrint *> prints;
 
+  /* The prints compiled into flat arrays of numbers, so that
+     match_fingerprint doesn't have to parse expressions or compare
+     strings. Each "TEST.ATTR" has an ID, and the tests of prints[i] are
+     attr_tests[print_tests[i]] to attr_tests[print_tests[i + 1] - 1],
+     the ones worth the most points first. The arrays all point into one
+     block laid out like the nmap-os-db cache file (see osscan.cc), which
+     is either built by compile() or mapped from the cache. In the latter
+     case the prints have no tests and MatchPoints is NULL. */
+  u32 num_prints;
+  u32 num_attrs;
+  u32 num_values;
+  const char *strings;
+  const FPStringID *attr_index; /* Sorted by name */
+  const u32 *attr_names;        /* By attribute ID */
+  const int *attr_points;       /* By attribute ID; -1 if not in MatchPoints */
+  const FPStringID *value_index; /* Sorted by value */
+  const FPExprTerm *terms;
+  const FPAttrTest *attr_tests;
+  const u32 *print_tests;
+
   FingerPrintDB();
   ~FingerPrintDB();
+  void compile();
+  bool attach(const void *data, size_t len);
+  bool isCompiled() const { return print_tests != NULL && num_prints == prints.size(); }
+  const void *imageData() const { return mapped ? (const void *) mapped : (const void *) &image[0]; }
+  size_t imageLength() const { return mapped ? mapped_len : image.size() * sizeof(u32); }
+
+  /* Where the compiled arrays live: either image, or mapped_len bytes
+     mapped at mapped. */
+  std::vector<u32> image;
+  char *mapped;
+  int mapped_len;
 };
 
 /* Based on TCP congestion control techniques from RFC2581. */
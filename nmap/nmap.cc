@@ -265,6 +265,12 @@ static void printusage(int rc) {
          "  --version-light: Limit to most likely probes (intensity 2)\n"
          "  --version-all: Try every single probe (intensity 9)\n"
          "  --version-trace: Show detailed version scan activity (for debugging)\n"
+         "  --version-cache <filename>: Remember results and try the probe that\n"
+         "      identified each service on the last scan first\n"
+         "  --version-stats <filename>: Count which probes identify services and\n"
+         "      try the most successful one for each port first\n"
+         "  --version-profile <filename>: Write how much time each match line\n"
+         "      takes to the file (for debugging)\n"
 #ifndef NOLUA
          "SCRIPT SCAN:\n"
          "  -sC: equivalent to --script=default\n"
@@ -282,6 +288,9 @@ static void printusage(int rc) {
          "  -O: Enable OS detection\n"
          "  --osscan-limit: Limit OS detection to promising targets\n"
          "  --osscan-guess: Guess OS more aggressively\n"
+         "  --osscan-adaptive: Stop probing once the OS match can't change\n"
+         "  --osscan-cache <filename>: Remember OS matches and reuse them for hosts\n"
+         "      that answer a few of the probes the same way\n"
          "TIMING AND PERFORMANCE:\n"
          "  Options which take <time> are in seconds, or append 'ms' (milliseconds),\n"
          "  's' (seconds), 'm' (minutes), or 'h' (hours) to the value (e.g. 30m).\n"
@@ -581,6 +590,10 @@ void parse_options(int argc, char **argv) {
     {"osscan_guess", no_argument, 0, 0}, /* More guessing flexability */
     {"osscan-guess", no_argument, 0, 0}, /* More guessing flexability */
     {"fuzzy", no_argument, 0, 0}, /* Alias for osscan_guess */
+    {"osscan_adaptive", no_argument, 0, 0},
+    {"osscan-adaptive", no_argument, 0, 0},
+    {"osscan_cache", required_argument, 0, 0},
+    {"osscan-cache", required_argument, 0, 0},
     {"packet_trace", no_argument, 0, 0}, /* Display all packets sent/rcv */
     {"packet-trace", no_argument, 0, 0}, /* Display all packets sent/rcv */
     {"version_trace", no_argument, 0, 0}, /* Display -sV related activity */
@@ -618,6 +631,12 @@ void parse_options(int argc, char **argv) {
     {"version-light", no_argument, 0, 0},
     {"version_all", no_argument, 0, 0},
     {"version-all", no_argument, 0, 0},
+    {"version_cache", required_argument, 0, 0},
+    {"version-cache", required_argument, 0, 0},
+    {"version_stats", required_argument, 0, 0},
+    {"version-stats", required_argument, 0, 0},
+    {"version_profile", required_argument, 0, 0},
+    {"version-profile", required_argument, 0, 0},
     {"system_dns", no_argument, 0, 0},
     {"system-dns", no_argument, 0, 0},
     {"log_errors", no_argument, 0, 0},
@@ -776,6 +795,18 @@ void parse_options(int argc, char **argv) {
           o.version_intensity = 2;
         } else if (optcmp(long_options[option_index].name, "version-all") == 0) {
           o.version_intensity = 9;
+        } else if (optcmp(long_options[option_index].name, "version-cache") == 0) {
+          if (o.version_cache)
+            free(o.version_cache);
+          o.version_cache = strdup(optarg);
+        } else if (optcmp(long_options[option_index].name, "version-stats") == 0) {
+          if (o.version_stats)
+            free(o.version_stats);
+          o.version_stats = strdup(optarg);
+        } else if (optcmp(long_options[option_index].name, "version-profile") == 0) {
+          if (o.version_profile)
+            free(o.version_profile);
+          o.version_profile = strdup(optarg);
         } else if (optcmp(long_options[option_index].name, "scan-delay") == 0) {
           l = tval2msecs(optarg);
           if (l < 0)
@@ -808,6 +839,12 @@ void parse_options(int argc, char **argv) {
         } else if (optcmp(long_options[option_index].name, "osscan-guess")  == 0
                    || strcmp(long_options[option_index].name, "fuzzy") == 0) {
           o.osscan_guess = 1;
+        } else if (optcmp(long_options[option_index].name, "osscan-adaptive")  == 0) {
+          o.osscan_adaptive = 1;
+        } else if (optcmp(long_options[option_index].name, "osscan-cache") == 0) {
+          if (o.osscan_cache)
+            free(o.osscan_cache);
+          o.osscan_cache = strdup(optarg);
         } else if (optcmp(long_options[option_index].name, "packet-trace") == 0) {
           o.setPacketTrace(true);
 #ifndef NOLUA
@@ -2127,6 +2164,9 @@ int nmap_main(int argc, char *argv[]) {
 
   printdatafilepaths();
 
+  if (o.servicescan && o.version_profile)
+    write_service_match_profile(o.version_profile);
+
   printfinaloutput();
 
   free_scan_lists(&ports);
@@ -3076,6 +3116,43 @@ static int nmap_fetchfile_userdir(char *buf, size_t buflen, const char *file) {
 }
 #endif
 
+/* Stores in buf the name of a file in which Nmap may keep data between
+   runs, such as compiled copies of data files. Such files live in the
+   per-user directory that nmap_fetchfile also searches (~/.nmap or
+   ...\AppData\Roaming\nmap), which is created if necessary. Returns
+   false if there is no usable per-user directory. */
+int nmap_cachefile(char *buf, int buflen, const char *file) {
+  char dir[512];
+  int res;
+
+#ifdef WIN32
+  char appdata[MAX_PATH];
+
+  if (SHGetFolderPath(NULL, CSIDL_APPDATA, NULL, SHGFP_TYPE_CURRENT, appdata) != S_OK)
+    return 0;
+  res = Snprintf(dir, sizeof(dir), "%s\\nmap", appdata);
+  if (res <= 0 || res >= (int) sizeof(dir))
+    return 0;
+  if (!CreateDirectory(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    return 0;
+  res = Snprintf(buf, buflen, "%s\\%s", dir, file);
+#else
+  struct passwd *pw;
+
+  pw = getpwuid(geteuid());
+  if (pw == NULL)
+    return 0;
+  res = Snprintf(dir, sizeof(dir), "%s/.nmap", pw->pw_dir);
+  if (res <= 0 || res >= (int) sizeof(dir))
+    return 0;
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+    return 0;
+  res = Snprintf(buf, buflen, "%s/%s", dir, file);
+#endif
+
+  return res > 0 && res < buflen;
+}
+
 static int nmap_fetchfile_sub(char *filename_returned, int bufferlen, const char *file) {
   char *dirptr;
   int res;
@@ -432,6 +432,7 @@ const char *tsseqclass2ascii(int seqclass);
    into a difficulty string like "Worthy Challenge */
 const char *seqidx2difficultystr(unsigned long idx);
 int nmap_fetchfile(char *filename_returned, int bufferlen, const char *file);
+int nmap_cachefile(char *buf, int buflen, const char *file);
 int nmap_fileexistsandisreadable(const char* pathname);
 int gather_logfile_resumption_state(char *fname, int *myargc, char ***myargv);
 
@@ -930,6 +930,7 @@ int luaopen_nmap (lua_State *L)
     {"new_dnet", nseU_placeholder}, /* imported from nmap.dnet */
     {"get_interface_info", nseU_placeholder}, /* imported from nmap.dnet */
     {"new_socket", nseU_placeholder}, /* imported from nmap.socket */
+    {"nsock_stats", nseU_placeholder}, /* imported from nmap.socket */
     {"mutex", nseU_placeholder}, /* placeholder */
     {"condvar", nseU_placeholder}, /* placeholder */
     {NULL, NULL}
@@ -955,6 +956,9 @@ int luaopen_nmap (lua_State *L)
   /* nmap.socket.new -> nmap.new_socket. */
   lua_getfield(L, -1, "new");
   lua_setfield(L, nmap_idx, "new_socket");
+  /* nmap.socket.stats -> nmap.nsock_stats. */
+  lua_getfield(L, -1, "stats");
+  lua_setfield(L, nmap_idx, "nsock_stats");
   /* Store nmap.socket; used by nse_main.lua. */
   lua_setfield(L, nmap_idx, "socket");
 
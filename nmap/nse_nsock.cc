@@ -87,6 +87,8 @@ static nsock_pool new_pool (lua_State *L)
 
   nsp_setdevice(nsp, o.device);
   nsp_setbroadcast(nsp, true);
+  if (o.debugging)
+    nsp_set_stats(nsp, 1);
   
   nspp = (nsock_pool *) lua_newuserdata(L, sizeof(nsock_pool));
   *nspp = nsp;
@@ -351,6 +353,24 @@ static void callback (nsock_pool nsp, nsock_event nse, void *ud)
   status(L, nse_status(nse));
 }
 
+/* A pending socket:send(). nsock_writev does not copy the data, so the Lua
+ * string is anchored in the registry until the event completes or is killed;
+ * the sending thread may time out and be collected before that. */
+typedef struct nse_send {
+  lua_State *L; /* main thread, always alive while the pool is */
+  int ref;
+  nse_nsock_udata *nu;
+} nse_send;
+
+static void send_callback (nsock_pool nsp, nsock_event nse, void *ud)
+{
+  nse_send *send = (nse_send *) ud;
+  nse_nsock_udata *nu = send->nu;
+  luaL_unref(send->L, LUA_REGISTRYINDEX, send->ref);
+  free(send);
+  callback(nsp, nse, nu);
+}
+
 static int yield (lua_State *L, nse_nsock_udata *nu, const char *action,
     const char *direction, int ctx, lua_CFunction k)
 {
@@ -533,7 +553,15 @@ static int l_send (lua_State *L)
   size_t size;
   const char *string = luaL_checklstring(L, 2, &size);
   trace(nu->nsiod, hexify((unsigned char *) string, size).c_str(), TO);
-  nsock_write(nsp, nu->nsiod, callback, nu->timeout, nu, string, size);
+  nse_send *send = (nse_send *) safe_malloc(sizeof(nse_send));
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  send->L = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  lua_pushvalue(L, 2);
+  send->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  send->nu = nu;
+  struct nsock_iovec iov = {string, size};
+  nsock_writev(nsp, nu->nsiod, send_callback, nu->timeout, send, &iov, 1);
   return yield(L, nu, "SEND", TO, 0, NULL);
 }
 
@@ -611,11 +639,113 @@ static int l_receive_bytes (lua_State *L)
   return yield(L, nu, "RECEIVE BYTES", FROM, 0, NULL);
 }
 
+/* The data buffered by receive_buf is kept in a userdata at BUFFER_I in the
+ * socket environment, so that each read appends to it instead of creating a
+ * new Lua string. */
+struct receive_buffer
+{
+  size_t len; /* bytes of data in the buffer */
+  size_t size; /* bytes allocated after the header */
+  size_t scanned; /* bytes already searched for the current delimiter */
+};
+
+#define RECEIVE_BUFFER_DATA(b) ((char *) ((struct receive_buffer *) (b) + 1))
+
+/* Return the buffer from the socket environment at env, creating it if
+ * necessary, with room for at least need more bytes. */
+static struct receive_buffer *receive_buffer_reserve (lua_State *L, int env,
+    size_t need)
+{
+  struct receive_buffer *b, *nb;
+  size_t size;
+
+  lua_rawgeti(L, env, BUFFER_I);
+  b = (struct receive_buffer *) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (b != NULL && b->size - b->len >= need)
+    return b;
+
+  size = (b == NULL) ? 0 : b->size;
+  if (size < 1024)
+    size = 1024;
+  while (size - (b == NULL ? 0 : b->len) < need)
+    size *= 2;
+  nb = (struct receive_buffer *) lua_newuserdata(L, sizeof(*nb) + size);
+  nb->size = size;
+  if (b == NULL)
+    nb->len = nb->scanned = 0;
+  else
+  {
+    nb->len = b->len;
+    nb->scanned = b->scanned;
+    memcpy(RECEIVE_BUFFER_DATA(nb), RECEIVE_BUFFER_DATA(b), b->len);
+  }
+  lua_rawseti(L, env, BUFFER_I);
+  return nb;
+}
+
+/* Return the maximum length of a match of the Lua pattern p, or -1 if it is
+ * not bounded (repetitions, back references, balances, frontiers and start
+ * anchors). A search that failed can then be resumed near the end of the data
+ * it was run on when more data arrives. */
+static lua_Integer pattern_max_length (const char *p, size_t len)
+{
+  const char *end = p + len;
+  lua_Integer n = 0;
+
+  if (p < end && *p == '^')
+    return -1;
+  while (p < end)
+  {
+    switch (*p)
+    {
+      case '(': case ')':
+        p++;
+        continue;
+      case '$':
+        if (p + 1 == end)
+          return n;
+        break;
+      case '%':
+        if (p + 1 == end)
+          return -1;
+        if (p[1] == 'b' || p[1] == 'f' || isdigit((int) (unsigned char) p[1]))
+          return -1;
+        p++;
+        break;
+      case '[':
+        p++;
+        if (p < end && *p == '^')
+          p++;
+        do { /* look for a ']', the first character is taken literally */
+          if (p == end)
+            return -1;
+          if (*p == '%')
+            p++;
+          p++;
+        } while (p < end && *p != ']');
+        if (p == end)
+          return -1;
+        break;
+    }
+    p++; /* the last character of the single character class */
+    if (p < end && (*p == '*' || *p == '+' || *p == '-'))
+      return -1;
+    if (p < end && *p == '?')
+      p++;
+    n++;
+  }
+  return n;
+}
+
 static int l_receive_buf (lua_State *L)
 {
   nsock_pool nsp = get_pool(L);
   nse_nsock_udata *nu = check_nsock_udata(L, 1, true);
   NSOCK_UDATA_ENSURE_OPEN(L, nu);
+  struct receive_buffer *b;
+  const char *data;
+  size_t offset = 0;
   if (!(lua_type(L, 2) == LUA_TFUNCTION || lua_type(L, 2) == LUA_TSTRING))
     nseU_typeerror(L, 2, "function/string");
   luaL_checktype(L, 3, LUA_TBOOLEAN); /* 3 */
@@ -624,51 +754,69 @@ static int l_receive_buf (lua_State *L)
   {
     lua_settop(L, 3); /* clear top */
     lua_getuservalue(L, 1); /* 4 */
-    lua_rawgeti(L, 4, BUFFER_I); /* 5 */
+    b = receive_buffer_reserve(L, 4, 0);
+    b->scanned = 0; /* new delimiter, search everything */
   }
   else
   {
     /* Here we are returning from nsock_read below.
      * We have two extra values on the stack pushed by receive_callback.
      */
-    assert(lua_gettop(L) == 7);
-    if (lua_toboolean(L, 6)) /* success? */
+    assert(lua_gettop(L) == 6);
+    if (lua_toboolean(L, 5)) /* success? */
     {
-      lua_replace(L, 6); /* remove boolean */
-      lua_concat(L, 2); /* concat BUFFER_I with received data */
+      size_t len;
+      data = lua_tolstring(L, 6, &len);
+      b = receive_buffer_reserve(L, 4, len);
+      memcpy(RECEIVE_BUFFER_DATA(b) + b->len, data, len);
+      b->len += len;
+      lua_settop(L, 4);
     }
     else /* receive_callback encountered an error */
       return 2;
   }
+  data = RECEIVE_BUFFER_DATA(b);
 
   if (lua_isfunction(L, 2))
   {
     lua_pushvalue(L, 2);
-    lua_pushvalue(L, 5);
+    lua_pushlstring(L, data, b->len);
     lua_call(L, 1, 2); /* we do not allow yields */
   }
   else /* string */
   {
+    size_t plen;
+    const char *pattern = lua_tolstring(L, 2, &plen);
+    lua_Integer max = pattern_max_length(pattern, plen);
+
+    /* A match that was not found in the scanned data must end in the new
+       data, so only its last max bytes need to be searched again. */
+    if (max >= 0 && b->scanned > (size_t) max)
+      offset = b->scanned - max;
+    b->scanned = b->len;
+
     lua_getglobal(L, "string");
     lua_getfield(L, -1, "find");
     lua_replace(L, -2);
-    lua_pushvalue(L, 5);
+    lua_pushlstring(L, data + offset, b->len - offset);
     lua_pushvalue(L, 2);
     lua_call(L, 2, 2); /* we do not allow yields */
   }
 
   if (lua_isnumber(L, -2) && lua_isnumber(L, -1)) /* found end? */
   {
-    lua_Integer l = lua_tointeger(L, -2), r = lua_tointeger(L, -1);
-    if (l > r || r > (lua_Integer) lua_rawlen(L, 5))
+    lua_Integer l = lua_tointeger(L, -2) + (lua_Integer) offset;
+    lua_Integer r = lua_tointeger(L, -1) + (lua_Integer) offset;
+    if (l > r || r > (lua_Integer) b->len)
       return luaL_error(L, "invalid indices for match");
     lua_pushboolean(L, 1);
     if (lua_toboolean(L, 3))
-      lua_pushlstring(L, lua_tostring(L, 5), r);
+      lua_pushlstring(L, data, r);
     else
-      lua_pushlstring(L, lua_tostring(L, 5), l-1);
-    lua_pushlstring(L, lua_tostring(L, 5)+r, lua_rawlen(L, 5)-r);
-    lua_rawseti(L, 4, BUFFER_I);
+      lua_pushlstring(L, data, l-1);
+    b->len -= r;
+    memmove(RECEIVE_BUFFER_DATA(b), data + r, b->len);
+    b->scanned = 0;
     return 2;
   }
   else
@@ -733,6 +881,63 @@ static void sleep_callback (nsock_pool nsp, nsock_event nse, void *ud)
   nse_restore(L, 0);
 }
 
+static void push_histogram (lua_State *L, const unsigned long *hist)
+{
+  lua_createtable(L, NSOCK_STATS_BUCKETS, 0);
+  for (int i = 0; i < NSOCK_STATS_BUCKETS; i++)
+  {
+    lua_pushnumber(L, hist[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+}
+
+static int l_stats (lua_State *L)
+{
+  nsock_pool nsp = get_pool(L);
+  struct nsock_stats stats;
+
+  if (nsp_get_stats(nsp, &stats) == -1)
+    return nseU_safeerror(L, "statistics are not enabled");
+
+  lua_pushboolean(L, 1);
+  lua_newtable(L);
+  lua_createtable(L, 0, NSE_TYPE_MAX);
+  for (int t = 0; t < NSE_TYPE_MAX; t++)
+  {
+    lua_newtable(L);
+    for (int s = NSE_STATUS_NONE; s <= NSE_STATUS_EOF; s++)
+    {
+      if (stats.events[t][s] == 0)
+        continue;
+      lua_pushnumber(L, stats.events[t][s]);
+      lua_setfield(L, -2, nse_status2str((enum nse_status) s));
+    }
+    lua_setfield(L, -2, nse_type2str((enum nse_type) t));
+  }
+  lua_setfield(L, -2, "events");
+  push_histogram(L, stats.handler_usecs);
+  lua_setfield(L, -2, "handler_usecs");
+  push_histogram(L, stats.loop_usecs);
+  lua_setfield(L, -2, "loop_usecs");
+  push_histogram(L, stats.loop_events);
+  lua_setfield(L, -2, "loop_events");
+  lua_pushnumber(L, stats.loops);
+  lua_setfield(L, -2, "loops");
+  lua_pushnumber(L, stats.loop_time);
+  lua_setfield(L, -2, "loop_time");
+  lua_pushnumber(L, stats.wait_time);
+  lua_setfield(L, -2, "wait_time");
+  lua_pushnumber(L, stats.handler_time);
+  lua_setfield(L, -2, "handler_time");
+  lua_pushinteger(L, stats.events_pending);
+  lua_setfield(L, -2, "events_pending");
+  lua_pushinteger(L, stats.iods_active);
+  lua_setfield(L, -2, "iods_active");
+  lua_pushnumber(L, stats.iods_created);
+  lua_setfield(L, -2, "iods_created");
+  return 2;
+}
+
 static int l_sleep (lua_State *L)
 {
   nsock_pool nsp = get_pool(L);
@@ -828,9 +1033,7 @@ static void initialize (lua_State *L, int idx, nse_nsock_udata *nu,
   int proto, int af)
 {
 
-  lua_createtable(L, 2, 0); /* room for thread in array */
-  lua_pushliteral(L, "");
-  lua_rawseti(L, -2, BUFFER_I);
+  lua_createtable(L, 2, 0); /* room for thread and buffer in array */
   lua_setuservalue(L, idx);
   nu->nsiod = NULL;
   nu->proto = proto;
@@ -1040,6 +1243,7 @@ LUALIB_API int luaopen_nsock (lua_State *L)
     {"loop", l_loop},
     {"new", l_new},
     {"sleep", l_sleep},
+    {"stats", l_stats},
     {NULL, NULL}
   };
 
@@ -1087,6 +1291,8 @@ LUALIB_API int luaopen_nsock (lua_State *L)
 #if HAVE_OPENSSL
   /* Value speed over security in SSL connections. */
   nsp_ssl_init_max_speed(nsp);
+  /* Resume sessions when scripts reconnect to the same target. */
+  nsp_ssl_set_session_cache(nsp, 1024);
 #endif
 
   luaL_newlibtable(L, l_nsock);
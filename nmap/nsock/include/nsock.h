@@ -238,6 +238,20 @@ nsock_ssl_ctx nsp_ssl_init(nsock_pool ms_pool);
  * verification is done. Returns the SSL_CTX so you can set your own options. */
 nsock_ssl_ctx nsp_ssl_init_max_speed(nsock_pool ms_pool);
 
+/* Enables or disables the SSL session cache of an Nsock pool. When enabled,
+ * the sessions (session IDs or tickets) negotiated by SSL connections are
+ * remembered per target address, port, and SNI hostname, and are offered again
+ * by nsock_connect_ssl and nsock_reconnect_ssl to the same target when no
+ * explicit ssl_session is passed. maxsize is the maximum number of sessions to
+ * keep (the oldest ones are dropped first), or 0 to disable the cache and free
+ * the sessions it holds. The cache is disabled by default. */
+void nsp_ssl_set_session_cache(nsock_pool ms_pool, int maxsize);
+
+/* Retrieves the number of SSL handshakes that resumed a session from the pool's
+ * cache (hits) and the number that required a full handshake (misses).  Pass
+ * NULL for values you are not interested in. */
+void nsp_ssl_session_cache_stats(nsock_pool ms_pool, unsigned long *hits, unsigned long *misses);
+
 /* Enforce use of a given IO engine.
  * The engine parameter is a zero-terminated string that will be
  * strup()'ed by the library. No validity check is performed by this function,
@@ -499,6 +513,17 @@ nsock_event_id nsock_connect_unixsock_datagram(nsock_pool nsp, nsock_iod nsiod,
 nsock_event_id nsock_connect_tcp(nsock_pool nsp, nsock_iod nsiod, nsock_ev_handler handler, int timeout_msecs,
                                  void *userdata, struct sockaddr *ss, size_t sslen, unsigned short port);
 
+/* Like nsock_connect_tcp, but also sends the datalen bytes of data (which are
+ * copied) on the new connection. Where the system supports TCP Fast Open, the
+ * data is carried in the SYN if the server gave us a cookie before, so its
+ * reply can come a round trip earlier. Otherwise the data is sent as soon as
+ * the connection is established. The handler is called when the connection is
+ * established, as with nsock_connect_tcp. If sending the data fails after
+ * that, the next read on the iod fails with the error of the write. */
+nsock_event_id nsock_connect_tcp_data(nsock_pool nsp, nsock_iod nsiod, nsock_ev_handler handler, int timeout_msecs,
+                                      void *userdata, struct sockaddr *ss, size_t sslen, unsigned short port,
+                                      const char *data, int datalen);
+
 /* Request an SCTP association to another system (by IP address). The in_addr is
  * normal network byte order, but the port number should be given in HOST BYTE
  * ORDER.  ss should be a sockaddr_storage, sockaddr_in6, or sockaddr_in as
@@ -565,6 +590,19 @@ nsock_event_id nsock_read(nsock_pool nsp, nsock_iod nsiod, nsock_ev_handler hand
 nsock_event_id nsock_write(nsock_pool nsp, nsock_iod nsiod,
                            nsock_ev_handler handler, int timeout_msecs, void *userdata, const char *data, int datalen);
 
+/* A buffer to write with nsock_writev. */
+struct nsock_iovec {
+  const void *base;
+  size_t len;
+};
+
+/* Write the iovcnt buffers described by iov, in order, like writev() does. The
+ * data is NOT copied: the buffers are owned by the caller and must stay valid
+ * and unmodified until the handler is called, whatever the outcome of the
+ * event (the iov array itself is copied and may be reused right away). */
+nsock_event_id nsock_writev(nsock_pool nsp, nsock_iod nsiod, nsock_ev_handler handler, int timeout_msecs,
+                            void *userdata, const struct nsock_iovec *iov, int iovcnt);
+
 nsock_event_id nsock_sendto(nsock_pool ms_pool, nsock_iod ms_iod, nsock_ev_handler handler, int timeout_msecs,
                             void *userdata, struct sockaddr *saddr, size_t sslen, unsigned short port, const char *data, int datalen);
 
@@ -592,6 +630,42 @@ int nsock_event_cancel(nsock_pool ms_pool, nsock_event_id id, int notify );
  * you call it, it will do so before returning */
 const struct timeval *nsock_gettimeofday();
 
+/* Event loop statistics. Histograms have a logarithmic scale: bucket 0 counts
+ * values lower than 1, bucket i (i > 0) counts values in [2^(i-1), 2^i) and
+ * the last bucket also counts everything bigger. */
+#define NSOCK_STATS_BUCKETS 24
+
+struct nsock_stats {
+  /* Number of events delivered, by nse_type and nse_status */
+  unsigned long events[NSE_TYPE_MAX][NSE_STATUS_EOF + 1];
+  /* Time spent in each event handler, in microseconds */
+  unsigned long handler_usecs[NSOCK_STATS_BUCKETS];
+  /* Time spent in each iteration of nsock_loop(), in microseconds */
+  unsigned long loop_usecs[NSOCK_STATS_BUCKETS];
+  /* Number of events delivered by each iteration of nsock_loop() */
+  unsigned long loop_events[NSOCK_STATS_BUCKETS];
+  /* Number of iterations of nsock_loop() */
+  unsigned long loops;
+  /* Total seconds spent in the loop, waiting in the IO engine (epoll_wait,
+   * select...) and running event handlers. The rest is nsock overhead. */
+  double loop_time;
+  double wait_time;
+  double handler_time;
+  /* Number of events pending, IODs in use and IODs ever created */
+  int events_pending;
+  int iods_active;
+  unsigned long iods_created;
+};
+
+/* Start (enable nonzero) or stop collecting event loop statistics on the pool.
+ * Statistics are disabled by default and cost nothing then. Enabling them
+ * again resets them. */
+void nsp_set_stats(nsock_pool nsp, int enable);
+
+/* Copy the statistics collected so far into *stats. Returns 0 on success and -1
+ * if statistics are not enabled on this pool. */
+int nsp_get_stats(nsock_pool nsp, struct nsock_stats *stats);
+
 
 #ifdef HAVE_PCAP
 /* Open pcap device and connect it to nsp. Other parameters have the
@@ -340,6 +340,8 @@ int select_loop(mspool *nsp, int msec_timeout) {
     }
 
     gettimeofday(&nsock_tod, NULL); /* Due to select delay */
+    if (nsp->stats)
+      nsock_stats_wakeup(nsp);
   } while (results_left == -1 && sock_err == EINTR); /* repeat only if signal occurred */
 
   if (results_left == -1 && sock_err != EINTR) {
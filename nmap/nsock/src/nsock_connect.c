@@ -63,6 +63,16 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <string.h>
+#ifndef WIN32
+#include <netinet/tcp.h>
+#endif
+
+/* How data given to nsock_connect_tcp_data is sent with the connection */
+enum fastopen_method {
+  FASTOPEN_NONE,    /* sent once connected */
+  FASTOPEN_CONNECT, /* TCP_FASTOPEN_CONNECT: connect() then send() */
+  FASTOPEN_SENDTO   /* sendto() with MSG_FASTOPEN instead of connect() */
+};
 
 /* Create the actual socket (nse->iod->sd) underlying the iod. This unblocks the
  * socket, binds to the localaddr address, sets IP options, and sets the
@@ -71,15 +81,25 @@
  * or write on the iod. */
 static int nsock_make_socket(mspool *ms, msiod *iod, int family, int type, int proto) {
   int rc;
+  int nonblocking = 0;
 
   /* inheritable_socket is from nbase */
-  iod->sd = (int)inheritable_socket(family, type, proto);
+#ifdef SOCK_NONBLOCK
+  /* Get a non-blocking socket right away, saving the two fcntl() calls of
+   * unblock_socket. Old kernels reject the flag with EINVAL. */
+  iod->sd = (int)inheritable_socket(family, type | SOCK_NONBLOCK, proto);
+  if (iod->sd != -1)
+    nonblocking = 1;
+  else if (socket_errno() == EINVAL)
+#endif
+    iod->sd = (int)inheritable_socket(family, type, proto);
   if (iod->sd == -1) {
     perror("Socket troubles");
     return -1;
   }
 
-  unblock_socket(iod->sd);
+  if (!nonblocking)
+    unblock_socket(iod->sd);
 
   iod->lastproto = proto;
 
@@ -148,16 +168,37 @@ int nsock_setup_udp(nsock_pool nsp, nsock_iod ms_iod, int af) {
   return nsi->sd;
 }
 
-/* This does the actual logistics of requesting a TCP connection.  It is shared
- * by nsock_connect_tcp and nsock_connect_ssl */
-void nsock_connect_internal(mspool *ms, msevent *nse, int type, int proto, struct sockaddr_storage *ss, size_t sslen,
-                            unsigned short port) {
+/* Prepare the socket of iod for sending data along with the TCP handshake,
+ * using TCP Fast Open if the system supports it. */
+static enum fastopen_method fastopen_setup(mspool *ms, msiod *iod) {
+#ifdef TCP_FASTOPEN_CONNECT
+  int one = 1;
+
+  if (setsockopt(iod->sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (const char *)&one, sizeof(one)) == 0)
+    return FASTOPEN_CONNECT;
+  nsock_log_debug_all(ms, "Setting of TCP_FASTOPEN_CONNECT failed (IOD #%li): %s",
+                      iod->id, strerror(errno));
+#endif
+#ifdef MSG_FASTOPEN
+  return FASTOPEN_SENDTO;
+#else
+  return FASTOPEN_NONE;
+#endif
+}
+
+/* This does the actual logistics of requesting a connection, and sending the
+ * first datalen bytes of data with it where TCP Fast Open makes it possible.
+ * Returns the number of bytes of data that were sent. */
+static int nsock_connect_internal_data(mspool *ms, msevent *nse, int type, int proto, struct sockaddr_storage *ss,
+                                       size_t sslen, unsigned short port, const char *data, int datalen) {
 
   struct sockaddr_in *sin = (struct sockaddr_in *)ss;
 #if HAVE_IPV6
   struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
 #endif
   msiod *iod = nse->iod;
+  enum fastopen_method fastopen = FASTOPEN_NONE;
+  int sent = 0;
 
   /* Now it is time to actually attempt the connection */
   if (nsock_make_socket(ms, iod, ss->ss_family, type, proto) == -1) {
@@ -186,7 +227,30 @@ void nsock_connect_internal(mspool *ms, msevent *nse, int type, int proto, struc
       memcpy(&iod->peer, ss, sslen);
     iod->peerlen = sslen;
 
-    if (connect(iod->sd, (struct sockaddr *)ss, sslen) == -1) {
+    if (datalen > 0 && proto == IPPROTO_TCP)
+      fastopen = fastopen_setup(ms, iod);
+
+#ifdef MSG_FASTOPEN
+    if (fastopen == FASTOPEN_SENDTO) {
+      /* This sends the SYN, with the data if we have a cookie for the server. */
+      sent = sendto(iod->sd, data, datalen, MSG_FASTOPEN, (struct sockaddr *)ss, sslen);
+      if (sent == -1) {
+        int err = socket_errno();
+
+        sent = 0;
+        if (err == EOPNOTSUPP) {
+          /* TCP Fast Open is disabled, go on with a normal connect() */
+          fastopen = FASTOPEN_NONE;
+        } else if (err != EINPROGRESS && err != EAGAIN) {
+          nse->event_done = 1;
+          nse->status = NSE_STATUS_ERROR;
+          nse->errnum = err;
+        }
+      }
+    }
+#endif
+
+    if (fastopen != FASTOPEN_SENDTO && connect(iod->sd, (struct sockaddr *)ss, sslen) == -1) {
       int err = socket_errno();
 
       if (proto == IPPROTO_UDP || (err != EINPROGRESS && err != EAGAIN)) {
@@ -194,9 +258,27 @@ void nsock_connect_internal(mspool *ms, msevent *nse, int type, int proto, struc
         nse->status = NSE_STATUS_ERROR;
         nse->errnum = err;
       }
+    } else if (fastopen == FASTOPEN_CONNECT) {
+      /* The connect() was deferred, this sends the SYN (with the data if we
+       * have a cookie for the server). Failure here means that the data must
+       * wait for the handshake, connection errors are reported as usual. */
+      sent = send(iod->sd, data, datalen, 0);
+      if (sent == -1)
+        sent = 0;
     }
+    if (sent > 0)
+      nsock_log_debug(ms, "TCP Fast Open sent %d bytes with the SYN (IOD #%li) EID %li",
+                      sent, iod->id, nse->id);
     /* The callback handle_connect_result handles the connection once it completes. */
   }
+  return sent;
+}
+
+/* This does the actual logistics of requesting a TCP connection.  It is shared
+ * by nsock_connect_tcp and nsock_connect_ssl */
+void nsock_connect_internal(mspool *ms, msevent *nse, int type, int proto, struct sockaddr_storage *ss, size_t sslen,
+                            unsigned short port) {
+  nsock_connect_internal_data(ms, nse, type, proto, ss, sslen, port, NULL, 0);
 }
 
 #if HAVE_SYS_UN_H
@@ -254,32 +336,83 @@ nsock_event_id nsock_connect_unixsock_datagram(nsock_pool nsp, nsock_iod nsiod,
 
 #endif  /* HAVE_SYS_UN_H */
 
-/* Request a TCP connection to another system (by IP address).  The in_addr is
- * normal network byte order, but the port number should be given in HOST BYTE
- * ORDER.  ss should be a sockaddr_storage, sockaddr_in6, or sockaddr_in as
- * appropriate (just like what you would pass to connect).  sslen should be the
- * sizeof the structure you are passing in. */
-nsock_event_id nsock_connect_tcp(nsock_pool nsp, nsock_iod ms_iod, nsock_ev_handler handler, int timeout_msecs,
-                                 void *userdata, struct sockaddr *saddr, size_t sslen, unsigned short port) {
+/* Handler of the write event that sends what TCP Fast Open couldn't of the data
+ * given to nsock_connect_tcp_data. The connect handler has already been called
+ * by then, so a failure is kept in the iod and reported by the next read. */
+static void connect_data_write_handler(nsock_pool nsp, nsock_event nse, void *userdata) {
+  msiod *nsi = (msiod *)nse_iod(nse);
+
+  switch (nse_status(nse)) {
+    case NSE_STATUS_ERROR:
+      nsi->pending_errnum = nse_errorcode(nse);
+      break;
+    case NSE_STATUS_TIMEOUT:
+      nsi->pending_errnum = ETIMEDOUT;
+      break;
+    default:
+      return;
+  }
+  nsock_log_info((mspool *)nsp, "Sending connection data failed (IOD #%li): %s",
+                 nsi->id, socket_strerror(nsi->pending_errnum));
+}
 
-  msiod *nsi = (msiod *)ms_iod;
-  mspool *ms = (mspool *)nsp;
+static nsock_event_id connect_tcp_data(mspool *ms, msiod *nsi, nsock_ev_handler handler, int timeout_msecs,
+                                       void *userdata, struct sockaddr_storage *ss, size_t sslen,
+                                       unsigned short port, const char *data, int datalen) {
   msevent *nse;
-  struct sockaddr_storage *ss = (struct sockaddr_storage *)saddr;
+  nsock_event_id id;
+  int sent, failed;
 
   assert(nsi->state == NSIOD_STATE_INITIAL || nsi->state == NSIOD_STATE_UNKNOWN);
+  assert(datalen >= 0);
 
   nse = msevent_new(ms, NSE_TYPE_CONNECT, nsi, timeout_msecs, handler, userdata);
   assert(nse);
 
-  nsock_log_info(ms, "TCP connection requested to %s:%hu (IOD #%li) EID %li",
-                 inet_ntop_ez(ss, sslen), port, nsi->id, nse->id);
+  if (datalen > 0)
+    nsock_log_info(ms, "TCP connection requested to %s:%hu with %d bytes of data (IOD #%li) EID %li",
+                   inet_ntop_ez(ss, sslen), port, datalen, nsi->id, nse->id);
+  else
+    nsock_log_info(ms, "TCP connection requested to %s:%hu (IOD #%li) EID %li",
+                   inet_ntop_ez(ss, sslen), port, nsi->id, nse->id);
 
   /* Do the actual connect() */
-  nsock_connect_internal(ms, nse, SOCK_STREAM, IPPROTO_TCP, ss, sslen, port);
+  sent = nsock_connect_internal_data(ms, nse, SOCK_STREAM, IPPROTO_TCP, ss, sslen, port, data, datalen);
+  id = nse->id;
+  failed = nse->event_done;
   nsp_add_event(ms, nse);
 
-  return nse->id;
+  /* Whatever wasn't sent with the SYN goes out as soon as we're connected. The
+   * write event is processed right after the connect event of the iod. */
+  if (sent < datalen && !failed)
+    nsock_write(ms, nsi, connect_data_write_handler, timeout_msecs, NULL, data + sent, datalen - sent);
+
+  return id;
+}
+
+/* Request a TCP connection to another system (by IP address).  The in_addr is
+ * normal network byte order, but the port number should be given in HOST BYTE
+ * ORDER.  ss should be a sockaddr_storage, sockaddr_in6, or sockaddr_in as
+ * appropriate (just like what you would pass to connect).  sslen should be the
+ * sizeof the structure you are passing in. */
+nsock_event_id nsock_connect_tcp(nsock_pool nsp, nsock_iod ms_iod, nsock_ev_handler handler, int timeout_msecs,
+                                 void *userdata, struct sockaddr *saddr, size_t sslen, unsigned short port) {
+  return connect_tcp_data((mspool *)nsp, (msiod *)ms_iod, handler, timeout_msecs, userdata,
+                          (struct sockaddr_storage *)saddr, sslen, port, NULL, 0);
+}
+
+/* Request a TCP connection like nsock_connect_tcp, and send datalen bytes of
+ * data on it. The data is copied. TCP Fast Open is used where the system
+ * supports it, so that the data can be carried in the SYN and the server's
+ * reply can arrive a round trip earlier; otherwise the data is sent as soon as
+ * the connection is established. The handler is called when the connection is
+ * established, just like with nsock_connect_tcp. If sending the data fails
+ * after that, the next read on the iod fails with the error of the write. */
+nsock_event_id nsock_connect_tcp_data(nsock_pool nsp, nsock_iod ms_iod, nsock_ev_handler handler, int timeout_msecs,
+                                      void *userdata, struct sockaddr *saddr, size_t sslen, unsigned short port,
+                                      const char *data, int datalen) {
+  return connect_tcp_data((mspool *)nsp, (msiod *)ms_iod, handler, timeout_msecs, userdata,
+                          (struct sockaddr_storage *)saddr, sslen, port, data, datalen);
 }
 
 /* Request an SCTP association to another system (by IP address).  The in_addr
@@ -80,9 +80,15 @@
 #if HAVE_STRING_H
 #include <string.h>
 #endif
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
 
 #include "netutils.h"
 
+/* Maximum number of buffers handed to a single sendmsg() by vectored writes */
+#define NSOCK_IOV_BATCH 64
+
 #if HAVE_PCAP
 #include "nsock_pcap.h"
 #endif
@@ -428,6 +434,9 @@ void handle_connect_result(mspool *ms, msevent *nse, enum nse_status status) {
       if (rc == 0)
         nsock_log_error(ms, "Uh-oh: SSL_set_session() failed - please tell nmap-dev@insecure.org\n");
       iod->ssl_session = NULL; /* No need for this any more */
+    } else if (ms->sslcache != NULL && !sslconnect_inprogress) {
+      /* No session given by the caller, try the pool's session cache. */
+      ssl_cache_lookup(ms, iod);
     }
 
     /* If this is a reinvocation of handle_connect_result, clear out the listen
@@ -443,6 +452,8 @@ void handle_connect_result(mspool *ms, msevent *nse, enum nse_status status) {
     if (rc == 1) {
       /* Woop!  Connect is done! */
       nse->event_done = 1;
+      if (ms->sslcache != NULL)
+        ssl_cache_account(ms, iod);
       /* Check that certificate verification was okay, if requested. */
       if (nsi_ssl_post_connect_verify(iod)) {
         nse->status = NSE_STATUS_SUCCESS;
@@ -501,6 +512,76 @@ void handle_connect_result(mspool *ms, msevent *nse, enum nse_status status) {
   return;
 }
 
+/* Write as much as possible of the caller-owned buffers of a vectored write,
+ * starting after the writeinfo.written_so_far bytes already sent. Returns the
+ * number of bytes written or -1, just like send() or SSL_write(). */
+static int do_actual_writev(mspool *ms, msevent *nse) {
+  struct writeinfo *wi = &nse->writeinfo;
+  msiod *iod = nse->iod;
+  size_t skip = wi->written_so_far;
+  int i = 0;
+
+  /* Find the first buffer that hasn't been entirely written yet */
+  while (i < wi->iovcnt && skip >= wi->iov[i].len) {
+    skip -= wi->iov[i].len;
+    i++;
+  }
+  assert(i < wi->iovcnt);
+
+#if HAVE_OPENSSL
+  if (iod->ssl) {
+    int done = 0;
+    int res;
+
+    /* SSL has no scatter/gather interface. Write the buffers one after the
+     * other, and give up at the first one that doesn't go through entirely
+     * (SSL_write must be retried with the same arguments). */
+    for (; i < wi->iovcnt; i++, skip = 0) {
+      int len = (int)(wi->iov[i].len - skip);
+
+      if (len == 0)
+        continue;
+      res = SSL_write(iod->ssl, (const char *)wi->iov[i].base + skip, len);
+      if (res <= 0)
+        return (done > 0) ? done : res;
+      done += res;
+      if (res < len)
+        break;
+    }
+    return done;
+  }
+#endif
+
+#ifndef WIN32
+  {
+    struct iovec vec[NSOCK_IOV_BATCH];
+    struct msghdr msg;
+    int n, res;
+
+    for (n = 0; i < wi->iovcnt && n < NSOCK_IOV_BATCH; i++, skip = 0) {
+      if (wi->iov[i].len == skip)
+        continue;
+      vec[n].iov_base = (char *)wi->iov[i].base + skip;
+      vec[n].iov_len = wi->iov[i].len - skip;
+      n++;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = n;
+
+    res = sendmsg(iod->sd, &msg, 0);
+    if (res == -1 && socket_errno() == ENOTSOCK) {
+      /* Not a network socket (i.e. stdout) */
+      return writev(iod->sd, vec, n);
+    }
+    return res;
+  }
+#else
+  return send(iod->sd, (const char *)wi->iov[i].base + skip, (int)(wi->iov[i].len - skip), 0);
+#endif
+}
+
 void handle_write_result(mspool *ms, msevent *nse, enum nse_status status) {
   int bytesleft;
   char *str;
@@ -512,19 +593,24 @@ void handle_write_result(mspool *ms, msevent *nse, enum nse_status status) {
     nse->event_done = 1;
     nse->status = status;
   } else if (status == NSE_STATUS_SUCCESS) {
-    str = fs_str(&nse->iobuf) + nse->writeinfo.written_so_far;
-    bytesleft = fs_length(&nse->iobuf) - nse->writeinfo.written_so_far;
-    if (nse->writeinfo.written_so_far > 0)
-      assert(bytesleft > 0);
+    if (nse->writeinfo.iov != NULL) {
+      bytesleft = nse->writeinfo.iovlen - nse->writeinfo.written_so_far;
+      res = do_actual_writev(ms, nse);
+    } else {
+      str = fs_str(&nse->iobuf) + nse->writeinfo.written_so_far;
+      bytesleft = fs_length(&nse->iobuf) - nse->writeinfo.written_so_far;
+      if (nse->writeinfo.written_so_far > 0)
+        assert(bytesleft > 0);
 #if HAVE_OPENSSL
-    if (iod->ssl)
-      res = SSL_write(iod->ssl, str, bytesleft);
-    else
-#endif
-      if (nse->writeinfo.dest.ss_family == AF_UNSPEC)
-        res = send(nse->iod->sd, str, bytesleft, 0);
+      if (iod->ssl)
+        res = SSL_write(iod->ssl, str, bytesleft);
       else
-        res = sendto(nse->iod->sd, str, bytesleft, 0, (struct sockaddr *)&nse->writeinfo.dest, (int)nse->writeinfo.destlen);
+#endif
+        if (nse->writeinfo.dest.ss_family == AF_UNSPEC)
+          res = send(nse->iod->sd, str, bytesleft, 0);
+        else
+          res = sendto(nse->iod->sd, str, bytesleft, 0, (struct sockaddr *)&nse->writeinfo.dest, (int)nse->writeinfo.destlen);
+    }
     if (res == bytesleft) {
       nse->event_done = 1;
       nse->status = NSE_STATUS_SUCCESS;
@@ -730,12 +816,16 @@ static int do_actual_read(mspool *ms, msevent *nse) {
 
 
 void handle_read_result(mspool *ms, msevent *nse, enum nse_status status) {
-  unsigned int count;
   char *str;
   int rc, len;
   msiod *iod = nse->iod;
 
-  if (status == NSE_STATUS_TIMEOUT) {
+  if (iod->pending_errnum && status != NSE_STATUS_CANCELLED) {
+    nse->event_done = 1;
+    nse->status = NSE_STATUS_ERROR;
+    nse->errnum = iod->pending_errnum;
+    iod->pending_errnum = 0;
+  } else if (status == NSE_STATUS_TIMEOUT) {
     nse->event_done = 1;
     if (fs_length(&nse->iobuf) > 0)
       nse->status = NSE_STATUS_SUCCESS;
@@ -763,18 +853,17 @@ void handle_read_result(mspool *ms, msevent *nse, enum nse_status status) {
           /* else we are not done */
           break;
         case NSOCK_READLINES:
-          /* Lets count the number of lines we have ... */
-          count = 0;
-          len = fs_length(&nse->iobuf) -1;
-          str = fs_str(&nse->iobuf);
-          for (count=0; len >= 0; len--) {
-            if (str[len] == '\n') {
-              count++;
-              if ((int)count >= nse->readinfo.num)
-                break;
-            }
+          /* Lets count the number of lines we have ... Only the bytes that
+           * arrived since the last time need to be looked at. */
+          len = fs_length(&nse->iobuf);
+          str = fs_str(&nse->iobuf) + nse->readinfo.scanned;
+          while (nse->readinfo.lines < nse->readinfo.num
+                 && (str = (char *)memchr(str, '\n', fs_str(&nse->iobuf) + len - str)) != NULL) {
+            nse->readinfo.lines++;
+            str++;
           }
-          if ((int) count >= nse->readinfo.num) {
+          nse->readinfo.scanned = len;
+          if (nse->readinfo.lines >= nse->readinfo.num) {
             nse->event_done = 1;
             nse->status = NSE_STATUS_SUCCESS;
           }
@@ -912,6 +1001,9 @@ enum nsock_loopstatus nsock_loop(nsock_pool nsp, int msec_timeout) {
       }
     }
 
+    if (ms->stats)
+      nsock_stats_loop_start(ms);
+
     if (ms->engine->loop(ms, msecs_left) == -1) {
       quitstatus = NSOCK_LOOP_ERROR;
       break;
@@ -919,6 +1011,8 @@ enum nsock_loopstatus nsock_loop(nsock_pool nsp, int msec_timeout) {
 
     gettimeofday(&nsock_tod, NULL); /* we do this at end because there is one
                                      * at beginning of function */
+    if (ms->stats)
+      nsock_stats_loop_end(ms);
     loopnum++;
   }
 
@@ -1134,6 +1228,14 @@ const struct timeval *nsock_gettimeofday() {
 void nsp_add_event(mspool *nsp, msevent *nse) {
     nsock_log_debug(nsp, "NSE #%lu: Adding event", nse->id);
 
+  /* A read on an iod with a failed internal write reports that failure */
+  if (nse->type == NSE_TYPE_READ && nse->iod->pending_errnum) {
+    nse->event_done = 1;
+    nse->status = NSE_STATUS_ERROR;
+    nse->errnum = nse->iod->pending_errnum;
+    nse->iod->pending_errnum = 0;
+  }
+
   /* First lets do the event-type independent stuff, starting with timeouts */
   if (nse->event_done) {
     nsp->next_ev = nsock_tod;
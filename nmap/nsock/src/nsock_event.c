@@ -332,6 +332,9 @@ int msevent_cancel(mspool *nsp, msevent *nse, gh_list *event_list, gh_list_elem
  * from any lists it might be on (eg nsp->read_list etc.) nse->event_done
  * MUST be true when you call this */
 void msevent_dispatch_and_delete(mspool *nsp, msevent *nse, int notify) {
+  struct timeval start;
+  int timed = 0;
+
   assert(nsp);
   assert(nse);
 
@@ -347,10 +350,16 @@ void msevent_dispatch_and_delete(mspool *nsp, msevent *nse, int notify) {
 
   if (notify) {
     nsock_trace_handler_callback(nsp, nse);
+    if (nsp->stats) {
+      gettimeofday(&start, NULL);
+      timed = 1;
+    }
     nse->handler(nsp, nse, nse->userdata);
   }
 
-  /* FIXME: We should be updating stats here ... */
+  /* The handler may have turned statistics on or off */
+  if (nsp->stats)
+    nsock_stats_event(nsp, nse, &start, timed);
 
   /* Now we clobber the event ... */
   msevent_delete(nsp, nse);
@@ -462,6 +471,10 @@ void msevent_delete(mspool *nsp, msevent *nse) {
   if (nse->type == NSE_TYPE_READ || nse->type ==  NSE_TYPE_WRITE) {
     fs_free(&nse->iobuf);
   }
+  if (nse->type == NSE_TYPE_WRITE && nse->writeinfo.iov != NULL) {
+    free(nse->writeinfo.iov);
+    nse->writeinfo.iov = NULL;
+  }
   #if HAVE_PCAP
   if (nse->type == NSE_TYPE_PCAP_READ) {
     fs_free(&nse->iobuf);
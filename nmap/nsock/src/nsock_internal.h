@@ -139,6 +139,10 @@ struct readinfo {
   enum nsock_read_types read_type;
   /* num lines; num bytes; whatever (depends on read_type) */
   int num;
+  /* NSOCK_READLINES: number of bytes of the iobuf already searched for
+   * newlines, and the number of newlines found in them */
+  int scanned;
+  int lines;
 };
 
 struct writeinfo {
@@ -146,6 +150,13 @@ struct writeinfo {
   size_t destlen;
   /* Number of bytes successfully written */
   int written_so_far;
+
+  /* Caller-owned buffers of a vectored write (see nsock_writev), NULL when
+   * the data to write is in the event's iobuf */
+  struct nsock_iovec *iov;
+  int iovcnt;
+  /* Total number of bytes described by iov */
+  int iovlen;
 };
 
 /* Remember that callers of this library should NOT be accessing these
@@ -213,9 +224,14 @@ typedef struct {
    * NSOCK_LOOP_QUIT. */
   int quit;
 
+  /* Event loop statistics (NULL if disabled), see nsock_stats.c */
+  struct nsock_stats_info *stats;
+
 #if HAVE_OPENSSL
   /* The SSL Context (options and such) */
   SSL_CTX *sslctx;
+  /* Cache of SSL sessions by target (NULL if disabled), see nsock_ssl.c */
+  struct ssl_session_cache *sslcache;
 #endif
 } mspool;
 
@@ -271,6 +287,7 @@ typedef struct {
 
 #define IOD_REGISTERED  0x01
 #define IOD_PROCESSED   0x02    /* internally used by engine_kqueue.c */
+#define IOD_SSLCACHE    0x04    /* SSL handshake accounted in the session cache */
 
 #define IOD_PROPSET(iod, flag)  ((iod)->_flags |= (flag))
 #define IOD_PROPCLR(iod, flag)  ((iod)->_flags &= ~(flag))
@@ -298,6 +315,10 @@ typedef struct {
   /* No. of bytes written to the sd */
   unsigned long write_count;
 
+  /* Error of a write nsock made on its own (see nsock_connect_tcp_data) that
+   * is to be reported by the next read, or 0 */
+  int pending_errnum;
+
   void *userdata;
 
   /* IP options to set on socket before connect() */
@@ -454,7 +475,20 @@ void nsock_trace_handler_callback(mspool *ms, msevent *nse);
 /* Sets the ssl session of an nsock_iod, increments usage count.  The session
  * should not have been set yet (as no freeing is done) */
 void nsi_set_ssl_session(msiod *iod, SSL_SESSION *sessid);
+
+/* SSL session cache internals, defined in nsock_ssl.c */
+void ssl_cache_configure_ctx(mspool *nsp);
+void ssl_cache_lookup(mspool *nsp, msiod *iod);
+void ssl_cache_account(mspool *nsp, msiod *iod);
+void ssl_cache_free(mspool *nsp);
 #endif
 
+/* Event loop statistics, defined in nsock_stats.c. These must only be called
+ * when nsp->stats is not NULL. */
+void nsock_stats_loop_start(mspool *nsp);
+void nsock_stats_wakeup(mspool *nsp);
+void nsock_stats_loop_end(mspool *nsp);
+void nsock_stats_event(mspool *nsp, msevent *nse, const struct timeval *start, int handler);
+
 #endif /* NSOCK_INTERNAL_H */
 
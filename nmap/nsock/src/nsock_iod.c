@@ -128,6 +128,8 @@ nsock_iod nsi_new2(nsock_pool nsockp, int sd, void *userdata) {
   nsi->read_count = 0;
   nsi->write_count = 0;
 
+  nsi->pending_errnum = 0;
+
   nsi->hostname = NULL;
 
   nsi->ipopts = NULL;
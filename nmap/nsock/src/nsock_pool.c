@@ -183,6 +183,7 @@ nsock_pool nsp_new(void *userdata) {
 
 #if HAVE_OPENSSL
   nsp->sslctx = NULL;
+  nsp->sslcache = NULL;
 #endif
 
   return (nsock_pool)nsp;
@@ -255,10 +256,13 @@ void nsp_delete(nsock_pool ms_pool) {
   nsp->engine->destroy(nsp);
 
 #if HAVE_OPENSSL
+  ssl_cache_free(nsp);
   if (nsp->sslctx != NULL)
     SSL_CTX_free(nsp->sslctx);
 #endif
 
+  free(nsp->stats);
+
   free(nsp);
 }
 
@@ -62,6 +62,7 @@
 #include "nsock.h"
 #include "nsock_internal.h"
 #include "nsock_ssl.h"
+#include "nsock_log.h"
 #include "netutils.h"
 
 #if HAVE_OPENSSL
@@ -116,8 +117,10 @@ nsock_ssl_ctx nsp_ssl_init(nsock_pool ms_pool) {
   mspool *ms = (mspool *)ms_pool;
   char rndbuf[128];
 
-  if (ms->sslctx == NULL)
+  if (ms->sslctx == NULL) {
     ms->sslctx = ssl_init_common();
+    ssl_cache_configure_ctx(ms);
+  }
 
   /* get_random_bytes may or may not provide high-quality randomness. Add it to
    * the entropy pool without increasing the entropy estimate (third argument of
@@ -162,8 +165,10 @@ nsock_ssl_ctx nsp_ssl_init_max_speed(nsock_pool ms_pool) {
   mspool *ms = (mspool *)ms_pool;
   char rndbuf[128];
 
-  if (ms->sslctx == NULL)
+  if (ms->sslctx == NULL) {
     ms->sslctx = ssl_init_common();
+    ssl_cache_configure_ctx(ms);
+  }
 
   /* get_random_bytes may or may not provide high-quality randomness. */
   get_random_bytes(rndbuf, sizeof(rndbuf));
@@ -211,3 +216,334 @@ int nsi_ssl_post_connect_verify(const nsock_iod nsockiod) {
   return 1;
 }
 
+
+
+/* ---- SSL SESSION CACHE ---- */
+
+/* The session cache remembers the last SSL_SESSION negotiated with each
+ * (address, port, SNI hostname) target so that later connections to the same
+ * target can resume it instead of doing a full handshake. Sessions are handed
+ * to us by OpenSSL through the new session callback, which covers both
+ * session IDs and session tickets (including tickets that arrive after the
+ * handshake). Entries are chained in a small hash table and evicted in
+ * insertion order once the cache holds more than maxsize sessions. */
+
+#define SSL_CACHE_BUCKETS 256
+
+#if HAVE_OPENSSL
+struct ssl_cache_entry {
+  struct sockaddr_storage peer;
+  char *hostname;
+  SSL_SESSION *session;
+
+  /* Hash bucket holding this entry, and next entry in the same bucket */
+  int bucket;
+  struct ssl_cache_entry *next;
+
+  /* Insertion order, used for eviction */
+  struct ssl_cache_entry *older;
+  struct ssl_cache_entry *newer;
+};
+
+struct ssl_session_cache {
+  struct ssl_cache_entry *buckets[SSL_CACHE_BUCKETS];
+
+  struct ssl_cache_entry *oldest;
+  struct ssl_cache_entry *newest;
+
+  int count;
+  int maxsize;
+
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/* Hash the target of an IOD. Returns -1 if the peer address can't be used as a
+ * cache key (unknown family, or not connected yet). */
+static int ssl_cache_hash(const msiod *iod) {
+  const unsigned char *p = NULL;
+  const char *h;
+  size_t len = 0, i;
+  unsigned int hash = 2166136261U;
+
+  if (iod->peer.ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (struct sockaddr_in *)&iod->peer;
+
+    p = (const unsigned char *)&sin->sin_addr;
+    len = sizeof(sin->sin_addr);
+    hash = (hash ^ sin->sin_port) * 16777619U;
+  }
+#if HAVE_IPV6
+  else if (iod->peer.ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&iod->peer;
+
+    p = (const unsigned char *)&sin6->sin6_addr;
+    len = sizeof(sin6->sin6_addr);
+    hash = (hash ^ sin6->sin6_port) * 16777619U;
+  }
+#endif
+  else {
+    return -1;
+  }
+
+  for (i = 0; i < len; i++)
+    hash = (hash ^ p[i]) * 16777619U;
+
+  if (iod->hostname != NULL) {
+    for (h = iod->hostname; *h != '\0'; h++)
+      hash = (hash ^ (unsigned char)*h) * 16777619U;
+  }
+
+  return hash % SSL_CACHE_BUCKETS;
+}
+
+/* Return nonzero if the cache entry describes the current target of iod. */
+static int ssl_cache_entry_match(const struct ssl_cache_entry *ent, const msiod *iod) {
+  const char *h1 = ent->hostname ? ent->hostname : "";
+  const char *h2 = iod->hostname ? iod->hostname : "";
+
+  if (ent->peer.ss_family != iod->peer.ss_family)
+    return 0;
+
+  if (iod->peer.ss_family == AF_INET) {
+    const struct sockaddr_in *a = (struct sockaddr_in *)&ent->peer;
+    const struct sockaddr_in *b = (struct sockaddr_in *)&iod->peer;
+
+    if (a->sin_port != b->sin_port
+        || memcmp(&a->sin_addr, &b->sin_addr, sizeof(a->sin_addr)) != 0)
+      return 0;
+  }
+#if HAVE_IPV6
+  else if (iod->peer.ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a = (struct sockaddr_in6 *)&ent->peer;
+    const struct sockaddr_in6 *b = (struct sockaddr_in6 *)&iod->peer;
+
+    if (a->sin6_port != b->sin6_port
+        || memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) != 0)
+      return 0;
+  }
+#endif
+  else {
+    return 0;
+  }
+
+  return strcmp(h1, h2) == 0;
+}
+
+static struct ssl_cache_entry *ssl_cache_find(struct ssl_session_cache *cache, const msiod *iod, int bucket) {
+  struct ssl_cache_entry *ent;
+
+  for (ent = cache->buckets[bucket]; ent != NULL; ent = ent->next) {
+    if (ssl_cache_entry_match(ent, iod))
+      return ent;
+  }
+  return NULL;
+}
+
+/* Unlink an entry from both the hash chain and the insertion order list, and
+ * free it along with the session reference it holds. */
+static void ssl_cache_entry_remove(struct ssl_session_cache *cache, struct ssl_cache_entry *ent) {
+  struct ssl_cache_entry **pp;
+
+  for (pp = &cache->buckets[ent->bucket]; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == ent) {
+      *pp = ent->next;
+      break;
+    }
+  }
+
+  if (ent->older)
+    ent->older->newer = ent->newer;
+  else
+    cache->oldest = ent->newer;
+  if (ent->newer)
+    ent->newer->older = ent->older;
+  else
+    cache->newest = ent->older;
+
+  SSL_SESSION_free(ent->session);
+  free(ent->hostname);
+  free(ent);
+  cache->count--;
+}
+
+/* Called by OpenSSL whenever a new session (or session ticket) has been
+ * established on one of our connections. Returning 1 tells OpenSSL that we
+ * keep the reference to sess. */
+static int ssl_cache_new_session_cb(SSL *ssl, SSL_SESSION *sess) {
+  msiod *iod = (msiod *)SSL_get_app_data(ssl);
+  struct ssl_session_cache *cache;
+  struct ssl_cache_entry *ent;
+  int bucket;
+
+  if (iod == NULL || iod->nsp->sslcache == NULL)
+    return 0;
+
+  cache = iod->nsp->sslcache;
+  bucket = ssl_cache_hash(iod);
+  if (bucket < 0)
+    return 0;
+
+  ent = ssl_cache_find(cache, iod, bucket);
+  if (ent != NULL) {
+    /* Replace the session of an existing target and make it the newest */
+    SSL_SESSION_free(ent->session);
+    ent->session = sess;
+    if (ent != cache->newest) {
+      if (ent->older)
+        ent->older->newer = ent->newer;
+      else
+        cache->oldest = ent->newer;
+      ent->newer->older = ent->older;
+      ent->older = cache->newest;
+      ent->newer = NULL;
+      cache->newest->newer = ent;
+      cache->newest = ent;
+    }
+  } else {
+    ent = (struct ssl_cache_entry *)safe_zalloc(sizeof(*ent));
+    memcpy(&ent->peer, &iod->peer, iod->peerlen);
+    if (iod->hostname != NULL)
+      ent->hostname = strdup(iod->hostname);
+    ent->session = sess;
+
+    ent->bucket = bucket;
+    ent->next = cache->buckets[bucket];
+    cache->buckets[bucket] = ent;
+
+    ent->older = cache->newest;
+    if (cache->newest)
+      cache->newest->newer = ent;
+    else
+      cache->oldest = ent;
+    cache->newest = ent;
+    cache->count++;
+
+    while (cache->count > cache->maxsize)
+      ssl_cache_entry_remove(cache, cache->oldest);
+  }
+
+  nsock_log_debug(iod->nsp, "SSL session stored in cache for %s (IOD #%li)",
+                  get_peeraddr_string(iod), iod->id);
+  return 1;
+}
+
+/* Set the session caching mode of the pool's SSL_CTX according to whether the
+ * session cache is enabled. */
+void ssl_cache_configure_ctx(mspool *nsp) {
+  if (nsp->sslctx == NULL)
+    return;
+
+  if (nsp->sslcache != NULL) {
+    /* We store client sessions ourselves, OpenSSL only has to notify us. */
+    SSL_CTX_set_session_cache_mode(nsp->sslctx,
+                                   SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(nsp->sslctx, ssl_cache_new_session_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(nsp->sslctx, SSL_SESS_CACHE_OFF|SSL_SESS_CACHE_NO_AUTO_CLEAR);
+    SSL_CTX_sess_set_new_cb(nsp->sslctx, NULL);
+  }
+}
+
+/* Offer a cached session for the target of iod, if any. This is called right
+ * before SSL_connect() is first attempted, and only when the caller didn't
+ * provide an explicit session. */
+void ssl_cache_lookup(mspool *nsp, msiod *iod) {
+  struct ssl_cache_entry *ent;
+  int bucket;
+
+  SSL_set_app_data(iod->ssl, iod);
+
+  bucket = ssl_cache_hash(iod);
+  if (bucket < 0)
+    return;
+
+  IOD_PROPSET(iod, IOD_SSLCACHE);
+
+  ent = ssl_cache_find(nsp->sslcache, iod, bucket);
+  if (ent == NULL)
+    return;
+
+  /* SSL_set_session takes its own reference, so the entry may be replaced or
+   * evicted during the handshake. */
+  if (SSL_set_session(iod->ssl, ent->session) != 1)
+    nsock_log_error(nsp, "SSL_set_session() failed for cached session (IOD #%li)", iod->id);
+  else
+    nsock_log_debug(nsp, "Offering cached SSL session to %s (IOD #%li)",
+                    get_peeraddr_string(iod), iod->id);
+}
+
+/* Account for a completed handshake: a hit if a cached session was resumed, a
+ * miss if a full handshake was required. */
+void ssl_cache_account(mspool *nsp, msiod *iod) {
+  if (!IOD_PROPGET(iod, IOD_SSLCACHE))
+    return;
+
+  IOD_PROPCLR(iod, IOD_SSLCACHE);
+  if (SSL_session_reused(iod->ssl))
+    nsp->sslcache->hits++;
+  else
+    nsp->sslcache->misses++;
+}
+
+/* Free the cache and all the sessions it holds. */
+void ssl_cache_free(mspool *nsp) {
+  struct ssl_cache_entry *ent, *next;
+
+  if (nsp->sslcache == NULL)
+    return;
+
+  for (ent = nsp->sslcache->oldest; ent != NULL; ent = next) {
+    next = ent->newer;
+    SSL_SESSION_free(ent->session);
+    free(ent->hostname);
+    free(ent);
+  }
+  free(nsp->sslcache);
+  nsp->sslcache = NULL;
+
+  ssl_cache_configure_ctx(nsp);
+}
+#endif /* HAVE_OPENSSL */
+
+/* Enables (maxsize > 0) or disables (maxsize == 0) the SSL session cache of an
+ * nsock pool. See nsock.h for a description. */
+void nsp_ssl_set_session_cache(nsock_pool ms_pool, int maxsize) {
+#if HAVE_OPENSSL
+  mspool *ms = (mspool *)ms_pool;
+
+  assert(maxsize >= 0);
+
+  if (maxsize == 0) {
+    ssl_cache_free(ms);
+    return;
+  }
+
+  if (ms->sslcache == NULL)
+    ms->sslcache = (struct ssl_session_cache *)safe_zalloc(sizeof(*ms->sslcache));
+  ms->sslcache->maxsize = maxsize;
+  while (ms->sslcache->count > maxsize)
+    ssl_cache_entry_remove(ms->sslcache, ms->sslcache->oldest);
+  ssl_cache_configure_ctx(ms);
+#endif
+}
+
+/* Reports the number of SSL handshakes that resumed a cached session (hits)
+ * and the number that required a full handshake (misses). */
+void nsp_ssl_session_cache_stats(nsock_pool ms_pool, unsigned long *hits, unsigned long *misses) {
+#if HAVE_OPENSSL
+  mspool *ms = (mspool *)ms_pool;
+
+  if (ms->sslcache != NULL) {
+    if (hits)
+      *hits = ms->sslcache->hits;
+    if (misses)
+      *misses = ms->sslcache->misses;
+    return;
+  }
+#endif
+  if (hits)
+    *hits = 0;
+  if (misses)
+    *misses = 0;
+}
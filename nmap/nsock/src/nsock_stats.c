@@ -0,0 +1,172 @@
+/***************************************************************************
+ * nsock_stats.c -- event loop statistics.                                *
+ *                                                                         *
+ ***********************IMPORTANT NSOCK LICENSE TERMS***********************
+ *                                                                         *
+ * The nsock parallel socket event library is (C) 1999-2012 Insecure.Com   *
+ * LLC This library is free software; you may redistribute and/or          *
+ * modify it under the terms of the GNU General Public License as          *
+ * published by the Free Software Foundation; Version 2.  This guarantees  *
+ * your right to use, modify, and redistribute this software under certain *
+ * conditions.  If this license is unacceptable to you, Insecure.Com LLC   *
+ * may be willing to sell alternative licenses (contact                    *
+ * sales@insecure.com ).                                                   *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement stating    *
+ * terms other than the (GPL) terms above, then that alternative license   *
+ * agreement takes precedence over this comment.                           *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes (none     *
+ * have been found so far).                                                *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU       *
+ * General Public License v2.0 for more details                            *
+ * (http://www.gnu.org/licenses/gpl-2.0.html).                             *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#include "nsock_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+extern struct timeval nsock_tod;
+
+struct nsock_stats_info {
+  struct nsock_stats s;
+  /* When the current iteration of nsock_loop() started, and when the IO engine
+   * last returned from waiting during it. */
+  struct timeval loop_start;
+  struct timeval wakeup;
+  int started;
+  int woken;
+  /* Events delivered during the current iteration */
+  unsigned long loop_events;
+};
+
+static void hist_add(unsigned long *hist, unsigned long value) {
+  int i = 0;
+
+  while (value > 0 && i < NSOCK_STATS_BUCKETS - 1) {
+    value >>= 1;
+    i++;
+  }
+  hist[i]++;
+}
+
+static unsigned long usecs_between(const struct timeval *start, const struct timeval *end) {
+  long long usecs = TIMEVAL_SUBTRACT(*end, *start);
+
+  return (usecs > 0) ? (unsigned long)usecs : 0;
+}
+
+void nsp_set_stats(nsock_pool nsp, int enable) {
+  mspool *ms = (mspool *)nsp;
+
+  free(ms->stats);
+  ms->stats = NULL;
+  if (enable)
+    ms->stats = (struct nsock_stats_info *)safe_zalloc(sizeof(*ms->stats));
+}
+
+int nsp_get_stats(nsock_pool nsp, struct nsock_stats *stats) {
+  mspool *ms = (mspool *)nsp;
+
+  if (ms->stats == NULL)
+    return -1;
+
+  *stats = ms->stats->s;
+  stats->events_pending = ms->events_pending;
+  stats->iods_active = GH_LIST_COUNT(&ms->active_iods);
+  /* IOD serials start at 1 */
+  stats->iods_created = (ms->next_iod_serial > 0) ? ms->next_iod_serial - 1 : 0;
+  return 0;
+}
+
+/* Called by nsock_loop() before handing control to the IO engine. nsock_tod
+ * is current at this point. */
+void nsock_stats_loop_start(mspool *nsp) {
+  struct nsock_stats_info *info = nsp->stats;
+
+  info->loop_start = nsock_tod;
+  info->started = 1;
+  info->woken = 0;
+  info->loop_events = 0;
+}
+
+/* Called by the IO engines every time they return from waiting for events,
+ * right after updating nsock_tod. */
+void nsock_stats_wakeup(mspool *nsp) {
+  nsp->stats->wakeup = nsock_tod;
+  nsp->stats->woken = 1;
+}
+
+/* Called by nsock_loop() when the IO engine is done, once nsock_tod has been
+ * updated again. */
+void nsock_stats_loop_end(mspool *nsp) {
+  struct nsock_stats_info *info = nsp->stats;
+  unsigned long usecs;
+
+  /* Statistics may have been enabled by a handler during this iteration */
+  if (!info->started)
+    return;
+  info->started = 0;
+
+  usecs = usecs_between(&info->loop_start, &nsock_tod);
+  info->s.loops++;
+  info->s.loop_time += usecs / 1000000.0;
+  hist_add(info->s.loop_usecs, usecs);
+  hist_add(info->s.loop_events, info->loop_events);
+  if (info->woken)
+    info->s.wait_time += usecs_between(&info->loop_start, &info->wakeup) / 1000000.0;
+}
+
+/* Account for an event whose handler was called at start and just returned
+ * (handler is zero if the event was deleted without notification). */
+void nsock_stats_event(mspool *nsp, msevent *nse, const struct timeval *start, int handler) {
+  struct nsock_stats_info *info = nsp->stats;
+  struct timeval now;
+  unsigned long usecs;
+
+  if (nse->type < NSE_TYPE_MAX && nse->status <= NSE_STATUS_EOF)
+    info->s.events[nse->type][nse->status]++;
+  info->loop_events++;
+
+  if (!handler)
+    return;
+
+  gettimeofday(&now, NULL);
+  usecs = usecs_between(start, &now);
+  info->s.handler_time += usecs / 1000000.0;
+  hist_add(info->s.handler_usecs, usecs);
+}
@@ -64,6 +64,7 @@
 #include <nbase.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
 
 nsock_event_id nsock_sendto(nsock_pool ms_pool, nsock_iod ms_iod, nsock_ev_handler handler, int timeout_msecs,
                             void *userdata, struct sockaddr *saddr, size_t sslen, unsigned short port, const char *data, int datalen) {
@@ -164,6 +165,53 @@ nsock_event_id nsock_write(nsock_pool ms_pool, nsock_iod ms_iod,
   return nse->id;
 }
 
+/* Write the buffers described by iov to the socket without copying them. The
+ * caller keeps ownership of the buffers, which must not be modified or freed
+ * until the handler is called. The iov array itself is copied. */
+nsock_event_id nsock_writev(nsock_pool ms_pool, nsock_iod ms_iod, nsock_ev_handler handler, int timeout_msecs,
+                            void *userdata, const struct nsock_iovec *iov, int iovcnt) {
+  mspool *nsp = (mspool *)ms_pool;
+  msiod *nsi = (msiod *)ms_iod;
+  msevent *nse;
+  size_t total = 0;
+  int i;
+
+  assert(iovcnt >= 0);
+
+  nse = msevent_new(nsp, NSE_TYPE_WRITE, nsi, timeout_msecs, handler, userdata);
+  assert(nse);
+
+  nse->writeinfo.dest.ss_family = AF_UNSPEC;
+
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].len;
+
+  if (total > INT_MAX) {
+    nse->event_done = 1;
+    nse->status = NSE_STATUS_ERROR;
+    nse->errnum = EMSGSIZE;
+  } else if (total == 0) {
+    nse->event_done = 1;
+    nse->status = NSE_STATUS_SUCCESS;
+  } else {
+    nse->writeinfo.iov = (struct nsock_iovec *)safe_malloc(iovcnt * sizeof(*iov));
+    memcpy(nse->writeinfo.iov, iov, iovcnt * sizeof(*iov));
+    nse->writeinfo.iovcnt = iovcnt;
+    nse->writeinfo.iovlen = (int)total;
+  }
+
+  if (nsi->peerlen > 0)
+    nsock_log_debug(nsp, "Writev request for %lu bytes in %d buffers to IOD #%li EID %li [%s]",
+                    (unsigned long)total, iovcnt, nsi->id, nse->id, get_peeraddr_string(nsi));
+  else
+    nsock_log_debug(nsp, "Writev request for %lu bytes in %d buffers to IOD #%li EID %li (peer unspecified)",
+                    (unsigned long)total, iovcnt, nsi->id, nse->id);
+
+  nsp_add_event(nsp, nse);
+
+  return nse->id;
+}
+
 /* Same as nsock_write except you can use a printf-style format and you can only use this for ASCII strings */
 nsock_event_id nsock_printf(nsock_pool ms_pool, nsock_iod ms_iod,
           nsock_ev_handler handler, int timeout_msecs, void *userdata, char *format, ...) {
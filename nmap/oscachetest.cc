@@ -0,0 +1,252 @@
+/***************************************************************************
+ * oscachetest.cc -- Checks that --osscan-cache entries survive being      *
+ * written and read back, and that verification tells a changed host from  *
+ * an unchanged one.                                                       *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2012 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 with the clarifications and exceptions described  *
+ * below.  This guarantees your right to use, modify, and redistribute     *
+ * this software under certain conditions.  If you wish to embed Nmap      *
+ * technology into proprietary software, we sell alternative licenses      *
+ * (contact sales@insecure.com).  Dozens of software vendors already       *
+ * license Nmap technology such as host discovery, port scanning, OS       *
+ * detection, version detection, and the Nmap Scripting Engine.            *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derived works", yet *
+ * it does not provide a detailed definition of that term.  To avoid       *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * "derivative work" for the purpose of this license if it does any of the *
+ * following:                                                              *
+ * o Integrates source code from Nmap                                      *
+ * o Reads or includes Nmap copyrighted data files, such as                *
+ *   nmap-os-db or nmap-service-probes.                                    *
+ * o Executes Nmap and parses the results (as opposed to typical shell or  *
+ *   execution-menu apps, which simply display raw Nmap output and so are  *
+ *   not derivative works.)                                                *
+ * o Integrates/includes/aggregates Nmap into a proprietary executable     *
+ *   installer, such as those produced by InstallShield.                   *
+ * o Links to a library or executes a program that does any of the above   *
+ *                                                                         *
+ * The term "Nmap" should be taken to also include any portions or derived *
+ * works of Nmap, as well as other software we distribute under this       *
+ * license such as Zenmap, Ncat, and Nping.  This list is not exclusive,   *
+ * but is meant to clarify our interpretation of derived works with some   *
+ * common examples.  Our interpretation applies only to Nmap--we don't     *
+ * speak for other people's GPL works.                                     *
+ *                                                                         *
+ * If you have any questions about the GPL licensing restrictions on using *
+ * Nmap in non-GPL works, we would be happy to help.  As mentioned above,  *
+ * we also offer alternative license to integrate Nmap into proprietary    *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@insecure.com for     *
+ * further information.                                                    *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement or         *
+ * contract stating terms other than the terms above, then that            *
+ * alternative license agreement takes precedence over these comments.     *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes (none     *
+ * have been found so far).                                                *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING         *
+ *                                                                         *
+ ***************************************************************************/
+
+
+/* $Id$ */
+
+/* Usage: oscachetest
+
+   Checks the --osscan-cache code without scanning anything: an entry is
+   formatted as a line of the cache file and parsed back, and must come
+   back whole, sequence results included. A truncated or edited line, or
+   one from before the sequence results were kept, must be refused. The
+   fingerprint of the entry must pass verification against itself and
+   against a host that only differs in tests a verification try doesn't
+   do, and must fail against one that differs in a test it does. Prints
+   each check that fails and exits nonzero if any did. */
+
+#include "osscan.h"
+#include "osscan2.h"
+#include "NmapOps.h"
+#include "nmap.h"
+#include "nmap_error.h"
+#include "utils.h"
+
+#include <algorithm>
+
+extern NmapOps o;
+extern void set_program_name(const char *name);
+
+static const char *OCT_FP =
+  "SEQ(SP=104%GCD=1%ISR=10D%TI=Z%CI=Z%II=I%TS=21) "
+  "OPS(O1=MFFD7ST11NWA%O2=MFFD7ST11NWA%O3=MFFD7NNT11NWA%O4=MFFD7ST11NWA%O5=MFFD7ST11NWA%O6=MFFD7ST11) "
+  "WIN(W1=FFCB%W2=FFCB%W3=FFCB%W4=FFCB%W5=FFCB%W6=FFCB) "
+  "ECN(R=Y%DF=Y%T=40%W=FFD7%O=MFFD7NNSNWA%CC=Y%Q=) "
+  "T1(R=Y%DF=Y%T=40%S=O%A=S+%F=AS%RD=0%Q=) T2(R=N) T3(R=N) "
+  "T4(R=Y%DF=Y%T=40%W=0%S=A%A=Z%F=R%O=%RD=0%Q=) "
+  "T5(R=Y%DF=Y%T=40%W=0%S=Z%A=S+%F=AR%O=%RD=0%Q=) "
+  "T6(R=Y%DF=Y%T=40%W=0%S=A%A=Z%F=R%O=%RD=0%Q=) "
+  "T7(R=Y%DF=Y%T=40%W=0%S=Z%A=S+%F=AR%O=%RD=0%Q=) "
+  "U1(R=Y%DF=N%T=40%IPL=164%UN=0%RIPL=G%RID=G%RIPCK=G%RUCK=G%RUD=G) "
+  "IE(R=Y%DFI=N%T=40%CD=S)";
+
+static unsigned long failures;
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+/* Returns OCT_FP with the first occurrence of from replaced by to. */
+static std::string edit_fp(const char *from, const char *to) {
+  std::string fp = OCT_FP;
+  size_t pos;
+
+  pos = fp.find(from);
+  if (pos == std::string::npos)
+    fatal("%s not found in the test fingerprint", from);
+  fp.replace(pos, strlen(from), to);
+
+  return fp;
+}
+
+static FingerPrint *parse_fp(const std::string &spaced) {
+  std::string fp = spaced;
+  FingerPrint *FP;
+
+  std::replace(fp.begin(), fp.end(), ' ', '\n');
+  FP = parse_single_fingerprint((char *) fp.c_str());
+  if (FP == NULL)
+    fatal("Failed to parse the test fingerprint");
+
+  return FP;
+}
+
+static bool verifies(const std::string &fp) {
+  FingerPrint *cached, *FP;
+  bool verified;
+
+  cached = parse_fp(OCT_FP);
+  FP = parse_fp(fp);
+  verified = os_cache_verified(cached, FP);
+  delete cached;
+  delete FP;
+
+  return verified;
+}
+
+static void check_round_trip() {
+  OSCacheEntry entry, back;
+  std::string line, addr, old;
+  char hash[32];
+  int i;
+
+  entry.mac = "00:11:22:33:44:55";
+  entry.opentcpport = 22;
+  entry.closedtcpport = 1;
+  entry.distance = 1;
+  memset(&entry.si, 0, sizeof(entry.si));
+  entry.si.responses = NUM_SEQ_SAMPLES;
+  entry.si.index = 260;
+  entry.si.ts_seqclass = TS_SEQ_1000HZ;
+  entry.si.ipid_seqclass = IPID_SEQ_ZERO;
+  entry.si.lastboot = 1350000000;
+  for (i = 0; i < NUM_SEQ_SAMPLES; i++) {
+    entry.si.seqs[i] = 0xF0000000 + i * 0x01234567;
+    entry.si.timestamps[i] = 0x100000 + i * 100;
+    entry.si.ipids[i] = 0xFFF0 + i;
+  }
+  entry.fp = OCT_FP;
+
+  line = os_cache_format_line("192.168.0.1", entry);
+  check(os_cache_parse_line((line + "\n").c_str(), addr, back), "a formatted entry parses");
+  check(addr == "192.168.0.1", "the address comes back");
+  check(back.mac == entry.mac, "the MAC address comes back");
+  check(back.opentcpport == entry.opentcpport && back.closedtcpport == entry.closedtcpport,
+        "the ports come back");
+  check(back.distance == entry.distance, "the distance comes back");
+  check(back.fp == entry.fp, "the fingerprint comes back");
+  check(back.si.responses == entry.si.responses && back.si.index == entry.si.index
+        && back.si.ts_seqclass == entry.si.ts_seqclass
+        && back.si.ipid_seqclass == entry.si.ipid_seqclass
+        && back.si.lastboot == entry.si.lastboot, "the sequence classes and last boot come back");
+  check(memcmp(back.si.seqs, entry.si.seqs, sizeof(entry.si.seqs)) == 0
+        && memcmp(back.si.timestamps, entry.si.timestamps, sizeof(entry.si.timestamps)) == 0
+        && memcmp(back.si.ipids, entry.si.ipids, sizeof(entry.si.ipids)) == 0,
+        "the sequence samples come back");
+
+  check(!os_cache_parse_line(line.substr(0, line.size() - 10).c_str(), addr, back),
+        "a truncated entry is refused");
+  line[line.size() - 3] = line[line.size() - 3] == '4' ? '5' : '4';
+  check(!os_cache_parse_line(line.c_str(), addr, back), "an edited entry is refused");
+
+  Snprintf(hash, sizeof(hash), "%016llx ", fnv1a64(OCT_FP, strlen(OCT_FP)));
+  old = std::string("192.168.0.1 00:11:22:33:44:55 22/1 1 ") + hash + OCT_FP;
+  check(!os_cache_parse_line(old.c_str(), addr, back), "an entry without sequence results is refused");
+}
+
+static void check_verify() {
+  check(verifies(OCT_FP), "an unchanged host verifies");
+  check(verifies(edit_fp("SP=104", "SP=F7")), "a host differing only in SEQ verifies");
+  check(!verifies(edit_fp("T5(R=Y%DF=Y%T=40%W=0", "T5(R=Y%DF=Y%T=40%W=400")),
+        "a host differing in T5 does not verify");
+  check(!verifies(edit_fp("IE(R=Y%DFI=N", "IE(R=Y%DFI=Y")), "a host differing in IE does not verify");
+  check(!verifies(edit_fp("U1(R=Y%DF=N%T=40%IPL=164%UN=0%RIPL=G%RID=G%RIPCK=G%RUCK=G%RUD=G) ", "")),
+        "a host that doesn't answer U1 does not verify");
+}
+
+int main(int argc, char *argv[]) {
+  set_program_name(argv[0]);
+
+  check_round_trip();
+  check_verify();
+
+  if (failures > 0) {
+    printf("%lu checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+
+  return 0;
+}
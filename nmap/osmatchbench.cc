@@ -0,0 +1,810 @@
+/***************************************************************************
+ * osmatchbench.cc -- Benchmarks OS detection fingerprint matching on a    *
+ * corpus made from nmap-os-db, and records or checks the results so that  *
+ * changes to the matchers can be shown not to change any match.           *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2012 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 with the clarifications and exceptions described  *
+ * below.  This guarantees your right to use, modify, and redistribute     *
+ * this software under certain conditions.  If you wish to embed Nmap      *
+ * technology into proprietary software, we sell alternative licenses      *
+ * (contact sales@insecure.com).  Dozens of software vendors already       *
+ * license Nmap technology such as host discovery, port scanning, OS       *
+ * detection, version detection, and the Nmap Scripting Engine.            *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derived works", yet *
+ * it does not provide a detailed definition of that term.  To avoid       *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * "derivative work" for the purpose of this license if it does any of the *
+ * following:                                                              *
+ * o Integrates source code from Nmap                                      *
+ * o Reads or includes Nmap copyrighted data files, such as                *
+ *   nmap-os-db or nmap-service-probes.                                    *
+ * o Executes Nmap and parses the results (as opposed to typical shell or  *
+ *   execution-menu apps, which simply display raw Nmap output and so are  *
+ *   not derivative works.)                                                *
+ * o Integrates/includes/aggregates Nmap into a proprietary executable     *
+ *   installer, such as those produced by InstallShield.                   *
+ * o Links to a library or executes a program that does any of the above   *
+ *                                                                         *
+ * The term "Nmap" should be taken to also include any portions or derived *
+ * works of Nmap, as well as other software we distribute under this       *
+ * license such as Zenmap, Ncat, and Nping.  This list is not exclusive,   *
+ * but is meant to clarify our interpretation of derived works with some   *
+ * common examples.  Our interpretation applies only to Nmap--we don't     *
+ * speak for other people's GPL works.                                     *
+ *                                                                         *
+ * If you have any questions about the GPL licensing restrictions on using *
+ * Nmap in non-GPL works, we would be happy to help.  As mentioned above,  *
+ * we also offer alternative license to integrate Nmap into proprietary    *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@insecure.com for     *
+ * further information.                                                    *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement or         *
+ * contract stating terms other than the terms above, then that            *
+ * alternative license agreement takes precedence over these comments.     *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes (none     *
+ * have been found so far).                                                *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING         *
+ *                                                                         *
+ ***************************************************************************/
+
+
+/* $Id$ */
+
+/* Usage: osmatchbench [options]
+
+   Benchmarks the OS detection matchers without scanning anything. A corpus
+   of observed IPv4 fingerprints is made from the prints in nmap-os-db by
+   dropping tests and attributes and by replacing values with ones that do
+   or nearly do match, some taken from other prints. Each is matched with
+   match_fingerprint the way OS detection does, and compared with the print
+   it came from with compare_fingerprints. A corpus of IPv6 feature vectors
+   is made the same way from the class means and variances of the IPv6
+   model and classified. The corpus depends only on nmap-os-db, the model
+   and --seed, so the same one can be made again later.
+
+   For each matcher it prints the calls per second, the allocations (made
+   through operator new) per call and, at the end, the peak resident set
+   size. With --record, the top matches and accuracies found for the whole
+   corpus are written to a file; with --check, they are compared with such
+   a file and any difference, down to the last bit of an accuracy, is
+   reported and makes the exit status nonzero. Run --record before changing
+   a matcher and --check after. The accuracies are floating point, so a
+   baseline is only expected to match on the platform and compiler it was
+   recorded with.
+
+   With --adaptive, it also checks --osscan-adaptive: the TUI phase of a try
+   is replayed for each IPv4 fingerprint, and the matches of what is left
+   once the try settles must be the same as those of the whole fingerprint.
+   Any difference makes the exit status nonzero. */
+
+#include "osscan.h"
+#include "FPEngine.h"
+#include "FingerPrintResults.h"
+#include "NmapOps.h"
+#include "nmap.h"
+#include "nmap_error.h"
+#include "utils.h"
+#include "linear.h"
+
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include <algorithm>
+#include <new>
+
+extern NmapOps o;
+
+extern void set_program_name(const char *name);
+
+/* From FPModel.cc. */
+extern struct model FPModel;
+extern double FPmean[][659];
+extern double FPvariance[][659];
+
+// Default number of fingerprints in each corpus
+#define OMB_DEFAULT_COUNT 2000
+
+// Default number of times the corpus is matched while timing
+#define OMB_DEFAULT_ROUNDS 5
+
+// How often a value of an IPv4 fingerprint is changed, as one in this many.
+// Each fingerprint of the corpus uses one of these.
+static const unsigned long OMB_NOISE_LEVELS[] = { 200, 40, 12, 4 };
+
+// How far IPv6 features are spread around their class mean, in standard
+// deviations of the class. Each vector of the corpus uses one of these.
+static const double OMB_SPREADS[] = { 0.1, 0.3, 0.6, 1.0 };
+
+// Variance used for IPv6 features whose class variance is zero
+#define OMB_DEFAULT_VARIANCE 0.01
+
+// The tests done in the TUI phase of an OS detection try, whose probes
+// --osscan-adaptive may drop
+static const char *OMB_TUI_TESTS[] = { "ECN", "T2", "T3", "T4", "T5", "T6", "T7", "U1", "IE" };
+
+/* Allocations made through operator new since the program started. Only
+   the main thread allocates while the matchers are timed. */
+static unsigned long long allocations;
+
+void *operator new(size_t size) {
+  void *p;
+
+  allocations++;
+  if ((p = malloc(size ? size : 1)) == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *p) {
+  free(p);
+}
+
+void operator delete[](void *p) {
+  free(p);
+}
+
+#if __cpp_sized_deallocation
+void operator delete(void *p, size_t) {
+  free(p);
+}
+
+void operator delete[](void *p, size_t) {
+  free(p);
+}
+#endif
+
+/* A small generator of our own (xorshift64*), so that the corpus for a
+   seed is the same whatever the C library. */
+struct OMBRandom {
+  u64 state;
+
+  OMBRandom(u64 seed) {
+    state = seed * 0x9E3779B97F4A7C15ULL + 1;
+  }
+  u64 next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+  }
+  unsigned long below(unsigned long n) {
+    return (unsigned long) (next() % n);
+  }
+  // Uniform in [0, 1)
+  double uniform() {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+};
+
+/* The results found for the corpus, one line per fingerprint, in the form
+   written by --record. */
+struct OMBResults {
+  std::vector<std::string> ipv4, ipv6;
+};
+
+static void print_usage(void) {
+  printf("Usage: osmatchbench [options]\n"
+         "Benchmarks OS detection matching on a corpus of fingerprints made from\n"
+         "nmap-os-db, and records or checks the results.\n"
+         "Options:\n"
+         "  -d, --datadir <dir>: Look for nmap-os-db in this directory\n"
+         "  -n, --count <num>: Make this many fingerprints of each kind (default %d)\n"
+         "  -r, --rounds <num>: Match the corpus this many times (default %d)\n"
+         "  -s, --seed <num>: Seed for making the corpus (default 1)\n"
+         "  -w, --record <file>: Write the results to file as a baseline\n"
+         "  -c, --check <file>: Compare the results with a baseline; the count\n"
+         "                      and seed are taken from the baseline\n"
+         "  -a, --adaptive: Check that --osscan-adaptive doesn't change any match\n"
+         "  -h, --help: Print this help\n",
+         OMB_DEFAULT_COUNT, OMB_DEFAULT_ROUNDS);
+}
+
+/* Returns an observed value for the reference expression expr: one that
+   matches one of its terms or is just outside a range, or, one time in
+   noise, something else entirely. */
+static const char *perturb_value(OMBRandom &rnd, const char *expr, unsigned long noise) {
+  std::vector<std::string> terms;
+  std::string term;
+  const char *p, *q, *dash;
+  char buf[32];
+  long lo, hi, v;
+  unsigned long r;
+
+  if (rnd.below(noise) == 0) {
+    r = rnd.below(3);
+    if (r == 0)
+      return string_pool_insert("");
+    if (r == 1)
+      return string_pool_insert("Z");
+    Snprintf(buf, sizeof(buf), "%lX", rnd.below(0x300));
+    return string_pool_insert(buf);
+  }
+
+  p = expr;
+  do {
+    q = strchr(p, '|');
+    if (q == NULL)
+      q = strchr(p, '&');
+    terms.push_back(q != NULL ? std::string(p, q) : std::string(p));
+    p = q + 1;
+  } while (q != NULL);
+  term = terms[rnd.below(terms.size())];
+
+  if (term == "+") {
+    Snprintf(buf, sizeof(buf), "%lX", rnd.below(3));
+    return string_pool_insert(buf);
+  }
+  if (term[0] == '<' || term[0] == '>') {
+    v = strtol(term.c_str() + 1, NULL, 16) + (long) rnd.below(5) - 2;
+    Snprintf(buf, sizeof(buf), "%lX", MAX(v, 0L));
+    return string_pool_insert(buf);
+  }
+  dash = strchr(term.c_str(), '-');
+  if (dash != NULL && isxdigit((int) (unsigned char) term[0])
+      && isxdigit((int) (unsigned char) dash[1])) {
+    lo = strtol(term.c_str(), NULL, 16);
+    hi = strtol(dash + 1, NULL, 16);
+    v = lo - 1 + (long) rnd.below(hi - lo + 3);
+    Snprintf(buf, sizeof(buf), "%lX", MAX(v, 0L));
+    return string_pool_insert(buf);
+  }
+
+  return string_pool_insert(term.c_str());
+}
+
+static bool is_scored(const FingerPrint *MatchPoints, const char *test, const char *attr) {
+  std::vector<FingerTest>::const_iterator t;
+  std::vector<AVal>::const_iterator a;
+
+  for (t = MatchPoints->tests.begin(); t != MatchPoints->tests.end(); t++) {
+    if (strcmp(t->name, test) != 0)
+      continue;
+    for (a = t->results.begin(); a != t->results.end(); a++) {
+      if (strcmp(a->attribute, attr) == 0)
+        return true;
+    }
+  }
+
+  return false;
+}
+
+/* Makes count observed fingerprints from the prints in DB. sources gets the
+   print each came from. How much each is changed from its print varies, so
+   that the corpus has close matches, guesses and fingerprints that match
+   nothing. */
+static void make_ipv4_corpus(const FingerPrintDB *DB, OMBRandom &rnd, unsigned long count,
+                             std::vector<FingerPrint *> &corpus,
+                             std::vector<const FingerPrint *> &sources) {
+  const FingerPrint *src, *other;
+  FingerPrint *FP;
+  const char *expr;
+  unsigned long noise;
+  unsigned int t, a;
+
+  while (corpus.size() < count) {
+    src = DB->prints[rnd.below(DB->prints.size())];
+    other = DB->prints[rnd.below(DB->prints.size())];
+    // One value in this many is made wrong, or taken from the other print
+    noise = OMB_NOISE_LEVELS[rnd.below(NELEMS(OMB_NOISE_LEVELS))];
+    FP = new FingerPrint;
+    for (t = 0; t < src->tests.size(); t++) {
+      FingerTest test;
+
+      if (rnd.below(15) == 0)
+        continue;
+      test.name = src->tests[t].name;
+      for (a = 0; a < src->tests[t].results.size(); a++) {
+        AVal av;
+
+        av.attribute = src->tests[t].results[a].attribute;
+        if (rnd.below(20) == 0 || !is_scored(DB->MatchPoints, test.name, av.attribute))
+          continue;
+        expr = src->tests[t].results[a].value;
+        if (rnd.below(noise) == 0 && t < other->tests.size() && a < other->tests[t].results.size())
+          expr = other->tests[t].results[a].value;
+        av.value = perturb_value(rnd, expr, noise);
+        test.results.push_back(av);
+      }
+      FP->tests.push_back(test);
+    }
+    corpus.push_back(FP);
+    sources.push_back(src);
+  }
+}
+
+/* Makes count feature vectors, each near the mean of a random class of the
+   IPv6 model and sometimes pulled towards that of another. They are in the
+   scaled form classify_fp6_features takes. */
+static void make_ipv6_corpus(OMBRandom &rnd, unsigned long count,
+                             std::vector<std::vector<double> > &corpus) {
+  unsigned int nr_class, nr_feature, label, other, j;
+  double mix, spread, noise, variance;
+
+  nr_class = get_nr_class(&FPModel);
+  nr_feature = classify_fp6_num_features();
+  while (corpus.size() < count) {
+    label = rnd.below(nr_class);
+    other = rnd.below(nr_class);
+    mix = rnd.below(4) == 0 ? rnd.uniform() * 0.5 : 0.0;
+    spread = OMB_SPREADS[rnd.below(NELEMS(OMB_SPREADS))];
+    corpus.push_back(std::vector<double>(nr_feature));
+    for (j = 0; j < nr_feature; j++) {
+      variance = FPvariance[label][j] > 0 ? FPvariance[label][j] : OMB_DEFAULT_VARIANCE;
+      // Roughly normal, with the class's variance
+      noise = (rnd.uniform() + rnd.uniform() + rnd.uniform() + rnd.uniform() - 2.0) * sqrt(3.0);
+      corpus.back()[j] = FPmean[label][j] * (1 - mix) + FPmean[other][j] * mix
+        + noise * spread * sqrt(variance);
+    }
+  }
+}
+
+static void append_accuracy(std::string &line, int id, double accuracy) {
+  u64 bits;
+  char buf[40];
+
+  memcpy(&bits, &accuracy, sizeof(bits));
+  Snprintf(buf, sizeof(buf), " %d:%016llX", id, (unsigned long long) bits);
+  line += buf;
+}
+
+/* Describes a result the way --record writes it: the overall result, the
+   number of perfect matches and then the ID (the line in nmap-os-db, or
+   the IPv6 class) and accuracy of each match. */
+static std::string describe_result(char kind, unsigned long i, const FingerPrintResults *FPR) {
+  std::string line;
+  char buf[64];
+  int k, id;
+
+  Snprintf(buf, sizeof(buf), "%c %lu %d %d %d", kind, i, FPR->overall_results,
+           FPR->num_perfect_matches, FPR->num_matches);
+  line = buf;
+  for (k = 0; k < FPR->num_matches; k++) {
+    if (kind == '6')
+      id = FPR->matches[k] - &o.os_labels_ipv6[0];
+    else
+      id = FPR->matches[k]->line;
+    append_accuracy(line, id, FPR->accuracy[k]);
+  }
+
+  return line;
+}
+
+static void print_timing(const char *what, unsigned long calls, const struct timeval *start,
+                         unsigned long long allocs) {
+  struct timeval now;
+  double elapsed;
+
+  gettimeofday(&now, NULL);
+  elapsed = TIMEVAL_FSEC_SUBTRACT(now, *start);
+  printf("%-22s %9lu calls in %7.3fs: %10.0f calls/s, %8.3f us/call, %7.2f allocations/call\n",
+         what, calls, elapsed, elapsed > 0 ? calls / elapsed : 0,
+         calls > 0 ? elapsed * 1000000 / calls : 0, calls > 0 ? (double) allocs / calls : 0);
+}
+
+static void bench_ipv4(const std::vector<FingerPrint *> &corpus,
+                       const std::vector<const FingerPrint *> &sources,
+                       const FingerPrintDB *DB, const FingerPrintDB *fullDB,
+                       unsigned long rounds, OMBResults &results) {
+  struct timeval start;
+  unsigned long long allocs;
+  unsigned long round, i;
+  double accuracy;
+
+  for (i = 0; i < corpus.size(); i++) {
+    FingerPrintResultsIPv4 FPR;
+
+    match_fingerprint(corpus[i], &FPR, DB, OSSCAN_GUESS_THRESHOLD);
+    results.ipv4.push_back(describe_result('4', i, &FPR));
+    accuracy = compare_fingerprints(sources[i], corpus[i], fullDB->MatchPoints, 0);
+    append_accuracy(results.ipv4.back(), sources[i]->match.line, accuracy);
+  }
+
+  allocs = allocations;
+  gettimeofday(&start, NULL);
+  for (round = 0; round < rounds; round++) {
+    for (i = 0; i < corpus.size(); i++) {
+      FingerPrintResultsIPv4 FPR;
+
+      match_fingerprint(corpus[i], &FPR, DB, OSSCAN_GUESS_THRESHOLD);
+    }
+  }
+  print_timing("match_fingerprint", rounds * corpus.size(), &start, allocations - allocs);
+
+  allocs = allocations;
+  gettimeofday(&start, NULL);
+  for (round = 0; round < rounds; round++) {
+    for (i = 0; i < corpus.size(); i++)
+      compare_fingerprints(sources[i], corpus[i], fullDB->MatchPoints, 0);
+  }
+  print_timing("compare_fingerprints", rounds * corpus.size(), &start, allocations - allocs);
+}
+
+static void bench_ipv6(const std::vector<std::vector<double> > &corpus,
+                       unsigned long rounds, OMBResults &results) {
+  struct timeval start;
+  unsigned long long allocs;
+  unsigned long round, i;
+
+  for (i = 0; i < corpus.size(); i++) {
+    FingerPrintResultsIPv6 FPR;
+
+    classify_fp6_features(&FPR, &corpus[i][0]);
+    results.ipv6.push_back(describe_result('6', i, &FPR));
+  }
+
+  allocs = allocations;
+  gettimeofday(&start, NULL);
+  for (round = 0; round < rounds; round++) {
+    for (i = 0; i < corpus.size(); i++) {
+      FingerPrintResultsIPv6 FPR;
+
+      classify_fp6_features(&FPR, &corpus[i][0]);
+    }
+  }
+  print_timing("classify_fp6_features", rounds * corpus.size(), &start, allocations - allocs);
+}
+
+static bool is_tui_test(const char *name) {
+  unsigned int i;
+
+  for (i = 0; i < NELEMS(OMB_TUI_TESTS); i++) {
+    if (strcmp(name, OMB_TUI_TESTS[i]) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+/* Replays the TUI phase of an --osscan-adaptive try for each fingerprint of
+   the corpus. The replies for its TUI tests come in a random order, and
+   before each one the tests done so far are checked the way
+   HostOsScan::tuiIsSettled does. Once they are settled, the tests still
+   waiting are dropped, and the SEQ line and the TTLs, which would then be
+   worked out without them, are given other values. The matches of what is
+   left must be those of the whole fingerprint, down to the last bit of
+   each accuracy. Returns the number of fingerprints for which they
+   aren't. */
+static unsigned long check_adaptive(const std::vector<FingerPrint *> &corpus,
+                                    const FingerPrintDB *DB, OMBRandom &rnd) {
+  std::vector<const char *> waiting;
+  std::vector<std::string> pending;
+  std::string full_result, adaptive_result;
+  unsigned long settled, dropped, differences, i;
+  unsigned int t, a, k;
+  bool is_settled;
+
+  settled = dropped = differences = 0;
+  for (i = 0; i < corpus.size(); i++) {
+    const FingerPrint *full = corpus[i];
+    FingerPrint adaptive;
+
+    waiting.clear();
+    for (t = 0; t < full->tests.size(); t++) {
+      if (is_tui_test(full->tests[t].name))
+        waiting.push_back(full->tests[t].name);
+    }
+    for (k = waiting.size(); k > 1; k--)
+      std::swap(waiting[k - 1], waiting[rnd.below(k)]);
+
+    is_settled = false;
+    while (!waiting.empty()) {
+      FingerPrint partial;
+
+      pending.clear();
+      pending.push_back("SEQ.*");
+      pending.push_back("*.T");
+      pending.push_back("*.TG");
+      for (k = 0; k < waiting.size(); k++)
+        pending.push_back(std::string(waiting[k]) + ".*");
+      for (t = 0; t < full->tests.size(); t++) {
+        if (strcmp(full->tests[t].name, "SEQ") != 0
+            && std::find(waiting.begin(), waiting.end(), full->tests[t].name) == waiting.end())
+          partial.tests.push_back(full->tests[t]);
+      }
+      if (fingerprint_match_is_settled(&partial, DB, pending, OSSCAN_GUESS_THRESHOLD)) {
+        is_settled = true;
+        break;
+      }
+      waiting.pop_back();
+    }
+
+    for (t = 0; t < full->tests.size(); t++) {
+      const FingerTest &test = full->tests[t];
+
+      if (std::find(waiting.begin(), waiting.end(), test.name) != waiting.end())
+        continue;
+      adaptive.tests.push_back(test);
+      if (!is_settled)
+        continue;
+      for (a = 0; a < test.results.size(); a++) {
+        if (strcmp(test.name, "SEQ") == 0 || strcmp(test.results[a].attribute, "T") == 0
+            || strcmp(test.results[a].attribute, "TG") == 0)
+          adaptive.tests.back().results[a].value = perturb_value(rnd, "", 1);
+      }
+    }
+    if (is_settled) {
+      settled++;
+      dropped += waiting.size();
+    }
+
+    FingerPrintResultsIPv4 fullFPR, adaptiveFPR;
+
+    match_fingerprint(full, &fullFPR, DB, OSSCAN_GUESS_THRESHOLD);
+    match_fingerprint(&adaptive, &adaptiveFPR, DB, OSSCAN_GUESS_THRESHOLD);
+    full_result = describe_result('4', i, &fullFPR);
+    adaptive_result = describe_result('4', i, &adaptiveFPR);
+    if (full_result != adaptive_result && differences++ < 10) {
+      error("Fingerprint %lu matches differently with %lu tests dropped:\n  full:     %s\n  adaptive: %s",
+            i, (unsigned long) waiting.size(), full_result.c_str(), adaptive_result.c_str());
+    }
+  }
+
+  printf("--osscan-adaptive settled %lu of %lu fingerprints, dropping %lu tests; %lu matched differently\n",
+         settled, (unsigned long) corpus.size(), dropped, differences);
+
+  return differences;
+}
+
+static void print_peak_rss(void) {
+#if HAVE_SYS_RESOURCE_H
+  struct rusage usage;
+  long kb;
+
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    error("getrusage failed: %s", strerror(errno));
+    return;
+  }
+  kb = usage.ru_maxrss;
+#ifdef MACOSX
+  // Reported in bytes rather than kilobytes.
+  kb /= 1024;
+#endif
+  printf("Peak RSS: %ld kB\n", kb);
+#endif
+}
+
+/* The header line of a baseline. The hash of nmap-os-db makes sure the
+   corpus is made from the same prints when it is checked. */
+static std::string baseline_header(unsigned long long dbhash, unsigned long count,
+                                   unsigned long seed) {
+  char buf[128];
+
+  Snprintf(buf, sizeof(buf), "osmatchbench db=%016llX count=%lu seed=%lu", dbhash, count, seed);
+  return buf;
+}
+
+static void read_baseline_header(const char *filename, unsigned long long *dbhash,
+                                 unsigned long *count, unsigned long *seed) {
+  char line[256];
+  FILE *fp;
+
+  if ((fp = fopen(filename, "r")) == NULL)
+    fatal("Failed to open %s: %s", filename, strerror(errno));
+  if (fgets(line, sizeof(line), fp) == NULL
+      || sscanf(line, "osmatchbench db=%llX count=%lu seed=%lu", dbhash, count, seed) != 3)
+    fatal("%s is not an osmatchbench baseline", filename);
+  fclose(fp);
+}
+
+static void write_baseline(const char *filename, const std::string &header,
+                           const OMBResults &results) {
+  unsigned int i;
+  FILE *fp;
+
+  if ((fp = fopen(filename, "w")) == NULL)
+    fatal("Failed to open %s for writing: %s", filename, strerror(errno));
+  fprintf(fp, "%s\n", header.c_str());
+  for (i = 0; i < results.ipv4.size(); i++)
+    fprintf(fp, "%s\n", results.ipv4[i].c_str());
+  for (i = 0; i < results.ipv6.size(); i++)
+    fprintf(fp, "%s\n", results.ipv6[i].c_str());
+  if (fclose(fp) != 0)
+    fatal("Failed to write %s: %s", filename, strerror(errno));
+}
+
+/* Compares the results with the baseline in filename, printing the first
+   few differences. Returns the number of lines that differ. */
+static unsigned long check_baseline(const char *filename, const std::string &header,
+                                    const OMBResults &results) {
+  std::vector<std::string> expected, actual;
+  std::string contents;
+  unsigned long differences;
+  size_t pos, end;
+  unsigned int i;
+
+  if (!read_whole_file(filename, contents))
+    fatal("Failed to read %s: %s", filename, strerror(errno));
+  for (pos = 0; pos < contents.size(); pos = end + 1) {
+    end = contents.find('\n', pos);
+    if (end == std::string::npos)
+      end = contents.size();
+    expected.push_back(contents.substr(pos, end - pos));
+  }
+  actual.push_back(header);
+  actual.insert(actual.end(), results.ipv4.begin(), results.ipv4.end());
+  actual.insert(actual.end(), results.ipv6.begin(), results.ipv6.end());
+
+  differences = 0;
+  for (i = 0; i < MAX(expected.size(), actual.size()); i++) {
+    if (i < expected.size() && i < actual.size() && expected[i] == actual[i])
+      continue;
+    if (differences++ < 10) {
+      error("Line %u differs:\n  expected: %s\n  got:      %s", i + 1,
+            i < expected.size() ? expected[i].c_str() : "(nothing)",
+            i < actual.size() ? actual[i].c_str() : "(nothing)");
+    }
+  }
+
+  return differences;
+}
+
+int main(int argc, char *argv[]) {
+  struct option long_options[] = {
+    {"datadir", required_argument, 0, 'd'},
+    {"count", required_argument, 0, 'n'},
+    {"rounds", required_argument, 0, 'r'},
+    {"seed", required_argument, 0, 's'},
+    {"record", required_argument, 0, 'w'},
+    {"check", required_argument, 0, 'c'},
+    {"adaptive", no_argument, 0, 'a'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+  const char *recordfile = NULL, *checkfile = NULL;
+  unsigned long count = OMB_DEFAULT_COUNT, rounds = OMB_DEFAULT_ROUNDS, seed = 1;
+  unsigned long checkcount, checkseed, differences, adaptive_differences = 0;
+  bool adaptive = false;
+  unsigned long long dbhash, checkhash;
+  std::vector<FingerPrint *> corpus4;
+  std::vector<const FingerPrint *> sources;
+  std::vector<std::vector<double> > corpus6;
+  FingerPrintDB *fullDB, *DB;
+  std::string contents, header;
+  char filename[256];
+  OMBResults results;
+  int arg;
+
+  set_program_name(argv[0]);
+
+  while ((arg = getopt_long(argc, argv, "d:n:r:s:w:c:ah", long_options, NULL)) != EOF) {
+    switch (arg) {
+    case 'd':
+      o.datadir = strdup(optarg);
+      break;
+    case 'n':
+      count = strtoul(optarg, NULL, 10);
+      if (count < 1)
+        fatal("Bogus --count argument: %s", optarg);
+      break;
+    case 'r':
+      rounds = strtoul(optarg, NULL, 10);
+      if (rounds < 1)
+        fatal("Bogus --rounds argument: %s", optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      recordfile = optarg;
+      break;
+    case 'c':
+      checkfile = optarg;
+      break;
+    case 'a':
+      adaptive = true;
+      break;
+    case 'h':
+      print_usage();
+      exit(0);
+    default:
+      print_usage();
+      exit(1);
+    }
+  }
+
+  if (nmap_fetchfile(filename, sizeof(filename), "nmap-os-db") != 1)
+    fatal("OS scan requested but I cannot find nmap-os-db file.");
+  if (!read_whole_file(filename, contents))
+    fatal("Failed to read %s: %s", filename, strerror(errno));
+  dbhash = fnv1a64(contents.data(), contents.size());
+  if (checkfile != NULL) {
+    read_baseline_header(checkfile, &checkhash, &checkcount, &checkseed);
+    if (checkhash != dbhash)
+      fatal("%s was recorded with a different nmap-os-db", checkfile);
+    count = checkcount;
+    seed = checkseed;
+  }
+  header = baseline_header(dbhash, count, seed);
+
+  // The full parse has the tests of each print, for making the corpus and
+  // for compare_fingerprints. OS detection itself matches against the
+  // reference DB, which may come from the cache.
+  fullDB = parse_fingerprint_file(filename);
+  DB = parse_fingerprint_reference_file("nmap-os-db");
+  o.os_labels_ipv6 = load_fp_matches();
+
+  OMBRandom rnd(seed);
+  make_ipv4_corpus(fullDB, rnd, count, corpus4, sources);
+  make_ipv6_corpus(rnd, count, corpus6);
+
+  printf("Corpus of %lu IPv4 and %lu IPv6 fingerprints (seed %lu), %lu rounds\n",
+         (unsigned long) corpus4.size(), (unsigned long) corpus6.size(), seed, rounds);
+  bench_ipv4(corpus4, sources, DB, fullDB, rounds, results);
+  bench_ipv6(corpus6, rounds, results);
+  print_peak_rss();
+
+  if (adaptive) {
+    OMBRandom arnd(seed + 1);
+    adaptive_differences = check_adaptive(corpus4, DB, arnd);
+  }
+
+  if (recordfile != NULL)
+    write_baseline(recordfile, header, results);
+  if (checkfile != NULL) {
+    differences = check_baseline(checkfile, header, results);
+    if (differences > 0) {
+      printf("%lu of %lu results differ from %s\n", differences,
+             (unsigned long) (results.ipv4.size() + results.ipv6.size()), checkfile);
+      return 1;
+    }
+    printf("All %lu results match %s\n",
+           (unsigned long) (results.ipv4.size() + results.ipv6.size()), checkfile);
+  }
+
+  return adaptive_differences > 0 ? 1 : 0;
+}
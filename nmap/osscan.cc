@@ -116,7 +116,9 @@
 
 #include <algorithm>
 #include <list>
+#include <map>
 #include <set>
+#include <string>
 
 extern NmapOps o;
 
@@ -197,6 +199,16 @@ const char *string_pool_sprintf(const char *fmt, ...)
 }
 
 FingerPrintDB::FingerPrintDB() : MatchPoints(NULL) {
+  num_prints = num_attrs = num_values = 0;
+  strings = NULL;
+  attr_index = value_index = NULL;
+  attr_names = NULL;
+  attr_points = NULL;
+  terms = NULL;
+  attr_tests = NULL;
+  print_tests = NULL;
+  mapped = NULL;
+  mapped_len = 0;
 }
 
 FingerPrintDB::~FingerPrintDB() {
@@ -206,6 +218,8 @@ FingerPrintDB::~FingerPrintDB() {
     delete MatchPoints;
   for (current = prints.begin(); current != prints.end(); current++)
     delete *current;
+  if (mapped != NULL && munmap(mapped, mapped_len) != 0)
+    gh_perror("%s: error in munmap(%p, %d)", __func__, mapped, mapped_len);
 }
 
 FingerPrint::FingerPrint() {
@@ -500,6 +514,618 @@ double compare_fingerprints(const FingerPrint *referenceFP, const FingerPrint *o
   return (num_subtests) ? (num_subtests_succeeded / (double) num_subtests) : 0;
 }
 
+/* Bump this whenever the layout of the compiled fingerprint DB changes. */
+#define OS_DB_CACHE_VERSION 1
+#define OS_DB_CACHE_MAGIC "NMAPOSDB"
+#define OS_DB_CACHE_FILE "nmap-os-db.cache"
+
+/* The compiled fingerprint DB, as held by FingerPrintDB and stored in the
+   nmap-os-db cache file. It is this header followed by these arrays, in
+   this order, each a multiple of 4 bytes long:
+     FPImagePrint prints[num_prints]
+     FPImageClass classes[num_classes]
+     u32 cpes[num_cpes]
+     FPStringID attr_index[num_attrs]
+     u32 attr_names[num_attrs]
+     int attr_points[num_attrs]
+     FPStringID value_index[num_values]
+     FPExprTerm terms[num_terms]
+     FPAttrTest attr_tests[num_attr_tests]
+     u32 print_tests[num_prints + 1]
+     char strings[strings_len], padded with NULs
+   Strings are offsets into strings. Integers are in host byte order, as
+   the cache is never shared between machines. The source fields tie a
+   cache file to the contents of nmap-os-db it was compiled from; they are
+   0 in a freshly compiled DB. */
+struct FPImageHeader {
+  char magic[8];
+  u32 version;
+  u32 source_len;
+  u32 source_hash[2];
+  u32 num_prints;
+  u32 num_classes;
+  u32 num_cpes;
+  u32 num_attrs;
+  u32 num_values;
+  u32 num_terms;
+  u32 num_attr_tests;
+  u32 strings_len;
+};
+
+/* What a print needs besides its tests: its FingerMatch. */
+struct FPImagePrint {
+  u32 line;
+  u32 name;
+  u32 first_class;
+  u32 num_classes;
+};
+
+struct FPImageClass {
+  u32 vendor;
+  u32 family;
+  u32 generation; /* FP_IMAGE_NO_STRING if unclassified */
+  u32 device_type;
+  u32 first_cpe;
+  u32 num_cpes;
+};
+
+#define FP_IMAGE_NO_STRING 0xFFFFFFFF
+
+/* The pieces of a compiled fingerprint DB, as they are put together by
+   FingerPrintDB::compile(). */
+struct FPImageBuilder {
+  std::map<std::string, u16> attr_ids;
+  std::vector<u32> attr_names;
+  std::vector<int> attr_points;
+  std::map<std::string, u32> value_ids;
+  std::map<std::string, FPAttrTest> exprs; /* Compiled expressions, to share their terms */
+  std::vector<FPExprTerm> terms;
+  std::vector<FPAttrTest> attr_tests;
+  std::vector<u32> print_tests;
+  std::vector<FPImagePrint> prints;
+  std::vector<FPImageClass> classes;
+  std::vector<u32> cpes;
+  std::map<std::string, u32> string_offsets;
+  std::string strings;
+
+  /* Returns the offset of s in strings, adding it if needed. */
+  u32 str(const char *s) {
+    std::map<std::string, u32>::iterator it;
+
+    if (s == NULL)
+      return FP_IMAGE_NO_STRING;
+    it = string_offsets.find(s);
+    if (it != string_offsets.end())
+      return it->second;
+    string_offsets[s] = strings.size();
+    strings.append(s, strlen(s) + 1);
+    return string_offsets[s];
+  }
+};
+
+template<class T> static void image_append(std::string &buf, const std::vector<T> &v) {
+  if (!v.empty())
+    buf.append((const char *) &v[0], v.size() * sizeof(T));
+}
+
+/* Returns the ID of "TEST.ATTR", assigning a new one if it hasn't got one. */
+static u16 fp_attr_id(FPImageBuilder *b, const char *test, const char *attr) {
+  std::string name = std::string(test) + "." + attr;
+  std::map<std::string, u16>::iterator it;
+
+  it = b->attr_ids.find(name);
+  if (it != b->attr_ids.end())
+    return it->second;
+  if (b->attr_names.size() >= 0xFFFF)
+    fatal("%s: Too many different attributes in fingerprint file", __func__);
+  b->attr_ids[name] = b->attr_names.size();
+  b->attr_names.push_back(b->str(name.c_str()));
+  b->attr_points.push_back(-1);
+
+  return b->attr_names.size() - 1;
+}
+
+static u32 fp_value_id(FPImageBuilder *b, const char *value) {
+  std::map<std::string, u32>::iterator it;
+  u32 id;
+
+  it = b->value_ids.find(value);
+  if (it != b->value_ids.end())
+    return it->second;
+  id = b->value_ids.size();
+  b->value_ids[value] = id;
+
+  return id;
+}
+
+/* Compiles a reference expression the way expr_match reads it, appending
+   its terms to b->terms unless the same expression has been seen before. */
+static void compile_expr(FPImageBuilder *b, const char *expr, FPAttrTest *test) {
+  std::map<std::string, FPAttrTest>::iterator seen;
+  std::string elem;
+  const char *p, *q, *q1;
+  char expchar;
+  FPExprTerm term;
+
+  seen = b->exprs.find(expr);
+  if (seen != b->exprs.end()) {
+    test->is_or = seen->second.is_or;
+    test->first = seen->second.first;
+    test->count = seen->second.count;
+    return;
+  }
+
+  test->is_or = strchr(expr, '|') != NULL;
+  expchar = test->is_or ? '|' : '&';
+  test->first = b->terms.size();
+  test->count = 0;
+
+  /* The terms are written out as they are, padding included. */
+  memset(&term, 0, sizeof(term));
+  p = expr;
+  do {
+    q = strchr(p, expchar);
+    elem = q ? std::string(p, q) : std::string(p);
+    term.lo = term.hi = 0;
+    if (elem == "+") {
+      term.op = FP_TERM_NONZERO;
+    } else if (elem[0] == '<' && isxdigit((int) (unsigned char) elem[1])) {
+      term.op = FP_TERM_LT;
+      term.lo = strtol(elem.c_str() + 1, NULL, 16);
+    } else if (elem[0] == '>' && isxdigit((int) (unsigned char) elem[1])) {
+      term.op = FP_TERM_GT;
+      term.lo = strtol(elem.c_str() + 1, NULL, 16);
+    } else if ((q1 = strchr(elem.c_str(), '-')) != NULL
+               && isxdigit((int) (unsigned char) elem[0])
+               && isxdigit((int) (unsigned char) q1[1])) {
+      term.op = FP_TERM_RANGE;
+      term.lo = strtol(elem.c_str(), NULL, 16);
+      term.hi = strtol(q1 + 1, NULL, 16);
+      if (term.hi < term.lo && o.debugging)
+        error("Range error in reference expr: %s", expr);
+    } else {
+      term.op = FP_TERM_EQ;
+      term.lo = fp_value_id(b, elem.c_str());
+    }
+    b->terms.push_back(term);
+    test->count++;
+    if (q)
+      p = q + 1;
+  } while (q);
+  b->exprs[expr] = *test;
+}
+
+/* Orders the attributes of a compiled print by the points they are worth,
+   most first, so that a print which is going to lose is found out after
+   as few comparisons as possible. */
+struct fp_attr_points_cmp {
+  const std::vector<int> &points;
+  fp_attr_points_cmp(const std::vector<int> &p) : points(p) {}
+  bool operator()(const FPAttrTest &a, const FPAttrTest &b) const {
+    return points[a.attr] > points[b.attr];
+  }
+};
+
+/* Builds the compiled form of the prints used by match_fingerprint. The
+   results are the same as those of compare_fingerprints. */
+void FingerPrintDB::compile() {
+  std::vector<FingerPrint *>::iterator current_os;
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  std::vector<OS_Classification>::const_iterator os_class;
+  std::vector<const char *>::const_iterator cpe;
+  std::map<std::string, u16>::const_iterator attr;
+  std::map<std::string, u32>::const_iterator value;
+  std::vector<FPStringID> attr_index, value_index;
+  FPImageBuilder b;
+  FPImageHeader header;
+  FPImagePrint print;
+  FPImageClass image_class;
+  FPAttrTest attr_test;
+  FPStringID sid;
+  std::string buf;
+  char *endptr;
+  u32 rest, first;
+  u16 id;
+  int points;
+  size_t i;
+
+  assert(mapped == NULL);
+
+  if (MatchPoints != NULL) {
+    for (test = MatchPoints->tests.begin(); test != MatchPoints->tests.end(); test++) {
+      for (av = test->results.begin(); av != test->results.end(); av++) {
+        errno = 0;
+        points = strtol(av->value, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || points < 0)
+          fatal("%s: Got bogus point amount (%s) for test %s.%s", __func__, av->value, test->name, av->attribute);
+        id = fp_attr_id(&b, test->name, av->attribute);
+        b.attr_points[id] = points;
+      }
+    }
+  }
+
+  memset(&attr_test, 0, sizeof(attr_test));
+  for (current_os = prints.begin(); current_os != prints.end(); current_os++) {
+    first = b.attr_tests.size();
+    b.print_tests.push_back(first);
+    for (test = (*current_os)->tests.begin(); test != (*current_os)->tests.end(); test++) {
+      for (av = test->results.begin(); av != test->results.end(); av++) {
+        attr_test.attr = fp_attr_id(&b, test->name, av->attribute);
+        compile_expr(&b, av->value, &attr_test);
+        b.attr_tests.push_back(attr_test);
+      }
+    }
+    std::stable_sort(b.attr_tests.begin() + first, b.attr_tests.end(),
+                     fp_attr_points_cmp(b.attr_points));
+    rest = 0;
+    for (i = b.attr_tests.size(); i > first; i--) {
+      if (b.attr_points[b.attr_tests[i - 1].attr] > 0)
+        rest += b.attr_points[b.attr_tests[i - 1].attr];
+      b.attr_tests[i - 1].rest_points = rest;
+    }
+
+    print.line = (*current_os)->match.line;
+    print.name = b.str((*current_os)->match.OS_name);
+    print.first_class = b.classes.size();
+    print.num_classes = (*current_os)->match.OS_class.size();
+    b.prints.push_back(print);
+    for (os_class = (*current_os)->match.OS_class.begin(); os_class != (*current_os)->match.OS_class.end(); os_class++) {
+      image_class.vendor = b.str(os_class->OS_Vendor);
+      image_class.family = b.str(os_class->OS_Family);
+      image_class.generation = b.str(os_class->OS_Generation);
+      image_class.device_type = b.str(os_class->Device_Type);
+      image_class.first_cpe = b.cpes.size();
+      image_class.num_cpes = os_class->cpe.size();
+      b.classes.push_back(image_class);
+      for (cpe = os_class->cpe.begin(); cpe != os_class->cpe.end(); cpe++)
+        b.cpes.push_back(b.str(*cpe));
+    }
+  }
+  b.print_tests.push_back(b.attr_tests.size());
+
+  /* The maps are in the same order as strcmp, which looks them up. */
+  for (attr = b.attr_ids.begin(); attr != b.attr_ids.end(); attr++) {
+    sid.str = b.attr_names[attr->second];
+    sid.id = attr->second;
+    attr_index.push_back(sid);
+  }
+  for (value = b.value_ids.begin(); value != b.value_ids.end(); value++) {
+    sid.str = b.str(value->first.c_str());
+    sid.id = value->second;
+    value_index.push_back(sid);
+  }
+  if (b.strings.empty())
+    b.strings.push_back('\0');
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, OS_DB_CACHE_MAGIC, sizeof(header.magic));
+  header.version = OS_DB_CACHE_VERSION;
+  header.num_prints = b.prints.size();
+  header.num_classes = b.classes.size();
+  header.num_cpes = b.cpes.size();
+  header.num_attrs = b.attr_names.size();
+  header.num_values = b.value_ids.size();
+  header.num_terms = b.terms.size();
+  header.num_attr_tests = b.attr_tests.size();
+  header.strings_len = b.strings.size();
+
+  buf.append((const char *) &header, sizeof(header));
+  image_append(buf, b.prints);
+  image_append(buf, b.classes);
+  image_append(buf, b.cpes);
+  image_append(buf, attr_index);
+  image_append(buf, b.attr_names);
+  image_append(buf, b.attr_points);
+  image_append(buf, value_index);
+  image_append(buf, b.terms);
+  image_append(buf, b.attr_tests);
+  image_append(buf, b.print_tests);
+  buf.append(b.strings);
+  buf.append((4 - buf.size() % 4) % 4, '\0');
+
+  image.assign(buf.size() / sizeof(u32), 0);
+  memcpy(&image[0], buf.data(), buf.size());
+  if (!attach(&image[0], buf.size()))
+    fatal("%s: Compiled fingerprint DB is inconsistent", __func__);
+}
+
+/* Returns the start of the next array of a compiled DB, of count elements
+   of size bytes, and moves *p past it. Returns NULL if it doesn't fit
+   before end. */
+static const u8 *image_section(const u8 **p, const u8 *end, u32 count, size_t size) {
+  const u8 *start = *p;
+
+  if ((unsigned long long) count * size > (unsigned long long) (end - start))
+    return NULL;
+  *p += count * size;
+  return start;
+}
+
+static bool image_string_ok(u32 str, u32 strings_len, bool optional) {
+  return str < strings_len || (optional && str == FP_IMAGE_NO_STRING);
+}
+
+/* Points the compiled arrays at a compiled DB of len bytes at data, which
+   must stay valid for as long as this FingerPrintDB. If there are no
+   prints yet, they are created from the image. Everything the matcher
+   will index with is checked first, so a damaged cache file is rejected
+   rather than read out of bounds. */
+bool FingerPrintDB::attach(const void *data, size_t len) {
+  const FPImageHeader *header = (const FPImageHeader *) data;
+  const FPImagePrint *image_prints;
+  const FPImageClass *image_classes;
+  const u32 *image_cpes;
+  const u8 *p, *end;
+  FingerPrint *FP;
+  OS_Classification os_class;
+  u32 i, j, k;
+
+  if (len < sizeof(*header) || memcmp(header->magic, OS_DB_CACHE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != OS_DB_CACHE_VERSION || header->num_prints == 0xFFFFFFFF
+      || header->strings_len == 0)
+    return false;
+  p = (const u8 *) data + sizeof(*header);
+  end = (const u8 *) data + len;
+  image_prints = (const FPImagePrint *) image_section(&p, end, header->num_prints, sizeof(FPImagePrint));
+  image_classes = (const FPImageClass *) image_section(&p, end, header->num_classes, sizeof(FPImageClass));
+  image_cpes = (const u32 *) image_section(&p, end, header->num_cpes, sizeof(u32));
+  attr_index = (const FPStringID *) image_section(&p, end, header->num_attrs, sizeof(FPStringID));
+  attr_names = (const u32 *) image_section(&p, end, header->num_attrs, sizeof(u32));
+  attr_points = (const int *) image_section(&p, end, header->num_attrs, sizeof(int));
+  value_index = (const FPStringID *) image_section(&p, end, header->num_values, sizeof(FPStringID));
+  terms = (const FPExprTerm *) image_section(&p, end, header->num_terms, sizeof(FPExprTerm));
+  attr_tests = (const FPAttrTest *) image_section(&p, end, header->num_attr_tests, sizeof(FPAttrTest));
+  print_tests = (const u32 *) image_section(&p, end, header->num_prints + 1, sizeof(u32));
+  strings = (const char *) image_section(&p, end, header->strings_len, 1);
+  if (image_prints == NULL || image_classes == NULL || image_cpes == NULL
+      || attr_index == NULL || attr_names == NULL || attr_points == NULL
+      || value_index == NULL || terms == NULL || attr_tests == NULL
+      || print_tests == NULL || strings == NULL
+      || strings[header->strings_len - 1] != '\0')
+    goto bad;
+
+  for (i = 0; i < header->num_attrs; i++) {
+    if (!image_string_ok(attr_index[i].str, header->strings_len, false)
+        || attr_index[i].id >= header->num_attrs
+        || !image_string_ok(attr_names[i], header->strings_len, false))
+      goto bad;
+  }
+  for (i = 0; i < header->num_values; i++) {
+    if (!image_string_ok(value_index[i].str, header->strings_len, false))
+      goto bad;
+  }
+  for (i = 0; i < header->num_attr_tests; i++) {
+    if (attr_tests[i].attr >= header->num_attrs
+        || attr_tests[i].first > header->num_terms
+        || attr_tests[i].count > header->num_terms - attr_tests[i].first)
+      goto bad;
+  }
+  for (i = 0; i < header->num_prints; i++) {
+    if (print_tests[i] > print_tests[i + 1])
+      goto bad;
+  }
+  if (print_tests[0] != 0 || print_tests[header->num_prints] != header->num_attr_tests)
+    goto bad;
+  for (i = 0; i < header->num_prints; i++) {
+    if (!image_string_ok(image_prints[i].name, header->strings_len, true)
+        || image_prints[i].first_class > header->num_classes
+        || image_prints[i].num_classes > header->num_classes - image_prints[i].first_class)
+      goto bad;
+  }
+  for (i = 0; i < header->num_classes; i++) {
+    if (!image_string_ok(image_classes[i].vendor, header->strings_len, true)
+        || !image_string_ok(image_classes[i].family, header->strings_len, true)
+        || !image_string_ok(image_classes[i].generation, header->strings_len, true)
+        || !image_string_ok(image_classes[i].device_type, header->strings_len, true)
+        || image_classes[i].first_cpe > header->num_cpes
+        || image_classes[i].num_cpes > header->num_cpes - image_classes[i].first_cpe)
+      goto bad;
+  }
+  for (i = 0; i < header->num_cpes; i++) {
+    if (!image_string_ok(image_cpes[i], header->strings_len, false))
+      goto bad;
+  }
+
+  if (prints.empty()) {
+#define IMAGE_STRING(s) ((s) == FP_IMAGE_NO_STRING ? NULL : strings + (s))
+    for (i = 0; i < header->num_prints; i++) {
+      FP = new FingerPrint;
+      FP->match.line = image_prints[i].line;
+      FP->match.OS_name = (char *) IMAGE_STRING(image_prints[i].name);
+      FP->match.OS_class.reserve(image_prints[i].num_classes);
+      for (j = image_prints[i].first_class; j < image_prints[i].first_class + image_prints[i].num_classes; j++) {
+        os_class.OS_Vendor = IMAGE_STRING(image_classes[j].vendor);
+        os_class.OS_Family = IMAGE_STRING(image_classes[j].family);
+        os_class.OS_Generation = IMAGE_STRING(image_classes[j].generation);
+        os_class.Device_Type = IMAGE_STRING(image_classes[j].device_type);
+        os_class.cpe.clear();
+        for (k = image_classes[j].first_cpe; k < image_classes[j].first_cpe + image_classes[j].num_cpes; k++)
+          os_class.cpe.push_back(strings + image_cpes[k]);
+        FP->match.OS_class.push_back(os_class);
+      }
+      prints.push_back(FP);
+    }
+#undef IMAGE_STRING
+  } else if (prints.size() != header->num_prints) {
+    goto bad;
+  }
+
+  num_prints = header->num_prints;
+  num_attrs = header->num_attrs;
+  num_values = header->num_values;
+  return true;
+
+bad:
+  strings = NULL;
+  attr_index = value_index = NULL;
+  attr_names = NULL;
+  attr_points = NULL;
+  terms = NULL;
+  attr_tests = NULL;
+  print_tests = NULL;
+  return false;
+}
+
+/* An attribute of an observed fingerprint, ready for comparing with
+   compiled expressions. */
+struct FPObservedValue {
+  bool present;
+  bool empty;
+  bool numeric; /* The whole value was read as a hex number (empty is 0) */
+  unsigned int num;
+  u32 value_id; /* 0xFFFFFFFF if no reference expression has the value */
+};
+
+/* The compiled equivalent of expr_match. As there, an empty value is 0
+   in comparisons joined by "|" but makes them fail when joined by "&". */
+static bool compiled_expr_match(const FPObservedValue *val, const FPExprTerm *term,
+                                int count, bool is_or) {
+  bool ok;
+
+  for (; count > 0; count--, term++) {
+    switch (term->op) {
+    case FP_TERM_EQ:
+      ok = val->value_id == term->lo;
+      break;
+    case FP_TERM_NONZERO:
+      ok = !val->empty && val->numeric && val->num != 0;
+      break;
+    case FP_TERM_LT:
+      ok = (is_or || !val->empty) && val->numeric && val->num < term->lo;
+      break;
+    case FP_TERM_GT:
+      ok = (is_or || !val->empty) && val->numeric && val->num > term->lo;
+      break;
+    default:
+      ok = (is_or || !val->empty) && val->numeric
+        && val->num >= term->lo && val->num <= term->hi;
+      break;
+    }
+    if (ok == is_or)
+      return ok;
+  }
+
+  return !is_or;
+}
+
+/* Finds s in a sorted index of a compiled DB. */
+static const FPStringID *fp_lookup(const FPStringID *index, u32 count,
+                                   const char *strings, const char *s) {
+  u32 lo = 0, hi = count, mid;
+  int cmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    cmp = strcmp(strings + index[mid].str, s);
+    if (cmp == 0)
+      return &index[mid];
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return NULL;
+}
+
+/* Looks up the attributes of FP in the compiled DB. */
+static void compile_observed(const FingerPrint *FP, const FingerPrintDB *DB,
+                             std::vector<FPObservedValue> &vals) {
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  const FPStringID *attr, *value;
+  std::string name;
+  char *endptr;
+
+  vals.assign(DB->num_attrs, FPObservedValue());
+  for (test = FP->tests.begin(); test != FP->tests.end(); test++) {
+    for (av = test->results.begin(); av != test->results.end(); av++) {
+      name = std::string(test->name) + "." + av->attribute;
+      attr = fp_lookup(DB->attr_index, DB->num_attrs, DB->strings, name.c_str());
+      if (attr == NULL)
+        continue;
+      FPObservedValue &val = vals[attr->id];
+      val.present = true;
+      val.empty = *av->value == '\0';
+      val.num = strtol(av->value, &endptr, 16);
+      val.numeric = *endptr == '\0';
+      value = fp_lookup(DB->value_index, DB->num_values, DB->strings, av->value);
+      val.value_id = value == NULL ? 0xFFFFFFFF : value->id;
+    }
+  }
+}
+
+/* Whether the attribute name (like "T1.W") is matched by a pattern of the
+   same form, either part of which may be "*". */
+static bool attr_name_matches(const char *name, const char *pattern) {
+  const char *dot, *pdot;
+
+  dot = strchr(name, '.');
+  pdot = strchr(pattern, '.');
+  if (dot == NULL || pdot == NULL)
+    return false;
+  if (!(pdot - pattern == 1 && *pattern == '*')
+      && (pdot - pattern != dot - name || strncmp(name, pattern, dot - name) != 0))
+    return false;
+  return strcmp(pdot + 1, "*") == 0 || strcmp(pdot + 1, dot + 1) == 0;
+}
+
+/* Returns true if the results still to come for the attributes matched by
+   pending can't change what match_fingerprint finds for FP with
+   accuracy_threshold, even if they never come and are left out of FP. FP
+   holds the results so far. That is the case when no print that tests a
+   pending attribute could reach the threshold, even if all of its pending
+   attributes matched: such a print is left out of the results whatever
+   they are, and the accuracy of every other print doesn't depend on
+   them. */
+bool fingerprint_match_is_settled(const FingerPrint *FP, const FingerPrintDB *DB,
+                                  const std::vector<std::string> &pending,
+                                  double accuracy_threshold) {
+  std::vector<std::string>::const_iterator pat;
+  std::vector<FPObservedValue> vals;
+  std::vector<bool> is_pending;
+  const FPAttrTest *test;
+  unsigned long succeeded, present, rest;
+  unsigned int i, t;
+  int points;
+
+  if (!DB->isCompiled())
+    const_cast<FingerPrintDB *>(DB)->compile();
+  compile_observed(FP, DB, vals);
+
+  is_pending.assign(DB->num_attrs, false);
+  for (i = 0; i < DB->num_attrs; i++) {
+    for (pat = pending.begin(); pat != pending.end(); pat++) {
+      if (attr_name_matches(DB->strings + DB->attr_names[i], pat->c_str())) {
+        is_pending[i] = true;
+        break;
+      }
+    }
+  }
+
+  for (i = 0; i < DB->num_prints; i++) {
+    succeeded = present = rest = 0;
+    for (t = DB->print_tests[i]; t < DB->print_tests[i + 1]; t++) {
+      test = &DB->attr_tests[t];
+      points = DB->attr_points[test->attr];
+      if (points < 0)
+        continue;
+      if (is_pending[test->attr]) {
+        rest += points;
+      } else if (vals[test->attr].present) {
+        present += points;
+        if (compiled_expr_match(&vals[test->attr], &DB->terms[test->first], test->count, test->is_or))
+          succeeded += points;
+      }
+    }
+    if (rest > 0 && (succeeded + rest) / (double) (present + rest) >= accuracy_threshold)
+      return false;
+  }
+
+  return true;
+}
+
 /* Takes a fingerprint and looks for matches inside the passed in
    reference fingerprint DB.  The results are stored in in FPR (which
    must point to an instantiated FingerPrintResultsIPv4 class) -- results
@@ -513,7 +1139,11 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
                                                            to be added to the
                                                            list */
   std::vector<FingerPrint *>::const_iterator current_os;
-  FingerPrint FP_copy;
+  std::vector<FPObservedValue> vals;
+  const FPAttrTest *test;
+  unsigned int i, t;
+  unsigned long num_subtests, num_subtests_succeeded, rest;
+  int points;
   double acc;
   int state;
   int skipfp;
@@ -526,15 +1156,43 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
   assert(FPR);
   assert(accuracy_threshold >= 0 && accuracy_threshold <= 1);
 
-  FP_copy = *FP;
-  FP_copy.sort();
+  /* A DB put together by hand rather than read by parse_fingerprint_file. */
+  if (!DB->isCompiled())
+    const_cast<FingerPrintDB *>(DB)->compile();
+  compile_observed(FP, DB, vals);
 
   FPR->overall_results = OSSCAN_SUCCESS;
 
   for (current_os = DB->prints.begin(); current_os != DB->prints.end(); current_os++) {
     skipfp = 0;
 
-    acc = compare_fingerprints(*current_os, &FP_copy, DB->MatchPoints, 0);
+    /* The same as compare_fingerprints(*current_os, FP, DB->MatchPoints, 0),
+       except that we stop as soon as the print can't reach the entrance
+       requirement any more. That is when even matching all the remaining
+       attributes, and all of them being present, would leave the accuracy
+       below it; the print would not have been added to the list anyway. */
+    num_subtests = num_subtests_succeeded = 0;
+    i = current_os - DB->prints.begin();
+    for (t = DB->print_tests[i]; t < DB->print_tests[i + 1]; t++) {
+      test = &DB->attr_tests[t];
+      const FPObservedValue &val = vals[test->attr];
+      if (!val.present)
+        continue;
+      points = DB->attr_points[test->attr];
+      if (points < 0)
+        fatal("%s: Failed to find point amount for test %s", __func__, DB->strings + DB->attr_names[test->attr]);
+      num_subtests += points;
+      if (compiled_expr_match(&val, &DB->terms[test->first], test->count, test->is_or)) {
+        num_subtests_succeeded += points;
+      } else {
+        rest = test->rest_points - points;
+        if ((num_subtests_succeeded + rest) / (double) (num_subtests + rest) < FPR_entrance_requirement)
+          break;
+      }
+    }
+    if (t < DB->print_tests[i + 1])
+      continue;
+    acc = (num_subtests) ? (num_subtests_succeeded / (double) num_subtests) : 0;
 
     /*    error("Comp to %s: %li/%li=%f", o.reference_FPs1[i]->OS_name, num_subtests_succeeded, num_subtests, acc); */
     if (acc >= FPR_entrance_requirement || acc == 1.0) {
@@ -1258,11 +1916,74 @@ fparse:
   }
 
   fclose(fp);
+  DB->compile();
+  return DB;
+}
+
+/* Returns the compiled DB in cachefile if it was compiled from the given
+   contents of nmap-os-db, or NULL. The file is mapped read-only and used
+   as it is, so concurrent scans share one copy of it. */
+static FingerPrintDB *load_os_db_cache(const char *cachefile, const std::string &source) {
+  unsigned long long hash = fnv1a64(source.data(), source.length());
+  const FPImageHeader *header;
+  FingerPrintDB *DB;
+
+  DB = new FingerPrintDB;
+#ifndef WIN32
+  DB->mapped = mmapfile((char *) cachefile, &DB->mapped_len, O_RDONLY);
+  if (DB->mapped == NULL) {
+    delete DB;
+    return NULL;
+  }
+  header = (const FPImageHeader *) DB->mapped;
+#else
+  /* mmapfile can only keep one file mapped at a time on Windows. */
+  std::string contents;
+  if (!read_whole_file(cachefile, contents)) {
+    delete DB;
+    return NULL;
+  }
+  DB->image.assign(contents.length() / sizeof(u32), 0);
+  if (!DB->image.empty())
+    memcpy(&DB->image[0], contents.data(), DB->image.size() * sizeof(u32));
+  header = (const FPImageHeader *) (DB->image.empty() ? NULL : &DB->image[0]);
+#endif
+
+  if (DB->imageLength() < sizeof(*header) || header->source_len != source.length()
+      || header->source_hash[0] != (u32) hash || header->source_hash[1] != (u32) (hash >> 32)
+      || !DB->attach(DB->imageData(), DB->imageLength())) {
+    delete DB;
+    return NULL;
+  }
+
   return DB;
 }
 
+static void save_os_db_cache(const FingerPrintDB *DB, const char *cachefile, const std::string &source) {
+  unsigned long long hash = fnv1a64(source.data(), source.length());
+  std::string contents((const char *) DB->imageData(), DB->imageLength());
+  FPImageHeader header;
+
+  memcpy(&header, contents.data(), sizeof(header));
+  header.source_len = source.length();
+  header.source_hash[0] = (u32) hash;
+  header.source_hash[1] = (u32) (hash >> 32);
+  contents.replace(0, sizeof(header), (const char *) &header, sizeof(header));
+
+  if (!write_file_atomically(cachefile, contents) && o.debugging)
+    error("Failed to write OS detection cache %s", cachefile);
+}
+
+/* Like parse_fingerprint_file, but finds dbname in the data directories. A
+   compiled copy of the DB is cached in the user's Nmap directory and
+   mapped instead of parsing the file again for as long as the file is
+   unchanged. Prints loaded from the cache have no tests. */
 FingerPrintDB *parse_fingerprint_reference_file(const char *dbname) {
   char filename[256];
+  char cachefile[512];
+  std::string source;
+  FingerPrintDB *DB;
+  bool cached;
 
   if (nmap_fetchfile(filename, sizeof(filename), dbname) != 1) {
     fatal("OS scan requested but I cannot find %s file.  It should be in %s, ~/.nmap/ or .", dbname, NMAPDATADIR);
@@ -1270,5 +1991,17 @@ FingerPrintDB *parse_fingerprint_reference_file(const char *dbname) {
   /* Record where this data file was found. */
   o.loaded_data_files[dbname] = filename;
 
-  return parse_fingerprint_file(filename);
+  cached = read_whole_file(filename, source)
+    && nmap_cachefile(cachefile, sizeof(cachefile), OS_DB_CACHE_FILE);
+  if (cached && (DB = load_os_db_cache(cachefile, source)) != NULL) {
+    if (o.debugging)
+      log_write(LOG_PLAIN, "Loaded %s from cache %s\n", filename, cachefile);
+    return DB;
+  }
+
+  DB = parse_fingerprint_file(filename);
+  if (cached)
+    save_os_db_cache(DB, cachefile, source);
+
+  return DB;
 }
@@ -130,7 +130,9 @@ FingerPrint *parse_single_fingerprint(char *fprint_orig);
 
 /* These functions take a file/db name and open+parse it, returning an
    (allocated) FingerPrintDB containing the results.  They exit with
-   an error message in the case of error. */
+   an error message in the case of error.  The reference file may instead
+   be loaded from its compiled cache, in which case the prints have only
+   their FingerMatch and no tests. */
 FingerPrintDB *parse_fingerprint_file(const char *fname);
 FingerPrintDB *parse_fingerprint_reference_file(const char *dbname);
 
@@ -153,6 +155,15 @@ double compare_fingerprints(const FingerPrint *referenceFP, const FingerPrint *o
 void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
 		       const FingerPrintDB *DB, double accuracy_threshold);
 
+/* Returns true if the results still to come for an observed fingerprint
+   can't change what match_fingerprint finds for it with accuracy_threshold,
+   even if they are left out of it.  FP holds the tests done so far and
+   pending names the attributes whose results may still come or change, as
+   "TEST.ATTR" where either part may be "*". */
+bool fingerprint_match_is_settled(const FingerPrint *FP, const FingerPrintDB *DB,
+                                  const std::vector<std::string> &pending,
+                                  double accuracy_threshold);
+
 /* Returns true if perfect match -- if num_subtests & num_subtests_succeeded are non_null it updates them.  if shortcircuit is zero, it does all the tests, otherwise it returns when the first one fails */
 
 void freeFingerPrint(FingerPrint *FP);
@@ -104,7 +104,11 @@
 
 #include "struct_ip.h"
 
+#include <algorithm>
 #include <list>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 extern NmapOps o;
 
@@ -151,6 +155,11 @@ static struct timeval now;
 /* Global to store performance info */
 struct scan_performance_vars perf;
 
+/* The names of the tests in HostOsScanStats::FPtests. */
+static const char *fp_test_names[NUM_FPTESTS] = {
+  "SEQ", "OPS", "WIN", "ECN", "T1", "T2", "T3", "T4", "T5", "T6", "T7", "U1", "IE"
+};
+
 
 /******************************************************************************
  * Miscellaneous functions                                                    *
@@ -312,19 +321,6 @@ int get_ipid_sequence(int numSamples, int *ipids, int islocalhost) {
 }
 
 
-/* Start the timeout clocks of any targets that aren't already timedout */
-static void startTimeOutClocks(OsScanInfo *OSI) {
-  std::list<HostOsScanInfo *>::iterator hostI;
-
-  gettimeofday(&now, NULL);
-  for (hostI = OSI->incompleteHosts.begin();
-       hostI != OSI->incompleteHosts.end(); hostI++) {
-    if (!(*hostI)->target->timedOut(NULL))
-      (*hostI)->target->startTimeOutClock(&now);
-  }
-}
-
-
 /** Sets up the pcap descriptor in HOS (obtains a descriptor and sets the
  * appropriate BPF filter, based on the supplied list of targets). */
 static void begin_sniffer(HostOsScan *HOS, std::vector<Target *> &Targets) {
@@ -379,418 +375,604 @@ static void begin_sniffer(HostOsScan *HOS, std::vector<Target *> &Targets) {
 }
 
 
-/* Sets everything up so the current round can be performed. This includes
- * reinitializing some variables of the supplied objects and deleting
- * some old information. */
-static void startRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
-  std::list<HostOsScanInfo *>::iterator hostI;
-  HostOsScanInfo *hsi = NULL;
+/* The cache, keyed by address. */
+static std::map<std::string, OSCacheEntry> os_cache;
+static bool os_cache_loaded = false;
 
-  /* Reinitial some parameters of the scan system. */
-  HOS->reInitScanSystem();
+/* The tests a cache verification try does: those against the closed TCP
+   port and the UDP and ICMP tests. They need no open port and, unlike the
+   sequence tests, should come out the same every time. */
+static const int os_cache_tests[] = {
+  FP_T1_7_OFF + 4, FP_T1_7_OFF + 5, FP_T1_7_OFF + 6, /* T5, T6, T7 */
+  FP_TUDP_OFF, FP_TICMP_OFF
+};
 
-  for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
-    hsi = *hostI;
-    if (hsi->FPs[roundNum]) {
-      delete hsi->FPs[roundNum];
-      hsi->FPs[roundNum] = NULL;
-    }
-    hsi->hss->initScanStats();
-  }
+static std::string os_cache_mac(Target *target) {
+  const u8 *mac = target->MACAddress();
+  char buf[32];
+
+  if (mac == NULL)
+    return "-";
+  Snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  return buf;
 }
 
-/* Run the sequence generation tests (6 TCP probes sent 100ms apart) */
-static void doSeqTests(OsScanInfo *OSI, HostOsScan *HOS) {
-  std::list<HostOsScanInfo *>::iterator hostI;
-  HostOsScanInfo *hsi = NULL;
-  HostOsScanStats *hss = NULL;
-  unsigned int unableToSend = 0;  /* # of times in a row that hosts were unable to send probe */
-  unsigned int expectReplies = 0;
-  long to_usec = 0;
-  int timeToSleep = 0;
-  struct ip *ip = NULL;
-  struct link_header linkhdr;
-  struct sockaddr_storage ss;
-  unsigned int bytes = 0;
-  struct timeval rcvdtime;
-  struct timeval stime;
-  struct timeval tmptv;
-  bool timedout = false;
-  bool thisHostGood = false;
-  bool foundgood = false;
-  bool goodResponse = false;
-  int numProbesLeft = 0;
+/* The sequence results of a cache entry are written as responses, index,
+   TS and IP ID classes and last boot time, then each sample's sequence
+   number, timestamp and IP ID, all separated by commas. */
+static std::string seq_info2str(const struct seq_info *si) {
+  char buf[128];
+  std::string s;
+  int i;
 
-  memset(&stime, 0, sizeof(stime));
-  memset(&tmptv, 0, sizeof(tmptv));
+  Snprintf(buf, sizeof(buf), "%d,%d,%d,%d,%ld", si->responses, si->index,
+           si->ts_seqclass, si->ipid_seqclass, si->lastboot);
+  s = buf;
+  for (i = 0; i < NUM_SEQ_SAMPLES; i++) {
+    Snprintf(buf, sizeof(buf), ",%X,%X,%hX", si->seqs[i], si->timestamps[i], si->ipids[i]);
+    s += buf;
+  }
 
-  /* For each host, build a list of sequence probes to send */
-  for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
-    hsi = *hostI;
-    hss = hsi->hss;
-    HOS->buildSeqProbeList(hss);
+  return s;
+}
+
+static bool str2seq_info(const char *s, struct seq_info *si) {
+  unsigned int seq, ts, ipid;
+  int i, n;
+
+  memset(si, 0, sizeof(*si));
+  n = 0;
+  if (sscanf(s, "%d,%d,%d,%d,%ld%n", &si->responses, &si->index, &si->ts_seqclass,
+             &si->ipid_seqclass, &si->lastboot, &n) != 5 || n == 0)
+    return false;
+  s += n;
+  for (i = 0; i < NUM_SEQ_SAMPLES; i++) {
+    n = 0;
+    if (sscanf(s, ",%X,%X,%X%n", &seq, &ts, &ipid, &n) != 3 || n == 0)
+      return false;
+    si->seqs[i] = seq;
+    si->timestamps[i] = ts;
+    si->ipids[i] = (u16) ipid;
+    s += n;
   }
 
-  /* Iterate until we have sent all the probes */
-  do {
-    if (timeToSleep > 0) {
-      if (o.debugging > 1)
-        log_write(LOG_PLAIN, "Sleep %dus for next sequence probe\n", timeToSleep);
-      usleep(timeToSleep);
-    }
+  return *s == '\0' && si->responses >= 0 && si->responses <= NUM_SEQ_SAMPLES;
+}
 
-    gettimeofday(&now, NULL);
-    expectReplies = 0;
-    unableToSend = 0;
+/* A line of the cache file is
+     <address> <MAC> <open port>/<closed port> <distance> <hash> <seq> <tests>
+   where the hash is of the rest of the line. */
+std::string os_cache_format_line(const std::string &addr, const OSCacheEntry &entry) {
+  std::string rest;
+  char line[256];
 
-    if (o.debugging > 2) {
-      for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
-        hss = (*hostI)->hss;
-        log_write(LOG_PLAIN, "Host %s. ProbesToSend %d: \tProbesActive %d\n",
-                  hss->target->targetipstr(), hss->numProbesToSend(),
-                  hss->numProbesActive());
-      }
-    }
+  rest = seq_info2str(&entry.si) + " " + entry.fp;
+  Snprintf(line, sizeof(line), "%s %s %d/%d %d %016llx ", addr.c_str(),
+           entry.mac.c_str(), entry.opentcpport, entry.closedtcpport,
+           entry.distance, fnv1a64(rest.data(), rest.size()));
 
-    /* Send a seq probe to each host. */
-    while (unableToSend < OSI->numIncompleteHosts() && HOS->stats->sendOK()) {
-      hsi = OSI->nextIncompleteHost();
-      hss = hsi->hss;
-      gettimeofday(&now, NULL);
-      if (hss->numProbesToSend()>0 && HOS->hostSeqSendOK(hss, NULL)) {
-        HOS->sendNextProbe(hss);
-        expectReplies++;
-        unableToSend = 0;
-      } else {
-        unableToSend++;
-      }
-    }
+  return line + rest;
+}
 
-    HOS->stats->num_probes_sent_at_last_wait = HOS->stats->num_probes_sent;
+bool os_cache_parse_line(const char *line, std::string &addr, OSCacheEntry &entry) {
+  char addrbuf[128], mac[32], seq[512];
+  unsigned long long hash;
+  const char *rest;
+  size_t len;
+  int n;
 
-    gettimeofday(&now, NULL);
+  n = 0;
+  if (sscanf(line, "%127s %31s %d/%d %d %llx %n", addrbuf, mac, &entry.opentcpport,
+             &entry.closedtcpport, &entry.distance, &hash, &n) != 6 || n == 0)
+    return false;
+  rest = line + n;
+  len = strcspn(rest, "\r\n");
+  /* Skip truncated or edited entries rather than have
+     parse_single_fingerprint choke on them later. */
+  if (len == 0 || fnv1a64(rest, len) != hash)
+    return false;
+  n = 0;
+  if (sscanf(rest, "%511s %n", seq, &n) != 1 || n == 0 || (size_t) n >= len
+      || !str2seq_info(seq, &entry.si))
+    return false;
+  addr = addrbuf;
+  entry.mac = mac;
+  entry.fp.assign(rest + n, len - n);
 
-    /* Count the pcap wait time. */
-    if (!HOS->stats->sendOK()) {
-      TIMEVAL_MSEC_ADD(stime, now, 1000);
+  return true;
+}
 
-      for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
-        if (HOS->nextTimeout((*hostI)->hss, &tmptv)) {
-          if (TIMEVAL_SUBTRACT(tmptv, stime) < 0)
-            stime = tmptv;
-        }
-      }
-    } else {
-      foundgood = false;
-      for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
-        thisHostGood = HOS->hostSeqSendOK((*hostI)->hss, &tmptv);
-        if (thisHostGood) {
-          stime = tmptv;
-          foundgood = true;
-          break;
-        }
+/* Reads the --osscan-cache file. A missing file is the same as an empty
+   one. */
+static void load_os_cache() {
+  char line[4096];
+  OSCacheEntry entry;
+  std::string addr;
+  FILE *f;
+
+  os_cache_loaded = true;
+  f = fopen(o.osscan_cache, "r");
+  if (f == NULL)
+    return;
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#')
+      continue;
+    if (os_cache_parse_line(line, addr, entry))
+      os_cache[addr] = entry;
+  }
+  fclose(f);
+  if (o.debugging)
+    log_write(LOG_PLAIN, "Loaded %u cached OS detection results from %s\n",
+              (unsigned int) os_cache.size(), o.osscan_cache);
+}
 
-        if (!foundgood || TIMEVAL_SUBTRACT(tmptv, stime) < 0) {
-          stime = tmptv;
-          foundgood = true;
-        }
-      }
-    }
+/* Returns the fingerprint cached for a host if it has an entry with its
+   current MAC address and the TCP ports chosen for OS detection, or NULL.
+   distance and si get the distance and sequence results recorded with it. */
+static FingerPrint *lookup_os_cache(Target *target, int *distance, struct seq_info *si) {
+  std::map<std::string, OSCacheEntry>::iterator entry;
+  std::string fp;
+
+  if (!os_cache_loaded)
+    load_os_cache();
+  entry = os_cache.find(target->targetipstr());
+  if (entry == os_cache.end())
+    return NULL;
+  if (entry->second.mac != os_cache_mac(target)
+      || entry->second.opentcpport != target->FPR->osscan_opentcpport
+      || entry->second.closedtcpport != target->FPR->osscan_closedtcpport) {
+    if (o.debugging)
+      log_write(LOG_PLAIN, "Cached OS detection result for %s is for different ports or MAC address\n",
+                target->targetipstr());
+    return NULL;
+  }
 
-    do {
-      to_usec = TIMEVAL_SUBTRACT(stime, now);
-      if (to_usec < 2000)
-        to_usec = 2000;
+  fp = entry->second.fp;
+  std::replace(fp.begin(), fp.end(), ' ', '\n');
+  *distance = entry->second.distance;
+  *si = entry->second.si;
+  return parse_single_fingerprint((char *) fp.c_str());
+}
 
-      if (o.debugging > 2)
-        log_write(LOG_PLAIN, "pcap wait time is %ld.\n", to_usec);
+/* Records the fingerprint that gave a host its perfect match, with the
+   sequence results in target->seq. */
+static void record_os_cache(Target *target, FingerPrint *FP) {
+  OSCacheEntry entry;
+  std::string fp;
+
+  entry.mac = os_cache_mac(target);
+  entry.opentcpport = target->FPR->osscan_opentcpport;
+  entry.closedtcpport = target->FPR->osscan_closedtcpport;
+  entry.distance = target->distance;
+  entry.si = target->seq;
+  fp = fp2ascii(FP);
+  while (!fp.empty() && fp[fp.size() - 1] == '\n')
+    fp.erase(fp.size() - 1);
+  std::replace(fp.begin(), fp.end(), '\n', ' ');
+  entry.fp = fp;
+  os_cache[target->targetipstr()] = entry;
+}
 
-      ip = (struct ip*) readipv4_pcap(HOS->pd, &bytes, to_usec, &rcvdtime, &linkhdr, true);
+/* Writes the cache out, through a temporary file. */
+static void write_os_cache() {
+  std::map<std::string, OSCacheEntry>::iterator entry;
+  std::string contents;
 
-      gettimeofday(&now, NULL);
+  contents = "# Nmap OS detection cache: address, MAC, open/closed TCP port, distance, hash, sequence results, fingerprint\n";
+  for (entry = os_cache.begin(); entry != os_cache.end(); entry++) {
+    contents += os_cache_format_line(entry->first, entry->second);
+    contents += "\n";
+  }
+  if (!write_file_atomically(o.osscan_cache, contents))
+    error("Failed to write OS detection cache %s", o.osscan_cache);
+}
 
-      if (!ip && TIMEVAL_SUBTRACT(stime, now) < 0) {
-        timedout = true;
-        break;
-      } else if (!ip) {
-        continue;
-      }
+static const FingerTest *find_test(const FingerPrint *FP, const char *name) {
+  std::vector<FingerTest>::const_iterator test;
 
-      if (TIMEVAL_SUBTRACT(now, stime) > 200000) {
-        /* While packets are still being received, I'll be generous and give
-           an extra 1/5 sec.  But we have to draw the line somewhere */
-        timedout = true;
-      }
+  for (test = FP->tests.begin(); test != FP->tests.end(); test++) {
+    if (strcmp(test->name, name) == 0)
+      return &*test;
+  }
 
-      if (bytes < (4 * ip->ip_hl) + 4U)
-        continue;
+  return NULL;
+}
 
-      memset(&ss, 0, sizeof(ss));
-      ((struct sockaddr_in *) &ss)->sin_addr.s_addr = ip->ip_src.s_addr;
-      ss.ss_family = AF_INET;
-      hsi = OSI->findIncompleteHost(&ss);
-      if (!hsi)
-        continue; /* Not from one of our targets. */
-      setTargetMACIfAvailable(hsi->target, &linkhdr, &ss, 0);
+/* Whether the tests of a cache verification try came out the same as in
+   the cached fingerprint, including whether they got a response at all. */
+bool os_cache_verified(const FingerPrint *cached, const FingerPrint *FP) {
+  std::vector<struct AVal>::const_iterator av, cav;
+  const FingerTest *test, *ctest;
+  unsigned int i;
+
+  for (i = 0; i < NELEMS(os_cache_tests); i++) {
+    test = find_test(FP, fp_test_names[os_cache_tests[i]]);
+    ctest = find_test(cached, fp_test_names[os_cache_tests[i]]);
+    if (test == NULL || ctest == NULL) {
+      if (test != ctest)
+        return false;
+      continue;
+    }
+    if (test->results.size() != ctest->results.size())
+      return false;
+    for (av = test->results.begin(); av != test->results.end(); av++) {
+      for (cav = ctest->results.begin(); cav != ctest->results.end(); cav++) {
+        if (strcmp(av->attribute, cav->attribute) == 0)
+          break;
+      }
+      if (cav == ctest->results.end() || strcmp(av->value, cav->value) != 0)
+        return false;
+    }
+  }
 
-      goodResponse = HOS->processResp(hsi->hss, ip, bytes, &rcvdtime);
+  return true;
+}
 
-      if (goodResponse)
-        expectReplies--;
 
-    } while (!timedout && expectReplies > 0);
+/* Starts the next try against a host: chooses new probe values and
+ * queues the sequence probes. With --osscan-cache, the first try of a host
+ * with a usable entry only does the tests that check it is unchanged. */
+static void startTry(HostOsScan *HOS, HostOsScanInfo *hsi) {
+  if (hsi->FPs[hsi->tryno]) {
+    delete hsi->FPs[hsi->tryno];
+    hsi->FPs[hsi->tryno] = NULL;
+  }
+  hsi->hss->initScanStats();
+  if (o.osscan_cache && !hsi->cacheChecked) {
+    hsi->cacheChecked = true;
+    hsi->cachedFP = lookup_os_cache(hsi->target, &hsi->cachedDistance, &hsi->cachedSeq);
+  }
+  hsi->cacheTry = hsi->cachedFP != NULL;
+  if (hsi->cacheTry) {
+    HOS->buildVerifyProbeList(hsi->hss);
+    hsi->phase = OS_PHASE_TUI;
+  } else {
+    HOS->buildSeqProbeList(hsi->hss);
+    hsi->phase = OS_PHASE_SEQ;
+  }
+}
 
-    /* Remove any timeout hosts during the scan. */
-    OSI->removeCompletedHosts();
 
-    numProbesLeft = 0;
-    for (hostI = OSI->incompleteHosts.begin();
-        hostI != OSI->incompleteHosts.end(); hostI++) {
-      hss = (*hostI)->hss;
-      HOS->updateActiveSeqProbes(hss);
-      numProbesLeft += hss->numProbesToSend();
-      numProbesLeft += hss->numProbesActive();
-    }
+/* Makes the fingerprint of the try a host has just finished. The host then
+ * waits for it to be matched; see matchTry and finishTry. If the try was
+ * checking the host's --osscan-cache entry, the cached fingerprint is used
+ * instead when the host passes; when it doesn't, a full try is started and
+ * false is returned. */
+static bool endTry(HostOsScan *HOS, HostOsScanInfo *hsi) {
+  int roundNum = hsi->tryno;
+  int distance = -1;
+  enum dist_calc_method distance_calculation_method = DIST_METHOD_NONE;
+  FingerPrint *FP;
+
+  HOS->makeFP(hsi->hss);
+  FP = hsi->hss->getFP();
+
+  if (islocalhost(hsi->target->TargetSockAddr())) {
+    /* scanning localhost */
+    distance = 0;
+    distance_calculation_method = DIST_METHOD_LOCALHOST;
+  } else if (hsi->target->MACAddress()) {
+    /* on the same network segment */
+    distance = 1;
+    distance_calculation_method = DIST_METHOD_DIRECT;
+  } else if (hsi->hss->distance!=-1) {
+    distance = hsi->hss->distance;
+    distance_calculation_method = DIST_METHOD_ICMP;
+  }
 
-    gettimeofday(&now, NULL);
+  if (hsi->cacheTry) {
+    bool verified = distance == hsi->cachedDistance && os_cache_verified(hsi->cachedFP, FP);
 
-    if (expectReplies == 0) {
-      timeToSleep = TIMEVAL_SUBTRACT(stime, now);
-    } else {
-      timeToSleep = 0;
+    if (o.debugging)
+      log_write(LOG_PLAIN, "%s %s its cached OS detection result\n",
+                hsi->target->targetipstr(), verified ? "matches" : "no longer matches");
+    delete FP;
+    FP = hsi->cachedFP;
+    hsi->cachedFP = NULL;
+    if (!verified) {
+      delete FP;
+      startTry(HOS, hsi);
+      return false;
     }
+  }
+
+  hsi->FPs[roundNum] = FP;
+  hsi->FPR->FPs[roundNum] = hsi->FPs[roundNum];
+  hsi->FPR->numFPs = roundNum + 1;
+  double tr = hsi->hss->timingRatio();
+  hsi->target->FPR->maxTimingRatio = MAX(hsi->target->FPR->maxTimingRatio, tr);
 
-  } while (numProbesLeft > 0);
+  hsi->target->distance = hsi->target->FPR->distance = distance;
+  hsi->target->distance_calculation_method = distance_calculation_method;
+  hsi->target->FPR->distance_guess = hsi->hss->distance_guess;
 
+  hsi->phase = OS_PHASE_MATCH;
+  return true;
 }
 
 
-/* TCP, UDP, ICMP Tests */
-static void doTUITests(OsScanInfo *OSI, HostOsScan *HOS) {
-  std::list<HostOsScanInfo *>::iterator hostI;
-  HostOsScanInfo *hsi = NULL;
-  HostOsScanStats *hss = NULL;
-  unsigned int unableToSend; /* # of times in a row that hosts were unable to send probe */
-  unsigned int expectReplies;
-  long to_usec;
-  int timeToSleep = 0;
+/* A fingerprint to match against o.reference_FPs. If it has a perfect match
+ * and perfectFPR isn't NULL, it is matched into that one as well. */
+struct OSMatchJob {
+  HostOsScanInfo *hsi;
+  const FingerPrint *FP;
+  FingerPrintResultsIPv4 *FPR;
+  FingerPrintResultsIPv4 *perfectFPR;
+};
 
-  struct ip *ip = NULL;
-  struct link_header linkhdr;
-  struct sockaddr_storage ss;
-  unsigned int bytes;
-  struct timeval rcvdtime;
+static void runMatchJob(const OSMatchJob *job) {
+  match_fingerprint(job->FP, job->FPR, o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+  if (job->perfectFPR != NULL && job->FPR->overall_results == OSSCAN_SUCCESS &&
+      job->FPR->num_perfect_matches > 0) {
+    match_fingerprint(job->FP, job->perfectFPR, o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+  }
+}
 
-  struct timeval stime, tmptv;
+#if HAVE_PTHREAD
+/* Matches fingerprints on a pool of threads while the scan loop goes on
+ * sending and receiving probes. The threads only read o.reference_FPs, and
+ * each job writes only to its own results. */
+class OSMatchWorkers {
+public:
+  OSMatchWorkers(int nthreads);
+  ~OSMatchWorkers();
+  void submit(const OSMatchJob &job);
+  /* Moves the hosts of the finished jobs to finished. If wait is true, it
+   * first waits for all the submitted jobs to finish. */
+  void collect(std::list<HostOsScanInfo *> &finished, bool wait);
+  bool ok() { return !threads.empty(); }
+
+private:
+  static void *work(void *arg);
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;      /* Signaled when a job is submitted */
+  pthread_cond_t doneCond;  /* Signaled when a job is finished */
+  std::list<OSMatchJob> todo, done;
+  std::vector<pthread_t> threads;
+  bool stopping;
+  int outstanding; /* Submitted and not yet collected */
+};
 
-  bool timedout = false;
-  bool thisHostGood;
-  bool foundgood;
-  bool goodResponse;
-  int numProbesLeft = 0;
+OSMatchWorkers::OSMatchWorkers(int nthreads) {
+  pthread_t thread;
+  int i;
 
-  memset(&stime, 0, sizeof(stime));
-  memset(&tmptv, 0, sizeof(tmptv));
+  stopping = false;
+  outstanding = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+  pthread_cond_init(&doneCond, NULL);
 
-  for (hostI = OSI->incompleteHosts.begin();
-      hostI != OSI->incompleteHosts.end(); hostI++) {
-    hsi = *hostI;
-    hss = hsi->hss;
-    HOS->buildTUIProbeList(hss);
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&thread, NULL, work, this) != 0)
+      break;
+    threads.push_back(thread);
   }
+}
 
-  do {
+OSMatchWorkers::~OSMatchWorkers() {
+  std::vector<pthread_t>::iterator it;
 
-    if (timeToSleep > 0) {
-      if (o.debugging > 1) {
-        log_write(LOG_PLAIN, "Time to sleep %d. Sleeping. \n", timeToSleep);
-      }
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  for (it = threads.begin(); it != threads.end(); it++)
+    pthread_join(*it, NULL);
 
-      usleep(timeToSleep);
-    }
+  pthread_cond_destroy(&doneCond);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
 
-    gettimeofday(&now, NULL);
-    expectReplies = 0;
-    unableToSend = 0;
+void OSMatchWorkers::submit(const OSMatchJob &job) {
+  pthread_mutex_lock(&lock);
+  todo.push_back(job);
+  outstanding++;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
 
-    if (o.debugging > 2) {
-      for (hostI = OSI->incompleteHosts.begin();
-          hostI != OSI->incompleteHosts.end(); hostI++) {
-        hss = (*hostI)->hss;
-        log_write(LOG_PLAIN, "Host %s. ProbesToSend %d: \tProbesActive %d\n",
-                  hss->target->targetipstr(), hss->numProbesToSend(),
-                  hss->numProbesActive());
-      }
-    }
+void OSMatchWorkers::collect(std::list<HostOsScanInfo *> &finished, bool wait) {
+  pthread_mutex_lock(&lock);
+  while (wait && (int) done.size() < outstanding)
+    pthread_cond_wait(&doneCond, &lock);
+  while (!done.empty()) {
+    finished.push_back(done.front().hsi);
+    done.pop_front();
+    outstanding--;
+  }
+  pthread_mutex_unlock(&lock);
+}
 
-    while (unableToSend < OSI->numIncompleteHosts() && HOS->stats->sendOK()) {
-      hsi = OSI->nextIncompleteHost();
-      hss = hsi->hss;
-      gettimeofday(&now, NULL);
-      if (hss->numProbesToSend()>0 && HOS->hostSendOK(hss, NULL)) {
-        HOS->sendNextProbe(hss);
-        expectReplies++;
-        unableToSend = 0;
-      } else {
-        unableToSend++;
-      }
-    }
+void *OSMatchWorkers::work(void *arg) {
+  OSMatchWorkers *workers = (OSMatchWorkers *) arg;
+  OSMatchJob job;
 
-    HOS->stats->num_probes_sent_at_last_wait = HOS->stats->num_probes_sent;
+  pthread_mutex_lock(&workers->lock);
+  for (;;) {
+    while (workers->todo.empty() && !workers->stopping)
+      pthread_cond_wait(&workers->cond, &workers->lock);
+    if (workers->stopping)
+      break;
+    job = workers->todo.front();
+    workers->todo.pop_front();
+    pthread_mutex_unlock(&workers->lock);
 
-    gettimeofday(&now, NULL);
+    runMatchJob(&job);
 
-    /* Count the pcap wait time. */
-    if (!HOS->stats->sendOK()) {
-      TIMEVAL_MSEC_ADD(stime, now, 1000);
+    pthread_mutex_lock(&workers->lock);
+    workers->done.push_back(job);
+    pthread_cond_signal(&workers->doneCond);
+  }
+  pthread_mutex_unlock(&workers->lock);
 
-      for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end();
-          hostI++) {
-        if (HOS->nextTimeout((*hostI)->hss, &tmptv)) {
-          if (TIMEVAL_SUBTRACT(tmptv, stime) < 0)
-            stime = tmptv;
-        }
-      }
-    }
-    else {
-      foundgood = false;
-      for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
-        thisHostGood = HOS->hostSendOK((*hostI)->hss, &tmptv);
-        if (thisHostGood) {
-          stime = tmptv;
-          foundgood = true;
-          break;
-        }
+  return NULL;
+}
 
-        if (!foundgood || TIMEVAL_SUBTRACT(tmptv, stime) < 0) {
-          stime = tmptv;
-          foundgood = true;
-        }
-      }
-    }
+/* Starts the threads that match fingerprints for an IPv4 OS scan, or
+ * returns NULL if matching should simply be done in the scan loop: on
+ * single-CPU machines, or when there is only one host. */
+static OSMatchWorkers *start_match_workers(OsScanInfo *OSI) {
+  OSMatchWorkers *workers;
+  long ncpus;
 
-    do {
-      to_usec = TIMEVAL_SUBTRACT(stime, now);
-      if (to_usec < 2000) to_usec = 2000;
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus < 2 || OSI->numWaitingHosts() < 2)
+    return NULL;
 
-      if (o.debugging > 2)
-        log_write(LOG_PLAIN, "pcap wait time is %ld.\n", to_usec);
+  /* match_fingerprint compiles a DB that hasn't been on first use, which
+     isn't safe to do from the threads. */
+  if (!o.reference_FPs->isCompiled())
+    o.reference_FPs->compile();
 
-      ip = (struct ip*) readipv4_pcap(HOS->pd, &bytes, to_usec, &rcvdtime, &linkhdr, true);
+  workers = new OSMatchWorkers(MIN(ncpus - 1, OS_MAX_MATCH_THREADS));
+  if (!workers->ok()) {
+    delete workers;
+    return NULL;
+  }
+  if (o.debugging)
+    log_write(LOG_PLAIN, "Matching OS fingerprints on %d threads\n", (int) MIN(ncpus - 1, OS_MAX_MATCH_THREADS));
 
-      gettimeofday(&now, NULL);
+  return workers;
+}
+#else
+/* Without threads every match is made in the scan loop. */
+class OSMatchWorkers {
+public:
+  void submit(const OSMatchJob &job) {}
+  void collect(std::list<HostOsScanInfo *> &finished, bool wait) {}
+};
 
-      if (!ip && TIMEVAL_SUBTRACT(stime, now) < 0) {
-        timedout = true;
-        break;
-      } else if (!ip) {
-        continue;
-      }
+static OSMatchWorkers *start_match_workers(OsScanInfo *OSI) {
+  return NULL;
+}
+#endif
 
-      if (TIMEVAL_SUBTRACT(now, stime) > 200000) {
-        /* While packets are still being received, I'll be generous and give
-           an extra 1/5 sec.  But we have to draw the line somewhere */
-        timedout = true;
-      }
 
-      if (bytes < (4 * ip->ip_hl) + 4U)
-        continue;
+/* Matches a fingerprint, on the match threads if there are any. Otherwise
+ * the match is made right away and the host added to matched. */
+static void submitMatch(OSMatchWorkers *workers, const OSMatchJob &job,
+                        std::list<HostOsScanInfo *> &matched) {
+  if (workers != NULL) {
+    workers->submit(job);
+  } else {
+    runMatchJob(&job);
+    matched.push_back(job.hsi);
+  }
+}
 
-      memset(&ss, 0, sizeof(ss));
-      ((struct sockaddr_in *) &ss)->sin_addr.s_addr = ip->ip_src.s_addr;
-      ss.ss_family = AF_INET;
-      hsi = OSI->findIncompleteHost(&ss);
-      if (!hsi)
-        continue; /* Not from one of our targets. */
-      setTargetMACIfAvailable(hsi->target, &linkhdr, &ss, 0);
 
-      goodResponse = HOS->processResp(hsi->hss, ip, bytes, &rcvdtime);
+/* Matches the fingerprint of the try a host has just finished. */
+static void matchTry(OSMatchWorkers *workers, HostOsScanInfo *hsi,
+                     std::list<HostOsScanInfo *> &matched) {
+  OSMatchJob job;
 
-      if (goodResponse)
-        expectReplies--;
+  job.hsi = hsi;
+  job.FP = hsi->FPs[hsi->tryno];
+  job.FPR = &hsi->FP_matches[hsi->tryno];
+  job.perfectFPR = hsi->FPR;
+  submitMatch(workers, job, matched);
+}
 
-    } while (!timedout && expectReplies > 0);
 
-    /* Remove any timeout hosts during the scan. */
-    OSI->removeCompletedHosts();
+/* Acts on the match of a host's try. If there is a perfect match the host
+ * is completed; otherwise it waits for its next try. Returns true if the
+ * host has had all the tries it is going to get without matching. */
+static bool finishTry(HostOsScanInfo *hsi) {
+  int roundNum = hsi->tryno;
+  int max_tries;
 
-    numProbesLeft = 0;
-    for (hostI = OSI->incompleteHosts.begin();
-        hostI != OSI->incompleteHosts.end(); hostI++) {
-      hss = (*hostI)->hss;
-      HOS->updateActiveTUIProbes(hss);
-      numProbesLeft += hss->numProbesToSend();
-      numProbesLeft += hss->numProbesActive();
+  hsi->phase = OS_PHASE_WAIT;
+  if (hsi->FP_matches[roundNum].overall_results == OSSCAN_SUCCESS &&
+      hsi->FP_matches[roundNum].num_perfect_matches > 0) {
+    /* A cache verification try has no sequence results of its own. */
+    if (hsi->cacheTry)
+      memcpy(&(hsi->target->seq), &hsi->cachedSeq, sizeof(struct seq_info));
+    else
+      memcpy(&(hsi->target->seq), &hsi->hss->si, sizeof(struct seq_info));
+    if (roundNum > 0) {
+      if (o.verbose)
+        log_write(LOG_STDOUT, "WARNING: OS didn't match until try #%d\n", roundNum + 1);
     }
+    hsi->isCompleted = true;
+    if (o.osscan_cache)
+      record_os_cache(hsi->target, hsi->FPs[roundNum]);
+    return false;
+  }
 
-    gettimeofday(&now, NULL);
+  if (hsi->cacheTry) {
+    /* The cached fingerprint no longer has a perfect match (nmap-os-db may
+       have changed). Forget it and start over with a full try. Like the
+       rest of FP_matches, the try's results start out zeroed. */
+    memset((void *) &hsi->FP_matches[roundNum], 0, sizeof(hsi->FP_matches[roundNum]));
+    hsi->FPR->numFPs = 0;
+    hsi->nextTry = now;
+    return false;
+  }
 
-    if (expectReplies == 0) {
-      timeToSleep = TIMEVAL_SUBTRACT(stime, now);
-    } else {
-      timeToSleep = 0;
-    }
+  max_tries = o.maxOSTries(); /* The amt. if print is suitable for submission */
+  if (hsi->target->FPR->OmitSubmissionFP())
+    max_tries = MIN(max_tries, STANDARD_OS2_TRIES);
+  if (hsi->FPR->numFPs >= max_tries)
+    return true;
 
-  } while (numProbesLeft > 0);
+  hsi->tryno++;
+  /* Try waiting a little longer before the fourth try just in case it
+     matters */
+  TIMEVAL_MSEC_ADD(hsi->nextTry, now,
+                   OS_RETRY_DELAY + (hsi->tryno == 3 ? OS_RETRY_EXTRA_DELAY : 0));
+  return false;
 }
 
 
-static void endRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
-  std::list<HostOsScanInfo *>::iterator hostI;
-  HostOsScanInfo *hsi = NULL;
-  int distance = -1;
-  enum dist_calc_method distance_calculation_method = DIST_METHOD_NONE;
-
-  for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI++) {
-    distance = -1;
-    hsi = *hostI;
-    HOS->makeFP(hsi->hss);
-
-    hsi->FPs[roundNum] = hsi->hss->getFP();
-    hsi->FPR->FPs[roundNum] = hsi->FPs[roundNum];
-    hsi->FPR->numFPs = roundNum + 1;
-    double tr = hsi->hss->timingRatio();
-    hsi->target->FPR->maxTimingRatio = MAX(hsi->target->FPR->maxTimingRatio, tr);
-    match_fingerprint(hsi->FPs[roundNum], &hsi->FP_matches[roundNum],
-                      o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
-
-    if (hsi->FP_matches[roundNum].overall_results == OSSCAN_SUCCESS &&
-        hsi->FP_matches[roundNum].num_perfect_matches > 0) {
-      memcpy(&(hsi->target->seq), &hsi->hss->si, sizeof(struct seq_info));
-      if (roundNum > 0) {
-        if (o.verbose)
-          log_write(LOG_STDOUT, "WARNING: OS didn't match until try #%d\n", roundNum + 1);
-      }
-      match_fingerprint(hsi->FPR->FPs[roundNum], hsi->FPR,
-                        o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
-      hsi->isCompleted = true;
-    }
+/* Admits waiting hosts to the scan while there are fewer hosts in it than
+ * the group congestion window, or than OS_MIN_HOSTS_IN_FLIGHT. A host in
+ * flight has few probes outstanding at a time, so the window doubles as a
+ * number of hosts: it grows as replies come in, and after drops it keeps
+ * new hosts out until others have finished. */
+static void admitHosts(OsScanInfo *OSI, HostOsScan *HOS) {
+  HostOsScanInfo *hsi;
 
-    if (islocalhost(hsi->target->TargetSockAddr())) {
-      /* scanning localhost */
-      distance = 0;
-      distance_calculation_method = DIST_METHOD_LOCALHOST;
-    } else if (hsi->target->MACAddress()) {
-      /* on the same network segment */
-      distance = 1;
-      distance_calculation_method = DIST_METHOD_DIRECT;
-    } else if (hsi->hss->distance!=-1) {
-      distance = hsi->hss->distance;
-      distance_calculation_method = DIST_METHOD_ICMP;
-    }
+  while (OSI->numWaitingHosts() > 0
+         && (OSI->numIncompleteHosts() < OS_MIN_HOSTS_IN_FLIGHT
+             || OSI->numIncompleteHosts() < HOS->stats->timing.cwnd)) {
+    hsi = OSI->admitNextHost();
+    if (!hsi->target->timedOut(NULL))
+      hsi->target->startTimeOutClock(&now);
+    startTry(HOS, hsi);
+  }
+}
 
-    hsi->target->distance = hsi->target->FPR->distance = distance;
-    hsi->target->distance_calculation_method = distance_calculation_method;
-    hsi->target->FPR->distance_guess = hsi->hss->distance_guess;
 
+/* Check whether the next probe of the current phase of a host's try can be
+ * sent. If not, fill _when_ with the time when it can and return false. */
+static bool hostTrySendOK(HostOsScan *HOS, HostOsScanInfo *hsi, struct timeval *when) {
+  switch (hsi->phase) {
+  case OS_PHASE_SEQ:
+    return HOS->hostSeqSendOK(hsi->hss, when);
+  case OS_PHASE_TUI:
+    return HOS->hostSendOK(hsi->hss, when);
+  case OS_PHASE_MATCH:
+    /* Nothing to send until the match is in; check back for it soon. */
+    if (when)
+      TIMEVAL_MSEC_ADD(*when, now, OS_MATCH_POLL_INTERVAL);
+    return false;
+  default:
+    if (when)
+      *when = hsi->nextTry;
+    return false;
   }
-  OSI->removeCompletedHosts();
 }
 
 
-static void findBestFPs(OsScanInfo *OSI) {
+static void findBestFPs(OsScanInfo *OSI, OSMatchWorkers *workers) {
   std::list<HostOsScanInfo *>::iterator hostI;
+  std::list<HostOsScanInfo *> matched;
   HostOsScanInfo *hsi = NULL;
+  OSMatchJob job;
   int i;
 
   double bestacc;
@@ -817,9 +999,15 @@ static void findBestFPs(OsScanInfo *OSI) {
     // Now we redo the match, since target->FPR has various data (such as
     // target->FPR->numFPs) which is not in FP_matches[bestaccidx].  This is
     // kinda ugly.
-    match_fingerprint(hsi->FPR->FPs[bestaccidx], (FingerPrintResultsIPv4 *) hsi->target->FPR,
-                      o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+    job.hsi = hsi;
+    job.FP = hsi->FPR->FPs[bestaccidx];
+    job.FPR = (FingerPrintResultsIPv4 *) hsi->target->FPR;
+    job.perfectFPR = NULL;
+    submitMatch(workers, job, matched);
   }
+
+  if (workers != NULL)
+    workers->collect(matched, true);
 }
 
 
@@ -845,40 +1033,6 @@ static void printFP(OsScanInfo *OSI) {
 }
 
 
-/* Goes through every unmatched host in OSI.  If a host has completed
-   the maximum number of OS detection tries allowed for it without
-   matching, it is transferred to the passed in unMatchedHosts list.
-   Returns the number of hosts moved to unMatchedHosts. */
-static int expireUnmatchedHosts(OsScanInfo *OSI, std::list<HostOsScanInfo *> *unMatchedHosts) {
-  std::list<HostOsScanInfo *>::iterator hostI, nextHost;
-  int hostsRemoved = 0;
-  HostOsScanInfo *HOS;
-
-  gettimeofday(&now, NULL);
-  for (hostI = OSI->incompleteHosts.begin(); hostI != OSI->incompleteHosts.end(); hostI = nextHost) {
-    HOS = *hostI;
-    nextHost = hostI;
-    nextHost++;
-
-    int max_tries = o.maxOSTries(); /* The amt. if print is suitable for submission */
-    if (HOS->target->FPR->OmitSubmissionFP())
-      max_tries = MIN(max_tries, STANDARD_OS2_TRIES);
-
-    if (HOS->FPR->numFPs >= max_tries) {
-      /* We've done all the OS2 tries we're going to do ... move this
-     to unMatchedHosts */
-      HOS->target->stopTimeOutClock(&now);
-      OSI->incompleteHosts.erase(hostI);
-      /* We need to adjust nextI if necessary */
-      OSI->resetHostIterator();
-      hostsRemoved++;
-      unMatchedHosts->push_back(HOS);
-    }
-  }
-  return hostsRemoved;
-}
-
-
 /******************************************************************************
  * Implementation of class OFProbe                                            *
  ******************************************************************************/
@@ -945,8 +1099,13 @@ HostOsScanStats::HostOsScanStats(Target * t) {
   timing.num_updates = 0;
   gettimeofday(&timing.last_drop, NULL);
 
-  for (i = 0; i < NUM_FPTESTS; i++)
+  for (i = 0; i < NUM_FPTESTS; i++) {
     FPtests[i] = NULL;
+    FPtestsSkipped[i] = false;
+  }
+  probesLeftAtSettleCheck = UINT_MAX;
+  for (i = 0; i < NUM_OFPROBE_SLOTS; i++)
+    activeProbeIndex[i] = probesActive.end();
   for (i = 0; i < 6; i++) {
     TOps_AVs[i] = NULL;
     TWin_AVs[i] = NULL;
@@ -1061,7 +1220,11 @@ void HostOsScanStats::initScanStats() {
     if (FPtests[i] != NULL)
       delete FPtests[i];
     FPtests[i] = NULL;
+    FPtestsSkipped[i] = false;
   }
+  probesLeftAtSettleCheck = UINT_MAX;
+  for (i = 0; i < NUM_OFPROBE_SLOTS; i++)
+    activeProbeIndex[i] = probesActive.end();
   for (i = 0; i < 6; i++) {
     if (TOps_AVs[i])
       free(TOps_AVs[i]);
@@ -1092,6 +1255,11 @@ void HostOsScanStats::initScanStats() {
   storedIcmpReply = -1;
 
   memset(&upi, 0, sizeof(upi));
+
+  tcpSeqBase = get_random_u32();
+  tcpAck = get_random_u32();
+  icmpEchoId = get_random_u16();
+  udpttl = (time(NULL) % 14) + 51;
 }
 
 
@@ -1120,9 +1288,53 @@ void HostOsScanStats::addNewProbe(OFProbeType type, int subid) {
 }
 
 
+/* The place of a probe in HostOsScanStats::activeProbeIndex, or -1 for a
+   type and subid no try sends. */
+static int probeSlot(OFProbeType type, int subid) {
+  int base, count;
+
+  switch (type) {
+  case OFP_TSEQ:
+    base = 0;
+    count = NUM_SEQ_SAMPLES;
+    break;
+  case OFP_TOPS:
+    base = NUM_SEQ_SAMPLES;
+    count = 6;
+    break;
+  case OFP_TECN:
+    base = NUM_SEQ_SAMPLES + 6;
+    count = 1;
+    break;
+  case OFP_T1_7:
+    base = NUM_SEQ_SAMPLES + 7;
+    count = 7;
+    break;
+  case OFP_TICMP:
+    base = NUM_SEQ_SAMPLES + 14;
+    count = 2;
+    break;
+  case OFP_TUDP:
+    base = NUM_SEQ_SAMPLES + 16;
+    count = 1;
+    break;
+  default:
+    return -1;
+  }
+  if (subid < 0 || subid >= count)
+    return -1;
+
+  return base + subid;
+}
+
+
 /* Remove a probe from the probesActive. */
 void HostOsScanStats::removeActiveProbe(std::list<OFProbe *>::iterator probeI) {
   OFProbe *probe = *probeI;
+  int slot = probeSlot(probe->type, probe->subid);
+
+  if (slot != -1)
+    activeProbeIndex[slot] = probesActive.end();
   probesActive.erase(probeI);
   delete probe;
 }
@@ -1132,13 +1344,9 @@ void HostOsScanStats::removeActiveProbe(std::list<OFProbe *>::iterator probeI) {
    and subid.  Returns probesActive.end() if there isn't one */
 std::list<OFProbe *>::iterator HostOsScanStats::getActiveProbe(OFProbeType type, int subid) {
   std::list<OFProbe *>::iterator probeI;
-  OFProbe *probe = NULL;
+  int slot = probeSlot(type, subid);
 
-  for (probeI = probesActive.begin(); probeI != probesActive.end(); probeI++) {
-    probe = *probeI;
-    if (probe->type == type && probe->subid == subid)
-      break;
-  }
+  probeI = (slot == -1) ? probesActive.end() : activeProbeIndex[slot];
 
   if (probeI == probesActive.end()) {
     /* not found!? */
@@ -1153,13 +1361,21 @@ std::list<OFProbe *>::iterator HostOsScanStats::getActiveProbe(OFProbeType type,
 
 /* Move a probe from probesToSend to probesActive. */
 void HostOsScanStats::moveProbeToActiveList(std::list<OFProbe *>::iterator probeI) {
+  int slot = probeSlot((*probeI)->type, (*probeI)->subid);
+
   probesActive.push_back(*probeI);
+  if (slot != -1)
+    activeProbeIndex[slot] = --probesActive.end();
   probesToSend.erase(probeI);
 }
 
 
 /* Move a probe from probesActive to probesToSend. */
 void HostOsScanStats::moveProbeToUnSendList(std::list<OFProbe *>::iterator probeI) {
+  int slot = probeSlot((*probeI)->type, (*probeI)->subid);
+
+  if (slot != -1)
+    activeProbeIndex[slot] = probesActive.end();
   probesToSend.push_back(*probeI);
   probesActive.erase(probeI);
 }
@@ -1278,7 +1494,8 @@ HostOsScan::HostOsScan(Target *t) {
 
   tcpPortBase = o.magic_port_set? o.magic_port : o.magic_port + get_random_u8();
   udpPortBase = o.magic_port_set? o.magic_port : o.magic_port + get_random_u8();
-  reInitScanSystem();
+  tcpMss = 265;
+  icmpEchoSeq = 295;
 
   stats = new ScanStats();
 }
@@ -1298,16 +1515,6 @@ HostOsScan::~HostOsScan() {
 }
 
 
-void HostOsScan::reInitScanSystem() {
-  tcpSeqBase = get_random_u32();
-  tcpAck = get_random_u32();
-  tcpMss = 265;
-  icmpEchoId = get_random_u16();
-  icmpEchoSeq = 295;
-  udpttl = (time(NULL) % 14) + 51;
-}
-
-
 /* Initiate seq probe list */
 void HostOsScan::buildSeqProbeList(HostOsScanStats *hss) {
   assert(hss);
@@ -1403,6 +1610,27 @@ void HostOsScan::buildTUIProbeList(HostOsScanStats *hss) {
 }
 
 
+/* Initialize the probe list of a try that only checks a host against its
+ * --osscan-cache entry: the probes for the tests in os_cache_tests. The
+ * other tests are left out of the fingerprint. */
+void HostOsScan::buildVerifyProbeList(HostOsScanStats *hss) {
+  assert(hss);
+  int i;
+
+  for (i = 0; i < NUM_FPTESTS; i++)
+    hss->FPtestsSkipped[i] = true;
+  for (i = 0; i < (int) NELEMS(os_cache_tests); i++)
+    hss->FPtestsSkipped[os_cache_tests[i]] = false;
+
+  /* Same order as buildTUIProbeList. */
+  for (i = 0; i < 2; i++)
+    hss->addNewProbe(OFP_TICMP, i);
+  hss->addNewProbe(OFP_TUDP, 0);
+  for (i = 4; i < 7; i++)
+    hss->addNewProbe(OFP_T1_7, i);
+}
+
+
 /* Update the probes in the active probe list:
  * 1) Remove the expired probes (timedout and reached the retry limit);
  * 2) Move timedout probes to probeNeedToSend; */
@@ -1653,7 +1881,7 @@ void HostOsScan::sendTSeqProbe(HostOsScanStats *hss, int probeNo) {
 
   send_tcp_probe(hss, o.ttl, false, NULL, 0,
                  tcpPortBase + probeNo, hss->openTCPPort,
-                 tcpSeqBase + probeNo, tcpAck,
+                 hss->tcpSeqBase + probeNo, hss->tcpAck,
                  0, TH_SYN, prbWindowSz[probeNo], 0,
                  prbOpts[probeNo].val, prbOpts[probeNo].len, NULL, 0);
 
@@ -1670,7 +1898,7 @@ void HostOsScan::sendTOpsProbe(HostOsScanStats *hss, int probeNo) {
 
   send_tcp_probe(hss, o.ttl, false, NULL, 0,
                  tcpPortBase + NUM_SEQ_SAMPLES + probeNo, hss->openTCPPort,
-                 tcpSeqBase, tcpAck,
+                 hss->tcpSeqBase, hss->tcpAck,
                  0, TH_SYN, prbWindowSz[probeNo], 0,
                  prbOpts[probeNo].val, prbOpts[probeNo].len, NULL, 0);
 }
@@ -1684,7 +1912,7 @@ void HostOsScan::sendTEcnProbe(HostOsScanStats *hss) {
 
   send_tcp_probe(hss, o.ttl, false, NULL, 0,
                  tcpPortBase + NUM_SEQ_SAMPLES + 6, hss->openTCPPort,
-                 tcpSeqBase, 0,
+                 hss->tcpSeqBase, 0,
                  8, TH_CWR|TH_ECE|TH_SYN, prbWindowSz[6], 63477,
                  prbOpts[6].val, prbOpts[6].len, NULL, 0);
 }
@@ -1705,7 +1933,7 @@ void HostOsScan::sendT1_7Probe(HostOsScanStats *hss, int probeNo) {
       return;
     send_tcp_probe(hss, o.ttl, false, NULL, 0,
                    port_base, hss->openTCPPort,
-                   tcpSeqBase, tcpAck,
+                   hss->tcpSeqBase, hss->tcpAck,
                    0, TH_SYN, prbWindowSz[0], 0,
                    prbOpts[0].val, prbOpts[0].len, NULL, 0);
     break;
@@ -1714,7 +1942,7 @@ void HostOsScan::sendT1_7Probe(HostOsScanStats *hss, int probeNo) {
       return;
     send_tcp_probe(hss, o.ttl, true, NULL, 0,
                    port_base + 1, hss->openTCPPort,
-                   tcpSeqBase, tcpAck,
+                   hss->tcpSeqBase, hss->tcpAck,
                    0, 0, prbWindowSz[7], 0,
                    prbOpts[7].val, prbOpts[7].len, NULL, 0);
     break;
@@ -1723,7 +1951,7 @@ void HostOsScan::sendT1_7Probe(HostOsScanStats *hss, int probeNo) {
       return;
     send_tcp_probe(hss, o.ttl, false, NULL, 0,
                    port_base + 2, hss->openTCPPort,
-                   tcpSeqBase, tcpAck,
+                   hss->tcpSeqBase, hss->tcpAck,
                    0, TH_SYN|TH_FIN|TH_URG|TH_PUSH, prbWindowSz[8], 0,
                    prbOpts[8].val, prbOpts[8].len, NULL, 0);
     break;
@@ -1732,7 +1960,7 @@ void HostOsScan::sendT1_7Probe(HostOsScanStats *hss, int probeNo) {
       return;
     send_tcp_probe(hss, o.ttl, true, NULL, 0,
                    port_base + 3, hss->openTCPPort,
-                   tcpSeqBase, tcpAck,
+                   hss->tcpSeqBase, hss->tcpAck,
                    0, TH_ACK, prbWindowSz[9], 0,
                    prbOpts[9].val, prbOpts[9].len, NULL, 0);
     break;
@@ -1741,7 +1969,7 @@ void HostOsScan::sendT1_7Probe(HostOsScanStats *hss, int probeNo) {
       return;
     send_tcp_probe(hss, o.ttl, false, NULL, 0,
                    port_base + 4, hss->closedTCPPort,
-                   tcpSeqBase, tcpAck,
+                   hss->tcpSeqBase, hss->tcpAck,
                    0, TH_SYN, prbWindowSz[10], 0,
                    prbOpts[10].val, prbOpts[10].len, NULL, 0);
     break;
@@ -1750,7 +1978,7 @@ void HostOsScan::sendT1_7Probe(HostOsScanStats *hss, int probeNo) {
       return;
     send_tcp_probe(hss, o.ttl, true, NULL, 0,
                    port_base + 5, hss->closedTCPPort,
-                   tcpSeqBase, tcpAck,
+                   hss->tcpSeqBase, hss->tcpAck,
                    0, TH_ACK, prbWindowSz[11], 0,
                    prbOpts[11].val, prbOpts[11].len, NULL, 0);
     break;
@@ -1759,7 +1987,7 @@ void HostOsScan::sendT1_7Probe(HostOsScanStats *hss, int probeNo) {
       return;
     send_tcp_probe(hss, o.ttl, false, NULL, 0,
                    port_base + 6, hss->closedTCPPort,
-                   tcpSeqBase, tcpAck,
+                   hss->tcpSeqBase, hss->tcpAck,
                    0, TH_FIN|TH_PUSH|TH_URG, prbWindowSz[12], 0,
                    prbOpts[12].val, prbOpts[12].len, NULL, 0);
   }
@@ -1771,11 +1999,11 @@ void HostOsScan::sendTIcmpProbe(HostOsScanStats *hss, int probeNo) {
   assert(probeNo >= 0 && probeNo < 2);
   if (probeNo == 0) {
     send_icmp_echo_probe(hss, IP_TOS_DEFAULT,
-                         true, 9, icmpEchoId, icmpEchoSeq, 120);
+                         true, 9, hss->icmpEchoId, icmpEchoSeq, 120);
   }
   else {
     send_icmp_echo_probe(hss, IP_TOS_RELIABILITY,
-                         false, 0, icmpEchoId + 1, icmpEchoSeq + 1, 150);
+                         false, 0, hss->icmpEchoId + 1, icmpEchoSeq + 1, 150);
   }
 }
 
@@ -1784,7 +2012,7 @@ void HostOsScan::sendTUdpProbe(HostOsScanStats *hss, int probeNo) {
   assert(hss);
   if (hss->closedUDPPort == -1)
     return;
-  send_closedudp_probe(hss, udpttl, udpPortBase + probeNo, hss->closedUDPPort);
+  send_closedudp_probe(hss, hss->udpttl, udpPortBase + probeNo, hss->closedUDPPort);
 }
 
 
@@ -1871,7 +2099,7 @@ bool HostOsScan::processResp(HostOsScanStats *hss, struct ip *ip, unsigned int l
 
     /* Is it an icmp echo reply? */
     if (icmp->icmp_type == ICMP_ECHOREPLY) {
-      testno = ntohs(icmp->icmp_id) - icmpEchoId;
+      testno = ntohs(icmp->icmp_id) - hss->icmpEchoId;
       if (testno == 0 || testno == 1) {
         isPktUseful = processTIcmpResp(hss, ip, testno);
         if (isPktUseful) {
@@ -1945,7 +2173,7 @@ void HostOsScan::makeFP(HostOsScanStats *hss) {
     makeTWinFP(hss);
 
   for (i = 3; i < NUM_FPTESTS; i++) {
-    if (!hss->FPtests[i] &&
+    if (!hss->FPtests[i] && !hss->FPtestsSkipped[i] &&
         ((i >= 3 && i <= 7 && hss->openTCPPort != -1) ||
          (i >= 8 && i <= 10 && hss->target->FPR->osscan_closedtcpport != -1) ||
          i >= 11)) {
@@ -1956,7 +2184,7 @@ void HostOsScan::makeFP(HostOsScanStats *hss) {
       AV.attribute = "R";
       AV.value = "N";
       hss->FPtests[i]->results.push_back(AV);
-      hss->FPtests[i]->name =  (i == 3)? "ECN" : (i == 4)? "T1" : (i == 5)? "T2" : (i == 6)? "T3" : (i == 7)? "T4" : (i == 8)? "T5" : (i == 9)? "T6" : (i == 10)? "T7" : (i == 11)? "U1" : "IE";
+      hss->FPtests[i]->name = fp_test_names[i];
     }
     else if (hss->FPtests[i]) {
       /* Replace TTL with initial TTL. */
@@ -1997,6 +2225,107 @@ void HostOsScan::makeFP(HostOsScanStats *hss) {
 }
 
 
+/* The tests of FPtests whose results come from a probe of this type. */
+static void probe_tests(const OFProbe *probe, bool tests[NUM_FPTESTS]) {
+  switch (probe->type) {
+  case OFP_TSEQ:
+    tests[0] = true;
+    break;
+  case OFP_TOPS:
+    tests[1] = tests[2] = true;
+    break;
+  case OFP_TECN:
+    tests[3] = true;
+    break;
+  case OFP_T1_7:
+    tests[FP_T1_7_OFF + probe->subid] = true;
+    break;
+  case OFP_TUDP:
+    tests[11] = true;
+    break;
+  case OFP_TICMP:
+    tests[12] = true;
+    break;
+  default:
+    break;
+  }
+}
+
+
+/* Builds the fingerprint of the TUI tests done so far and checks it against
+ * the reference DB. The SEQ line and the TTLs can still change with the
+ * remaining replies, so they count as pending along with the tests whose
+ * probes are still out. */
+bool HostOsScan::tuiIsSettled(HostOsScanStats *hss) {
+  std::list<OFProbe *>::iterator probeI;
+  std::vector<std::string> pending;
+  bool waiting[NUM_FPTESTS];
+  FingerPrint FP;
+  FingerTest noResp;
+  struct AVal AV;
+  unsigned int left;
+  int i;
+
+  left = hss->numProbesToSend() + hss->numProbesActive();
+  if (left == 0 || left >= hss->probesLeftAtSettleCheck)
+    return false;
+  hss->probesLeftAtSettleCheck = left;
+
+  memset(waiting, 0, sizeof(waiting));
+  for (probeI = hss->probesToSend.begin(); probeI != hss->probesToSend.end(); probeI++)
+    probe_tests(*probeI, waiting);
+  for (probeI = hss->probesActive.begin(); probeI != hss->probesActive.end(); probeI++)
+    probe_tests(*probeI, waiting);
+
+  pending.push_back("SEQ.*");
+  pending.push_back("*.T");
+  pending.push_back("*.TG");
+  AV.attribute = "R";
+  AV.value = "N";
+  noResp.results.push_back(AV);
+  for (i = 1; i < NUM_FPTESTS; i++) {
+    if (waiting[i]) {
+      pending.push_back(std::string(fp_test_names[i]) + ".*");
+    } else if (hss->FPtests[i]) {
+      FP.tests.push_back(*hss->FPtests[i]);
+    } else if ((i >= 3 && i <= 7 && hss->openTCPPort != -1) ||
+               (i >= 8 && i <= 10 && hss->target->FPR->osscan_closedtcpport != -1) ||
+               i >= 11) {
+      /* makeFP will record that there was no response. */
+      noResp.name = fp_test_names[i];
+      FP.tests.push_back(noResp);
+    }
+  }
+
+  return fingerprint_match_is_settled(&FP, o.reference_FPs, pending, OSSCAN_GUESS_THRESHOLD);
+}
+
+
+void HostOsScan::dropProbes(HostOsScanStats *hss) {
+  std::list<OFProbe *>::iterator probeI;
+  bool tests[NUM_FPTESTS];
+  int i;
+
+  memset(tests, 0, sizeof(tests));
+  while (!hss->probesToSend.empty()) {
+    probe_tests(hss->probesToSend.front(), tests);
+    delete hss->probesToSend.front();
+    hss->probesToSend.pop_front();
+  }
+  while (!hss->probesActive.empty()) {
+    probeI = hss->probesActive.begin();
+    probe_tests(*probeI, tests);
+    hss->removeActiveProbe(probeI);
+    assert(stats->num_probes_active > 0);
+    stats->num_probes_active--;
+  }
+  for (i = 0; i < NUM_FPTESTS; i++) {
+    if (tests[i] && !hss->FPtests[i])
+      hss->FPtestsSkipped[i] = true;
+  }
+}
+
+
 /* Send a TCP probe. This takes care of decoys and filling in Ethernet
  * addresses if necessary. Used for the SEQ, OPS, WIN, ECN, and T1-T7 probes. */
 int HostOsScan::send_tcp_probe(HostOsScanStats *hss,
@@ -2553,7 +2882,7 @@ bool HostOsScan::processTSeqResp(HostOsScanStats *hss, struct ip *ip, int replyN
     /*  error("DEBUG: response is SYN|ACK to port %hu\n", ntohs(tcp->th_dport)); */
     /*readtcppacket((char *)ip, ntohs(ip->ip_len));*/
     /* We use the ACK value to match up our sent with rcv'd packets */
-    seq_response_num = ntohl(tcp->th_ack) - tcpSeqBase - 1;
+    seq_response_num = ntohl(tcp->th_ack) - hss->tcpSeqBase - 1;
     /* printf("seq_response_num = %d\treplyNo = %d\n", seq_response_num, replyNo); */
 
     if (seq_response_num != replyNo) {
@@ -2563,7 +2892,7 @@ bool HostOsScan::processTSeqResp(HostOsScanStats *hss, struct ip *ip, int replyN
               hss->target->targetipstr());
         error("Received ack: %lX; sequence sent: %lX. Packet:",
               (unsigned long) ntohl(tcp->th_ack),
-              (unsigned long) tcpSeqBase);
+              (unsigned long) hss->tcpSeqBase);
         readtcppacket((unsigned char *)ip, ntohs(ip->ip_len));
       }
       seq_response_num = replyNo;
@@ -2824,9 +3153,9 @@ bool HostOsScan::processT1_7Resp(HostOsScanStats *hss, struct ip *ip, int replyN
   AV.attribute = "S";
   if (ntohl(tcp->th_seq) == 0)
     AV.value = "Z";
-  else if (ntohl(tcp->th_seq) == tcpAck)
+  else if (ntohl(tcp->th_seq) == hss->tcpAck)
     AV.value = "A";
-  else if (ntohl(tcp->th_seq) == tcpAck + 1)
+  else if (ntohl(tcp->th_seq) == hss->tcpAck + 1)
     AV.value = "A+";
   else
     AV.value = "O";
@@ -2841,9 +3170,9 @@ bool HostOsScan::processT1_7Resp(HostOsScanStats *hss, struct ip *ip, int replyN
   AV.attribute = "A";
   if (ntohl(tcp->th_ack) == 0)
     AV.value = "Z";
-  else if (ntohl(tcp->th_ack) == tcpSeqBase)
+  else if (ntohl(tcp->th_ack) == hss->tcpSeqBase)
     AV.value = "S";
-  else if (ntohl(tcp->th_ack) == tcpSeqBase + 1)
+  else if (ntohl(tcp->th_ack) == hss->tcpSeqBase + 1)
     AV.value = "S+";
   else
     AV.value = "O";
@@ -3081,7 +3410,7 @@ bool HostOsScan::processTUdpResp(HostOsScanStats *hss, struct ip *ip) {
 
   /* Count hop count */
   if (hss->distance == -1) {
-    hss->distance = this->udpttl - ip2->ip_ttl + 1;
+    hss->distance = hss->udpttl - ip2->ip_ttl + 1;
   }
 
   return true;
@@ -3291,6 +3620,13 @@ HostOsScanInfo::HostOsScanInfo(Target *t, OsScanInfo *OsSI) {
   FP_matches = (FingerPrintResultsIPv4 *) safe_zalloc(o.maxOSTries() * sizeof(FingerPrintResultsIPv4));
   timedOut = false;
   isCompleted = false;
+  tryno = 0;
+  phase = OS_PHASE_WAIT;
+  memset(&nextTry, 0, sizeof(nextTry));
+  cachedFP = NULL;
+  cachedDistance = -1;
+  cacheChecked = false;
+  cacheTry = false;
 
   if (target->FPR == NULL) {
     this->FPR = new FingerPrintResultsIPv4;
@@ -3304,6 +3640,8 @@ HostOsScanInfo::HostOsScanInfo(Target *t, OsScanInfo *OsSI) {
 
 HostOsScanInfo::~HostOsScanInfo() {
   delete hss;
+  if (cachedFP != NULL)
+    delete cachedFP;
   free(FPs);
   free(FP_matches);
 }
@@ -3352,7 +3690,7 @@ OsScanInfo::OsScanInfo(std::vector<Target *> &Targets) {
     }
 
     hsi = new HostOsScanInfo(Targets[targetno], this);
-    incompleteHosts.push_back(hsi);
+    waitingHosts.push_back(hsi);
     numInitialTargets++;
   }
 
@@ -3366,23 +3704,80 @@ OsScanInfo::~OsScanInfo()
     delete incompleteHosts.front();
     incompleteHosts.pop_front();
   }
+  while (!waitingHosts.empty()) {
+    delete waitingHosts.front();
+    waitingHosts.pop_front();
+  }
+}
+
+
+HostOsScanInfo *OsScanInfo::admitNextHost() {
+  HostOsScanInfo *hsi;
+
+  if (waitingHosts.empty())
+    return NULL;
+
+  hsi = waitingHosts.front();
+  waitingHosts.pop_front();
+  incompleteHosts.push_back(hsi);
+  incompleteByAddr.insert(std::make_pair(hsi->target->v4hostip()->s_addr, hsi));
+  /* nextI is meaningless while the list is empty. */
+  if (incompleteHosts.size() == 1)
+    nextI = incompleteHosts.begin();
+
+  return hsi;
 }
 
 
 /* Find a HostScanStats by IP its address in the incomplete list.  Returns NULL if
    none are found. */
 HostOsScanInfo *OsScanInfo::findIncompleteHost(struct sockaddr_storage *ss) {
-  std::list<HostOsScanInfo *>::iterator hostI;
+  std::map<u32, HostOsScanInfo *>::iterator hostI;
   struct sockaddr_in *sin = (struct sockaddr_in *) ss;
 
   if (sin->sin_family != AF_INET)
     fatal("%s passed a non IPv4 address", __func__);
 
+  hostI = incompleteByAddr.find(sin->sin_addr.s_addr);
+  if (hostI == incompleteByAddr.end())
+    return NULL;
+  return hostI->second;
+}
+
+
+/* Drops a host that has left incompleteHosts from incompleteByAddr. If
+   the group has another host with the same address, that one takes its
+   place. */
+void OsScanInfo::unindexHost(HostOsScanInfo *hsi) {
+  std::list<HostOsScanInfo *>::iterator hostI;
+  u32 addr = hsi->target->v4hostip()->s_addr;
+
+  if (incompleteByAddr[addr] != hsi)
+    return;
+  incompleteByAddr.erase(addr);
   for (hostI = incompleteHosts.begin(); hostI != incompleteHosts.end(); hostI++) {
-    if ((*hostI)->target->v4hostip()->s_addr == sin->sin_addr.s_addr)
-      return *hostI;
+    if ((*hostI)->target->v4hostip()->s_addr == addr) {
+      incompleteByAddr[addr] = *hostI;
+      break;
+    }
   }
-  return NULL;
+}
+
+
+void OsScanInfo::removeIncompleteHost(HostOsScanInfo *hsi) {
+  incompleteHosts.remove(hsi);
+  unindexHost(hsi);
+  resetHostIterator();
+}
+
+
+void OsScanInfo::restoreIncompleteHosts(std::list<HostOsScanInfo *> &hosts) {
+  std::list<HostOsScanInfo *>::iterator hostI;
+
+  for (hostI = hosts.begin(); hostI != hosts.end(); hostI++)
+    incompleteByAddr.insert(std::make_pair((*hostI)->target->v4hostip()->s_addr, *hostI));
+  incompleteHosts.splice(incompleteHosts.begin(), hosts);
+  resetHostIterator();
 }
 
 
@@ -3418,6 +3813,10 @@ int OsScanInfo::removeCompletedHosts() {
     nxt = hostI;
     nxt++;
     hsi = *hostI;
+    /* The host may be in use by a match thread; it is looked at again once
+       the match is in, which doesn't take long. */
+    if (hsi->phase == OS_PHASE_MATCH)
+      continue;
     timedout = hsi->target->timedOut(&now);
     if (hsi->isCompleted || timedout) {
       /* A host to remove!  First adjust nextI appropriately */
@@ -3428,7 +3827,7 @@ int OsScanInfo::removeCompletedHosts() {
       }
 
       if (o.verbose && numInitialTargets > 50) {
-        int remain = incompleteHosts.size() - 1;
+        int remain = incompleteHosts.size() - 1 + waitingHosts.size();
         if (remain && !timedout)
           log_write(LOG_STDOUT, "Completed os scan against %s in %.3fs (%d %s)\n",
                     hsi->target->targetipstr(),
@@ -3440,6 +3839,7 @@ int OsScanInfo::removeCompletedHosts() {
                     (remain == 1)? "host left" : "hosts left");
       }
       incompleteHosts.erase(hostI);
+      unindexHost(hsi);
       hostsRemoved++;
       hsi->target->stopTimeOutClock(&now);
       delete hsi;
@@ -3469,52 +3869,43 @@ void OSScan::reset() {
 }
 
 
-/* This function takes a group of targets and divides it in chunks if there are
- * too many to be processed at the same time. The threshold is based on Nmap's
- * timing level (when timing level is above 4, no chunking is performed).
- * The reason targets are processed in smaller groups is to improve accuracy. */
-int OSScan::chunk_and_do_scan(std::vector<Target *> &Targets, int family) {
-  unsigned int max_os_group_sz = 20;
-  double fudgeratio = 1.2; /* Allow a slightly larger final group rather than finish with a tiny one */
-  std::vector<Target *> tmpTargets;
-  unsigned int startidx = 0;
-
-  if (o.timing_level == 4)
-    max_os_group_sz = (unsigned int) (max_os_group_sz * 1.5);
-
-  if (o.timing_level > 4 || Targets.size() <= max_os_group_sz * fudgeratio) {
-    if (family == AF_INET6)
-      os_scan_ipv6(Targets);
-    else
-      os_scan_ipv4(Targets);
-    return OP_SUCCESS;
-  }
-
-  /* We need to split it up */
-  while (startidx < Targets.size()) {
-    int diff = Targets.size() - startidx;
-    if (diff > max_os_group_sz * fudgeratio) {
-      diff = max_os_group_sz;
-    }
-    tmpTargets.assign(Targets.begin() + startidx, Targets.begin() + startidx + diff);
-    if (family == AF_INET6)
-      os_scan_ipv6(Targets);
-    else
-      os_scan_ipv4(Targets);
-    startidx += diff;
-  }
-  return OP_SUCCESS;
-}
-
-
 /* Performs the OS detection for IPv4 hosts. This method should not be called
- * directly. os_scan() should be used instead, as it handles chunking so
- * you don't do too many targets in parallel */
+ * directly. os_scan() should be used instead, as it sorts the targets by
+ * address family.
+ *
+ * Hosts are not scanned in lockstep rounds. Each host goes through the
+ * sequence and TCP/UDP/ICMP tests of a try on its own, is matched as soon as
+ * the try is over, and waits OS_RETRY_DELAY before the next try if it didn't
+ * match. Hosts are admitted from OSI.waitingHosts as the group congestion
+ * window allows (see admitHosts), and finished hosts make room for others. */
 int OSScan::os_scan_ipv4(std::vector<Target *> &Targets) {
-  int itry = 0;
   /* Hosts which haven't matched and have been removed from incompleteHosts because
    * they have exceeded the number of retransmissions the host is allowed. */
   std::list<HostOsScanInfo *> unMatchedHosts;
+  /* Hosts whose fingerprint has just been matched */
+  std::list<HostOsScanInfo *> matched;
+  std::list<HostOsScanInfo *>::iterator hostI, nextHost;
+  OSMatchWorkers *workers;
+  HostOsScanInfo *hsi = NULL;
+  HostOsScanStats *hss = NULL;
+  unsigned int unableToSend; /* # of times in a row that hosts were unable to send probe */
+  unsigned int expectReplies;
+  long to_usec;
+  int timeToSleep = 0;
+
+  struct ip *ip = NULL;
+  struct link_header linkhdr;
+  struct sockaddr_storage ss;
+  unsigned int bytes;
+  struct timeval rcvdtime;
+
+  struct timeval stime, tmptv;
+
+  bool timedout;
+  bool thisHostGood;
+  bool foundgood;
+  bool goodResponse;
+  bool phaseChanged;
 
   /* Check we have at least one target*/
   if (Targets.size() == 0) {
@@ -3524,58 +3915,252 @@ int OSScan::os_scan_ipv4(std::vector<Target *> &Targets) {
   perf.init();
 
   OsScanInfo OSI(Targets);
-  if (OSI.numIncompleteHosts() == 0) {
+  if (OSI.numWaitingHosts() == 0) {
     /* no one will be scanned */
     return OP_FAILURE;
   }
   OSI.starttime = o.TimeSinceStart();
-  startTimeOutClocks(&OSI);
 
   HostOsScan HOS(Targets[0]);
 
   /* Initialize the pcap session handler in HOS */
   begin_sniffer(&HOS, Targets);
-  while (OSI.numIncompleteHosts() != 0) {
-    if (itry > 0)
-      sleep(1);
-    if (itry == 3)
-      usleep(1500000); /* Try waiting a little longer just in case it matters */
-    if (o.verbose) {
-      char targetstr[128];
-      bool plural = (OSI.numIncompleteHosts() != 1);
-      if (!plural) {
-	(*(OSI.incompleteHosts.begin()))->target->NameIP(targetstr, sizeof(targetstr));
-      } else Snprintf(targetstr, sizeof(targetstr), "%d hosts", (int) OSI.numIncompleteHosts());
-      log_write(LOG_STDOUT, "%s OS detection (try #%d) against %s\n", (itry == 0)? "Initiating" : "Retrying", itry + 1, targetstr);
-      log_flush_all();
-    }
-    startRound(&OSI, &HOS, itry);
-    doSeqTests(&OSI, &HOS);
-    doTUITests(&OSI, &HOS);
-    endRound(&OSI, &HOS, itry);
-    expireUnmatchedHosts(&OSI, &unMatchedHosts);
-    itry++;
+
+  workers = start_match_workers(&OSI);
+
+  if (o.verbose) {
+    char targetstr[128];
+    bool plural = (OSI.numWaitingHosts() != 1);
+    if (!plural) {
+      (*(OSI.waitingHosts.begin()))->target->NameIP(targetstr, sizeof(targetstr));
+    } else Snprintf(targetstr, sizeof(targetstr), "%d hosts", (int) OSI.numWaitingHosts());
+    log_write(LOG_STDOUT, "Initiating OS detection (try #1) against %s\n", targetstr);
+    log_flush_all();
+  }
+
+  memset(&stime, 0, sizeof(stime));
+  memset(&tmptv, 0, sizeof(tmptv));
+
+  while (OSI.numIncompleteHosts() != 0 || OSI.numWaitingHosts() != 0) {
+    if (timeToSleep > 0) {
+      if (o.debugging > 1) {
+        log_write(LOG_PLAIN, "Time to sleep %d. Sleeping. \n", timeToSleep);
+      }
+
+      usleep(timeToSleep);
+    }
+
+    gettimeofday(&now, NULL);
+    admitHosts(&OSI, &HOS);
+
+    /* Start the next try of hosts that are done waiting for it. */
+    for (hostI = OSI.incompleteHosts.begin(); hostI != OSI.incompleteHosts.end(); hostI++) {
+      hsi = *hostI;
+      if (hsi->phase == OS_PHASE_WAIT && TIMEVAL_SUBTRACT(hsi->nextTry, now) <= 0) {
+        if (o.verbose) {
+          log_write(LOG_STDOUT, "Retrying OS detection (try #%d) against %s\n",
+                    hsi->tryno + 1, hsi->target->NameIP());
+          log_flush_all();
+        }
+        startTry(&HOS, hsi);
+      }
+    }
+
+    expectReplies = 0;
+    unableToSend = 0;
+
+    if (o.debugging > 2) {
+      for (hostI = OSI.incompleteHosts.begin();
+          hostI != OSI.incompleteHosts.end(); hostI++) {
+        hss = (*hostI)->hss;
+        log_write(LOG_PLAIN, "Host %s. ProbesToSend %d: \tProbesActive %d\n",
+                  hss->target->targetipstr(), hss->numProbesToSend(),
+                  hss->numProbesActive());
+      }
+    }
+
+    while (unableToSend < OSI.numIncompleteHosts() && HOS.stats->sendOK()) {
+      hsi = OSI.nextIncompleteHost();
+      hss = hsi->hss;
+      gettimeofday(&now, NULL);
+      if (hss->numProbesToSend()>0 && hostTrySendOK(&HOS, hsi, NULL)) {
+        HOS.sendNextProbe(hss);
+        expectReplies++;
+        unableToSend = 0;
+      } else {
+        unableToSend++;
+      }
+    }
+
+    HOS.stats->num_probes_sent_at_last_wait = HOS.stats->num_probes_sent;
+
+    gettimeofday(&now, NULL);
+
+    /* Count the pcap wait time. */
+    if (!HOS.stats->sendOK()) {
+      TIMEVAL_MSEC_ADD(stime, now, 1000);
+
+      for (hostI = OSI.incompleteHosts.begin(); hostI != OSI.incompleteHosts.end();
+          hostI++) {
+        if (HOS.nextTimeout((*hostI)->hss, &tmptv)) {
+          if (TIMEVAL_SUBTRACT(tmptv, stime) < 0)
+            stime = tmptv;
+        }
+      }
+    }
+    else {
+      foundgood = false;
+      for (hostI = OSI.incompleteHosts.begin(); hostI != OSI.incompleteHosts.end(); hostI++) {
+        thisHostGood = hostTrySendOK(&HOS, *hostI, &tmptv);
+        if (thisHostGood) {
+          stime = tmptv;
+          foundgood = true;
+          break;
+        }
+
+        if (!foundgood || TIMEVAL_SUBTRACT(tmptv, stime) < 0) {
+          stime = tmptv;
+          foundgood = true;
+        }
+      }
+    }
+
+    timedout = false;
+    do {
+      to_usec = TIMEVAL_SUBTRACT(stime, now);
+      if (to_usec < 2000) to_usec = 2000;
+
+      if (o.debugging > 2)
+        log_write(LOG_PLAIN, "pcap wait time is %ld.\n", to_usec);
+
+      ip = (struct ip*) readipv4_pcap(HOS.pd, &bytes, to_usec, &rcvdtime, &linkhdr, true);
+
+      gettimeofday(&now, NULL);
+
+      if (!ip && TIMEVAL_SUBTRACT(stime, now) < 0) {
+        timedout = true;
+        break;
+      } else if (!ip) {
+        continue;
+      }
+
+      if (TIMEVAL_SUBTRACT(now, stime) > 200000) {
+        /* While packets are still being received, I'll be generous and give
+           an extra 1/5 sec.  But we have to draw the line somewhere */
+        timedout = true;
+      }
+
+      if (bytes < (4 * ip->ip_hl) + 4U)
+        continue;
+
+      memset(&ss, 0, sizeof(ss));
+      ((struct sockaddr_in *) &ss)->sin_addr.s_addr = ip->ip_src.s_addr;
+      ss.ss_family = AF_INET;
+      hsi = OSI.findIncompleteHost(&ss);
+      if (!hsi)
+        continue; /* Not from one of our targets. */
+      setTargetMACIfAvailable(hsi->target, &linkhdr, &ss, 0);
+
+      goodResponse = HOS.processResp(hsi->hss, ip, bytes, &rcvdtime);
+
+      if (goodResponse)
+        expectReplies--;
+
+    } while (!timedout && expectReplies > 0);
+
+    /* Remove any timeout hosts during the scan. */
+    OSI.removeCompletedHosts();
+
+    /* Move hosts whose probes are all done on to the next phase. */
+    phaseChanged = false;
+    for (hostI = OSI.incompleteHosts.begin(); hostI != OSI.incompleteHosts.end(); hostI = nextHost) {
+      nextHost = hostI;
+      nextHost++;
+      hsi = *hostI;
+      hss = hsi->hss;
+      if (hsi->phase == OS_PHASE_SEQ) {
+        HOS.updateActiveSeqProbes(hss);
+        if (hss->numProbesToSend() == 0 && hss->numProbesActive() == 0) {
+          HOS.buildTUIProbeList(hss);
+          hsi->phase = OS_PHASE_TUI;
+          phaseChanged = true;
+        }
+      } else if (hsi->phase == OS_PHASE_TUI) {
+        HOS.updateActiveTUIProbes(hss);
+        if (o.osscan_adaptive && !hsi->cacheTry && HOS.tuiIsSettled(hss)) {
+          if (o.debugging)
+            log_write(LOG_PLAIN, "OS match of %s settled with %d probes left in try #%d\n",
+                      hsi->target->targetipstr(),
+                      hss->numProbesToSend() + hss->numProbesActive(), hsi->tryno + 1);
+          HOS.dropProbes(hss);
+        }
+        if (hss->numProbesToSend() == 0 && hss->numProbesActive() == 0) {
+          phaseChanged = true;
+          if (endTry(&HOS, hsi))
+            matchTry(workers, hsi, matched);
+        }
+      }
+    }
+
+    /* Act on the matches that are in. */
+    if (workers != NULL)
+      workers->collect(matched, false);
+    while (!matched.empty()) {
+      hsi = matched.front();
+      matched.pop_front();
+      phaseChanged = true;
+      if (finishTry(hsi)) {
+        /* We've done all the OS2 tries we're going to do ... move this
+           to unMatchedHosts */
+        hsi->target->stopTimeOutClock(&now);
+        OSI.removeIncompleteHost(hsi);
+        unMatchedHosts.push_back(hsi);
+      }
+    }
+
+    /* Remove the hosts that have just matched. */
+    OSI.removeCompletedHosts();
+
+    gettimeofday(&now, NULL);
+
+    if (expectReplies == 0 && !phaseChanged) {
+      timeToSleep = TIMEVAL_SUBTRACT(stime, now);
+    } else {
+      timeToSleep = 0;
+    }
   }
 
   /* Now move the unMatchedHosts array back to IncompleteHosts */
   if (!unMatchedHosts.empty())
-    OSI.incompleteHosts.splice(OSI.incompleteHosts.begin(), unMatchedHosts);
+    OSI.restoreIncompleteHosts(unMatchedHosts);
 
   if (OSI.numIncompleteHosts()) {
     /* For hosts that don't have a perfect match, find the closest fingerprint
      * in the DB and, if we are in debugging mode, print them. */
-    findBestFPs(&OSI);
+    findBestFPs(&OSI, workers);
     if (o.debugging > 1)
       printFP(&OSI);
   }
 
+  delete workers;
+
+  if (o.osscan_cache) {
+    /* Hosts that were scanned to the end without a perfect match lose their
+       entries; hosts that timed out keep theirs. */
+    for (hostI = OSI.incompleteHosts.begin(); hostI != OSI.incompleteHosts.end(); hostI++) {
+      if (!(*hostI)->target->timedOut(NULL))
+        os_cache.erase((*hostI)->target->targetipstr());
+    }
+    write_os_cache();
+  }
+
   return OP_SUCCESS;
 }
 
 
 /* Performs the OS detection for IPv6 hosts. This method should not be called
- * directly. os_scan() should be used instead, as it handles chunking so
- * you don't do too many targets in parallel */
+ * directly. os_scan() should be used instead, as it sorts the targets by
+ * address family. */
 int OSScan::os_scan_ipv6(std::vector<Target *> &Targets) {
 
   /* Object instantiation */
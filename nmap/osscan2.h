@@ -101,6 +101,8 @@
 #include "nbase.h"
 #include <vector>
 #include <list>
+#include <map>
+#include <string>
 #include "Target.h"
 class Target;
 
@@ -111,6 +113,10 @@ class Target;
 
 #define NUM_FPTESTS    13
 
+/* The number of distinct probes, by type and subid, a try can have out:
+   NUM_SEQ_SAMPLES TSeq, 6 TOps, 1 TEcn, 7 T1_7, 2 TIcmp and 1 TUdp. */
+#define NUM_OFPROBE_SLOTS (NUM_SEQ_SAMPLES + 6 + 1 + 7 + 2 + 1)
+
 /* The number of tries we normally do.  This may be increased if
    the target looks like a good candidate for fingerprint submission, or fewer
    if the user gave the --max-os-tries option */
@@ -145,18 +151,50 @@ typedef enum OFProbeType {
   OFP_TUDP
 } OFProbeType;
 
+/* What --osscan-cache remembers about a host that had a perfect match: the
+   evidence that it is the same host (its MAC address, the open and closed
+   TCP ports OS detection used and its distance), the sequence results of
+   the try and the fingerprint that matched. The closed UDP port isn't part
+   of it, as without a UDP scan it is chosen at random. */
+struct OSCacheEntry {
+  std::string mac;
+  int opentcpport, closedtcpport;
+  int distance;
+  struct seq_info si;
+  std::string fp; /* The tests of the fingerprint, separated by spaces */
+};
+
 /******************************************************************************
  * FUNCTION PROTOTYPES                                                        *
  ******************************************************************************/
 
-/* This is the primary OS detection function.  If many Targets are
-   passed in (the threshold is based on timing level), they are
-   processed as smaller groups to improve accuracy  */
-void os_scan2(std::vector<Target *> &Targets);
+/* Hosts are admitted to IPv4 OS detection as the group congestion
+   window grows, and this many at first no matter how small it is. */
+#define OS_MIN_HOSTS_IN_FLIGHT 10
+
+/* How long a host that hasn't matched waits before its next try, and
+   how much longer before the fourth, in milliseconds. */
+#define OS_RETRY_DELAY 1000
+#define OS_RETRY_EXTRA_DELAY 1500
+
+/* At most this many threads match the fingerprints of IPv4 hosts while the
+   scan goes on. A host waiting for its match is looked at again after
+   OS_MATCH_POLL_INTERVAL milliseconds. */
+#define OS_MAX_MATCH_THREADS 8
+#define OS_MATCH_POLL_INTERVAL 10
 
 int get_initial_ttl_guess(u8 ttl);
 int get_ipid_sequence(int numSamples, int *ipids, int islocalhost);
 
+/* Formats an --osscan-cache entry as a line of the cache file, without the
+   newline, and parses one back. os_cache_parse_line returns false for a
+   line that is malformed, truncated or edited. */
+std::string os_cache_format_line(const std::string &addr, const OSCacheEntry &entry);
+bool os_cache_parse_line(const char *line, std::string &addr, OSCacheEntry &entry);
+/* Whether the tests a cache verification try does came out the same in FP
+   as in the cached fingerprint. */
+bool os_cache_verified(const FingerPrint *cached, const FingerPrint *FP);
+
 
 /******************************************************************************
  * CLASS DEFINITIONS                                                          *
@@ -256,6 +294,10 @@ class HostOsScanStats {
    * sent again till expired. */
   std::list<OFProbe *> probesToSend;
   std::list<OFProbe *> probesActive;
+  /* Where each probe is in probesActive, by type and subid (see
+   * probeSlot()), or probesActive.end() if it isn't there. A response
+   * identifies its probe by these, so this saves walking the list. */
+  std::list<OFProbe *>::iterator activeProbeIndex[NUM_OFPROBE_SLOTS];
 
   /* A record of total number of probes that have been sent to this
    * host, including restranmited ones. */
@@ -283,8 +325,17 @@ class HostOsScanStats {
   #define FP_T5    FPtests[8]
   #define FP_T6    FPtests[9]
   #define FP_T7    FPtests[10]
-  #define FP_TUdp  FPtests[11]
-  #define FP_TIcmp FPtests[12]
+  #define FP_TUDP_OFF  11
+  #define FP_TICMP_OFF 12
+  #define FP_TUdp  FPtests[FP_TUDP_OFF]
+  #define FP_TIcmp FPtests[FP_TICMP_OFF]
+  /* Tests whose probes were dropped once the match of the try was settled
+   * without them (--osscan-adaptive). makeFP leaves them out of the
+   * fingerprint instead of recording that they got no response. */
+  bool FPtestsSkipped[NUM_FPTESTS];
+  /* Probes left to send or answer when the try was last checked for being
+   * settled; it only needs checking again once that goes down. */
+  unsigned int probesLeftAtSettleCheck;
   struct AVal *TOps_AVs[6]; /* 6 AVs of TOps */
   struct AVal *TWin_AVs[6]; /* 6 AVs of TWin */
 
@@ -300,6 +351,14 @@ class HostOsScanStats {
   int storedIcmpReply; /* Which one of the two icmp replies is stored? */
 
   struct udpprobeinfo upi; /* info of the udp probe we sent */
+
+  /* Values put in the probes of the current try, and checked in the
+   * replies. They are chosen anew for each try (by initScanStats) so
+   * that late replies to an earlier try aren't taken for answers. */
+  unsigned int tcpSeqBase;    /* Seq value used in TCP probes                 */
+  unsigned int tcpAck;        /* Ack value used in TCP probes                 */
+  unsigned short icmpEchoId;  /* ICMP Echo Identifier value for ICMP probes   */
+  int udpttl;                 /* TTL value used in the UDP probe              */
 };
 
 /* These are statistics for the whole group of Targets */
@@ -329,15 +388,16 @@ class HostOsScan {
   pcap_t *pd;
   ScanStats *stats;
 
-  /* (Re)Initialize the parameters that will be used during the scan.*/
-  void reInitScanSystem();
-
   void buildSeqProbeList(HostOsScanStats *hss);
   void updateActiveSeqProbes(HostOsScanStats *hss);
 
   void buildTUIProbeList(HostOsScanStats *hss);
   void updateActiveTUIProbes(HostOsScanStats *hss);
 
+  /* Initialize the probe list of a try that only checks a host against its
+   * --osscan-cache entry. */
+  void buildVerifyProbeList(HostOsScanStats *hss);
+
   /* send the next probe in the probe list of the hss */
   void sendNextProbe(HostOsScanStats *hss);
 
@@ -347,6 +407,14 @@ class HostOsScan {
   /* Make up the fingerprint. */
   void makeFP(HostOsScanStats *hss);
 
+  /* Whether the TUI tests still waiting for replies can't change which OS
+   * the host matches best. */
+  bool tuiIsSettled(HostOsScanStats *hss);
+
+  /* Drop the probes still to send or waiting for replies, leaving their
+   * tests out of the fingerprint. */
+  void dropProbes(HostOsScanStats *hss);
+
   /* Check whether the host is sendok. If not, fill _when_ with the
    * time when it will be sendOK and return false; else, fill it with
    * now and return true. */
@@ -411,11 +479,7 @@ private:
   int rawsd;    /* Raw socket descriptor */
   eth_t *ethsd; /* Ethernet handle       */
 
-  unsigned int tcpSeqBase;    /* Seq value used in TCP probes                 */
-  unsigned int  tcpAck;       /* Ack value used in TCP probes                 */
   int tcpMss;                 /* TCP MSS value used in TCP probes             */
-  int udpttl;                 /* TTL value used in the UDP probe              */
-  unsigned short icmpEchoId;  /* ICMP Echo Identifier value for ICMP probes   */
   unsigned short icmpEchoSeq; /* ICMP Echo Sequence value used in ICMP probes */
 
   /* Source port number in TCP probes. Different probes will use an arbitrary
@@ -434,6 +498,13 @@ class OsScanInfo {
   ~OsScanInfo();
   float starttime;
 
+  /* Hosts that haven't been admitted to the scan yet, in order. */
+  std::list<HostOsScanInfo *> waitingHosts;
+  unsigned int numWaitingHosts() {return waitingHosts.size();}
+
+  /* Moves the first waiting host to incompleteHosts and returns it. */
+  HostOsScanInfo *admitNextHost();
+
   /* If you remove from this, you had better adjust nextI too (or call
    * resetHostIterator() afterward). Don't let this list get empty,
    * then add to it again, or you may mess up nextI (I'm not sure) */
@@ -442,6 +513,13 @@ class OsScanInfo {
   unsigned int numIncompleteHosts() {return incompleteHosts.size();}
   HostOsScanInfo *findIncompleteHost(struct sockaddr_storage *ss);
 
+  /* Takes a host out of incompleteHosts without deleting it, and resets
+     the host iterator. */
+  void removeIncompleteHost(HostOsScanInfo *hsi);
+
+  /* Puts hosts taken out by removeIncompleteHost back in incompleteHosts. */
+  void restoreIncompleteHosts(std::list<HostOsScanInfo *> &hosts);
+
   /* A circular buffer of the incompleteHosts.  nextIncompleteHost() gives
      the next one.  The first time it is called, it will give the
      first host in the list.  If incompleteHosts is empty, returns
@@ -458,9 +536,18 @@ class OsScanInfo {
  private:
   unsigned int numInitialTargets;
   std::list<HostOsScanInfo *>::iterator nextI;
+  /* The hosts in incompleteHosts by IPv4 address (in network order), for
+     findIncompleteHost. */
+  std::map<u32, HostOsScanInfo *> incompleteByAddr;
+  void unindexHost(HostOsScanInfo *hsi);
 };
 
 
+/* Where a host is in its current try: each host goes through the
+ * sequence and then the TCP/UDP/ICMP tests of a try at its own pace,
+ * has the fingerprint matched, and waits for a while between tries. */
+enum os_try_phase { OS_PHASE_WAIT, OS_PHASE_SEQ, OS_PHASE_TUI, OS_PHASE_MATCH };
+
 /* The overall os scan information of a host:
  *  - Fingerprints gotten from every scan round;
  *  - Maching results of these fingerprints.
@@ -480,6 +567,18 @@ class HostOsScanInfo {
   bool timedOut;        /* Did it time out?                            */
   bool isCompleted;     /* Has the OS detection been completed?        */
   HostOsScanStats *hss; /* Scan status of the host in one scan round   */
+  int tryno;            /* The current try, or the next while waiting  */
+  enum os_try_phase phase;
+  struct timeval nextTry; /* When a waiting host starts its next try   */
+  /* --osscan-cache: the fingerprint the host matched with last time, and
+   * its distance and sequence results then, while a try checks that the
+   * host is unchanged. The verification try does no sequence tests, so
+   * cachedSeq is what the host gets when it passes. */
+  FingerPrint *cachedFP;
+  int cachedDistance;
+  struct seq_info cachedSeq;
+  bool cacheChecked;    /* Has the host been looked up in the cache?    */
+  bool cacheTry;        /* Is the current try checking the cache entry? */
 };
 
 
@@ -491,7 +590,6 @@ class OSScan {
 
  private:
   int ip_ver;             /* IP version for the OS Scan (4 or 6) */
-  int chunk_and_do_scan(std::vector<Target *> &Targets, int family);
   int os_scan_ipv4(std::vector<Target *> &Targets);
   int os_scan_ipv6(std::vector<Target *> &Targets);
         
@@ -122,6 +122,8 @@ enum serviceprobestate {
   PROBESTATE_NULLPROBE, // Is working on the NULL Probe
   PROBESTATE_MATCHINGPROBES, // Is doing matching probe(s)
   PROBESTATE_NONMATCHINGPROBES, // The above failed, is checking nonmatches
+  PROBESTATE_CACHEDPROBE, // Is trying the probe that worked on an earlier scan
+  PROBESTATE_LEARNEDPROBE, // Is trying the probe that works most often here
   PROBESTATE_FINISHED_HARDMATCHED, // Yay!  Found a match
   PROBESTATE_FINISHED_SOFTMATCHED, // Well, a soft match anyway
   PROBESTATE_FINISHED_NOMATCH, // D'oh!  Failed to find the service.
@@ -128,9 +128,178 @@
 
 #include <algorithm>
 #include <list>
+#include <map>
+#include <set>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 extern NmapOps o;
 
+/* Set by enable_service_match_profiling(). The counters of all match
+   lines share one lock; it is only taken while profiling. */
+static bool match_profiling = false;
+#if HAVE_PTHREAD
+static pthread_mutex_t match_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* PCRE 8.20 and later can compile studied patterns to machine code. The
+   result of pcre_study must then be released with pcre_free_study. */
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define SERVICE_PCRE_STUDY_OPTIONS PCRE_STUDY_JIT_COMPILE
+#define service_pcre_free_study pcre_free_study
+#else
+#define SERVICE_PCRE_STUDY_OPTIONS 0
+#define service_pcre_free_study pcre_free
+#endif
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+/* Without a stack of its own, JIT code runs on 32K of the machine stack,
+   which some match lines outgrow. Each thread that matches gets its own
+   stack (a JIT stack can't be shared between threads), allocated when it
+   first needs one. */
+#define SERVICE_JIT_STACK_START (32 * 1024)
+#define SERVICE_JIT_STACK_MAX (1024 * 1024)
+
+#if HAVE_PTHREAD
+static pthread_key_t jit_stack_key;
+static pthread_once_t jit_stack_once = PTHREAD_ONCE_INIT;
+
+static void jit_stack_free(void *stack) {
+  pcre_jit_stack_free((pcre_jit_stack *) stack);
+}
+
+static void jit_stack_key_create(void) {
+  pthread_key_create(&jit_stack_key, jit_stack_free);
+}
+#endif
+
+/* The pcre_jit_callback of all studied patterns. If it returns NULL, PCRE
+   falls back to the machine stack. */
+static pcre_jit_stack *service_jit_stack(void *data) {
+  pcre_jit_stack *stack;
+
+#if HAVE_PTHREAD
+  pthread_once(&jit_stack_once, jit_stack_key_create);
+  stack = (pcre_jit_stack *) pthread_getspecific(jit_stack_key);
+  if (stack == NULL) {
+    stack = pcre_jit_stack_alloc(SERVICE_JIT_STACK_START, SERVICE_JIT_STACK_MAX);
+    if (stack != NULL)
+      pthread_setspecific(jit_stack_key, stack);
+  }
+#else
+  static pcre_jit_stack *jit_stack = NULL;
+
+  if (jit_stack == NULL)
+    jit_stack = pcre_jit_stack_alloc(SERVICE_JIT_STACK_START, SERVICE_JIT_STACK_MAX);
+  stack = jit_stack;
+#endif
+  return stack;
+}
+#endif
+
+/* Studies regex for matching service responses. Returns NULL and sets
+   *errptr if that fails. */
+static pcre_extra *service_pcre_study(const pcre *regex, const char **errptr) {
+  pcre_extra *extra;
+
+  *errptr = NULL;
+  extra = pcre_study(regex, SERVICE_PCRE_STUDY_OPTIONS, errptr);
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (extra != NULL)
+    pcre_assign_jit_stack(extra, service_jit_stack, NULL);
+#endif
+  return extra;
+}
+
+/* Bump this whenever the layout written by the saveToCache functions
+   or the cache header changes. */
+#define PROBE_CACHE_VERSION 3
+#define PROBE_CACHE_MAGIC "NMAPSVC\n"
+#define PROBE_CACHE_FILE "nmap-service-probes.cache"
+
+/* Reads back data written by the saveToCache functions. Integers are
+   stored in host byte order, as the cache holds compiled PCRE patterns
+   anyway and is never shared between machines. Any read past the end
+   clears ok and returns zeroes from then on. */
+struct probe_cache_reader {
+  const u8 *p;
+  const u8 *end;
+  bool ok;
+};
+
+static void cache_put_u32(std::string &buf, u32 v) {
+  buf.append((const char *) &v, sizeof(v));
+}
+
+static void cache_put_bytes(std::string &buf, const void *data, u32 len) {
+  cache_put_u32(buf, len);
+  buf.append((const char *) data, len);
+}
+
+/* NULL strings are stored with a length of 0xffffffff. */
+static void cache_put_str(std::string &buf, const char *s) {
+  if (s == NULL)
+    cache_put_u32(buf, 0xffffffff);
+  else
+    cache_put_bytes(buf, s, strlen(s));
+}
+
+static u32 cache_get_u32(struct probe_cache_reader *r) {
+  u32 v;
+
+  if (!r->ok || r->end - r->p < (ptrdiff_t) sizeof(v)) {
+    r->ok = false;
+    return 0;
+  }
+  memcpy(&v, r->p, sizeof(v));
+  r->p += sizeof(v);
+  return v;
+}
+
+static const u8 *cache_get_bytes(struct probe_cache_reader *r, u32 *len) {
+  const u8 *data;
+
+  *len = cache_get_u32(r);
+  if (!r->ok || (u32) (r->end - r->p) < *len) {
+    r->ok = false;
+    *len = 0;
+    return NULL;
+  }
+  data = r->p;
+  r->p += *len;
+  return data;
+}
+
+/* Returns a newly allocated string, or NULL if a NULL string was stored
+   or on error. */
+static char *cache_get_str(struct probe_cache_reader *r) {
+  const u8 *data;
+  char *s;
+  u32 len;
+
+  if (r->ok && r->end - r->p >= 4 && memcmp(r->p, "\xff\xff\xff\xff", 4) == 0) {
+    r->p += 4;
+    return NULL;
+  }
+  data = cache_get_bytes(r, &len);
+  if (!r->ok)
+    return NULL;
+  s = (char *) safe_malloc(len + 1);
+  memcpy(s, data, len);
+  s[len] = '\0';
+  return s;
+}
+
+static void cache_get_string(struct probe_cache_reader *r, std::string &s) {
+  const u8 *data;
+  u32 len;
+
+  data = cache_get_bytes(r, &len);
+  s.assign((const char *) data, len);
+}
+
 // Details on a particular service (open port) we are trying to match
 class ServiceNFO {
 public:
@@ -175,6 +344,9 @@ public:
   // if a match was found (see above), this tells whether it was a "soft"
   // or hard match.  It is always false if no match has been found.
   bool softMatchFound;
+  // The service name of the soft match that preceded a hard match (or NULL),
+  // for --version-stats
+  const char *softmatch_service;
   // most recent probe executed (or in progress).  If there has been a match 
   // (probe_matched != NULL), this will be the corresponding ServiceProbe.
   ServiceProbe *currentProbe();
@@ -193,46 +365,179 @@ public:
   int probe_timemsleft(const ServiceProbe *probe, const struct timeval *now = NULL);
   enum serviceprobestate probe_state; // defined in portlist.h
   nsock_iod niod; // The IO Descriptor being used in this probe (or NULL)
+  // True if the probe text was given to nsock along with the connection
+  // request, so it must not be sent again when the connection is made
+  bool probe_sent_on_connect;
+  // From the --version-cache file: the probe that identified this service
+  // on an earlier scan, which is tried before any other, the match line
+  // (in fallback probe number cached_fallback) that matched, and a hash of
+  // the response it matched.  cached_probe is NULL if there is no entry.
+  ServiceProbe *cached_probe;
+  ServiceProbeMatch *cached_match;
+  int cached_fallback;
+  unsigned long long cached_hash;
+  // The same for the hard match found by this scan, to be saved in the
+  // cache.  hardmatch_probe is NULL if there was none.
+  ServiceProbe *hardmatch_probe;
+  int hardmatch_lineno;
+  unsigned long long hardmatch_hash;
   u16 portno; // in host byte order
   u8 proto; // IPPROTO_TCP or IPPROTO_UDP
   // The time that the current probe was executed (meaning TCP connection
   // made or first UDP packet sent
   struct timeval currentprobe_exec_time;
+  // When the pending plain TCP connection was requested, for measuring
+  // connect times.  Zeroed for UDP and SSL connections.
+  struct timeval connect_start;
   // Append newly-received data to the current response string (if any)
   void appendtocurrentproberesponse(const u8 *respstr, int respstrlen);
   // Get the full current response string.  Note that this pointer is 
   // INVALIDATED if you call appendtocurrentproberesponse() or nextProbe()
   u8 *getcurrentproberesponse(int *respstrlen);
+  // Throw away the current response, without moving to another probe
+  void clearcurrentproberesponse();
+  // What the service sent during the NULL probe, before any probe text
+  std::string banner;
+  // True if the current probe was sent on the connection of the previous
+  // one (see the "reuse" directive) rather than on a new connection
+  bool reusing_connection;
   AllProbes *AP;
           
 private:
-  // Adds a character to servicefp.  Takes care of word wrapping if
-  // necessary at the given (wrapat) column.  Chars will only be
-  // written if there is enough space.  Otherwise it exits.
-  void addServiceChar(char c, int wrapat);
-  // Like addServiceChar, but for a whole zero-terminated string
-  void addServiceString(const char *s, int wrapat);
+  // Appends len bytes of already escaped text to servicefp, starting a
+  // new "SF:" line whenever the current one reaches SERVICEFP_WRAP
+  // columns.  Grows servicefp as needed.
+  void addServiceData(const char *s, int len);
+  // Makes sure servicefp has room for at least len more bytes
+  void reserveServiceFP(int len);
+  // Picks the probe that has most often identified services on this port
+  // (or with the service name of the current soft match) in the
+  // --version-stats file.  Returns NULL if there is none worth trying.
+  ServiceProbe *learnedProbe();
+  // The probe tried after the NULL probe because of --version-stats, or NULL
+  ServiceProbe *learned_probe;
   std::vector<ServiceProbe *>::iterator current_probe;
   u8 *currentresp;
   int currentresplen;
+  int currentrespalloc;
   char *servicefp;
   int servicefplen;
   int servicefpalloc;
 };
 
 // This holds the service information for a group of Targets being service scanned.
+#if HAVE_PTHREAD
+/* Matching responses against nmap-service-probes is most of the CPU work
+   of version detection. Where threads are available it is done by a small
+   pool of worker threads, so that the nsock loop keeps servicing
+   connections (and their timeouts) while a batch of banners is matched.
+   Each job carries its own copy of the response. Finished jobs are handed
+   back through a socketpair whose read end the nsock loop watches; it is
+   only watched while jobs are outstanding, so nsock_loop still returns
+   when the scan runs out of events. */
+struct MatchJob {
+  ServiceNFO *svc;
+  nsock_iod nsi;
+  ServiceProbe *probe;
+  std::string response;
+  int fallbackDepth;
+  const struct MatchDetails *MD;
+  struct MatchResult result;
+};
+
+class MatchWorkers {
+public:
+  MatchWorkers(nsock_pool nsp, int nthreads);
+  ~MatchWorkers();
+  // Queues svc's current response to be matched against the fallbacks of
+  // its current probe. handle_match is called from the nsock loop once
+  // that is done.
+  void submit(nsock_pool nsp, ServiceNFO *svc, nsock_iod nsi,
+              const u8 *response, int responselen);
+  bool ok() { return !threads.empty(); }
+
+private:
+  // Arranges for done_handler to be called once jobs are finished.
+  void wait(nsock_pool nsp);
+  static void *work(void *arg);
+  static void done_handler(nsock_pool nsp, nsock_event nse, void *mydata);
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  std::list<MatchJob *> todo, done;
+  std::vector<pthread_t> threads;
+  bool stopping;
+  int outstanding; // Submitted and not yet handled, touched only by the nsock loop
+  int wakefd; // Written by workers for each finished job
+  nsock_iod wakensi;
+  // Set if reading wakensi failed; finished jobs are then collected on a
+  // timer and the workers stop writing to wakefd.
+  bool polling;
+};
+#endif
+
+// Scheduling state for the services of one target in a ServiceGroup.
+struct ServiceHostState {
+  // Congestion window for this host: the number of its services that may be
+  // probed at once.
+  struct ultra_timing_vals timing;
+  unsigned int in_progress; // Its services in services_in_progress
+  unsigned int remaining; // Its services in services_remaining
+};
+
 class ServiceGroup {
 public:
   ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP);
   ~ServiceGroup();
   std::list<ServiceNFO *> services_finished; // Services finished (discovered or not)
   std::list<ServiceNFO *> services_in_progress; // Services currently being probed
-  std::list<ServiceNFO *> services_remaining; // Probes not started yet
-  unsigned int ideal_parallelism; // Max (and desired) number of probes out at once.
+  // Probes not started yet.  Services of different hosts are interleaved
+  // so that consecutive connections go to different targets.
+  std::list<ServiceNFO *> services_remaining;
+  // Max number of services probed at once, from the group congestion window
+  unsigned int parallelism() const;
+  // Max number of services of the host probed at once
+  unsigned int hostParallelism(const ServiceHostState *host) const;
+  // Moves the service at svcI from services_remaining to services_in_progress
+  void startService(std::list<ServiceNFO *>::iterator svcI);
+  // Removes the service at svcI from services_remaining (without starting it)
+  void removeRemaining(std::list<ServiceNFO *>::iterator svcI);
+  // Records the result of a TCP connection attempt for svc. Connections
+  // made grow the congestion windows of the group and the service's host;
+  // timeouts and errors (the port was known to be open) shrink them.
+  void connectDone(ServiceNFO *svc, bool success, const struct timeval *now);
+  std::map<Target *, ServiceHostState> hosts;
+  unsigned int hosts_pending; // Hosts with services in services_remaining
+  struct scan_performance_vars perf;
+  struct ultra_timing_vals timing; // Congestion window for the whole group
+  struct timeout_info connect_to; // Connect round trip times
   ScanProgressMeter *SPM;
   int num_hosts_timedout; // # of hosts timed out during (or before) scan
+#if HAVE_PTHREAD
+  MatchWorkers *match_workers; // NULL if matching is done in the nsock loop
+#endif
 };
 
+// Number of SSL sessions the service scan nsock pool remembers for resumption.
+#define SSL_SESSION_CACHE_SIZE 1024
+
+// Upper limit on the number of threads matching service responses.
+#define MAX_MATCH_THREADS 8
+// How often finished matches are collected if the socket the threads
+// announce them on fails.
+#define MATCH_POLL_MSECS 10
+
+// Service fingerprint lines are wrapped at this many columns.
+#define SERVICEFP_WRAP 74
+
+// Probe responses are kept in buffers of power-of-two sizes from
+// 1 << RESPBUF_MIN_SHIFT up to 1 << (RESPBUF_MIN_SHIFT + RESPBUF_CLASSES - 1)
+// bytes. Up to RESPBUF_POOL_DEPTH free buffers of each size are kept for
+// reuse by the next probe; larger buffers go straight back to the heap.
+#define RESPBUF_MIN_SHIFT 9
+#define RESPBUF_CLASSES 8
+#define RESPBUF_POOL_DEPTH 64
+
 #define SUBSTARGS_MAX_ARGS 5
 #define SUBSTARGS_STRLEN 128
 #define SUBSTARGS_ARGTYPE_NONE 0
@@ -255,6 +560,9 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
 static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *mydata);
 static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *mydata);
 static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, ServiceGroup *SG, ServiceNFO *svc, nsock_iod nsi);
+static void handle_match(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG, ServiceNFO *svc,
+                         const struct MatchDetails *MD, int fallbackDepth);
+static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG);
 
 ServiceProbeMatch::ServiceProbeMatch() {
   deflineno = -1;
@@ -268,6 +576,7 @@ ServiceProbeMatch::ServiceProbeMatch() {
   matchops_ignorecase = false;
   matchops_dotall = false;
   isSoft = false;
+  memset(&profile, 0, sizeof(profile));
 }
 
 ServiceProbeMatch::~ServiceProbeMatch() {
@@ -285,7 +594,7 @@ ServiceProbeMatch::~ServiceProbeMatch() {
     free(*it);
   matchstrlen = 0;
   if (regex_compiled) pcre_free(regex_compiled);
-  if (regex_extra) pcre_free(regex_extra);
+  if (regex_extra) service_pcre_free_study(regex_extra);
   isInitialized = false;
   matchops_anchor = -1;
 }
@@ -354,6 +663,414 @@ static bool next_template(const char **matchtext, char **modestr, char **tmplt,
   return true;
 }
 
+/* The functions below find literal text that any subject matched by a
+   match line's regex must contain, so that ServiceProbe::testMatch can
+   rule out most match lines without running PCRE at all. The parsing is
+   deliberately conservative: anything not understood either ends the
+   current run of literal characters or, if it could change the meaning
+   of the rest of the pattern (alternation, inline options, \Q...\E),
+   makes us give up and extract nothing. */
+
+/* Parses a quantifier at p, if there is one, setting min and max (-1
+   means unbounded). Returns a pointer past the quantifier, including
+   any lazy or possessive suffix, or p itself with min = max = 1. */
+static const char *regex_quantifier(const char *p, int *min, int *max) {
+  const char *q;
+
+  *min = *max = 1;
+  if (*p == '?') {
+    *min = 0;
+  } else if (*p == '*') {
+    *min = 0;
+    *max = -1;
+  } else if (*p == '+') {
+    *max = -1;
+  } else if (*p == '{' && isdigit((int) (unsigned char) p[1])) {
+    /* {n}, {n,} or {n,m}. Anything else is a literal brace. */
+    *min = strtol(p + 1, (char **) &q, 10);
+    if (*q == ',') {
+      q++;
+      if (isdigit((int) (unsigned char) *q))
+        *max = strtol(q, (char **) &q, 10);
+      else
+        *max = -1;
+    } else {
+      *max = *min;
+    }
+    if (*q != '}') {
+      *min = *max = 1;
+      return p;
+    }
+    p = q;
+  } else {
+    return p;
+  }
+  p++;
+  if (*p == '?' || *p == '+')
+    p++;
+  return p;
+}
+
+/* Parses the escape sequence starting with the backslash at p. Sets c to
+   the byte it stands for, or to -1 if it matches something other than a
+   single fixed byte. Returns a pointer past the escape, or NULL if we
+   don't understand it. */
+static const char *regex_escape(const char *p, int *c) {
+  int i;
+
+  *c = -1;
+  p++;
+  switch (*p) {
+  case 'n': *c = '\n'; break;
+  case 'r': *c = '\r'; break;
+  case 't': *c = '\t'; break;
+  case 'f': *c = '\f'; break;
+  case 'a': *c = '\a'; break;
+  case 'e': *c = '\033'; break;
+  case 'x':
+    if (p[1] == '{')
+      return NULL;
+    *c = 0;
+    for (i = 0; i < 2 && isxdigit((int) (unsigned char) p[1]); i++, p++)
+      *c = *c * 16 + (isdigit((int) (unsigned char) p[1]) ? p[1] - '0'
+                      : tolower((int) (unsigned char) p[1]) - 'a' + 10);
+    break;
+  case '0':
+    *c = 0;
+    for (i = 0; i < 2 && p[1] >= '0' && p[1] <= '7'; i++, p++)
+      *c = *c * 8 + (p[1] - '0');
+    break;
+  case 'd': case 'D': case 's': case 'S': case 'w': case 'W':
+  case 'h': case 'H': case 'v': case 'V': case 'R': case 'X':
+  case 'C': case 'N': case 'b': case 'B': case 'A': case 'Z':
+  case 'z': case 'G':
+    break;
+  default:
+    /* Back-references, \Q, \p, \c and friends. */
+    if (*p == '\0' || isalnum((int) (unsigned char) *p))
+      return NULL;
+    *c = (unsigned char) *p;
+    break;
+  }
+  return p + 1;
+}
+
+/* Skips the character class starting at p. Returns a pointer past its
+   closing bracket, or NULL if there isn't one. */
+static const char *regex_skip_class(const char *p) {
+  p++;
+  if (*p == '^')
+    p++;
+  if (*p == ']')
+    p++;
+  for (; *p != '\0'; p++) {
+    if (*p == '\\') {
+      if (*++p == '\0')
+        return NULL;
+    } else if (*p == '[' && p[1] == ':') {
+      const char *end = strstr(p + 2, ":]");
+      if (end != NULL)
+        p = end + 1;
+    } else if (*p == ']') {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+/* Skips the group starting with the parenthesis at p. Returns a pointer
+   past its closing parenthesis, or NULL if there isn't one. */
+static const char *regex_skip_group(const char *p) {
+  int depth = 0;
+
+  while (*p != '\0') {
+    if (*p == '\\') {
+      if (*++p == '\0')
+        return NULL;
+      p++;
+    } else if (*p == '[') {
+      p = regex_skip_class(p);
+      if (p == NULL)
+        return NULL;
+    } else {
+      if (*p == '(')
+        depth++;
+      else if (*p == ')' && --depth == 0)
+        return p + 1;
+      p++;
+    }
+  }
+  return NULL;
+}
+
+/* PCRE's default character tables only fold ASCII letters, whatever the
+   locale. */
+static inline u8 ascii_lower(u8 c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static void lowercase_literal(std::string &s) {
+  std::string::iterator it;
+
+  for (it = s.begin(); it != s.end(); it++)
+    *it = ascii_lower(*it);
+}
+
+/* Fills in prefix with the literal text a subject matching regex must
+   begin with, and literal with the longest other run of literal text it
+   must contain. Either may be left empty. */
+static void extract_required_literals(const char *regex, bool caseless,
+                                      std::string &prefix, std::string &literal) {
+  std::string run, best, anchored;
+  bool run_anchored = false;
+  const char *p = regex, *q;
+  int c, min, max;
+
+  prefix.clear();
+  literal.clear();
+
+  if (*p == '^') {
+    run_anchored = true;
+    p++;
+  }
+
+  for (;;) {
+    c = -1;
+    q = p + 1;
+    switch (*p) {
+    case '\0':
+      break;
+    case '|': case ')': case '*': case '+': case '?':
+      return;
+    case '(':
+      /* Inline option settings like (?i) change how the rest of the
+         pattern matches. Plain, lookaround, atomic and named groups are
+         just skipped over. */
+      if (p[1] == '?' && strchr(":=!<>#", p[2]) == NULL)
+        return;
+      q = regex_skip_group(p);
+      if (q == NULL)
+        return;
+      break;
+    case '[':
+      q = regex_skip_class(p);
+      if (q == NULL)
+        return;
+      break;
+    case '\\':
+      q = regex_escape(p, &c);
+      if (q == NULL)
+        return;
+      break;
+    case '.': case '^': case '$':
+      break;
+    default:
+      c = (unsigned char) *p;
+      break;
+    }
+
+    if (*p != '\0')
+      q = regex_quantifier(q, &min, &max);
+    else
+      min = 0;
+
+    if (c >= 0 && min > 0) {
+      run.append(MIN(min, 32), (char) c);
+      if (max == min && min <= 32) {
+        p = q;
+        continue;
+      }
+    }
+
+    /* This atom ends the current run of literal text. */
+    if (run_anchored)
+      anchored = run;
+    else if (run.length() > best.length())
+      best = run;
+    run.clear();
+    run_anchored = false;
+
+    if (*p == '\0')
+      break;
+    p = q;
+  }
+
+  prefix = anchored;
+  literal = best;
+  if (caseless) {
+    lowercase_literal(prefix);
+    lowercase_literal(literal);
+  }
+}
+
+/* Decides with a single pass over a response which of a probe's match
+   lines could possibly match it. The required literals of all the match
+   lines (see extract_required_literals) are searched for at once with an
+   Aho-Corasick automaton over lowercased text; case-sensitive literals
+   are lowercased too, which can only let extra lines through to PCRE.
+   Required prefixes are simply compared against the start of the
+   response. */
+class MatchPrefilter {
+public:
+  MatchPrefilter(std::vector<ServiceProbeMatch *> &matches);
+  // Sets candidates[i] to nonzero if matches[i] may match buf.
+  void getCandidates(const u8 *buf, int buflen, std::vector<char> &candidates) const;
+
+private:
+  struct Node {
+    int fail; // Longest proper suffix of this node that is also in the trie
+    int dict; // Nearest node along the fail chain with outputs, or -1
+    int edges, nedges; // Children, in the edges array sorted by byte
+    int outputs, noutputs; // Match indices, in the outputs array
+  };
+  struct Prefix {
+    int match;
+    std::string text;
+    bool caseless;
+  };
+  std::vector<Node> nodes;
+  std::vector<std::pair<u8, int> > edges;
+  std::vector<int> outputs;
+  int root[256];
+  std::vector<Prefix> prefixes;
+  // Matches without a required literal are always candidates.
+  std::vector<char> unfiltered;
+
+  int child(int node, u8 c) const;
+};
+
+MatchPrefilter::MatchPrefilter(std::vector<ServiceProbeMatch *> &matches) {
+  std::vector<std::map<u8, int> > trie(1);
+  std::vector<std::vector<int> > out(1);
+  std::vector<int> queue;
+  std::map<u8, int>::iterator mi;
+  unsigned int i, j;
+  int n;
+
+  unfiltered.resize(matches.size());
+  for (i = 0; i < matches.size(); i++) {
+    const std::string &literal = matches[i]->getRequiredLiteral();
+    const std::string &prefix = matches[i]->getRequiredPrefix();
+
+    if (!prefix.empty()) {
+      Prefix pf;
+      pf.match = i;
+      pf.text = prefix;
+      pf.caseless = matches[i]->isCaseless();
+      prefixes.push_back(pf);
+    }
+    if (literal.empty()) {
+      unfiltered[i] = 1;
+      continue;
+    }
+    n = 0;
+    for (j = 0; j < literal.length(); j++) {
+      u8 c = ascii_lower(literal[j]);
+      mi = trie[n].find(c);
+      if (mi == trie[n].end()) {
+        trie[n][c] = trie.size();
+        n = trie.size();
+        trie.push_back(std::map<u8, int>());
+        out.push_back(std::vector<int>());
+      } else {
+        n = mi->second;
+      }
+    }
+    out[n].push_back(i);
+  }
+
+  /* Flatten the trie, numbering nodes in breadth-first order so that the
+     fail links can be filled in as we go. */
+  std::vector<int> number(trie.size());
+  nodes.resize(trie.size());
+  queue.push_back(0);
+  number[0] = 0;
+  for (i = 0; i < queue.size(); i++) {
+    Node &node = nodes[number[queue[i]]];
+    node.edges = edges.size();
+    node.nedges = trie[queue[i]].size();
+    node.outputs = outputs.size();
+    node.noutputs = out[queue[i]].size();
+    outputs.insert(outputs.end(), out[queue[i]].begin(), out[queue[i]].end());
+    for (mi = trie[queue[i]].begin(); mi != trie[queue[i]].end(); mi++) {
+      number[mi->second] = queue.size();
+      edges.push_back(std::make_pair(mi->first, (int) queue.size()));
+      queue.push_back(mi->second);
+    }
+  }
+
+  for (i = 0; i < 256; i++)
+    root[i] = child(0, i);
+  nodes[0].fail = 0;
+  nodes[0].dict = -1;
+  for (i = 0; i < nodes.size(); i++) {
+    for (j = 0; j < (unsigned int) nodes[i].nedges; j++) {
+      u8 c = edges[nodes[i].edges + j].first;
+      Node &next = nodes[edges[nodes[i].edges + j].second];
+      if (i == 0) {
+        next.fail = 0;
+      } else {
+        n = nodes[i].fail;
+        while (n != 0 && child(n, c) < 0)
+          n = nodes[n].fail;
+        next.fail = (n == 0) ? MAX(root[c], 0) : child(n, c);
+      }
+      next.dict = nodes[next.fail].noutputs > 0 ? next.fail : nodes[next.fail].dict;
+    }
+  }
+}
+
+int MatchPrefilter::child(int node, u8 c) const {
+  int i;
+
+  for (i = nodes[node].edges; i < nodes[node].edges + nodes[node].nedges; i++) {
+    if (edges[i].first == c)
+      return edges[i].second;
+  }
+  return -1;
+}
+
+void MatchPrefilter::getCandidates(const u8 *buf, int buflen, std::vector<char> &candidates) const {
+  std::vector<Prefix>::const_iterator pi;
+  int i, j, n, next;
+
+  candidates = unfiltered;
+
+  if (nodes.size() > 1) {
+    n = 0;
+    for (i = 0; i < buflen; i++) {
+      u8 c = ascii_lower(buf[i]);
+      while (n != 0 && (next = child(n, c)) < 0)
+        n = nodes[n].fail;
+      if (n == 0)
+        n = MAX(root[c], 0);
+      else
+        n = next;
+      for (j = (nodes[n].noutputs > 0) ? n : nodes[n].dict; j > 0; j = nodes[j].dict) {
+        const int *o = &outputs[nodes[j].outputs];
+        for (int k = 0; k < nodes[j].noutputs; k++)
+          candidates[o[k]] = 1;
+      }
+    }
+  }
+
+  for (pi = prefixes.begin(); pi != prefixes.end(); pi++) {
+    if (!candidates[pi->match])
+      continue;
+    if ((int) pi->text.length() > buflen) {
+      candidates[pi->match] = 0;
+      continue;
+    }
+    for (i = 0; i < (int) pi->text.length(); i++) {
+      u8 c = pi->caseless ? ascii_lower(buf[i]) : buf[i];
+      if (c != (u8) pi->text[i])
+        break;
+    }
+    if (i < (int) pi->text.length())
+      candidates[pi->match] = 0;
+  }
+}
+
 // match text from the nmap-service-probes file.  This must be called
 // before you try and do anything with this match.  This function
 // should be passed the whole line starting with "match" or
@@ -433,10 +1150,13 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
     fatal("%s: illegal regexp on line %d of nmap-service-probes (at regexp offset %d): %s\n", __func__, lineno, pcre_erroffset, pcre_errptr);
 
   // Now study the regexp for greater efficiency
-  regex_extra = pcre_study(regex_compiled, 0, &pcre_errptr);
+  regex_extra = service_pcre_study(regex_compiled, &pcre_errptr);
   if (pcre_errptr != NULL)
     fatal("%s: failed to pcre_study regexp on line %d of nmap-service-probes: %s\n", __func__, lineno, pcre_errptr);
 
+  extract_required_literals(matchstr, matchops_ignorecase,
+                            required_prefix, required_literal);
+
   free(modestr);
   free(flags);
 
@@ -481,51 +1201,161 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   isInitialized = 1;
 }
 
+void ServiceProbeMatch::saveToCache(std::string &buf) {
+  std::vector<char *>::iterator it;
+  size_t size = 0;
+
+  assert(isInitialized);
+  cache_put_u32(buf, deflineno);
+  cache_put_u32(buf, isSoft | (matchops_ignorecase << 1) | (matchops_dotall << 2));
+  cache_put_str(buf, servicename);
+  cache_put_str(buf, matchstr);
+  cache_put_str(buf, product_template);
+  cache_put_str(buf, version_template);
+  cache_put_str(buf, info_template);
+  cache_put_str(buf, hostname_template);
+  cache_put_str(buf, ostype_template);
+  cache_put_str(buf, devicetype_template);
+  cache_put_u32(buf, cpe_templates.size());
+  for (it = cpe_templates.begin(); it != cpe_templates.end(); it++)
+    cache_put_str(buf, *it);
+  cache_put_bytes(buf, required_prefix.data(), required_prefix.length());
+  cache_put_bytes(buf, required_literal.data(), required_literal.length());
+
+  pcre_fullinfo(regex_compiled, NULL, PCRE_INFO_SIZE, &size);
+  cache_put_bytes(buf, regex_compiled, size);
+#ifndef PCRE_STUDY_JIT_COMPILE
+  size = 0;
+  if (regex_extra != NULL)
+    pcre_fullinfo(regex_compiled, regex_extra, PCRE_INFO_STUDYSIZE, &size);
+  cache_put_bytes(buf, size ? regex_extra->study_data : NULL, size);
+#endif
+}
+
+bool ServiceProbeMatch::loadFromCache(struct probe_cache_reader *r) {
+  const u8 *data;
+  u32 flags, n, size;
+  size_t realsize;
+  unsigned long options;
+
+  assert(!isInitialized);
+  isInitialized = true;
+  matchtype = SERVICEMATCH_REGEX;
+  deflineno = cache_get_u32(r);
+  flags = cache_get_u32(r);
+  isSoft = (flags & 1) != 0;
+  matchops_ignorecase = (flags & 2) != 0;
+  matchops_dotall = (flags & 4) != 0;
+  servicename = cache_get_str(r);
+  matchstr = cache_get_str(r);
+  product_template = cache_get_str(r);
+  version_template = cache_get_str(r);
+  info_template = cache_get_str(r);
+  hostname_template = cache_get_str(r);
+  ostype_template = cache_get_str(r);
+  devicetype_template = cache_get_str(r);
+  n = cache_get_u32(r);
+  while (r->ok && n-- > 0)
+    cpe_templates.push_back(cache_get_str(r));
+  cache_get_string(r, required_prefix);
+  cache_get_string(r, required_literal);
+
+  data = cache_get_bytes(r, &size);
+  if (!r->ok || servicename == NULL || matchstr == NULL || size == 0)
+    return false;
+  regex_compiled = (pcre *) (pcre_malloc)(size);
+  if (regex_compiled == NULL)
+    fatal("%s: out of memory", __func__);
+  memcpy(regex_compiled, data, size);
+  /* The cache header ties the pattern to this PCRE build; this only
+     catches a pattern that doesn't belong to its match line. */
+  if (pcre_fullinfo(regex_compiled, NULL, PCRE_INFO_SIZE, &realsize) != 0
+      || realsize != size
+      || pcre_fullinfo(regex_compiled, NULL, PCRE_INFO_OPTIONS, &options) != 0
+      || ((options & PCRE_CASELESS) != 0) != matchops_ignorecase
+      || ((options & PCRE_DOTALL) != 0) != matchops_dotall)
+    return false;
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+  /* Machine code can't be cached, so study the pattern again. */
+  const char *pcre_errptr;
+  regex_extra = service_pcre_study(regex_compiled, &pcre_errptr);
+  if (pcre_errptr != NULL)
+    return false;
+#else
+  data = cache_get_bytes(r, &size);
+  if (!r->ok)
+    return false;
+  if (size > 0) {
+    /* Recreate the single allocation that pcre_study makes. */
+    regex_extra = (pcre_extra *) (pcre_malloc)(sizeof(pcre_extra) + size);
+    if (regex_extra == NULL)
+      fatal("%s: out of memory", __func__);
+    memset(regex_extra, 0, sizeof(pcre_extra));
+    regex_extra->flags = PCRE_EXTRA_STUDY_DATA;
+    regex_extra->study_data = regex_extra + 1;
+    memcpy(regex_extra->study_data, data, size);
+  }
+#endif
+
+  return true;
+}
+
   // If the buf (of length buflen) match the regex in this
   // ServiceProbeMatch, returns the details of the match (service
   // name, version number if applicable, and whether this is a "soft"
   // match.  If the buf doesn't match, the serviceName field in the
   // structure will be NULL.  The MatchDetails sructure returned is
-  // only valid until the next time this function is called. The only
-  // exception is that the serviceName field can be saved throughought
-  // program execution.  If no version matched, that field will be
-  // NULL.
-const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int buflen) {
+  // stored in result and only valid for as long as result is. The
+  // only exception is that the serviceName field can be saved
+  // throughought program execution.  If no version matched, that field
+  // will be NULL.
+const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int buflen,
+                                                        struct MatchResult *result) {
+  struct timeval start;
   int rc;
-  static char product[80];
-  static char version[80];
-  static char info[256];  /* We will truncate with ... later */
-  static char hostname[80];
-  static char ostype[32];
-  static char devicetype[32];
-  static char cpe_a[80], cpe_h[80], cpe_o[80];
   char *bufc = (char *) buf;
   int ovector[150]; // allows 50 substring matches (including the overall match)
   assert(isInitialized);
 
   assert (matchtype == SERVICEMATCH_REGEX);
+  assert(result != NULL);
+
+  struct MatchDetails &MD_return = result->MD;
+  char *product = result->product, *version = result->version, *info = result->info;
+  char *hostname = result->hostname, *ostype = result->ostype, *devicetype = result->devicetype;
+  char *cpe_a = result->cpe_a, *cpe_h = result->cpe_h, *cpe_o = result->cpe_o;
 
   // Clear out the output struct
   memset(&MD_return, 0, sizeof(MD_return));
   MD_return.isSoft = isSoft;
 
+  if (match_profiling)
+    gettimeofday(&start, NULL);
   rc = pcre_exec(regex_compiled, regex_extra, bufc, buflen, 0, 0, ovector, sizeof(ovector) / sizeof(*ovector));
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (rc == PCRE_ERROR_JIT_STACKLIMIT) {
+    // The JIT stack is exhausted. The interpreter has no such limit (only
+    // the match limit), so it gives the answer a non-JIT build would.
+    pcre_extra nojit = *regex_extra;
+
+    nojit.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+    result->error.note(rc, this);
+    rc = pcre_exec(regex_compiled, &nojit, bufc, buflen, 0, 0, ovector, sizeof(ovector) / sizeof(*ovector));
+  }
+#endif
+  if (match_profiling)
+    recordProfile(&start, rc);
   if (rc < 0) {
-#ifdef PCRE_ERROR_MATCHLIMIT  // earlier PCRE versions lack this
-    if (rc == PCRE_ERROR_MATCHLIMIT) {
-      if (o.debugging || o.verbose > 1) 
-	error("Warning: Hit PCRE_ERROR_MATCHLIMIT when probing for service %s with the regex '%s'", servicename, matchstr);
-    } else
-#endif // PCRE_ERROR_MATCHLIMIT
-      if (rc != PCRE_ERROR_NOMATCH) {
-	fatal("Unexpected PCRE error (%d) when probing for service %s with the regex '%s'", rc, servicename, matchstr);
-      }
+    if (rc != PCRE_ERROR_NOMATCH)
+      result->error.note(rc, this);
   } else {
     // Yeah!  Match apparently succeeded.
     // Now lets get the version number if available
-    getVersionStr(buf, buflen, ovector, rc, product, sizeof(product), version, sizeof(version), info, sizeof(info),
-                  hostname, sizeof(hostname), ostype, sizeof(ostype), devicetype, sizeof(devicetype),
-                  cpe_a, sizeof(cpe_a), cpe_h, sizeof(cpe_h), cpe_o, sizeof(cpe_o));
+    getVersionStr(buf, buflen, ovector, rc, product, sizeof(result->product), version, sizeof(result->version),
+                  info, sizeof(result->info), hostname, sizeof(result->hostname), ostype, sizeof(result->ostype),
+                  devicetype, sizeof(result->devicetype), cpe_a, sizeof(result->cpe_a),
+                  cpe_h, sizeof(result->cpe_h), cpe_o, sizeof(result->cpe_o));
     if (*product) MD_return.product = product;
     if (*version) MD_return.version = version;
     if (*info) MD_return.info = info;
@@ -543,6 +1373,145 @@ const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int bufle
   return &MD_return;
 }
 
+// How serious a PCRE error is, for MatchError::note.
+static int pcre_error_rank(int rc) {
+  if (rc == 0)
+    return 0;
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (rc == PCRE_ERROR_JIT_STACKLIMIT)
+    return 1; // Only means the match was retried without JIT
+#endif
+#ifdef PCRE_ERROR_MATCHLIMIT  // earlier PCRE versions lack this
+  if (rc == PCRE_ERROR_MATCHLIMIT)
+    return 2;
+#endif
+  return 3;
+}
+
+void MatchError::note(int rc, ServiceProbeMatch *match) {
+  if (pcre_error_rank(rc) > pcre_error_rank(this->rc)) {
+    this->rc = rc;
+    this->match = match;
+  }
+}
+
+void MatchError::report() {
+  if (rc == 0)
+    return;
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (rc == PCRE_ERROR_JIT_STACKLIMIT) {
+    if (o.debugging > 1)
+      error("Hit PCRE_ERROR_JIT_STACKLIMIT when probing for service %s with the regex '%s', retried without JIT", match->getName(), match->getPattern());
+  } else
+#endif
+#ifdef PCRE_ERROR_MATCHLIMIT  // earlier PCRE versions lack this
+  if (rc == PCRE_ERROR_MATCHLIMIT) {
+    if (o.debugging || o.verbose > 1)
+      error("Warning: Hit PCRE_ERROR_MATCHLIMIT when probing for service %s with the regex '%s'", match->getName(), match->getPattern());
+  } else
+#endif // PCRE_ERROR_MATCHLIMIT
+  {
+    fatal("Unexpected PCRE error (%d) when probing for service %s with the regex '%s'", rc, match->getName(), match->getPattern());
+  }
+  rc = 0;
+  match = NULL;
+}
+
+void ServiceProbeMatch::recordProfile(const struct timeval *start, int rc) {
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&match_profile_lock);
+#endif
+  profile.calls++;
+  profile.usecs += TIMEVAL_SUBTRACT(end, *start);
+  if (rc >= 0)
+    profile.matches++;
+#ifdef PCRE_ERROR_MATCHLIMIT
+  else if (rc == PCRE_ERROR_MATCHLIMIT)
+    profile.limit_hits++;
+#endif
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&match_profile_lock);
+#endif
+}
+
+void enable_service_match_profiling(void) {
+  match_profiling = true;
+}
+
+struct MatchProfileEntry {
+  ServiceProbe *probe;
+  ServiceProbeMatch *match;
+};
+
+static bool match_profile_cmp(const MatchProfileEntry &a, const MatchProfileEntry &b) {
+  const struct MatchProfile &pa = a.match->getProfile();
+  const struct MatchProfile &pb = b.match->getProfile();
+
+  if (pa.usecs != pb.usecs)
+    return pa.usecs > pb.usecs;
+  return pa.calls > pb.calls;
+}
+
+void print_service_match_profile(AllProbes *AP, FILE *fp) {
+  std::vector<MatchProfileEntry> entries;
+  std::vector<ServiceProbe *> probes;
+  std::vector<ServiceProbeMatch *>::const_iterator mi;
+  MatchProfileEntry entry;
+  unsigned long calls = 0, limit_hits = 0;
+  long long usecs = 0;
+  unsigned int i;
+
+  if (AP->nullProbe != NULL)
+    probes.push_back(AP->nullProbe);
+  probes.insert(probes.end(), AP->probes.begin(), AP->probes.end());
+  for (i = 0; i < probes.size(); i++) {
+    const std::vector<ServiceProbeMatch *> &matches = probes[i]->getMatches();
+    for (mi = matches.begin(); mi != matches.end(); mi++) {
+      const struct MatchProfile &prof = (*mi)->getProfile();
+      if (prof.calls == 0)
+        continue;
+      entry.probe = probes[i];
+      entry.match = *mi;
+      entries.push_back(entry);
+      calls += prof.calls;
+      limit_hits += prof.limit_hits;
+      usecs += prof.usecs;
+    }
+  }
+  std::sort(entries.begin(), entries.end(), match_profile_cmp);
+
+  fprintf(fp, "# Service match profile: %u match lines tried, %lu pcre_exec calls, %.1f ms, %lu match limit hits\n",
+          (unsigned int) entries.size(), calls, usecs / 1000.0, limit_hits);
+  fprintf(fp, "# %6s %10s %8s %6s %10s %8s %-20s %-16s %s\n", "LINE", "CALLS",
+          "MATCHES", "LIMITS", "TOTAL MS", "US/CALL", "PROBE", "SERVICE", "PATTERN");
+  for (i = 0; i < entries.size(); i++) {
+    const struct MatchProfile &prof = entries[i].match->getProfile();
+    fprintf(fp, "%8d %10lu %8lu %6lu %10.3f %8.2f %-20s %-16s %.60s%s\n",
+            entries[i].match->getLineNo(), prof.calls, prof.matches,
+            prof.limit_hits, prof.usecs / 1000.0, (double) prof.usecs / prof.calls,
+            entries[i].probe->getName(), entries[i].match->getName(),
+            entries[i].match->getPattern(),
+            strlen(entries[i].match->getPattern()) > 60 ? "..." : "");
+  }
+}
+
+void write_service_match_profile(const char *filename) {
+  FILE *fp;
+
+  fp = fopen(filename, "w");
+  if (fp == NULL) {
+    error("Failed to open %s for writing the service match profile: %s", filename, strerror(errno));
+    return;
+  }
+  print_service_match_profile(AllProbes::service_scan_init(), fp);
+  fclose(fp);
+  if (o.verbose)
+    log_write(LOG_PLAIN, "Wrote the service match profile to %s\n", filename);
+}
+
 // This simple function parses arguments out of a string.  The string
 // starts with the first argument.  Each argument can be a string or
 // an integer.  Strings must be enclosed in double quotes ("").  Most
@@ -1012,12 +1981,14 @@ ServiceProbe::ServiceProbe() {
   probename = NULL;
   probestring = NULL;
   totalwaitms = DEFAULT_SERVICEWAITMS;
+  reuse = false;
   probestringlen = 0; probeprotocol = -1;
   // The default rarity level for a probe without a rarity
   // directive - should almost never have to be relied upon.
   rarity = 5;
   fallbackStr = NULL;
   for (i=0; i<MAXFALLBACKS+1; i++) fallbacks[i] = NULL;
+  prefilter = NULL;
 }
 
 ServiceProbe::~ServiceProbe() {
@@ -1031,6 +2002,7 @@ ServiceProbe::~ServiceProbe() {
   }
 
   if (fallbackStr) free(fallbackStr);
+  delete prefilter;
 }
 
   // Parses the "probe " line in the nmap-service-probes file.  Pass the rest of the line
@@ -1175,6 +2147,17 @@ bool ServiceProbe::portIsProbable(enum service_tunnel_type tunnel, u16 portno) {
   return true;
 }
 
+// Returns the match of this probe defined on line lineno, or NULL.
+ServiceProbeMatch *ServiceProbe::getMatchByLine(int lineno) {
+  std::vector<ServiceProbeMatch *>::iterator vi;
+
+  for (vi = matches.begin(); vi != matches.end(); vi++) {
+    if ((*vi)->getLineNo() == lineno)
+      return *vi;
+  }
+  return NULL;
+}
+
  // Returns true if the passed in service name is among those that can
   // be detected by the matches in this probe;
 bool ServiceProbe::serviceIsPossible(const char *sname) {
@@ -1217,16 +2200,88 @@ void ServiceProbe::addMatch(const char *match, int lineno) {
   if (!serviceIsPossible(sname))
     detectedServices.push_back(sname);
   matches.push_back(newmatch);
+  delete prefilter;
+  prefilter = NULL;
 }
 
-/* Parses the given nmap-service-probes file into the AP class Must
-   NOT be made static because I have external maintenance tools
-   (servicematch) which use this */
-void parse_nmap_service_probe_file(AllProbes *AP, char *filename) {
-  ServiceProbe *newProbe = NULL;
-  char line[2048];
-  int lineno = 0;
-  FILE *fp;
+void ServiceProbe::saveToCache(std::string &buf) {
+  std::vector<const char *>::iterator si;
+  unsigned int i;
+
+  cache_put_str(buf, probename);
+  cache_put_bytes(buf, probestring, probestringlen);
+  cache_put_u32(buf, probeprotocol);
+  cache_put_u32(buf, rarity);
+  cache_put_u32(buf, totalwaitms);
+  cache_put_u32(buf, reuse);
+  cache_put_bytes(buf, probableports.empty() ? NULL : &probableports[0],
+                  probableports.size() * sizeof(u16));
+  cache_put_bytes(buf, probablesslports.empty() ? NULL : &probablesslports[0],
+                  probablesslports.size() * sizeof(u16));
+  cache_put_u32(buf, matches.size());
+  for (i = 0; i < matches.size(); i++)
+    matches[i]->saveToCache(buf);
+  /* detectedServices points into the matches' service names. Store the
+     index of the match each one came from. */
+  cache_put_u32(buf, detectedServices.size());
+  for (si = detectedServices.begin(); si != detectedServices.end(); si++) {
+    for (i = 0; i < matches.size() && matches[i]->getName() != *si; i++)
+      ;
+    assert(i < matches.size());
+    cache_put_u32(buf, i);
+  }
+}
+
+bool ServiceProbe::loadFromCache(struct probe_cache_reader *r) {
+  ServiceProbeMatch *match;
+  const u8 *data;
+  u32 i, n, size;
+
+  probename = cache_get_str(r);
+  data = cache_get_bytes(r, &size);
+  setProbeString(data, size);
+  probeprotocol = cache_get_u32(r);
+  rarity = cache_get_u32(r);
+  totalwaitms = cache_get_u32(r);
+  reuse = cache_get_u32(r) != 0;
+  data = cache_get_bytes(r, &size);
+  probableports.resize(size / sizeof(u16));
+  if (size > 0)
+    memcpy(&probableports[0], data, probableports.size() * sizeof(u16));
+  data = cache_get_bytes(r, &size);
+  probablesslports.resize(size / sizeof(u16));
+  if (size > 0)
+    memcpy(&probablesslports[0], data, probablesslports.size() * sizeof(u16));
+  if (!r->ok || probename == NULL
+      || (probeprotocol != IPPROTO_TCP && probeprotocol != IPPROTO_UDP))
+    return false;
+
+  n = cache_get_u32(r);
+  for (i = 0; r->ok && i < n; i++) {
+    match = new ServiceProbeMatch();
+    matches.push_back(match);
+    if (!match->loadFromCache(r))
+      return false;
+  }
+  n = cache_get_u32(r);
+  for (i = 0; r->ok && i < n; i++) {
+    u32 index = cache_get_u32(r);
+    if (index >= matches.size())
+      return false;
+    detectedServices.push_back(matches[index]->getName());
+  }
+
+  return r->ok;
+}
+
+/* Parses the given nmap-service-probes file into the AP class Must
+   NOT be made static because maintenance tools (servicematch.cc) use
+   this */
+void parse_nmap_service_probe_file(AllProbes *AP, char *filename) {
+  ServiceProbe *newProbe = NULL;
+  char line[2048];
+  int lineno = 0;
+  FILE *fp;
 
   // We better start by opening the file
   fp = fopen(filename, "r");
@@ -1282,6 +2337,8 @@ void parse_nmap_service_probe_file(AllProbes *AP, char *filename) {
 	if (waitms < 100 || waitms > 300000)
 	  fatal("Error on line %d of nmap-service-probes file (%s): bad totalwaitms value.  Must be between 100 and 300000 milliseconds", lineno, filename);
 	newProbe->totalwaitms = waitms;
+      } else if (strncmp(line, "reuse", 5) == 0 && (line[5] == '\0' || isspace((int) (unsigned char) line[5]))) {
+	newProbe->reuse = true;
       } else if (strncmp(line, "match ", 6) == 0 || strncmp(line, "softmatch ", 10) == 0) {
 	newProbe->addMatch(line, lineno);
       } else if (strncmp(line, "Exclude ", 8) == 0) {
@@ -1303,16 +2360,106 @@ void parse_nmap_service_probe_file(AllProbes *AP, char *filename) {
   AP->compileFallbacks();
 }
 
+/* pcre_config options that change the layout of compiled patterns. */
+static const int probe_cache_pcre_config[] = {
+  PCRE_CONFIG_UTF8, PCRE_CONFIG_NEWLINE, PCRE_CONFIG_LINK_SIZE,
+  PCRE_CONFIG_UNICODE_PROPERTIES, PCRE_CONFIG_BSR
+};
+
+/* The header of the probe database cache. It ties the cache to the exact
+   contents of nmap-service-probes (by a 64-bit FNV-1a hash, which is
+   plenty for noticing edits and much faster than a CRC) and to the PCRE
+   build that compiled the patterns it holds: its version, the headers
+   Nmap was built with and the configuration options that affect compiled
+   patterns. The version is written in host byte order, so a cache from a
+   machine of the other endianness is rejected too. A cache that doesn't
+   match is ignored and the patterns are compiled again. */
+static std::string probe_cache_header(const std::string &probes) {
+  std::string header(PROBE_CACHE_MAGIC);
+  unsigned long long hash = fnv1a64(probes.data(), probes.length());
+  unsigned int i;
+  int value;
+
+  cache_put_u32(header, PROBE_CACHE_VERSION);
+  cache_put_u32(header, sizeof(void *));
+  cache_put_str(header, pcre_version());
+  cache_put_u32(header, PCRE_MAJOR);
+  cache_put_u32(header, PCRE_MINOR);
+  for (i = 0; i < sizeof(probe_cache_pcre_config) / sizeof(*probe_cache_pcre_config); i++) {
+    value = -1;
+    pcre_config(probe_cache_pcre_config[i], &value);
+    cache_put_u32(header, value);
+  }
+  cache_put_u32(header, probes.length());
+  cache_put_u32(header, (u32) hash);
+  cache_put_u32(header, (u32) (hash >> 32));
+  return header;
+}
+
+/* Fills in AP from the cache if the cache matches the given contents of
+   nmap-service-probes. AP is left untouched on failure. */
+static bool load_probe_cache(AllProbes *AP, const char *cachefile, const std::string &probes) {
+  struct probe_cache_reader r;
+  std::string header, contents;
+  AllProbes *cached;
+  bool ok;
+
+  if (!read_whole_file(cachefile, contents))
+    return false;
+  header = probe_cache_header(probes);
+  if (contents.compare(0, header.length(), header) != 0)
+    return false;
+
+  r.p = (const u8 *) contents.data() + header.length();
+  r.end = (const u8 *) contents.data() + contents.length();
+  r.ok = true;
+  cached = new AllProbes();
+  ok = cached->loadFromCache(&r);
+  if (ok) {
+    AP->probes.swap(cached->probes);
+    std::swap(AP->nullProbe, cached->nullProbe);
+    std::swap(AP->excludedports, cached->excludedports);
+    AP->excluded_seen = cached->excluded_seen;
+  }
+  delete cached;
+
+  return ok;
+}
+
+static void save_probe_cache(AllProbes *AP, const char *cachefile, const std::string &probes) {
+  std::string contents;
+
+  contents = probe_cache_header(probes);
+  AP->saveToCache(contents);
+
+  if (!write_file_atomically(cachefile, contents) && o.debugging)
+    error("Failed to write version detection cache %s", cachefile);
+}
+
 // Parses the nmap-service-probes file, and adds each probe to
-// the already-created 'probes' vector.
+// the already-created 'probes' vector.  A compiled copy of the
+// database is cached in the user's Nmap directory, and used instead
+// of parsing the file again for as long as the file is unchanged.
 static void parse_nmap_service_probes(AllProbes *AP) {
   char filename[256];
+  char cachefile[512];
+  std::string probes;
+  bool cached;
 
   if (nmap_fetchfile(filename, sizeof(filename), "nmap-service-probes") != 1){
     fatal("Service scan requested but I cannot find nmap-service-probes file.  It should be in %s, ~/.nmap/ or .", NMAPDATADIR);
   }
 
-  parse_nmap_service_probe_file(AP, filename);
+  cached = read_whole_file(filename, probes)
+    && nmap_cachefile(cachefile, sizeof(cachefile), PROBE_CACHE_FILE);
+  if (cached && load_probe_cache(AP, cachefile, probes)) {
+    if (o.debugging)
+      log_write(LOG_PLAIN, "Loaded %s from cache %s\n", filename, cachefile);
+  } else {
+    parse_nmap_service_probe_file(AP, filename);
+    if (cached)
+      save_probe_cache(AP, cachefile, probes);
+  }
   /* Record where this data file was found. */
   o.loaded_data_files["nmap-service-probes"] = filename;
 }
@@ -1359,21 +2506,35 @@ int AllProbes::check_excluded_port(unsigned short portno, int proto)
   return excluded;
 }
 
+void ServiceProbe::buildPrefilter() {
+  if (prefilter == NULL)
+    prefilter = new MatchPrefilter(matches);
+}
+
 // If the buf (of length buflen) matches one of the regexes in this
 // ServiceProbe, returns the details of nth match (service name,
 // version number if applicable, and whether this is a "soft" match.
 // If the buf doesn't match, the serviceName field in the structure
-// will be NULL.  The MatchDetails returned is only valid until the
-// next time this function is called.  The only exception is that the
+// will be NULL.  The MatchDetails returned is stored in result and
+// only valid for as long as result is.  The only exception is that the
 // serviceName field can be saved throughought program execution.  If
 // no version matched, that field will be NULL. This function may
 // return NULL if there are no match lines at all in this probe.
-const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, int n = 0) {
-  std::vector<ServiceProbeMatch *>::iterator vi;
+const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, int n,
+                                                   struct MatchResult *result) {
+  std::vector<char> candidates;
   const struct MatchDetails *MD;
+  unsigned int i;
 
-  for(vi = matches.begin(); vi != matches.end(); vi++) {
-    MD = (*vi)->testMatch(buf, buflen);
+  // Lines are still tried in file order, so skipping the ones that
+  // cannot match doesn't change which one wins.
+  buildPrefilter();
+  prefilter->getCandidates(buf, buflen, candidates);
+
+  for (i = 0; i < matches.size(); i++) {
+    if (!candidates[i])
+      continue;
+    MD = matches[i]->testMatch(buf, buflen, result);
     if (MD->serviceName) {
       if (n == 0)
         return MD;
@@ -1513,17 +2674,245 @@ void AllProbes::compileFallbacks() {
 
 }
 
+static void cache_put_ports(std::string &buf, const unsigned short *ports, int count) {
+  cache_put_bytes(buf, ports, count * sizeof(*ports));
+}
+
+static void cache_get_ports(struct probe_cache_reader *r, unsigned short **ports, int *count) {
+  const u8 *data;
+  u32 size;
+
+  data = cache_get_bytes(r, &size);
+  *count = size / sizeof(**ports);
+  *ports = NULL;
+  if (*count > 0) {
+    *ports = (unsigned short *) safe_malloc(*count * sizeof(**ports));
+    memcpy(*ports, data, *count * sizeof(**ports));
+  }
+}
+
+void AllProbes::saveToCache(std::string &buf) {
+  std::vector<ServiceProbe *>::iterator vi;
+  ServiceProbe *probe;
+  u32 i, j;
+
+  cache_put_u32(buf, excluded_seen);
+  cache_put_ports(buf, excludedports.tcp_ports, excludedports.tcp_count);
+  cache_put_ports(buf, excludedports.udp_ports, excludedports.udp_count);
+  cache_put_ports(buf, excludedports.sctp_ports, excludedports.sctp_count);
+  cache_put_ports(buf, excludedports.prots, excludedports.prot_count);
+
+  cache_put_u32(buf, nullProbe != NULL);
+  if (nullProbe != NULL)
+    nullProbe->saveToCache(buf);
+  cache_put_u32(buf, probes.size());
+  for (vi = probes.begin(); vi != probes.end(); vi++)
+    (*vi)->saveToCache(buf);
+
+  /* Fallbacks are stored as indices into probes, with probes.size()
+     standing for the NULL probe. */
+  for (i = 0; i <= probes.size(); i++) {
+    probe = (i < probes.size()) ? probes[i] : nullProbe;
+    if (probe == NULL)
+      continue;
+    for (j = 0; probe->fallbacks[j] != NULL; j++)
+      ;
+    cache_put_u32(buf, j);
+    for (j = 0; probe->fallbacks[j] != NULL; j++) {
+      if (probe->fallbacks[j] == nullProbe)
+        cache_put_u32(buf, probes.size());
+      else
+        cache_put_u32(buf, std::find(probes.begin(), probes.end(), probe->fallbacks[j]) - probes.begin());
+    }
+  }
+}
+
+bool AllProbes::loadFromCache(struct probe_cache_reader *r) {
+  ServiceProbe *probe;
+  u32 i, j, n, index;
+
+  excluded_seen = cache_get_u32(r) != 0;
+  cache_get_ports(r, &excludedports.tcp_ports, &excludedports.tcp_count);
+  cache_get_ports(r, &excludedports.udp_ports, &excludedports.udp_count);
+  cache_get_ports(r, &excludedports.sctp_ports, &excludedports.sctp_count);
+  cache_get_ports(r, &excludedports.prots, &excludedports.prot_count);
+
+  if (cache_get_u32(r)) {
+    nullProbe = new ServiceProbe();
+    if (!nullProbe->loadFromCache(r) || !nullProbe->isNullProbe())
+      return false;
+  }
+  n = cache_get_u32(r);
+  for (i = 0; r->ok && i < n; i++) {
+    probe = new ServiceProbe();
+    probes.push_back(probe);
+    if (!probe->loadFromCache(r))
+      return false;
+  }
+
+  for (i = 0; r->ok && i <= probes.size(); i++) {
+    probe = (i < probes.size()) ? probes[i] : nullProbe;
+    if (probe == NULL)
+      continue;
+    n = cache_get_u32(r);
+    if (n > MAXFALLBACKS)
+      return false;
+    for (j = 0; j < n; j++) {
+      index = cache_get_u32(r);
+      if (index > probes.size() || (index == probes.size() && nullProbe == NULL))
+        return false;
+      probe->fallbacks[j] = (index < probes.size()) ? probes[index] : nullProbe;
+    }
+  }
+
+  return r->ok && r->p == r->end;
+}
+
+
+
+/* Counts of which probes produced hard matches, for --version-stats. The
+   counts are kept per port ("port 8080/tcp") and per service name of the
+   soft match that came before the hard one ("soft http"), and saved in a
+   text file with one "<count> <key> <probe name>" line per pair. */
+class ProbeStats {
+public:
+  void load(const char *filename);
+  bool save(const char *filename);
+  void record(const std::string &key, const char *probename);
+  // Fills names with the probes recorded for key, most successful first.
+  void ranking(const std::string &key, std::vector<std::string> &names);
+  bool loaded;
+
+  ProbeStats() { loaded = false; }
+
+private:
+  std::map<std::string, std::map<std::string, unsigned int> > counts;
+};
+
+static ProbeStats probe_stats;
 
+void ProbeStats::load(const char *filename) {
+  char line[512], kind[16], what[128], probename[64];
+  unsigned int count;
+  FILE *fp;
+
+  loaded = true;
+  fp = fopen(filename, "r");
+  if (fp == NULL)
+    return;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%u %15s %127s %63s", &count, kind, what, probename) != 4)
+      continue;
+    counts[std::string(kind) + " " + what][probename] += count;
+  }
+  fclose(fp);
+}
+
+bool ProbeStats::save(const char *filename) {
+  std::map<std::string, std::map<std::string, unsigned int> >::iterator key;
+  std::map<std::string, unsigned int>::iterator probe;
+  std::string contents;
+  char line[512];
+
+  contents = "# Nmap version detection statistics: hard matches, port or soft match, probe\n";
+  for (key = counts.begin(); key != counts.end(); key++) {
+    for (probe = key->second.begin(); probe != key->second.end(); probe++) {
+      Snprintf(line, sizeof(line), "%u %s %s\n", probe->second,
+               key->first.c_str(), probe->first.c_str());
+      contents += line;
+    }
+  }
+  return write_file_atomically(filename, contents);
+}
+
+void ProbeStats::record(const std::string &key, const char *probename) {
+  counts[key][probename]++;
+}
+
+static bool probe_count_greater(const std::pair<unsigned int, std::string> &a,
+                                const std::pair<unsigned int, std::string> &b) {
+  return a.first > b.first;
+}
+
+void ProbeStats::ranking(const std::string &key, std::vector<std::string> &names) {
+  std::map<std::string, std::map<std::string, unsigned int> >::iterator k;
+  std::map<std::string, unsigned int>::iterator probe;
+  std::vector<std::pair<unsigned int, std::string> > ranked;
+  unsigned int i;
+
+  names.clear();
+  k = counts.find(key);
+  if (k == counts.end())
+    return;
+  for (probe = k->second.begin(); probe != k->second.end(); probe++)
+    ranked.push_back(std::make_pair(probe->second, probe->first));
+  std::stable_sort(ranked.begin(), ranked.end(), probe_count_greater);
+  for (i = 0; i < ranked.size(); i++)
+    names.push_back(ranked[i].second);
+}
+
+/* Free response buffers, by size class. Only the nsock loop thread touches
+   probe responses, so this needs no locking. */
+static std::vector<u8 *> respbuf_pool[RESPBUF_CLASSES];
+
+/* Returns a buffer of at least len bytes, storing its actual size in
+   *alloc. */
+static u8 *get_response_buffer(int len, int *alloc) {
+  int cls, size;
+
+  for (cls = 0, size = 1 << RESPBUF_MIN_SHIFT; size < len; cls++)
+    size <<= 1;
+  *alloc = size;
+  if (cls < RESPBUF_CLASSES && !respbuf_pool[cls].empty()) {
+    u8 *buf = respbuf_pool[cls].back();
+    respbuf_pool[cls].pop_back();
+    return buf;
+  }
+  return (u8 *) safe_malloc(size);
+}
+
+/* Gives back a buffer obtained from get_response_buffer. */
+static void release_response_buffer(u8 *buf, int alloc) {
+  int cls, size;
+
+  for (cls = 0, size = 1 << RESPBUF_MIN_SHIFT; size < alloc; cls++)
+    size <<= 1;
+  if (cls < RESPBUF_CLASSES && respbuf_pool[cls].size() < RESPBUF_POOL_DEPTH)
+    respbuf_pool[cls].push_back(buf);
+  else
+    free(buf);
+}
+
+/* Frees all pooled response buffers, at the end of a service scan. */
+static void free_response_buffers() {
+  int cls;
+  unsigned int i;
+
+  for (cls = 0; cls < RESPBUF_CLASSES; cls++) {
+    for (i = 0; i < respbuf_pool[cls].size(); i++)
+      free(respbuf_pool[cls][i]);
+    respbuf_pool[cls].clear();
+  }
+}
 
 ServiceNFO::ServiceNFO(AllProbes *newAP) {
   target = NULL;
   probe_matched = NULL;
   niod = NULL;
+  probe_sent_on_connect = false;
+  reusing_connection = false;
+  cached_probe = hardmatch_probe = learned_probe = NULL;
+  cached_match = NULL;
+  softmatch_service = NULL;
+  cached_fallback = hardmatch_lineno = 0;
+  cached_hash = hardmatch_hash = 0;
   probe_state = PROBESTATE_INITIAL;
   portno = proto = 0;
   AP = newAP;
   currentresp = NULL; 
-  currentresplen = 0;
+  currentresplen = currentrespalloc = 0;
   product_matched[0] = version_matched[0] = extrainfo_matched[0] = '\0';
   hostname_matched[0] = ostype_matched[0] = devicetype_matched[0] = '\0';
   cpe_a_matched[0] = cpe_h_matched[0] = cpe_o_matched[0] = '\0';
@@ -1533,10 +2922,11 @@ ServiceNFO::ServiceNFO(AllProbes *newAP) {
   servicefplen = servicefpalloc = 0;
   servicefp = NULL;
   memset(&currentprobe_exec_time, 0, sizeof(currentprobe_exec_time));
+  memset(&connect_start, 0, sizeof(connect_start));
 }
 
 ServiceNFO::~ServiceNFO() {
-  if (currentresp) free(currentresp);
+  if (currentresp) release_response_buffer(currentresp, currentrespalloc);
   if (servicefp) free(servicefp);
   servicefp = NULL;
   servicefpalloc = servicefplen = 0;
@@ -1547,27 +2937,98 @@ ServiceNFO::~ServiceNFO() {
 #endif
 }
 
-  // Adds a character to servicefp.  Takes care of word wrapping if
-  // necessary at the given (wrapat) column.  Chars will only be
-  // written if there is enough space.  Otherwise it exits.
-void ServiceNFO::addServiceChar(const char c, int wrapat) {
+void ServiceNFO::reserveServiceFP(int len) {
+  int needed = servicefplen + len;
 
-  if (servicefpalloc - servicefplen < 6)
-    fatal("%s - out of space for servicefp", __func__);
+  if (needed <= servicefpalloc)
+    return;
+  // No point in tiny allocations, and grow geometrically so a
+  // fingerprint built from many responses is not copied over and over.
+  needed = MAX(needed, MAX(512, servicefpalloc * 2));
+  servicefp = (char *) safe_realloc(servicefp, needed);
+  servicefpalloc = needed;
+}
 
-  if (servicefplen % (wrapat+1) == wrapat) {
-    // we need to start a new line
-    memcpy(servicefp + servicefplen, "\nSF:", 4);
-    servicefplen += 4;
+void ServiceNFO::addServiceData(const char *s, int len) {
+  // Each line holds SERVICEFP_WRAP characters followed by a newline, the
+  // continuation lines starting with "SF:".  Work out how much room is
+  // left on the current line once and then copy whole runs.
+  int lineleft = SERVICEFP_WRAP - servicefplen % (SERVICEFP_WRAP + 1);
+  int n;
+
+  reserveServiceFP(len + (len / (SERVICEFP_WRAP - 4) + 2) * 4 + 2);
+  while (len > 0) {
+    if (lineleft == 0) {
+      memcpy(servicefp + servicefplen, "\nSF:", 4);
+      servicefplen += 4;
+      lineleft = SERVICEFP_WRAP - 3;
+    }
+    n = MIN(len, lineleft);
+    memcpy(servicefp + servicefplen, s, n);
+    servicefplen += n;
+    s += n;
+    len -= n;
+    lineleft -= n;
   }
+}
+
+/* The escaped form of each byte in a service fingerprint. '\0' is special
+   (see escape_service_response) and is not in the table. */
+static char servicefp_escapes[256][5];
+static u8 servicefp_escapelens[256];
 
-  servicefp[servicefplen++] = c;
+static void init_servicefp_escapes() {
+  static bool inited = false;
+  int c;
+
+  if (inited)
+    return;
+  for (c = 1; c < 256; c++) {
+    if (isalnum(c) || (ispunct(c) && !strchr("\\?\"[]().*+$^|", c)))
+      Snprintf(servicefp_escapes[c], sizeof(servicefp_escapes[c]), "%c", c);
+    else if (ispunct(c))
+      Snprintf(servicefp_escapes[c], sizeof(servicefp_escapes[c]), "\\%c", c);
+    else if (c == '\r')
+      Strncpy(servicefp_escapes[c], "\\r", sizeof(servicefp_escapes[c]));
+    else if (c == '\n')
+      Strncpy(servicefp_escapes[c], "\\n", sizeof(servicefp_escapes[c]));
+    else if (c == '\t')
+      Strncpy(servicefp_escapes[c], "\\t", sizeof(servicefp_escapes[c]));
+    else
+      Snprintf(servicefp_escapes[c], sizeof(servicefp_escapes[c]), "\\x%02x", c);
+    servicefp_escapelens[c] = strlen(servicefp_escapes[c]);
+  }
+  inited = true;
 }
 
-// Like addServiceChar, but for a whole zero-terminated string
-void ServiceNFO::addServiceString(const char *s, int wrapat) {
-  while(*s) 
-    addServiceChar(*s++, wrapat);
+/* Escapes resp so that it can be pasted into a match line of
+   nmap-service-probes. dst must have room for 4 * resplen bytes. Returns
+   the number of bytes written. */
+static int escape_service_response(char *dst, const u8 *resp, int resplen) {
+  char *p = dst;
+  int i;
+
+  init_servicefp_escapes();
+  for (i = 0; i < resplen; i++) {
+    if (resp[i] == '\0') {
+      /* We need to be careful with this, because if it is followed by
+         an ASCII number, PCRE will treat it differently. */
+      if (i + 1 >= resplen || !isdigit((int) resp[i + 1])) {
+        memcpy(p, "\\0", 2);
+        p += 2;
+      } else {
+        memcpy(p, "\\x00", 4);
+        p += 4;
+      }
+    } else if (servicefp_escapelens[resp[i]] == 1) {
+      *p++ = resp[i];
+    } else {
+      memcpy(p, servicefp_escapes[resp[i]], servicefp_escapelens[resp[i]]);
+      p += servicefp_escapelens[resp[i]];
+    }
+  }
+
+  return p - dst;
 }
 
 // If a service response to a given probeName, this function adds the
@@ -1576,14 +3037,9 @@ void ServiceNFO::addServiceString(const char *s, int wrapat) {
 // fingerprint (if any) via getServiceFingerprint();
 void ServiceNFO::addToServiceFingerprint(const char *probeName, const u8 *resp, 
 					 int resplen) {
-  int spaceleft = servicefpalloc - servicefplen;
-  int servicewrap=74; // Wrap after 74 chars / line
   int respused = MIN(resplen, (o.debugging)? 1300 : 900); // truncate to reasonable size
-  // every char could require \xHH escape, plus there is the matter of 
-  // "\nSF:" for each line, plus "%r(probename,probelen,"") Oh, and 
-  // the SF-PortXXXX-TCP stuff, etc
-  int spaceneeded = respused * 5 + strlen(probeName) + 128;  
-  int srcidx;
+  char escaped[1300 * 4];
+  int escapedlen;
   struct tm *ltime;
   time_t timep;
   char buf[128];
@@ -1594,63 +3050,24 @@ void ServiceNFO::addToServiceFingerprint(const char *probeName, const u8 *resp,
   if (servicefplen > (o.debugging? 10000 : 2200))
     return; // it is large enough.
 
-  if (spaceneeded >= spaceleft) {
-    spaceneeded = MAX(spaceneeded, 512); // No point in tiny allocations
-    spaceneeded += servicefpalloc;
-
-    servicefp = (char *) safe_realloc(servicefp, spaceneeded);
-    servicefpalloc = spaceneeded;
-  }
-  spaceleft = servicefpalloc - servicefplen;
-
   if (servicefplen == 0) {
     timep = time(NULL);
     ltime = localtime(&timep);
     Snprintf(buf, sizeof(buf), "SF-Port%hu-%s:V=%s%s%%I=%d%%D=%d/%d%%Time=%X%%P=%s", portno, proto2ascii_uppercase(proto), NMAP_VERSION, (tunnel == SERVICE_TUNNEL_SSL)? "%T=SSL" : "", o.version_intensity, ltime->tm_mon + 1, ltime->tm_mday, (int) timep, NMAP_PLATFORM);
-    addServiceString(buf, servicewrap);
+    addServiceData(buf, strlen(buf));
   }
 
   // Note that we give the total length of the response, even though we 
   // may truncate
   Snprintf(buf, sizeof(buf), "%%r(%s,%X,\"", probeName, resplen);
-  addServiceString(buf, servicewrap);
+  addServiceData(buf, strlen(buf));
 
   // Now for the probe response itself ...
-  for(srcidx=0; srcidx < respused; srcidx++) {
-    // A run of this can take up to 8 chars: "\n  \x20"
-    assert( servicefpalloc - servicefplen > 8);
- 
-    if (isalnum((int)resp[srcidx]))
-      addServiceChar((char) resp[srcidx], servicewrap);
-    else if (resp[srcidx] == '\0') {
-      /* We need to be careful with this, because if it is followed by
-	 an ASCII number, PCRE will treat it differently. */
-      if (srcidx + 1 >= respused || !isdigit((int) resp[srcidx + 1]))
-	addServiceString("\\0", servicewrap);
-      else addServiceString("\\x00", servicewrap);
-    } else if (strchr("\\?\"[]().*+$^|", resp[srcidx])) {
-      addServiceChar('\\', servicewrap);
-      addServiceChar(resp[srcidx], servicewrap);
-    } else if (ispunct((int)resp[srcidx])) {
-      addServiceChar((char) resp[srcidx], servicewrap);
-    } else if (resp[srcidx] == '\r') {
-      addServiceString("\\r", servicewrap);
-    } else if (resp[srcidx] == '\n') {
-      addServiceString("\\n", servicewrap);
-    } else if (resp[srcidx] == '\t') {
-      addServiceString("\\t", servicewrap);
-    } else {
-      addServiceChar('\\', servicewrap);
-      addServiceChar('x', servicewrap);
-      Snprintf(buf, sizeof(buf), "%02x", resp[srcidx]);
-      addServiceChar(*buf, servicewrap);
-      addServiceChar(*(buf+1), servicewrap);
-    }
-  }
+  escapedlen = escape_service_response(escaped, resp, respused);
+  addServiceData(escaped, escapedlen);
 
-  addServiceChar('"', servicewrap);
-  addServiceChar(')', servicewrap);
-  assert(servicefpalloc - servicefplen > 1);
+  addServiceData("\")", 2);
+  reserveServiceFP(1);
   servicefp[servicefplen] = '\0';
 }
 
@@ -1683,6 +3100,12 @@ const char *ServiceNFO::getServiceFingerprint(int *flen) {
 ServiceProbe *ServiceNFO::currentProbe() {
   if (probe_state == PROBESTATE_INITIAL) {
     return nextProbe(true);
+  } else if (probe_state == PROBESTATE_CACHEDPROBE) {
+    assert(cached_probe);
+    return cached_probe;
+  } else if (probe_state == PROBESTATE_LEARNEDPROBE) {
+    assert(learned_probe);
+    return learned_probe;
   } else if (probe_state == PROBESTATE_NULLPROBE) {
     assert(AP->nullProbe);
     return AP->nullProbe;
@@ -1693,6 +3116,39 @@ ServiceProbe *ServiceNFO::currentProbe() {
   return NULL;
 }
 
+ServiceProbe *ServiceNFO::learnedProbe() {
+  std::vector<std::string> names;
+  ServiceProbe *probe;
+  char key[128];
+  unsigned int i;
+  int pass;
+
+  // What identified services with the same soft match is the best guess;
+  // failing that, what identified services on the same port.
+  for (pass = 0; pass < 2; pass++) {
+    if (pass == 0 && !softMatchFound)
+      continue;
+    if (pass == 0)
+      Snprintf(key, sizeof(key), "soft %s", probe_matched);
+    else
+      Snprintf(key, sizeof(key), "port %hu/%s", portno, proto2ascii_lowercase(proto));
+    probe_stats.ranking(key, names);
+    for (i = 0; i < names.size(); i++) {
+      probe = AP->getProbeByName(names[i].c_str(), proto);
+      if (probe == NULL || probe->isNullProbe())
+        continue;
+      if (!probe->portIsProbable(tunnel, portno) &&
+          probe->getRarity() > o.version_intensity)
+        continue;
+      if (softMatchFound && !probe->serviceIsPossible(probe_matched))
+        continue;
+      return probe;
+    }
+  }
+
+  return NULL;
+}
+
 // computes the next probe to test, and ALSO CHANGES currentProbe() to
 // that!  If newresp is true, the old response info will be lost and
 // invalidated.  Otherwise it remains as if it had been received by
@@ -1702,8 +3158,25 @@ bool dropdown = false;
 
 // This invalidates the probe response string if any
  if (newresp) { 
-   if (currentresp) free(currentresp);
-   currentresp = NULL; currentresplen = 0;
+   if (currentresp) release_response_buffer(currentresp, currentrespalloc);
+   currentresp = NULL; currentresplen = currentrespalloc = 0;
+ }
+
+ if (probe_state == PROBESTATE_CACHEDPROBE) {
+   // The probe that identified this service last time did not do it
+   // again, so the service has probably changed.  Start over with the
+   // normal probe order.
+   cached_probe = NULL;
+   cached_match = NULL;
+   probe_state = PROBESTATE_INITIAL;
+ }
+
+ if (probe_state == PROBESTATE_INITIAL && cached_probe &&
+     !cached_probe->isNullProbe()) {
+   // The NULL probe comes first anyway, so only other probes need a state
+   // of their own.
+   probe_state = PROBESTATE_CACHEDPROBE;
+   return cached_probe;
  }
 
  if (probe_state == PROBESTATE_INITIAL) {
@@ -1716,7 +3189,16 @@ bool dropdown = false;
    // No valid NULL probe -- we'll drop to the next state
  }
  
- if (probe_state == PROBESTATE_NULLPROBE) {
+ if (probe_state == PROBESTATE_NULLPROBE && o.version_stats &&
+     (learned_probe = learnedProbe()) != NULL) {
+   // Before going through the list, try the probe that has identified
+   // this sort of service most often before.
+   probe_state = PROBESTATE_LEARNEDPROBE;
+   return learned_probe;
+ }
+
+ if (probe_state == PROBESTATE_NULLPROBE ||
+     probe_state == PROBESTATE_LEARNEDPROBE) {
    // There can only be one (or zero) NULL probe.  So now we go through the
    // list looking for matching probes
    probe_state = PROBESTATE_MATCHINGPROBES;
@@ -1729,6 +3211,7 @@ bool dropdown = false;
    while (current_probe != AP->probes.end()) {
      // For the first run, we only do probes that match this port number
      if ((proto == (*current_probe)->getProbeProtocol()) && 
+	 *current_probe != learned_probe &&
 	 (*current_probe)->portIsProbable(tunnel, portno)) {
        // This appears to be a valid probe.  Let's do it!
        return *current_probe;
@@ -1749,6 +3232,7 @@ bool dropdown = false;
      // be available via this probe. Also, the Probe's rarity must be <= to our
      // version detection intensity level.
      if ((proto == (*current_probe)->getProbeProtocol()) && 
+	 *current_probe != learned_probe &&
 	 !(*current_probe)->portIsProbable(tunnel, portno) &&
 	 (*current_probe)->getRarity() <= o.version_intensity &&
 	 (!softMatchFound || (*current_probe)->serviceIsPossible(probe_matched))) {
@@ -1772,14 +3256,21 @@ bool dropdown = false;
   // service fingerprint is freed too.
 void ServiceNFO::resetProbes(bool freefp) {
 
-  if (currentresp) free(currentresp);
+  if (currentresp) release_response_buffer(currentresp, currentrespalloc);
 
   if (freefp) {
     if (servicefp) { free(servicefp); servicefp = NULL; }
     servicefplen = servicefpalloc = 0;
   }
 
-  currentresp = NULL; currentresplen = 0;
+  currentresp = NULL; currentresplen = currentrespalloc = 0;
+  // The banner was read without the tunnel, and comes again through it
+  banner.clear();
+  reusing_connection = false;
+  // The cached probe was for the service without a tunnel
+  cached_probe = NULL;
+  cached_match = NULL;
+  learned_probe = NULL;
 
   probe_state = PROBESTATE_INITIAL;
 }
@@ -1805,7 +3296,17 @@ int ServiceNFO::probe_timemsleft(const ServiceProbe *probe, const struct timeval
 }
 
 void ServiceNFO::appendtocurrentproberesponse(const u8 *respstr, int respstrlen) {
-  currentresp = (u8 *) safe_realloc(currentresp, currentresplen + respstrlen);
+  if (currentresplen + respstrlen > currentrespalloc) {
+    int newalloc;
+    u8 *newresp = get_response_buffer(currentresplen + respstrlen, &newalloc);
+
+    if (currentresp) {
+      memcpy(newresp, currentresp, currentresplen);
+      release_response_buffer(currentresp, currentrespalloc);
+    }
+    currentresp = newresp;
+    currentrespalloc = newalloc;
+  }
   memcpy(currentresp + currentresplen, respstr, respstrlen);
   currentresplen += respstrlen;
 }
@@ -1817,6 +3318,40 @@ u8 *ServiceNFO::getcurrentproberesponse(int *respstrlen) {
   return currentresp;
 }
 
+void ServiceNFO::clearcurrentproberesponse() {
+  currentresplen = 0;
+}
+
+
+static void init_service_timing(struct ultra_timing_vals *timing, int cwnd,
+                                const struct scan_performance_vars *perf,
+                                const struct timeval *now) {
+  timing->cwnd = cwnd;
+  timing->ssthresh = perf->initial_ssthresh;
+  timing->num_replies_expected = 0;
+  timing->num_replies_received = 0;
+  timing->num_updates = 0;
+  timing->last_drop = *now;
+}
+
+/* Appends the services in byhost to dst, taking one from each host in turn,
+   so that consecutive services belong to different hosts. */
+static void append_round_robin(std::list<ServiceNFO *> &dst,
+                               std::vector<std::list<ServiceNFO *> > &byhost) {
+  unsigned int i;
+  bool more = true;
+
+  while (more) {
+    more = false;
+    for (i = 0; i < byhost.size(); i++) {
+      if (byhost[i].empty())
+        continue;
+      dst.push_back(byhost[i].front());
+      byhost[i].pop_front();
+      more = true;
+    }
+  }
+}
 
 ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   unsigned int targetno;
@@ -1825,7 +3360,13 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   Port port;
   int desired_par;
   struct timeval now;
+  std::vector<std::list<ServiceNFO *> > byhost(Targets.size());
+  std::list<ServiceNFO *>::iterator svcI;
+  std::map<Target *, ServiceHostState>::iterator hostI;
   num_hosts_timedout = 0;
+#if HAVE_PTHREAD
+  match_workers = NULL;
+#endif
   gettimeofday(&now, NULL);
 
   for(targetno = 0 ; targetno < Targets.size(); targetno++) {
@@ -1839,9 +3380,10 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
       svc->target = Targets[targetno];
       svc->portno = nxtport->portno;
       svc->proto = nxtport->proto;
-      services_remaining.push_back(svc);
+      byhost[targetno].push_back(svc);
     }
   }
+  append_round_robin(services_remaining, byhost);
 
   /* Use a whole new loop for PORT_OPENFILTERED so that we try all the
      known open ports first before bothering with this speculative
@@ -1856,20 +3398,40 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
       svc->target = Targets[targetno];
       svc->portno = nxtport->portno;
       svc->proto = nxtport->proto;
-      services_remaining.push_back(svc);
+      byhost[targetno].push_back(svc);
     }
   }
+  append_round_robin(services_remaining, byhost);
 
   SPM = new ScanProgressMeter("Service scan");
   desired_par = 1;
   if (o.timing_level == 3) desired_par = 20;
   if (o.timing_level == 4) desired_par = 30;
   if (o.timing_level >= 5) desired_par = 40;
-  // TODO: Come up with better ways to determine ideal_parallelism
-  int min_par, max_par;
-  min_par = o.min_parallelism;
-  max_par = MAX(min_par, o.max_parallelism ? o.max_parallelism : 100);
-  ideal_parallelism = box(min_par, max_par, desired_par);
+  /* Parallelism is governed like ultra_scan's: the group and each host have
+     a congestion window that starts at desired_par (half of it for a single
+     host, so that the first connections are spread over the group) and is
+     opened up as connections succeed and cut back when they time out or
+     fail.  The window never goes outside --min-parallelism and
+     --max-parallelism (100 by default). */
+  perf.init();
+  perf.max_cwnd = MAX(perf.low_cwnd, o.max_parallelism ? o.max_parallelism : 100);
+  perf.group_initial_cwnd = box(perf.low_cwnd, perf.max_cwnd, desired_par);
+  perf.host_initial_cwnd = box(perf.low_cwnd, perf.max_cwnd, desired_par / 2);
+  init_service_timing(&timing, perf.group_initial_cwnd, &perf, &now);
+  initialize_timeout_info(&connect_to);
+
+  for (svcI = services_remaining.begin(); svcI != services_remaining.end(); svcI++) {
+    hostI = hosts.find((*svcI)->target);
+    if (hostI == hosts.end()) {
+      hostI = hosts.insert(std::make_pair((*svcI)->target, ServiceHostState())).first;
+      init_service_timing(&hostI->second.timing, perf.host_initial_cwnd, &perf, &now);
+      hostI->second.in_progress = 0;
+      hostI->second.remaining = 0;
+    }
+    hostI->second.remaining++;
+  }
+  hosts_pending = hosts.size();
 }
 
 ServiceGroup::~ServiceGroup() {
@@ -1887,6 +3449,65 @@ ServiceGroup::~ServiceGroup() {
   delete SPM;
 }
 
+unsigned int ServiceGroup::parallelism() const {
+  return MAX(1, (unsigned int) timing.cwnd);
+}
+
+unsigned int ServiceGroup::hostParallelism(const ServiceHostState *host) const {
+  return MAX(1, (unsigned int) host->timing.cwnd);
+}
+
+void ServiceGroup::startService(std::list<ServiceNFO *>::iterator svcI) {
+  ServiceNFO *svc = *svcI;
+
+  removeRemaining(svcI);
+  services_in_progress.push_back(svc);
+  hosts[svc->target].in_progress++;
+}
+
+void ServiceGroup::removeRemaining(std::list<ServiceNFO *>::iterator svcI) {
+  ServiceHostState *host = &hosts[(*svcI)->target];
+
+  assert(host->remaining > 0);
+  if (--host->remaining == 0)
+    hosts_pending--;
+  services_remaining.erase(svcI);
+}
+
+void ServiceGroup::connectDone(ServiceNFO *svc, bool success,
+                               const struct timeval *now) {
+  ServiceHostState *host = &hosts[svc->target];
+
+  /* Only plain TCP connections are counted. UDP "connections" always
+     succeed, and a failed SSL handshake says nothing about congestion. */
+  if (svc->connect_start.tv_sec == 0)
+    return;
+
+  timing.num_replies_expected++;
+  host->timing.num_replies_expected++;
+
+  if (success) {
+    /* A connection that took much longer than usual was probably queued
+       somewhere; don't take it as a sign that there is room for more. */
+    if (TIMEVAL_SUBTRACT(*now, svc->connect_start) <= connect_to.timeout) {
+      timing.ack(&perf);
+      host->timing.ack(&perf);
+    }
+    adjust_timeouts2(&svc->connect_start, now, &connect_to);
+  } else {
+    /* Only react once to the connections that were already under way when
+       a window was last cut, as ultra_scan does for dropped probes. */
+    if (TIMEVAL_AFTER(svc->connect_start, host->timing.last_drop))
+      host->timing.drop(host->in_progress, &perf, now);
+    if (TIMEVAL_AFTER(svc->connect_start, timing.last_drop))
+      timing.drop_group(services_in_progress.size(), &perf, now);
+    if (o.debugging > 1)
+      log_write(LOG_PLAIN, "Service scan: connection to %s:%hu failed; parallelism is now %u (%u for the host)\n",
+                svc->target->targetipstr(), svc->portno, parallelism(), hostParallelism(host));
+  }
+  memset(&svc->connect_start, 0, sizeof(svc->connect_start));
+}
+
 /* Called if data is read for a service or a TCP connection made. Sets the port
    state to PORT_OPEN. */
 static void adjustPortStateIfNecessary(ServiceNFO *svc) {
@@ -1936,22 +3557,141 @@ static void adjustPortStateIfNecessary(ServiceNFO *svc) {
     return 0;
   }
 
+// Starts a TCP connection to svc that carries the text of probe, if any, so
+// that it can be sent with TCP Fast Open instead of waiting for the
+// connection to be established.
+static void start_tcp_connect(nsock_pool nsp, ServiceNFO *svc,
+                              ServiceProbe *probe,
+                              struct sockaddr_storage *ss, size_t ss_len) {
+  const char *probestring = NULL;
+  int probestringlen = 0;
+
+  svc->probe_sent_on_connect = false;
+  svc->connect_start = *nsock_gettimeofday();
+  if (!probe->isNullProbe()) {
+    if (o.debugging > 1 || o.versionTrace()) {
+      log_write(LOG_PLAIN, "Service scan sending probe %s to %s:%hu (%s)\n", probe->getName(), svc->target->targetipstr(), svc->portno, proto2ascii_lowercase(svc->proto));
+    }
+    probestring = (const char *) probe->getProbeString(&probestringlen);
+    svc->probe_sent_on_connect = true;
+  }
+  nsock_connect_tcp_data(nsp, svc->niod, servicescan_connect_handler,
+                         DEFAULT_CONNECT_TIMEOUT, svc,
+                         (struct sockaddr *) ss, ss_len, svc->portno,
+                         probestring, probestringlen);
+}
+
+// Closes nsi and starts a new TCP connection to svc, to send probe on.
+static void connectForProbe(nsock_pool nsp, nsock_iod nsi, ServiceNFO *svc,
+			    ServiceProbe *probe) {
+  struct sockaddr_storage ss;
+  size_t ss_len;
+
+  nsi_delete(nsi, NSOCK_PENDING_SILENT);
+  svc->reusing_connection = false;
+  if ((svc->niod = nsi_new(nsp, svc)) == NULL) {
+    fatal("Failed to allocate Nsock I/O descriptor in %s()", __func__);
+  }
+  if (o.spoofsource) {
+    o.SourceSockAddr(&ss, &ss_len);
+    nsi_set_localaddr(svc->niod, &ss, ss_len);
+  }
+  if (o.ipoptionslen)
+    nsi_set_ipoptions(svc->niod, o.ipoptions, o.ipoptionslen);
+  if (svc->target->TargetName()) {
+    if (nsi_set_hostname(svc->niod, svc->target->TargetName()) == -1)
+      fatal("nsi_set_hostname(\"%s\" failed in %s()", svc->target->TargetName(), __func__);
+  }
+  svc->target->TargetSockAddr(&ss, &ss_len);
+  if (svc->tunnel == SERVICE_TUNNEL_NONE) {
+    start_tcp_connect(nsp, svc, probe, &ss, ss_len);
+  } else {
+    assert(svc->tunnel == SERVICE_TUNNEL_SSL);
+    svc->probe_sent_on_connect = false;
+    memset(&svc->connect_start, 0, sizeof(svc->connect_start));
+    nsock_connect_ssl(nsp, svc->niod, servicescan_connect_handler, 
+		      DEFAULT_CONNECT_SSL_TIMEOUT, svc, 
+		      (struct sockaddr *) &ss,
+		      ss_len, svc->proto, svc->portno, svc->ssl_session);
+  }
+}
+
+// Called when the connection the current probe of svc was sent on fails.
+// If the connection had been kept open from the previous probe and the
+// service did not answer on it, the probe is sent again on a new
+// connection and true is returned.
+static bool retryWithoutReuse(nsock_pool nsp, nsock_iod nsi, ServiceNFO *svc) {
+  int readstrlen;
+
+  if (!svc->reusing_connection)
+    return false;
+  svc->getcurrentproberesponse(&readstrlen);
+  if (readstrlen > (int) svc->banner.length())
+    return false;
+  if (o.debugging > 1 || o.versionTrace())
+    log_write(LOG_PLAIN, "Service scan: %s:%hu closed a reused connection, reconnecting\n",
+	      svc->target->targetipstr(), svc->portno);
+  svc->clearcurrentproberesponse();
+  connectForProbe(nsp, nsi, svc, svc->currentProbe());
+  return true;
+}
+
+// Checks that nothing is waiting on a connection kept open from the
+// previous probe before the current probe is sent on it. Anything that is,
+// such as the late end of the previous response or a service that keeps
+// talking, would be taken for part of the new response, so the probe is
+// sent on a new connection instead. So it is if the service has closed the
+// connection.
+static void servicescan_drain_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
+  nsock_iod nsi = nse_iod(nse);
+  enum nse_status status = nse_status(nse);
+  ServiceNFO *svc = (ServiceNFO *) mydata;
+  ServiceProbe *probe = svc->currentProbe();
+  int readstrlen = 0;
+
+  if (status == NSE_STATUS_KILL)
+    return;
+  if (status == NSE_STATUS_TIMEOUT) {
+    svc->currentprobe_exec_time = *nsock_gettimeofday();
+    send_probe_text(nsp, nsi, svc, probe);
+    nsock_read(nsp, nsi, servicescan_read_handler, 
+	       svc->probe_timemsleft(probe, nsock_gettimeofday()), svc);
+    return;
+  }
+  if (o.debugging > 1 || o.versionTrace()) {
+    if (status == NSE_STATUS_SUCCESS) {
+      nse_readbuf(nse, &readstrlen);
+      log_write(LOG_PLAIN, "Service scan: %s:%hu sent %d bytes after the previous probe, reconnecting\n",
+		svc->target->targetipstr(), svc->portno, readstrlen);
+    } else {
+      log_write(LOG_PLAIN, "Service scan: %s:%hu closed a reused connection, reconnecting\n",
+		svc->target->targetipstr(), svc->portno);
+    }
+  }
+  svc->clearcurrentproberesponse();
+  connectForProbe(nsp, nsi, svc, probe);
+}
+
 // This simple helper function is used to start the next probe.  If
 // the probe exists, execution begins (and the previous one is cleaned
 // up if necessary) .  Otherwise, the service is listed as finished
 // and moved to the finished list.  If you pass 'true' for alwaysrestart, a
-// new connection will be made even if the previous probe was the NULL probe.
+// new connection will be made even if the previous probe was the NULL probe
+// (or another probe that allows its connection to be reused).
 // You would do this, for example, if the other side has closed the connection.
 static void startNextProbe(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG, 
 			   ServiceNFO *svc, bool alwaysrestart) {
   bool isInitial = svc->probe_state == PROBESTATE_INITIAL;
   ServiceProbe *probe = svc->currentProbe();
-  struct sockaddr_storage ss;
-  size_t ss_len;
+  ServiceProbe *prevprobe = probe;
+  const u8 *readstr;
+  int readstrlen;
 
   if (!alwaysrestart && probe->isNullProbe()) {
     // The difference here is that we can reuse the same (TCP) connection
     // if the last probe was the NULL probe.
+    readstr = svc->getcurrentproberesponse(&readstrlen);
+    svc->banner.assign((const char *) readstr, readstrlen);
     probe = svc->nextProbe(false);
     if (probe) {
       svc->currentprobe_exec_time = *nsock_gettimeofday();
@@ -1970,35 +3710,24 @@ static void startNextProbe(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
     if (!isInitial)
       probe = svc->nextProbe(true); // if was initial, currentProbe() returned the right one to execute.
     if (probe) {
-      // For a TCP probe, we start by requesting a new connection to the target
-      if (svc->proto == IPPROTO_TCP) {
-	nsi_delete(nsi, NSOCK_PENDING_SILENT);
-	if ((svc->niod = nsi_new(nsp, svc)) == NULL) {
-	  fatal("Failed to allocate Nsock I/O descriptor in %s()", __func__);
-	}
-	if (o.spoofsource) {
-	  o.SourceSockAddr(&ss, &ss_len);
-	  nsi_set_localaddr(svc->niod, &ss, ss_len);
-	}
-	if (o.ipoptionslen)
-	  nsi_set_ipoptions(svc->niod, o.ipoptions, o.ipoptionslen);
-        if (svc->target->TargetName()) {
-          if (nsi_set_hostname(svc->niod, svc->target->TargetName()) == -1)
-	    fatal("nsi_set_hostname(\"%s\" failed in %s()", svc->target->TargetName(), __func__);
-        }
-	svc->target->TargetSockAddr(&ss, &ss_len);
-	if (svc->tunnel == SERVICE_TUNNEL_NONE) {
-	  nsock_connect_tcp(nsp, svc->niod, servicescan_connect_handler, 
-			    DEFAULT_CONNECT_TIMEOUT, svc, 
-			    (struct sockaddr *) &ss, ss_len,
-			    svc->portno);
-	} else {
-	  assert(svc->tunnel == SERVICE_TUNNEL_SSL);
-	  nsock_connect_ssl(nsp, svc->niod, servicescan_connect_handler, 
-			    DEFAULT_CONNECT_SSL_TIMEOUT, svc, 
-			    (struct sockaddr *) &ss,
-			    ss_len, svc->proto, svc->portno, svc->ssl_session);
-	}
+      if (svc->proto == IPPROTO_TCP && !alwaysrestart && !isInitial &&
+	  prevprobe->reuse && probe->reuse) {
+	// The service kept the connection open, and both probes are fine
+	// to send on the same connection, so save a handshake.  Put the
+	// banner back in front of the response so that it looks the same
+	// as on a new connection.
+	svc->reusing_connection = true;
+	if (o.debugging > 1 || o.versionTrace())
+	  log_write(LOG_PLAIN, "Service scan: reusing connection to %s:%hu for probe %s\n",
+		    svc->target->targetipstr(), svc->portno, probe->getName());
+	if (!svc->banner.empty())
+	  svc->appendtocurrentproberesponse((const u8 *) svc->banner.data(), svc->banner.length());
+	// The probe is sent once we know nothing from the previous one is
+	// still waiting to be read.
+	nsock_read(nsp, nsi, servicescan_drain_handler, 0, svc);
+      } else if (svc->proto == IPPROTO_TCP) {
+	// For a TCP probe, we start by requesting a new connection to the target
+	connectForProbe(nsp, nsi, svc, probe);
       } else {
 	assert(svc->proto == IPPROTO_UDP);
 	/* Can maintain the same UDP "connection" */
@@ -2067,6 +3796,36 @@ static int scanThroughTunnel(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
 #endif
 }
 
+/* Prints a summary of the nsock event loop statistics, if they are being
+   collected. */
+static void printNsockStats(nsock_pool nsp) {
+  struct nsock_stats stats;
+  unsigned long events = 0, timeouts = 0, seen = 0;
+  int t, s, i;
+
+  if (nsp_get_stats(nsp, &stats) == -1)
+    return;
+
+  for (t = 0; t < NSE_TYPE_MAX; t++) {
+    for (s = NSE_STATUS_NONE; s <= NSE_STATUS_EOF; s++)
+      events += stats.events[t][s];
+    timeouts += stats.events[t][NSE_STATUS_TIMEOUT];
+  }
+  /* Upper bound of the 99th percentile of the handler execution time */
+  for (i = 0; i < NSOCK_STATS_BUCKETS - 1; i++) {
+    seen += stats.handler_usecs[i];
+    if (seen * 100 >= events * 99)
+      break;
+  }
+
+  log_write(LOG_PLAIN, "Nsock: %lu loops in %.2fs (%.2fs waiting, %.2fs in handlers), "
+            "%lu events (%lu timeouts), 99%% of handlers < %luus, %d events pending, "
+            "%d IODs open (%lu total)\n",
+            stats.loops, stats.loop_time, stats.wait_time, stats.handler_time,
+            events, timeouts, 1UL << i, stats.events_pending,
+            stats.iods_active, stats.iods_created);
+}
+
 /* Prints completion estimates and the like when appropriate */
 static void considerPrintingStats(nsock_pool nsp, ServiceGroup *SG) {
    /* Check for status requests */
@@ -2081,7 +3840,9 @@ static void considerPrintingStats(nsock_pool nsp, ServiceGroup *SG) {
   /* Perhaps this should be made more complex, but I suppose it should be
      good enough for now. */
   if (SG->SPM->mayBePrinted(nsock_gettimeofday())) {
-    SG->SPM->printStatsIfNecessary(SG->services_finished.size() / ((double)SG->services_remaining.size() + SG->services_in_progress.size() + SG->services_finished.size()), nsock_gettimeofday());
+    if (SG->SPM->printStatsIfNecessary(SG->services_finished.size() / ((double)SG->services_remaining.size() + SG->services_in_progress.size() + SG->services_finished.size()), nsock_gettimeofday())
+        && o.debugging)
+      printNsockStats(nsp);
   }
 }
 
@@ -2128,6 +3889,7 @@ static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, Ser
   if (member != SG->services_in_progress.end()) {
     assert(*member == svc);
     SG->services_in_progress.erase(member);
+    SG->hosts[target].in_progress--;
   } else {
     /* A probe can finish from services_remaining if the host times out before the
        probe has even started */
@@ -2135,7 +3897,7 @@ static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, Ser
 		  svc);
     assert(member != SG->services_remaining.end());
     assert(*member == svc);
-    SG->services_remaining.erase(member);
+    SG->removeRemaining(member);
   }
 
   SG->services_finished.push_back(svc);
@@ -2156,18 +3918,34 @@ static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, Ser
 static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
   ServiceNFO *svc;
   ServiceProbe *nextprobe;
+  ServiceHostState *host;
   struct sockaddr_storage ss;
   size_t ss_len;
   static int warn_no_scanning=1;
-
-  while (SG->services_in_progress.size() < SG->ideal_parallelism &&
-	 !SG->services_remaining.empty()) {
-    // Start executing a probe from the new list and move it to in_progress
-    svc = SG->services_remaining.front();
+  std::list<ServiceNFO *>::iterator svcI, nxt;
+  // Hosts whose window is full; once every host with services remaining
+  // is in here there is nothing more to start.
+  std::set<Target *> full_hosts;
+
+  for (svcI = SG->services_remaining.begin();
+       SG->services_in_progress.size() < SG->parallelism() &&
+       svcI != SG->services_remaining.end(); svcI = nxt) {
+    nxt = svcI;
+    nxt++;
+    svc = *svcI;
     if (svc->target->timedOut(nsock_gettimeofday())) {
       end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, NULL);
       continue;
     }
+    // Skip services of hosts that already have as many probes out as
+    // their window allows
+    host = &SG->hosts[svc->target];
+    if (host->in_progress >= SG->hostParallelism(host)) {
+      full_hosts.insert(svc->target);
+      if (full_hosts.size() >= SG->hosts_pending)
+        break;
+      continue;
+    }
     nextprobe = svc->nextProbe(true);
 
     if (nextprobe == NULL) {
@@ -2193,21 +3971,16 @@ static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
     if (o.ipoptionslen)
       nsi_set_ipoptions(svc->niod, o.ipoptions, o.ipoptionslen);
     svc->target->TargetSockAddr(&ss, &ss_len);
-    if (svc->proto == IPPROTO_TCP)
-      nsock_connect_tcp(nsp, svc->niod, servicescan_connect_handler, 
-			DEFAULT_CONNECT_TIMEOUT, svc, 
-			(struct sockaddr *)&ss, ss_len,
-			svc->portno);
-    else {
+    if (svc->proto == IPPROTO_TCP) {
+      start_tcp_connect(nsp, svc, nextprobe, &ss, ss_len);
+    } else {
       assert(svc->proto == IPPROTO_UDP);
       nsock_connect_udp(nsp, svc->niod, servicescan_connect_handler, 
 			svc, (struct sockaddr *) &ss, ss_len,
 			svc->portno);
     }
-    // Now remove it from the remaining service list
-    SG->services_remaining.pop_front();
-    // And add it to the in progress list
-    SG->services_in_progress.push_back(svc);
+    // Now move it from the remaining service list to the in progress list
+    SG->startService(svcI);
   }
   return 0;
 }
@@ -2226,6 +3999,7 @@ static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *m
   if (svc->target->timedOut(nsock_gettimeofday())) {
     end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, nsi);
   } else if (status == NSE_STATUS_SUCCESS) {
+    SG->connectDone(svc, true, nsock_gettimeofday());
 
 #if HAVE_OPENSSL
     // Snag our SSL_SESSION from the nsi for use in subsequent connections.
@@ -2248,9 +4022,13 @@ static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *m
       adjustPortStateIfNecessary(svc);
 
     // Yeah!  Connection made to the port.  Send the appropriate probe
-    // text (if any is needed -- might be NULL probe)
+    // text (if any is needed -- might be NULL probe), unless it went with
+    // the connection request.
     svc->currentprobe_exec_time = *nsock_gettimeofday();
-    send_probe_text(nsp, nsi, svc, probe);
+    if (svc->probe_sent_on_connect)
+      svc->probe_sent_on_connect = false;
+    else
+      send_probe_text(nsp, nsi, svc, probe);
     // Now let us read any results
     nsock_read(nsp, nsi, servicescan_read_handler, svc->probe_timemsleft(probe, nsock_gettimeofday()), svc);
   } else if (status == NSE_STATUS_TIMEOUT || status == NSE_STATUS_ERROR) {
@@ -2259,6 +4037,7 @@ static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *m
       // and move it to the finished bin.
     if (o.debugging)
       error("Got nsock CONNECT response with status %s - aborting this service", nse_status2str(status));
+    SG->connectDone(svc, false, nsock_gettimeofday());
     end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, nsi);
   } else if (status == NSE_STATUS_KILL) {
     /* User probablby specified host_timeout and so the service scan is
@@ -2306,6 +4085,9 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
     return;
   }
 
+  if (retryWithoutReuse(nsp, nsi, svc))
+    return;
+
   if (status == NSE_STATUS_ERROR) {
 	err = nse_errorcode(nse);
 	error("Got nsock WRITE error #%d (%s)", err, strerror(err));
@@ -2323,6 +4105,286 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
   return;
 }
 
+/* Acts on the result of matching svc's current response against the
+   fallbacks of its current probe: MD is the match found (or NULL) and
+   fallbackDepth the index of the fallback probe it came from. */
+static void handle_match(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG, ServiceNFO *svc,
+                         const struct MatchDetails *MD, int fallbackDepth) {
+  ServiceProbe *probe = svc->currentProbe();
+  const u8 *readstr;
+  int readstrlen;
+
+  readstr = svc->getcurrentproberesponse(&readstrlen);
+
+  if (MD && MD->serviceName) {
+    // WOO HOO!!!!!!  MATCHED!  But might be soft
+    if (MD->isSoft && svc->probe_matched) {
+      if (strcmp(svc->probe_matched, MD->serviceName) != 0)
+	error("WARNING: Service %s:%hu had already soft-matched %s, but now soft-matched %s; ignoring second value", svc->target->targetipstr(), svc->portno, svc->probe_matched, MD->serviceName);
+      // No error if its the same - that happens frequently.  For
+      // example, if we read more data for the same probe response
+      // it will probably still match.
+    } else {
+      if (o.debugging > 1 || o.versionTrace()) {
+	if (MD->product || MD->version || MD->info)
+	  log_write(LOG_PLAIN, "Service scan match (Probe %s matched with %s line %d): %s:%hu is %s%s.  Version: |%s|%s|%s|\n",
+                    probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
+		    MD->lineno,
+		    svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "", 
+		    MD->serviceName, (MD->product)? MD->product : "", (MD->version)? MD->version : "", 
+		    (MD->info)? MD->info : "");
+	else
+	  log_write(LOG_PLAIN, "Service scan %s match (Probe %s matched with %s line %d): %s:%hu is %s%s\n",
+                    (MD->isSoft)? "soft" : "hard",
+                    probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
+                    MD->lineno,
+		    svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "", MD->serviceName);
+      }
+      if (svc->softMatchFound && !MD->isSoft)
+	svc->softmatch_service = svc->probe_matched;
+      svc->probe_matched = MD->serviceName;
+      if (MD->product)
+	Strncpy(svc->product_matched, MD->product, sizeof(svc->product_matched));
+      if (MD->version) 
+	Strncpy(svc->version_matched, MD->version, sizeof(svc->version_matched));
+      if (MD->info) 
+	Strncpy(svc->extrainfo_matched, MD->info, sizeof(svc->extrainfo_matched));
+      if (MD->hostname) 
+	Strncpy(svc->hostname_matched, MD->hostname, sizeof(svc->hostname_matched));
+      if (MD->ostype) 
+	Strncpy(svc->ostype_matched, MD->ostype, sizeof(svc->ostype_matched));
+      if (MD->devicetype) 
+	Strncpy(svc->devicetype_matched, MD->devicetype, sizeof(svc->devicetype_matched));
+      if (MD->cpe_a)
+	Strncpy(svc->cpe_a_matched, MD->cpe_a, sizeof(svc->cpe_a_matched));
+      if (MD->cpe_h)
+	Strncpy(svc->cpe_h_matched, MD->cpe_h, sizeof(svc->cpe_h_matched));
+      if (MD->cpe_o)
+	Strncpy(svc->cpe_o_matched, MD->cpe_o, sizeof(svc->cpe_o_matched));
+      svc->softMatchFound = MD->isSoft;
+      if (!svc->softMatchFound && (o.version_cache || o.version_stats)) {
+	svc->hardmatch_probe = probe;
+	svc->hardmatch_lineno = MD->lineno;
+	svc->hardmatch_hash = fnv1a64(readstr, readstrlen);
+      }
+      if (!svc->softMatchFound) {
+	// We might be able to continue scan through a tunnel protocol 
+	// like SSL
+	if (scanThroughTunnel(nsp, nsi, SG, svc) == 0) 
+	  end_svcprobe(nsp, PROBESTATE_FINISHED_HARDMATCHED, SG, svc, nsi);
+      }
+    }
+  }
+
+  if (!MD || !MD->serviceName || MD->isSoft) {
+    // Didn't match... maybe reading more until timeout will help
+    // TODO: For efficiency I should be able to test if enough data
+    // has been received rather than always waiting for the reading
+    // to timeout.  For now I'll limit it to 4096 bytes just to
+    // avoid reading megs from services like chargen.  But better
+    // approach is needed.
+    if (svc->probe_timemsleft(probe) > 0 && readstrlen < 4096) { 
+      nsock_read(nsp, nsi, servicescan_read_handler, svc->probe_timemsleft(probe), svc);
+    } else {
+      // Failed -- lets go to the next probe.
+      if (readstrlen > 0)
+	svc->addToServiceFingerprint(probe->getName(), readstr, readstrlen);
+      startNextProbe(nsp, nsi, SG, svc, false);
+    }
+  }
+}
+
+#if HAVE_PTHREAD
+MatchWorkers::MatchWorkers(nsock_pool nsp, int nthreads) {
+  pthread_t thread;
+  int fds[2];
+  int i;
+
+  stopping = false;
+  outstanding = 0;
+  wakefd = -1;
+  wakensi = NULL;
+  polling = false;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return;
+  wakensi = nsi_new2(nsp, fds[0], NULL);
+  close(fds[0]);
+  if (wakensi == NULL) {
+    close(fds[1]);
+    return;
+  }
+  wakefd = fds[1];
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&thread, NULL, work, this) != 0)
+      break;
+    threads.push_back(thread);
+  }
+}
+
+MatchWorkers::~MatchWorkers() {
+  std::vector<pthread_t>::iterator it;
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  for (it = threads.begin(); it != threads.end(); it++)
+    pthread_join(*it, NULL);
+
+  while (!todo.empty()) {
+    delete todo.front();
+    todo.pop_front();
+  }
+  while (!done.empty()) {
+    delete done.front();
+    done.pop_front();
+  }
+  if (wakensi != NULL)
+    nsi_delete(wakensi, NSOCK_PENDING_SILENT);
+  if (wakefd != -1)
+    close(wakefd);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+void MatchWorkers::submit(nsock_pool nsp, ServiceNFO *svc, nsock_iod nsi,
+                          const u8 *response, int responselen) {
+  MatchJob *job = new MatchJob;
+
+  job->svc = svc;
+  job->nsi = nsi;
+  job->probe = svc->currentProbe();
+  job->response.assign((const char *) response, responselen);
+  job->fallbackDepth = 0;
+  job->MD = NULL;
+
+  pthread_mutex_lock(&lock);
+  todo.push_back(job);
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+
+  if (outstanding++ == 0)
+    wait(nsp);
+}
+
+void MatchWorkers::wait(nsock_pool nsp) {
+  if (polling)
+    nsock_timer_create(nsp, done_handler, MATCH_POLL_MSECS, this);
+  else
+    nsock_read(nsp, wakensi, done_handler, -1, this);
+}
+
+void *MatchWorkers::work(void *arg) {
+  MatchWorkers *workers = (MatchWorkers *) arg;
+  ServiceProbe *probe;
+  MatchJob *job;
+  bool wake;
+  char c = 0;
+
+  pthread_mutex_lock(&workers->lock);
+  for (;;) {
+    while (workers->todo.empty() && !workers->stopping)
+      pthread_cond_wait(&workers->cond, &workers->lock);
+    if (workers->stopping)
+      break;
+    job = workers->todo.front();
+    workers->todo.pop_front();
+    pthread_mutex_unlock(&workers->lock);
+
+    for (; (probe = job->probe->fallbacks[job->fallbackDepth]) != NULL; job->fallbackDepth++) {
+      job->MD = probe->testMatch((const u8 *) job->response.data(),
+                                 job->response.length(), 0, &job->result);
+      if (job->MD && job->MD->serviceName) break; // Found one!
+    }
+
+    pthread_mutex_lock(&workers->lock);
+    workers->done.push_back(job);
+    wake = !workers->polling;
+    pthread_mutex_unlock(&workers->lock);
+    while (wake && send(workers->wakefd, &c, 1, 0) == -1 && socket_errno() == EINTR)
+      ;
+    pthread_mutex_lock(&workers->lock);
+  }
+  pthread_mutex_unlock(&workers->lock);
+
+  return NULL;
+}
+
+void MatchWorkers::done_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
+  MatchWorkers *workers = (MatchWorkers *) mydata;
+  ServiceGroup *SG = (ServiceGroup *) nsp_getud(nsp);
+  std::list<MatchJob *> finished;
+  MatchJob *job;
+
+  if (nse_status(nse) == NSE_STATUS_KILL)
+    return;
+  if (nse_status(nse) != NSE_STATUS_SUCCESS) {
+    if (nse_status(nse) == NSE_STATUS_ERROR)
+      error("%s: error waiting for service match threads: %s", __func__,
+            socket_strerror(nse_errorcode(nse)));
+    else
+      error("%s: unexpected status %s waiting for service match threads", __func__,
+            nse_status2str(nse_status(nse)));
+    pthread_mutex_lock(&workers->lock);
+    workers->polling = true;
+    pthread_mutex_unlock(&workers->lock);
+  }
+
+  pthread_mutex_lock(&workers->lock);
+  finished.swap(workers->done);
+  pthread_mutex_unlock(&workers->lock);
+
+  while (!finished.empty()) {
+    job = finished.front();
+    finished.pop_front();
+    workers->outstanding--;
+    job->result.error.report();
+    handle_match(nsp, job->nsi, SG, job->svc, job->MD, job->fallbackDepth);
+    delete job;
+  }
+
+  if (workers->outstanding > 0)
+    workers->wait(nsp);
+
+  // We may have room for more pr0bes!
+  launchSomeServiceProbes(nsp, SG);
+}
+
+/* Starts the worker threads for a service scan, or returns NULL if
+   matching should simply be done in the nsock loop: on single-CPU
+   machines, or when there are too few services for it to matter. */
+static MatchWorkers *start_match_workers(nsock_pool nsp, AllProbes *AP, ServiceGroup *SG) {
+  std::vector<ServiceProbe *>::iterator vi;
+  MatchWorkers *workers;
+  long ncpus;
+
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus < 2 || SG->services_remaining.size() < 2)
+    return NULL;
+
+  // ServiceProbe::testMatch builds these on demand, which isn't safe to
+  // do from the worker threads.
+  if (AP->nullProbe != NULL)
+    AP->nullProbe->buildPrefilter();
+  for (vi = AP->probes.begin(); vi != AP->probes.end(); vi++)
+    (*vi)->buildPrefilter();
+
+  workers = new MatchWorkers(nsp, MIN(ncpus - 1, MAX_MATCH_THREADS));
+  if (!workers->ok()) {
+    delete workers;
+    return NULL;
+  }
+  if (o.debugging)
+    log_write(LOG_PLAIN, "Matching service responses on %d threads\n", (int) MIN(ncpus - 1, MAX_MATCH_THREADS));
+
+  return workers;
+}
+#endif
+
 static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
   nsock_iod nsi = nse_iod(nse);
   enum nse_status status = nse_status(nse);
@@ -2333,6 +4395,7 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
   const u8 *readstr;
   int readstrlen;
   const struct MatchDetails *MD;
+  struct MatchResult result;
   int fallbackDepth=0;
 
   assert(type == NSE_TYPE_READ);
@@ -2347,80 +4410,36 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
     // now get the full version
     readstr = svc->getcurrentproberesponse(&readstrlen);
 
-    for (MD = NULL; probe->fallbacks[fallbackDepth] != NULL; fallbackDepth++) {
-      MD = (probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen);
-      if (MD && MD->serviceName) break; // Found one!
+    if (svc->cached_match != NULL && probe == svc->cached_probe &&
+        fnv1a64(readstr, readstrlen) == svc->cached_hash) {
+      // The response is the same one that identified this service on an
+      // earlier scan, so only the match line that did it needs trying.
+      MD = svc->cached_match->testMatch(readstr, readstrlen, &result);
+      result.error.report();
+      if (MD && MD->serviceName && !MD->isSoft) {
+        if (o.debugging > 1 || o.versionTrace())
+          log_write(LOG_PLAIN, "Service scan: %s:%hu response unchanged since the cached scan\n",
+                    svc->target->targetipstr(), svc->portno);
+        handle_match(nsp, nsi, SG, svc, MD, svc->cached_fallback);
+        return;
+      }
     }
 
-    if (MD && MD->serviceName) {
-      // WOO HOO!!!!!!  MATCHED!  But might be soft
-      if (MD->isSoft && svc->probe_matched) {
-	if (strcmp(svc->probe_matched, MD->serviceName) != 0)
-	  error("WARNING: Service %s:%hu had already soft-matched %s, but now soft-matched %s; ignoring second value", svc->target->targetipstr(), svc->portno, svc->probe_matched, MD->serviceName);
-	// No error if its the same - that happens frequently.  For
-	// example, if we read more data for the same probe response
-	// it will probably still match.
-      } else {
-	if (o.debugging > 1 || o.versionTrace()) {
-	  if (MD->product || MD->version || MD->info)
-	    log_write(LOG_PLAIN, "Service scan match (Probe %s matched with %s line %d): %s:%hu is %s%s.  Version: |%s|%s|%s|\n",
-                      probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
-		      MD->lineno,
-		      svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "", 
-		      MD->serviceName, (MD->product)? MD->product : "", (MD->version)? MD->version : "", 
-		      (MD->info)? MD->info : "");
-	  else
-	    log_write(LOG_PLAIN, "Service scan %s match (Probe %s matched with %s line %d): %s:%hu is %s%s\n",
-                      (MD->isSoft)? "soft" : "hard",
-                      probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
-                      MD->lineno,
-		      svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "", MD->serviceName);
-	}
-	svc->probe_matched = MD->serviceName;
-	if (MD->product)
-	  Strncpy(svc->product_matched, MD->product, sizeof(svc->product_matched));
-	if (MD->version) 
-	  Strncpy(svc->version_matched, MD->version, sizeof(svc->version_matched));
-	if (MD->info) 
-	  Strncpy(svc->extrainfo_matched, MD->info, sizeof(svc->extrainfo_matched));
-	if (MD->hostname) 
-	  Strncpy(svc->hostname_matched, MD->hostname, sizeof(svc->hostname_matched));
-	if (MD->ostype) 
-	  Strncpy(svc->ostype_matched, MD->ostype, sizeof(svc->ostype_matched));
-	if (MD->devicetype) 
-	  Strncpy(svc->devicetype_matched, MD->devicetype, sizeof(svc->devicetype_matched));
-	if (MD->cpe_a)
-	  Strncpy(svc->cpe_a_matched, MD->cpe_a, sizeof(svc->cpe_a_matched));
-	if (MD->cpe_h)
-	  Strncpy(svc->cpe_h_matched, MD->cpe_h, sizeof(svc->cpe_h_matched));
-	if (MD->cpe_o)
-	  Strncpy(svc->cpe_o_matched, MD->cpe_o, sizeof(svc->cpe_o_matched));
-	svc->softMatchFound = MD->isSoft;
-	if (!svc->softMatchFound) {
-	  // We might be able to continue scan through a tunnel protocol 
-	  // like SSL
-	  if (scanThroughTunnel(nsp, nsi, SG, svc) == 0) 
-	    end_svcprobe(nsp, PROBESTATE_FINISHED_HARDMATCHED, SG, svc, nsi);
-	}
-      }
+#if HAVE_PTHREAD
+    if (SG->match_workers != NULL) {
+      // handle_match is called when a worker thread is done with it.
+      SG->match_workers->submit(nsp, svc, nsi, readstr, readstrlen);
+      return;
     }
+#endif
 
-    if (!MD || !MD->serviceName || MD->isSoft) {
-      // Didn't match... maybe reading more until timeout will help
-      // TODO: For efficiency I should be able to test if enough data
-      // has been received rather than always waiting for the reading
-      // to timeout.  For now I'll limit it to 4096 bytes just to
-      // avoid reading megs from services like chargen.  But better
-      // approach is needed.
-      if (svc->probe_timemsleft(probe) > 0 && readstrlen < 4096) { 
-	nsock_read(nsp, nsi, servicescan_read_handler, svc->probe_timemsleft(probe), svc);
-      } else {
-	// Failed -- lets go to the next probe.
-	if (readstrlen > 0)
-	  svc->addToServiceFingerprint(probe->getName(), readstr, readstrlen);
-	startNextProbe(nsp, nsi, SG, svc, false);
-      }
+    for (MD = NULL; probe->fallbacks[fallbackDepth] != NULL; fallbackDepth++) {
+      MD = (probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen, 0, &result);
+      if (MD && MD->serviceName) break; // Found one!
     }
+    result.error.report();
+
+    handle_match(nsp, nsi, SG, svc, MD, fallbackDepth);
   } else if (status == NSE_STATUS_TIMEOUT) {
     // Failed to read enough to make a match in the given amount of time.  So we
     // move on to the next probe.  If this was a NULL probe, we can simply
@@ -2432,6 +4451,10 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
 				   readstrlen);
     startNextProbe(nsp, nsi, SG, svc, false);
     
+  } else if ((status == NSE_STATUS_EOF || status == NSE_STATUS_ERROR) &&
+             retryWithoutReuse(nsp, nsi, svc)) {
+    // The service closed the connection it had kept open rather than
+    // answer the probe on it.  The probe has been sent again.
   } else if (status == NSE_STATUS_EOF) {
     // The jerk closed on us during read request!
     // If this was during the NULL probe, let's (for now) assume
@@ -2529,6 +4552,149 @@ static int shouldWePrintFingerprint(ServiceNFO *svc) {
 // The function iterates through each finished service and adds the results to Target structure for
 // Nmap to output later.
 
+/* What --version-cache remembers about a port: the probe and match line
+   that identified the service and a hash of the response they matched. */
+struct ServiceCacheEntry {
+  std::string probename;
+  int lineno;
+  unsigned long long hash;
+};
+
+/* The cache, keyed by "address port/protocol". */
+static std::map<std::string, ServiceCacheEntry> service_cache;
+static bool service_cache_loaded = false;
+
+static std::string service_cache_key(ServiceNFO *svc) {
+  char key[128];
+
+  Snprintf(key, sizeof(key), "%s %hu/%s", svc->target->targetipstr(),
+           svc->portno, proto2ascii_lowercase(svc->proto));
+  return key;
+}
+
+/* Reads the --version-cache file. Each line is
+     <address> <port>/<protocol> <match line number> <response hash> <probe name>
+   A missing file is the same as an empty one. */
+static void load_service_cache() {
+  char line[512], addr[128], proto[8], probename[64];
+  unsigned short portno;
+  ServiceCacheEntry entry;
+  FILE *fp;
+
+  service_cache_loaded = true;
+  fp = fopen(o.version_cache, "r");
+  if (fp == NULL)
+    return;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%127s %hu/%7s %d %llx %63s", addr, &portno, proto,
+               &entry.lineno, &entry.hash, probename) != 6)
+      continue;
+    entry.probename = probename;
+    Snprintf(line, sizeof(line), "%s %hu/%s", addr, portno, proto);
+    service_cache[line] = entry;
+  }
+  fclose(fp);
+  if (o.debugging)
+    log_write(LOG_PLAIN, "Loaded %u cached version detection results from %s\n",
+              (unsigned int) service_cache.size(), o.version_cache);
+}
+
+/* Looks up the services of SG in the cache, so that each starts with the
+   probe that identified it last time. Entries for probes or match lines
+   that are no longer in nmap-service-probes are ignored. */
+static void apply_service_cache(AllProbes *AP, ServiceGroup *SG) {
+  std::map<std::string, ServiceCacheEntry>::iterator entry;
+  std::list<ServiceNFO *>::iterator svcI;
+  ServiceNFO *svc;
+  ServiceProbe *probe;
+  int i;
+
+  if (!service_cache_loaded)
+    load_service_cache();
+  for (svcI = SG->services_remaining.begin(); svcI != SG->services_remaining.end(); svcI++) {
+    svc = *svcI;
+    entry = service_cache.find(service_cache_key(svc));
+    if (entry == service_cache.end())
+      continue;
+    probe = AP->getProbeByName(entry->second.probename.c_str(), svc->proto);
+    if (probe == NULL)
+      continue;
+    for (i = 0; probe->fallbacks[i] != NULL; i++) {
+      svc->cached_match = probe->fallbacks[i]->getMatchByLine(entry->second.lineno);
+      if (svc->cached_match != NULL)
+        break;
+    }
+    if (svc->cached_match == NULL)
+      continue;
+    svc->cached_probe = probe;
+    svc->cached_fallback = i;
+    svc->cached_hash = entry->second.hash;
+  }
+}
+
+/* Records the outcome of this service scan in the cache and writes it out.
+   Services that were identified without a tunnel get an entry, services
+   that could not be identified lose theirs, and services that were not
+   finished (host timeouts and the like) are left as they were. */
+static void update_service_cache(ServiceGroup *SG) {
+  std::list<ServiceNFO *>::iterator svcI;
+  std::map<std::string, ServiceCacheEntry>::iterator entry;
+  ServiceCacheEntry newentry;
+  ServiceNFO *svc;
+  std::string contents;
+  char line[512];
+
+  for (svcI = SG->services_finished.begin(); svcI != SG->services_finished.end(); svcI++) {
+    svc = *svcI;
+    if (svc->probe_state == PROBESTATE_FINISHED_HARDMATCHED &&
+        svc->hardmatch_probe != NULL && svc->tunnel == SERVICE_TUNNEL_NONE) {
+      newentry.probename = svc->hardmatch_probe->getName();
+      newentry.lineno = svc->hardmatch_lineno;
+      newentry.hash = svc->hardmatch_hash;
+      service_cache[service_cache_key(svc)] = newentry;
+    } else if (svc->probe_state != PROBESTATE_INCOMPLETE &&
+               svc->probe_state != PROBESTATE_EXCLUDED) {
+      service_cache.erase(service_cache_key(svc));
+    }
+  }
+
+  contents = "# Nmap version detection cache: address, port/protocol, match line, response hash, probe\n";
+  for (entry = service_cache.begin(); entry != service_cache.end(); entry++) {
+    Snprintf(line, sizeof(line), "%s %d %016llx %s\n", entry->first.c_str(),
+             entry->second.lineno, entry->second.hash,
+             entry->second.probename.c_str());
+    contents += line;
+  }
+  if (!write_file_atomically(o.version_cache, contents))
+    error("Failed to write version detection cache %s", o.version_cache);
+}
+
+/* Adds the hard matches of this service scan to the --version-stats
+   counts and writes them out. */
+static void update_probe_stats(ServiceGroup *SG) {
+  std::list<ServiceNFO *>::iterator svcI;
+  ServiceNFO *svc;
+  char key[128];
+
+  for (svcI = SG->services_finished.begin(); svcI != SG->services_finished.end(); svcI++) {
+    svc = *svcI;
+    if (svc->probe_state != PROBESTATE_FINISHED_HARDMATCHED ||
+        svc->hardmatch_probe == NULL || svc->tunnel != SERVICE_TUNNEL_NONE)
+      continue;
+    Snprintf(key, sizeof(key), "port %hu/%s", svc->portno, proto2ascii_lowercase(svc->proto));
+    probe_stats.record(key, svc->hardmatch_probe->getName());
+    if (svc->softmatch_service) {
+      Snprintf(key, sizeof(key), "soft %s", svc->softmatch_service);
+      probe_stats.record(key, svc->hardmatch_probe->getName());
+    }
+  }
+
+  if (!probe_stats.save(o.version_stats))
+    error("Failed to write version detection statistics %s", o.version_stats);
+}
+
 static void processResults(ServiceGroup *SG) {
 std::list<ServiceNFO *>::iterator svc;
 
@@ -2607,7 +4773,7 @@ static void remove_excluded_ports(AllProbes *AP, ServiceGroup *SG) {
                                         "Excluded from version scan", NULL,
 					NULL, NULL, NULL, NULL, NULL, NULL);
 
-      SG->services_remaining.erase(i);
+      SG->removeRemaining(i);
       SG->services_finished.push_back(svc);
     }
   }
@@ -2631,6 +4797,8 @@ int service_scan(std::vector<Target *> &Targets) {
     return 1;
 
   AP = AllProbes::service_scan_init();
+  if (o.version_profile)
+    enable_service_match_profiling();
 
 
   // Now I convert the targets into a new ServiceGroup
@@ -2644,6 +4812,11 @@ int service_scan(std::vector<Target *> &Targets) {
 
   startTimeOutClocks(SG);
 
+  if (o.version_cache)
+    apply_service_cache(AP, SG);
+  if (o.version_stats && !probe_stats.loaded)
+    probe_stats.load(o.version_stats);
+
   if (SG->services_remaining.size() == 0) {
     delete SG;
     return 1;
@@ -2676,6 +4849,15 @@ int service_scan(std::vector<Target *> &Targets) {
 #if HAVE_OPENSSL
   /* We don't care about connection security in version detection. */
   nsp_ssl_init_max_speed(nsp);
+  /* Resume SSL sessions across probes and services of the same target. */
+  nsp_ssl_set_session_cache(nsp, SSL_SESSION_CACHE_SIZE);
+#endif
+
+  if (o.debugging)
+    nsp_set_stats(nsp, 1);
+
+#if HAVE_PTHREAD
+  SG->match_workers = start_match_workers(nsp, AP, SG);
 #endif
 
   launchSomeServiceProbes(nsp, SG);
@@ -2691,6 +4873,23 @@ int service_scan(std::vector<Target *> &Targets) {
     fatal("Unexpected nsock_loop error.  Error code %d (%s)", err, socket_strerror(err));
   }
 
+#if HAVE_OPENSSL
+  if (o.debugging) {
+    unsigned long hits, misses;
+
+    nsp_ssl_session_cache_stats(nsp, &hits, &misses);
+    if (hits + misses > 0)
+      log_write(LOG_PLAIN, "SSL session cache: %lu resumed, %lu full handshakes\n", hits, misses);
+  }
+#endif
+
+  if (o.debugging)
+    printNsockStats(nsp);
+
+#if HAVE_PTHREAD
+  delete SG->match_workers;
+  SG->match_workers = NULL;
+#endif
   nsp_delete(nsp);
 
   if (o.verbose) {
@@ -2710,8 +4909,13 @@ int service_scan(std::vector<Target *> &Targets) {
   // discovered, store the important info away, and free up everything
   // else.
   processResults(SG);
+  if (o.version_cache)
+    update_service_cache(SG);
+  if (o.version_stats)
+    update_probe_stats(SG);
 
   delete SG;
+  free_response_buffers();
 
   return 0;
 }
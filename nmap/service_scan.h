@@ -100,6 +100,7 @@
 #include "global_structures.h"
 #include "portlist.h"
 
+#include <string>
 #include <vector>
 
 #ifdef HAVE_PCRE_PCRE_H
@@ -146,8 +147,53 @@ struct MatchDetails {
   const char *cpe_h;
 };
 
+class ServiceProbeMatch;
+
+// A PCRE error other than no match that testMatch ran into. testMatch may
+// run on a match worker thread, which must not call fatal() or log, so the
+// error is kept here for the caller to report from the nsock loop thread.
+// Only the most serious one is kept.
+struct MatchError {
+  int rc; // The PCRE error code, or 0 if there was none
+  ServiceProbeMatch *match; // The match line that gave it
+  MatchError() : rc(0), match(NULL) {}
+  // Keeps rc if it is more serious than the error already kept
+  void note(int rc, ServiceProbeMatch *match);
+  // Reports the error kept, if any, and clears it. Errors other than
+  // running into a PCRE limit are fatal.
+  void report();
+};
+
+// A MatchDetails together with storage for the strings it points to.
+// The testMatch functions fill in one of these when given it instead of
+// using static storage, which makes them safe to call from several
+// threads at once.
+struct MatchResult {
+  struct MatchDetails MD;
+  char product[80];
+  char version[80];
+  char info[256];  /* We will truncate with ... later */
+  char hostname[80];
+  char ostype[32];
+  char devicetype[32];
+  char cpe_a[80], cpe_h[80], cpe_o[80];
+  struct MatchError error;
+};
+
+// What match line profiling (see enable_service_match_profiling) has
+// recorded for one match line.
+struct MatchProfile {
+  unsigned long calls; // pcre_exec calls
+  unsigned long matches;
+  unsigned long limit_hits; // Calls that gave up with PCRE_ERROR_MATCHLIMIT
+  long long usecs; // Total time spent in pcre_exec
+};
+
 /**********************  CLASSES     ***********************************/
 
+class MatchPrefilter;
+struct probe_cache_reader;
+
 class ServiceProbeMatch {
  public:
   ServiceProbeMatch();
@@ -165,16 +211,31 @@ class ServiceProbeMatch {
   // ServiceProbeMatch, returns the details of the match (service
   // name, version number if applicable, and whether this is a "soft"
   // match.  If the buf doesn't match, the serviceName field in the
-  // structure will be NULL.  The MatchDetails returned is only valid
-  // until the next time this function is called.  The only exception
+  // structure will be NULL.  The MatchDetails returned is stored in
+  // result and only valid for as long as result is.  The only exception
   // is that the serviceName field can be saved throughought program
   // execution.  If no version matched, that field will be NULL.
-  const struct MatchDetails *testMatch(const u8 *buf, int buflen);
+  const struct MatchDetails *testMatch(const u8 *buf, int buflen,
+                                       struct MatchResult *result);
 // Returns the service name this matches
   const char *getName() { return servicename; }
   // The Line number where this match string was defined.  Returns
   // -1 if unknown.
   int getLineNo() { return deflineno; }
+  // Literals that every response matched by this regex must contain
+  // (see ServiceProbe::testMatch).  Either may be empty.
+  const std::string &getRequiredPrefix() { return required_prefix; }
+  const std::string &getRequiredLiteral() { return required_literal; }
+  bool isCaseless() { return matchops_ignorecase; }
+  // The regular expression, as written in nmap-service-probes
+  const char *getPattern() { return matchstr; }
+  const struct MatchProfile &getProfile() { return profile; }
+
+  // Serialize this match, including its compiled regex, for the probe
+  // database cache, or restore it from there instead of calling
+  // InitMatch.  loadFromCache returns false if the data is malformed.
+  void saveToCache(std::string &buf);
+  bool loadFromCache(struct probe_cache_reader *r);
  private:
   int deflineno; // The line number where this match is defined.
   bool isInitialized; // Has InitMatch yet been called?
@@ -187,6 +248,13 @@ class ServiceProbeMatch {
   bool matchops_ignorecase;
   bool matchops_dotall;
   bool isSoft; // is this a soft match? ("softmatch" keyword in nmap-service-probes)
+  struct MatchProfile profile;
+  void recordProfile(const struct timeval *start, int rc);
+  // Extracted from the regex by InitMatch.  The prefix must appear at
+  // the start of a matching response and the literal anywhere in it.
+  // Both are lowercased if the regex is case insensitive.
+  std::string required_prefix;
+  std::string required_literal;
   // If any of these 3 are non-NULL, a product, version, or template
   // string was given to deduce the application/version info via
   // substring matches.
@@ -201,9 +269,6 @@ class ServiceProbeMatch {
   // The anchor is for SERVICESCAN_STATIC matches.  If the anchor is not -1, the match must
   // start at that zero-indexed position in the response str.
   int matchops_anchor;
-// Details to fill out and return for testMatch() calls
-  struct MatchDetails MD_return;
-
   // Use the six version templates and the match data included here
   // to put the version info into the given strings, (as long as the sizes
   // are sufficient).  Returns zero for success.  If no template is available
@@ -233,6 +298,10 @@ class ServiceProbe {
                                    // probe (e.g. an SMTP probe would commonly identify port 25)
 // Amount of time to wait after a connection succeeds (or packet sent) for a responses.
   int totalwaitms;
+// True if this probe may be sent on a connection left open by the previous
+// probe (the "reuse" directive).  Both probes need it for the connection to
+// be reused.
+  bool reuse;
 
   // Parses the "probe " line in the nmap-service-probes file.  Pass the rest of the line
   // after "probe ".  The format better be:
@@ -293,12 +362,27 @@ class ServiceProbe {
   // ServiceProbe, returns the details of the nth match (service name,
   // version number if applicable, and whether this is a "soft" match.
   // If the buf doesn't match, the serviceName field in the structure
-  // will be NULL.  The MatchDetails returned is only valid until the
-  // next time this function is called.  The only exception is that the
+  // will be NULL.  The MatchDetails returned is stored in result and
+  // only valid for as long as result is.  The only exception is that the
   // serviceName field can be saved throughought program execution.  If
   // no version matched, that field will be NULL. This function may
   // return NULL if there are no match lines at all in this probe.
-  const struct MatchDetails *testMatch(const u8 *buf, int buflen, int n);
+  const struct MatchDetails *testMatch(const u8 *buf, int buflen, int n,
+                                       struct MatchResult *result);
+
+  // Builds the match prefilter now rather than on the first call to
+  // testMatch.  This must be done before matching on several threads.
+  void buildPrefilter();
+
+  // Returns the match defined on line lineno of nmap-service-probes, or
+  // NULL if that line is not one of this probe's matches.
+  ServiceProbeMatch *getMatchByLine(int lineno);
+  const std::vector<ServiceProbeMatch *> &getMatches() { return matches; }
+
+  // Serialize this probe and its matches for the probe database cache,
+  // or restore them from there.  Fallbacks are handled by AllProbes.
+  void saveToCache(std::string &buf);
+  bool loadFromCache(struct probe_cache_reader *r);
 
   char *fallbackStr;
   ServiceProbe *fallbacks[MAXFALLBACKS+1];
@@ -316,6 +400,8 @@ class ServiceProbe {
   std::vector<const char *> detectedServices;
   int probeprotocol;
   std::vector<ServiceProbeMatch *> matches; // first-ever use of STL in Nmap!
+  // Built from the matches on first use; discarded by addMatch().
+  MatchPrefilter *prefilter;
 };
 
 class AllProbes {
@@ -337,6 +423,12 @@ public:
   // fallbackStrs.
   void compileFallbacks();
 
+  // Serialize the whole parsed database, or restore it from a buffer
+  // written by saveToCache.  Used by parse_nmap_service_probes to skip
+  // parsing and compiling nmap-service-probes when it hasn't changed.
+  void saveToCache(std::string &buf);
+  bool loadFromCache(struct probe_cache_reader *r);
+
   int isExcluded(unsigned short port, int proto);
   bool excluded_seen;
   struct scan_lists excludedports;
@@ -351,10 +443,19 @@ protected:
 /**********************  PROTOTYPES  ***********************************/
 
 /* Parses the given nmap-service-probes file into the AP class Must
-   NOT be made static because I have external maintenance tools
-   (servicematch) which use this */
+   NOT be made static because maintenance tools (servicematch.cc) use
+   this */
 void parse_nmap_service_probe_file(AllProbes *AP, char *filename);
 
+/* Match line profiling. Once it is enabled, each pcre_exec call made by
+   ServiceProbeMatch::testMatch is counted and timed, for finding the
+   patterns in nmap-service-probes that cost the most. The report lists
+   the match lines of AP that were tried, the most expensive first. */
+void enable_service_match_profiling(void);
+void print_service_match_profile(AllProbes *AP, FILE *fp);
+/* Writes the report for the probes used by service_scan to filename. */
+void write_service_match_profile(const char *filename);
+
 /* Execute a service fingerprinting scan against all open ports of the
    Targets specified. */
 int service_scan(std::vector<Target *> &Targets);
@@ -0,0 +1,66 @@
+#!/bin/sh
+
+# Automated tests for the fingerprint parser of servicematch. Each test
+# feeds it one fingerprint and checks the JSON line it prints. Run it from
+# the nmap directory after "make servicematch".
+
+SERVICEMATCH="./servicematch --datadir ."
+TESTS=0
+TEST_PASS=0
+TEST_FAIL=0
+
+HEADER='SF-Port22-TCP:V=6.26SVN%I=7%D=10/19%Time=5080A1B2%P=x86_64-unknown-linux-gnu'
+SSH='%r(NULL,15,"SSH-2\.0-OpenSSH_5\.9\r\n")'
+
+# Takes as arguments a description, a fingerprint and a string that the
+# output must contain.
+test_fingerprint() {
+	desc=$1
+	fp=$2
+	expected=$3
+	result=$(printf '%s\n' "$fp" | $SERVICEMATCH)
+	ret=$?
+	TESTS=$((TESTS + 1))
+	if [ "$ret" != "0" ]; then
+		echo "FAIL $desc: servicematch returned $ret."
+		TEST_FAIL=$((TEST_FAIL + 1))
+	elif ! printf '%s\n' "$result" | grep -F -q -e "$expected"; then
+		echo "FAIL $desc: \"$result\" does not contain"
+		echo "     \"$expected\"."
+		TEST_FAIL=$((TEST_FAIL + 1))
+	else
+		echo "PASS $desc"
+		TEST_PASS=$((TEST_PASS + 1))
+	fi
+}
+
+test_fingerprint "complete fingerprint" \
+"$HEADER$SSH;" \
+'"service":"ssh"'
+
+test_fingerprint "no responses" \
+"$HEADER;" \
+'"error":"no responses"'
+
+test_fingerprint "truncated response string" \
+"$HEADER$SSH"'%r(GenericLines,20,"HTTP/1\.0\x20200\x20OK\r\nSer' \
+'"error":"malformed response"'
+
+test_fingerprint "truncated escape" \
+"$HEADER"'%r(NULL,15,"SSH-2\.0-OpenSSH_5\.9\' \
+'"error":"malformed response"'
+
+test_fingerprint "missing length" \
+"$HEADER$SSH"'%r(GenericLines' \
+'"error":"malformed response"'
+
+test_fingerprint "response not closed" \
+"$HEADER"'%r(NULL,15,"SSH-2\.0-OpenSSH_5\.9\r\n";' \
+'"error":"malformed response"'
+
+test_fingerprint "bad header" \
+'SF-PortX-TCP:V=6.26SVN%r(NULL,1,"x");' \
+'"error":"bad SF-Port header"'
+
+echo "$TEST_PASS / $TESTS passed, $TEST_FAIL failed"
+[ "$TEST_FAIL" = "0" ]
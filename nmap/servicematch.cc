@@ -0,0 +1,776 @@
+/***************************************************************************
+ * servicematch.cc -- Matches stored service fingerprints (or raw probe    *
+ * responses) against nmap-service-probes without scanning anything, and   *
+ * prints the results as JSON lines.  Used to re-check a corpus of         *
+ * fingerprints whenever nmap-service-probes changes.                      *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2012 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 with the clarifications and exceptions described  *
+ * below.  This guarantees your right to use, modify, and redistribute     *
+ * this software under certain conditions.  If you wish to embed Nmap      *
+ * technology into proprietary software, we sell alternative licenses      *
+ * (contact sales@insecure.com).  Dozens of software vendors already       *
+ * license Nmap technology such as host discovery, port scanning, OS       *
+ * detection, version detection, and the Nmap Scripting Engine.            *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derived works", yet *
+ * it does not provide a detailed definition of that term.  To avoid       *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * "derivative work" for the purpose of this license if it does any of the *
+ * following:                                                              *
+ * o Integrates source code from Nmap                                      *
+ * o Reads or includes Nmap copyrighted data files, such as                *
+ *   nmap-os-db or nmap-service-probes.                                    *
+ * o Executes Nmap and parses the results (as opposed to typical shell or  *
+ *   execution-menu apps, which simply display raw Nmap output and so are  *
+ *   not derivative works.)                                                *
+ * o Integrates/includes/aggregates Nmap into a proprietary executable     *
+ *   installer, such as those produced by InstallShield.                   *
+ * o Links to a library or executes a program that does any of the above   *
+ *                                                                         *
+ * The term "Nmap" should be taken to also include any portions or derived *
+ * works of Nmap, as well as other software we distribute under this       *
+ * license such as Zenmap, Ncat, and Nping.  This list is not exclusive,   *
+ * but is meant to clarify our interpretation of derived works with some   *
+ * common examples.  Our interpretation applies only to Nmap--we don't     *
+ * speak for other people's GPL works.                                     *
+ *                                                                         *
+ * If you have any questions about the GPL licensing restrictions on using *
+ * Nmap in non-GPL works, we would be happy to help.  As mentioned above,  *
+ * we also offer alternative license to integrate Nmap into proprietary    *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@insecure.com for     *
+ * further information.                                                    *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement or         *
+ * contract stating terms other than the terms above, then that            *
+ * alternative license agreement takes precedence over these comments.     *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes (none     *
+ * have been found so far).                                                *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING         *
+ *                                                                         *
+ ***************************************************************************/
+
+
+/* $Id$ */
+
+/* Usage: servicematch [options] [file ...]
+
+   Reads service fingerprints, as printed by Nmap when it cannot identify a
+   service ("SF-Port..." followed by "SF:" lines), from the named files or
+   from standard input, and matches the responses in them against
+   nmap-service-probes the same way version detection would. Each response
+   is tried against the match lines of the probe that elicited it and then
+   those of its fallbacks; the first hard match decides the service, or
+   failing that the first soft match. One JSON object is printed per
+   fingerprint, in input order.
+
+   With --raw, each file is instead taken as a single raw response to the
+   probe given with --probe (the NULL probe by default).
+
+   The matching is spread over several threads. The fingerprints are read
+   in batches, so memory use does not depend on the size of the input. */
+
+#include "service_scan.h"
+#include "NmapOps.h"
+#include "nmap_error.h"
+#include "utils.h"
+#include "protocols.h"
+#include "libnetutil/netutil.h"
+
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include <algorithm>
+#include <map>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+extern NmapOps o;
+
+extern void set_program_name(const char *name);
+
+// Number of fingerprints read before they are handed to the matching threads
+#define SM_BATCH_SIZE 4096
+
+// Upper limit on the number of matching threads
+#define SM_MAX_THREADS 64
+
+// A service fingerprint, or a single raw response, to be matched.
+struct SMInput {
+  std::string source; // File name, or "-" for standard input
+  int lineno; // Line of the source the fingerprint starts on (0 for raw)
+  u16 portno;
+  int proto;
+  bool ssl;
+  std::string error; // Set if the fingerprint could not be parsed
+  // The probe name and response of each %r() element
+  std::vector<std::pair<std::string, std::string> > responses;
+
+  // Filled in by match_input(). The error is reported by match_batch(),
+  // from the main thread.
+  std::string json;
+  struct MatchError matcherror;
+};
+
+// Time spent in ServiceProbe::testMatch for each probe.
+struct SMProbeTime {
+  unsigned long calls;
+  long long usecs;
+};
+
+// Matching state for one thread; the timings are merged at the end.
+struct SMWorker {
+  AllProbes *AP;
+  std::vector<SMInput> *batch;
+  std::map<ServiceProbe *, SMProbeTime> times;
+  unsigned long responses, hard, soft, nomatch;
+  unsigned long errors; // Inputs that could not be parsed
+#if HAVE_PTHREAD
+  pthread_t thread;
+#endif
+};
+
+#if HAVE_PTHREAD
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static size_t batch_next;
+
+static void print_usage(void) {
+  printf("Usage: servicematch [options] [file ...]\n"
+         "Matches Nmap service fingerprints from the given files (or standard input)\n"
+         "against nmap-service-probes and prints the results as JSON lines.\n"
+         "Options:\n"
+         "  -p, --probes <file>: Use this nmap-service-probes file\n"
+         "  -d, --datadir <dir>: Look for nmap-service-probes in this directory\n"
+         "  -j, --threads <num>: Match on this many threads (default: one per CPU)\n"
+         "  -r, --raw: Each file is one raw response rather than fingerprints\n"
+         "  -P, --probe <name>: Probe that elicited the raw responses (default NULL)\n"
+         "  -u, --udp: Raw responses are to a UDP probe\n"
+         "  -s, --stats: Print throughput and time spent per probe to stderr\n"
+         "  -f, --profile <file>: Write the time spent in each match line to file\n"
+         "  -h, --help: Print this help\n");
+}
+
+/* Appends s to out as a JSON string. Bytes outside printable ASCII are
+   written as \u00XX, that is, as if the string were Latin-1. */
+static void json_string(std::string &out, const char *s) {
+  char buf[8];
+
+  out += '"';
+  for (; *s; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      Snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+static void json_field(std::string &out, const char *name, const char *value) {
+  if (value == NULL || *value == '\0')
+    return;
+  out += ',';
+  json_string(out, name);
+  out += ':';
+  json_string(out, value);
+}
+
+/* Undoes the escaping done to responses in service fingerprints (see
+   escape_service_response in service_scan.cc). s points just past the
+   opening quote; the response ends at the first unescaped quote. Returns a
+   pointer past the closing quote, or NULL if there isn't one. */
+static const char *unescape_response(const char *s, std::string &resp) {
+  int c;
+
+  while (*s != '\0' && *s != '"') {
+    if (*s != '\\') {
+      resp += *s++;
+      continue;
+    }
+    s++;
+    switch (*s) {
+    case '\0':
+      return NULL;
+    case '0':
+      resp += '\0';
+      s++;
+      break;
+    case 'r':
+      resp += '\r';
+      s++;
+      break;
+    case 'n':
+      resp += '\n';
+      s++;
+      break;
+    case 't':
+      resp += '\t';
+      s++;
+      break;
+    case 'x':
+      if (!isxdigit((int) (unsigned char) s[1]) || !isxdigit((int) (unsigned char) s[2]))
+        return NULL;
+      sscanf(s + 1, "%2x", &c);
+      resp += (char) c;
+      s += 3;
+      break;
+    default:
+      resp += *s++;
+      break;
+    }
+  }
+
+  return *s == '"' ? s + 1 : NULL;
+}
+
+/* Parses the text of a fingerprint, with the line breaks and "SF:"
+   continuation prefixes already removed, into in. Sets in.error if it is
+   malformed. */
+static void parse_fingerprint(const std::string &fp, SMInput &in) {
+  char protostr[4];
+  const char *p, *q;
+  unsigned short portno;
+  std::string name, resp;
+  bool malformed = false;
+
+  if (sscanf(fp.c_str(), "SF-Port%hu-%3[A-Z]:", &portno, protostr) != 2) {
+    in.error = "bad SF-Port header";
+    return;
+  }
+  in.portno = portno;
+  if (strcmp(protostr, "TCP") == 0) {
+    in.proto = IPPROTO_TCP;
+  } else if (strcmp(protostr, "UDP") == 0) {
+    in.proto = IPPROTO_UDP;
+  } else {
+    in.error = "unknown protocol in SF-Port header";
+    return;
+  }
+  in.ssl = fp.find("%T=SSL") != std::string::npos;
+
+  p = fp.c_str();
+  while ((p = strstr(p, "%r(")) != NULL) {
+    p += 3;
+    q = strchr(p, ',');
+    if (q == NULL) {
+      malformed = true;
+      break;
+    }
+    name.assign(p, q - p);
+    // Then the length of the whole response in hex, which we don't need:
+    // the fingerprint may only hold the start of it.
+    q = strchr(q + 1, ',');
+    if (q == NULL || q[1] != '"') {
+      malformed = true;
+      break;
+    }
+    resp.clear();
+    // A string that isn't terminated gives NULL, so p can't tell whether
+    // the loop ended on its own.
+    p = unescape_response(q + 2, resp);
+    if (p == NULL || *p != ')') {
+      malformed = true;
+      break;
+    }
+    in.responses.push_back(std::make_pair(name, resp));
+  }
+  if (malformed)
+    in.error = "malformed response";
+  else if (in.responses.empty())
+    in.error = "no responses";
+}
+
+/* Reads the next fingerprint from fp into in. The start of the next
+   fingerprint has to be read to know that this one has ended, so it is
+   kept in pending between calls. Returns false at the end of the file. */
+static bool read_fingerprint(FILE *fp, const char *source, int *lineno,
+                             std::string &pending, int *pendinglineno,
+                             SMInput &in) {
+  char line[4096];
+  std::string text;
+  size_t len;
+
+  for (;;) {
+    if (pending.empty()) {
+      if (fgets(line, sizeof(line), fp) == NULL)
+        return false;
+      (*lineno)++;
+      len = strlen(line);
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+      if (strncmp(line, "SF-Port", 7) != 0)
+        continue;
+      pending = line;
+      *pendinglineno = *lineno;
+    }
+    text.swap(pending);
+    pending.clear();
+    in.source = source;
+    in.lineno = *pendinglineno;
+    break;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    (*lineno)++;
+    len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (strncmp(line, "SF:", 3) == 0) {
+      text.append(line + 3, len - 3);
+      continue;
+    }
+    if (strncmp(line, "SF-Port", 7) == 0) {
+      pending = line;
+      *pendinglineno = *lineno;
+    }
+    break;
+  }
+
+  parse_fingerprint(text, in);
+  return true;
+}
+
+/* Reads a whole file as a single raw response. */
+static bool read_raw(FILE *fp, const char *source, const char *probename,
+                     int proto, SMInput &in) {
+  char buf[8192];
+  std::string resp;
+  size_t n;
+
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    resp.append(buf, n);
+  if (ferror(fp))
+    return false;
+  in.source = source;
+  in.lineno = 0;
+  in.portno = 0;
+  in.proto = proto;
+  in.ssl = false;
+  in.responses.push_back(std::make_pair(std::string(probename), resp));
+  return true;
+}
+
+/* Tries a response against the probe that elicited it and its fallbacks,
+   as servicescan_read_handler does. */
+static const struct MatchDetails *match_response(SMWorker *w, ServiceProbe *probe,
+                                                 const std::string &resp,
+                                                 struct MatchResult *result,
+                                                 ServiceProbe **matchedprobe) {
+  const struct MatchDetails *MD;
+  struct timeval start, end;
+  ServiceProbe *fallback;
+  int i;
+
+  for (i = 0; (fallback = probe->fallbacks[i]) != NULL; i++) {
+    gettimeofday(&start, NULL);
+    MD = fallback->testMatch((const u8 *) resp.data(), resp.length(), 0, result);
+    gettimeofday(&end, NULL);
+    SMProbeTime &t = w->times[fallback];
+    t.calls++;
+    t.usecs += TIMEVAL_SUBTRACT(end, start);
+    if (MD && MD->serviceName) {
+      *matchedprobe = probe;
+      return MD;
+    }
+  }
+
+  return NULL;
+}
+
+/* Matches all the responses of in and fills in in.json. */
+static void match_input(SMWorker *w, SMInput &in) {
+  struct MatchResult hardresult, softresult;
+  const struct MatchDetails *MD, *hardMD = NULL, *softMD = NULL;
+  ServiceProbe *probe, *matchedprobe, *hardprobe = NULL, *softprobe = NULL;
+  int skipped = 0;
+  unsigned int i;
+  char buf[32];
+
+  in.json = "{";
+  in.json += "\"source\":";
+  json_string(in.json, in.source.c_str());
+  if (in.lineno > 0) {
+    Snprintf(buf, sizeof(buf), ",\"line\":%d", in.lineno);
+    in.json += buf;
+  }
+  if (!in.error.empty()) {
+    w->errors++;
+    json_field(in.json, "error", in.error.c_str());
+    in.json += "}";
+    return;
+  }
+  if (in.portno != 0) {
+    Snprintf(buf, sizeof(buf), ",\"port\":%hu", in.portno);
+    in.json += buf;
+  }
+  json_field(in.json, "protocol", proto2ascii_lowercase(in.proto));
+  if (in.ssl)
+    in.json += ",\"tunnel\":\"ssl\"";
+
+  for (i = 0; i < in.responses.size() && hardMD == NULL; i++) {
+    probe = w->AP->getProbeByName(in.responses[i].first.c_str(), in.proto);
+    if (probe == NULL) {
+      // Probably a probe that has since been removed or renamed
+      skipped++;
+      continue;
+    }
+    w->responses++;
+    // A soft match has to be kept in case nothing better turns up, so once
+    // there is one the other result is used for the rest.
+    MD = match_response(w, probe, in.responses[i].second,
+                        softMD ? &hardresult : &softresult, &matchedprobe);
+    if (MD == NULL)
+      continue;
+    if (!MD->isSoft) {
+      hardMD = MD;
+      hardprobe = matchedprobe;
+    } else if (softMD == NULL) {
+      softMD = MD;
+      softprobe = matchedprobe;
+    }
+  }
+
+  in.matcherror.note(hardresult.error.rc, hardresult.error.match);
+  in.matcherror.note(softresult.error.rc, softresult.error.match);
+
+  Snprintf(buf, sizeof(buf), ",\"responses\":%u", (unsigned int) in.responses.size());
+  in.json += buf;
+  if (skipped > 0) {
+    Snprintf(buf, sizeof(buf), ",\"unknown_probes\":%d", skipped);
+    in.json += buf;
+  }
+
+  if (hardMD == NULL) {
+    hardMD = softMD;
+    hardprobe = softprobe;
+  }
+  if (hardMD == NULL) {
+    w->nomatch++;
+    in.json += ",\"match\":null}";
+    return;
+  }
+  if (hardMD->isSoft)
+    w->soft++;
+  else
+    w->hard++;
+
+  in.json += ",\"match\":{";
+  json_string(in.json, "probe");
+  in.json += ':';
+  json_string(in.json, hardprobe->getName());
+  Snprintf(buf, sizeof(buf), ",\"line\":%d", hardMD->lineno);
+  in.json += buf;
+  in.json += hardMD->isSoft ? ",\"soft\":true" : ",\"soft\":false";
+  json_field(in.json, "service", hardMD->serviceName);
+  json_field(in.json, "product", hardMD->product);
+  json_field(in.json, "version", hardMD->version);
+  json_field(in.json, "info", hardMD->info);
+  json_field(in.json, "hostname", hardMD->hostname);
+  json_field(in.json, "ostype", hardMD->ostype);
+  json_field(in.json, "devicetype", hardMD->devicetype);
+  json_field(in.json, "cpe_a", hardMD->cpe_a);
+  json_field(in.json, "cpe_o", hardMD->cpe_o);
+  json_field(in.json, "cpe_h", hardMD->cpe_h);
+  in.json += "}}";
+}
+
+/* Matches inputs from the shared batch until there are none left. */
+static void *match_worker(void *arg) {
+  SMWorker *w = (SMWorker *) arg;
+  size_t i;
+
+  for (;;) {
+#if HAVE_PTHREAD
+    pthread_mutex_lock(&batch_lock);
+#endif
+    i = batch_next++;
+#if HAVE_PTHREAD
+    pthread_mutex_unlock(&batch_lock);
+#endif
+    if (i >= w->batch->size())
+      break;
+    match_input(w, (*w->batch)[i]);
+  }
+
+  return NULL;
+}
+
+/* Matches a batch on all the workers and prints the results in order. */
+static void match_batch(std::vector<SMWorker> &workers, std::vector<SMInput> &batch) {
+  unsigned int i;
+
+  batch_next = 0;
+  for (i = 0; i < workers.size(); i++)
+    workers[i].batch = &batch;
+#if HAVE_PTHREAD
+  for (i = 1; i < workers.size(); i++) {
+    if (pthread_create(&workers[i].thread, NULL, match_worker, &workers[i]) != 0)
+      fatal("Failed to start matching thread: %s", strerror(errno));
+  }
+#endif
+  match_worker(&workers[0]);
+#if HAVE_PTHREAD
+  for (i = 1; i < workers.size(); i++)
+    pthread_join(workers[i].thread, NULL);
+#endif
+
+  for (i = 0; i < batch.size(); i++) {
+    batch[i].matcherror.report();
+    puts(batch[i].json.c_str());
+  }
+  fflush(stdout);
+  batch.clear();
+}
+
+static bool probe_time_cmp(const std::pair<ServiceProbe *, SMProbeTime> &a,
+                           const std::pair<ServiceProbe *, SMProbeTime> &b) {
+  return a.second.usecs > b.second.usecs;
+}
+
+static void print_stats(std::vector<SMWorker> &workers, unsigned long inputs,
+                        const struct timeval *start) {
+  std::map<ServiceProbe *, SMProbeTime> times;
+  std::map<ServiceProbe *, SMProbeTime>::iterator it;
+  std::vector<std::pair<ServiceProbe *, SMProbeTime> > sorted;
+  unsigned long responses = 0, hard = 0, soft = 0, nomatch = 0, errors = 0;
+  struct timeval now;
+  double elapsed;
+  unsigned int i;
+
+  for (i = 0; i < workers.size(); i++) {
+    responses += workers[i].responses;
+    hard += workers[i].hard;
+    soft += workers[i].soft;
+    nomatch += workers[i].nomatch;
+    errors += workers[i].errors;
+    for (it = workers[i].times.begin(); it != workers[i].times.end(); it++) {
+      times[it->first].calls += it->second.calls;
+      times[it->first].usecs += it->second.usecs;
+    }
+  }
+  gettimeofday(&now, NULL);
+  elapsed = TIMEVAL_FSEC_SUBTRACT(now, *start);
+
+  fprintf(stderr, "Matched %lu fingerprints (%lu responses) in %.2fs on %u threads: %.0f fingerprints/s, %.0f responses/s\n",
+          inputs - errors, responses, elapsed, (unsigned int) workers.size(),
+          elapsed > 0 ? (inputs - errors) / elapsed : 0, elapsed > 0 ? responses / elapsed : 0);
+  fprintf(stderr, "%lu hard matches, %lu soft matches, %lu unmatched\n", hard, soft, nomatch);
+  if (errors > 0)
+    fprintf(stderr, "%lu fingerprints could not be parsed\n", errors);
+
+  sorted.assign(times.begin(), times.end());
+  std::sort(sorted.begin(), sorted.end(), probe_time_cmp);
+  fprintf(stderr, "%-24s %10s %12s %10s\n", "PROBE", "CALLS", "TOTAL MS", "US/CALL");
+  for (i = 0; i < sorted.size(); i++) {
+    fprintf(stderr, "%-24s %10lu %12.1f %10.1f\n", sorted[i].first->getName(),
+            sorted[i].second.calls, sorted[i].second.usecs / 1000.0,
+            (double) sorted[i].second.usecs / sorted[i].second.calls);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct option long_options[] = {
+    {"probes", required_argument, 0, 'p'},
+    {"datadir", required_argument, 0, 'd'},
+    {"threads", required_argument, 0, 'j'},
+    {"raw", no_argument, 0, 'r'},
+    {"probe", required_argument, 0, 'P'},
+    {"udp", no_argument, 0, 'u'},
+    {"stats", no_argument, 0, 's'},
+    {"profile", required_argument, 0, 'f'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+  const char *probesfile = NULL, *probename = "NULL", *profilefile = NULL;
+  bool raw = false, stats = false;
+  int proto = IPPROTO_TCP;
+  long nthreads = 0;
+  std::vector<SMWorker> workers;
+  std::vector<SMInput> batch;
+  std::string pending;
+  unsigned long inputs = 0;
+  struct timeval start;
+  AllProbes *AP;
+  int arg, i, lineno, pendinglineno;
+  FILE *fp;
+
+  set_program_name(argv[0]);
+
+  while ((arg = getopt_long(argc, argv, "p:d:j:rP:usf:h", long_options, NULL)) != EOF) {
+    switch (arg) {
+    case 'p':
+      probesfile = optarg;
+      break;
+    case 'd':
+      o.datadir = strdup(optarg);
+      break;
+    case 'j':
+      nthreads = strtol(optarg, NULL, 10);
+      if (nthreads < 1)
+        fatal("Bogus --threads argument: %s", optarg);
+      break;
+    case 'r':
+      raw = true;
+      break;
+    case 'P':
+      probename = optarg;
+      break;
+    case 'u':
+      proto = IPPROTO_UDP;
+      break;
+    case 's':
+      stats = true;
+      break;
+    case 'f':
+      profilefile = optarg;
+      break;
+    case 'h':
+      print_usage();
+      exit(0);
+    default:
+      print_usage();
+      exit(1);
+    }
+  }
+
+  if (probesfile != NULL) {
+    AP = new AllProbes();
+    parse_nmap_service_probe_file(AP, (char *) probesfile);
+  } else {
+    AP = AllProbes::service_scan_init();
+  }
+  if (profilefile != NULL)
+    enable_service_match_profiling();
+  if (raw && AP->getProbeByName(probename, proto) == NULL)
+    fatal("No %s probe named %s in nmap-service-probes", proto2ascii_uppercase(proto), probename);
+
+  // ServiceProbe::testMatch builds these on demand, which isn't safe to
+  // do from several threads.
+  if (AP->nullProbe != NULL)
+    AP->nullProbe->buildPrefilter();
+  for (i = 0; i < (int) AP->probes.size(); i++)
+    AP->probes[i]->buildPrefilter();
+
+#if HAVE_PTHREAD
+  if (nthreads == 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = box(1L, (long) SM_MAX_THREADS, nthreads);
+#else
+  nthreads = 1;
+#endif
+  workers.resize(nthreads);
+  for (i = 0; i < nthreads; i++) {
+    workers[i].AP = AP;
+    workers[i].responses = workers[i].hard = workers[i].soft = workers[i].nomatch = 0;
+    workers[i].errors = 0;
+  }
+
+  gettimeofday(&start, NULL);
+  i = optind;
+  do {
+    const char *source = i < argc ? argv[i] : "-";
+
+    if (strcmp(source, "-") == 0) {
+      fp = stdin;
+    } else if ((fp = fopen(source, raw ? "rb" : "r")) == NULL) {
+      error("Failed to open %s: %s", source, strerror(errno));
+      continue;
+    }
+
+    if (raw) {
+      batch.push_back(SMInput());
+      if (read_raw(fp, source, probename, proto, batch.back())) {
+        inputs++;
+      } else {
+        error("Failed to read %s: %s", source, strerror(errno));
+        batch.pop_back();
+      }
+    } else {
+      lineno = pendinglineno = 0;
+      pending.clear();
+      for (;;) {
+        batch.push_back(SMInput());
+        if (!read_fingerprint(fp, source, &lineno, pending, &pendinglineno, batch.back())) {
+          batch.pop_back();
+          break;
+        }
+        inputs++;
+        if (batch.size() >= SM_BATCH_SIZE)
+          match_batch(workers, batch);
+      }
+    }
+    if (fp != stdin)
+      fclose(fp);
+    if (batch.size() >= SM_BATCH_SIZE)
+      match_batch(workers, batch);
+  } while (++i < argc);
+  match_batch(workers, batch);
+
+  if (stats)
+    print_stats(workers, inputs, &start);
+  if (profilefile != NULL) {
+    if ((fp = fopen(profilefile, "w")) == NULL)
+      fatal("Failed to open %s for writing: %s", profilefile, strerror(errno));
+    print_service_match_profile(AP, fp);
+    fclose(fp);
+  }
+
+  return 0;
+}
@@ -470,6 +470,63 @@ int cpe_get_part(const char *cpe) {
 }
 
 
+/* Returns the 64-bit FNV-1a hash of len bytes at data. */
+unsigned long long fnv1a64(const void *data, size_t len) {
+  const u8 *p = (const u8 *) data;
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+
+  while (len-- > 0)
+    hash = (hash ^ *p++) * 0x100000001b3ULL;
+  return hash;
+}
+
+bool read_whole_file(const char *filename, std::string &contents) {
+  struct stat st;
+  size_t n;
+  FILE *fp;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return false;
+  if (fstat(fileno(fp), &st) != 0) {
+    fclose(fp);
+    return false;
+  }
+  contents.resize(st.st_size);
+  n = st.st_size > 0 ? fread(&contents[0], 1, st.st_size, fp) : 0;
+  fclose(fp);
+  return n == (size_t) st.st_size;
+}
+
+/* Replaces the contents of filename with contents. They are written to a
+   temporary file first so that concurrent scans never see a partial
+   file. */
+bool write_file_atomically(const char *filename, const std::string &contents) {
+  char tmpfile[512];
+  FILE *fp;
+  int res;
+
+  res = Snprintf(tmpfile, sizeof(tmpfile), "%s.%d", filename, (int) getpid());
+  if (res <= 0 || res >= (int) sizeof(tmpfile))
+    return false;
+  fp = fopen(tmpfile, "wb");
+  if (fp == NULL)
+    return false;
+  res = fwrite(contents.data(), 1, contents.length(), fp) == contents.length();
+  if (fclose(fp) != 0)
+    res = 0;
+#ifdef WIN32
+  if (res)
+    unlink(filename);
+#endif
+  if (!res || rename(tmpfile, filename) != 0) {
+    unlink(tmpfile);
+    return false;
+  }
+  return true;
+}
+
+
 /* mmap() an entire file into the address space.  Returns a pointer
    to the beginning of the file.  The mmap'ed length is returned
    inside the length parameter.  If there is a problem, NULL is
@@ -101,6 +101,7 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <string>
 #include "nmap.h"
 #ifdef WIN32
 #include "mswin32\winclude.h"
@@ -205,6 +206,17 @@ char *strerror(int errnum);
    a character: 'a', 'h', or 'o'. Returns -1 on error. */
 int cpe_get_part(const char *cpe);
 
+/* Returns the 64-bit FNV-1a hash of len bytes at data. */
+unsigned long long fnv1a64(const void *data, size_t len);
+
+/* Reads all of filename into contents. Returns false on error. */
+bool read_whole_file(const char *filename, std::string &contents);
+
+/* Replaces the contents of filename with contents, through a temporary
+   file so that concurrent readers never see a partial file. Returns false
+   on error. */
+bool write_file_atomically(const char *filename, const std::string &contents);
+
 /* mmap() an entire file into the address space.  Returns a pointer
    to the beginning of the file.  The mmap'ed length is returned
    inside the length parameter.  If there is a problem, NULL is